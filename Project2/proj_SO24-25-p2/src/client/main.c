@@ -14,6 +14,7 @@
 #include "src/client/api.h"
 #include "src/common/constants.h"
 #include "src/common/io.h"
+#include "src/common/protocol.h"
 #include "src/common/safeFunctions.h"
 
 int client_notifications_fd;
@@ -33,16 +34,50 @@ void* notif_function(void *args){
   // pthread_t main_id = *(pthread_t *)args;
 
   ssize_t bytes_read;
-  char buffer[(MAX_STRING_SIZE + 1) * 2];
-  char key[MAX_STRING_SIZE + 1];
-  char value[MAX_STRING_SIZE + 1];
-  char message[MAX_STRING_SIZE * 2 + 5];
+  NotificationHeader header;
+  char *message = NULL;   // "(key,value)\n", grown for longer values
+  size_t capacity = 0;
+  size_t length;
   int interrupted_read = 0;
 
   while (!atomic_load(&terminate)) {
     errno = 0; // Reset errno before the system call
-    bytes_read = read_all(client_notifications_fd, buffer,\
-      (MAX_STRING_SIZE + 1) * 2, &interrupted_read);
+    bytes_read = read_all(client_notifications_fd, &header, sizeof(header),\
+      &interrupted_read);
+
+    // Frames with impossible lengths mean the stream is out of sync
+    if (bytes_read > 0 && (header.key_len > MAX_STRING_SIZE ||\
+      header.value_len > MAX_VALUE_SIZE)) {
+      fprintf(stderr, "Invalid notification received\n");
+      bytes_read = -1;
+    }
+
+    length = header.key_len + header.value_len + 4;
+    if (bytes_read > 0 && length > capacity) {
+      char *grown = realloc(message, length);
+
+      if (grown == NULL) {
+        perror("Failed to allocate memory for the notification");
+        bytes_read = -1;
+      } else {
+        message = grown;
+        capacity = length;
+      }
+    }
+
+    // Read the key and the value straight into the message (key,value)\n
+    if (bytes_read > 0) {
+      message[0] = '(';
+      message[header.key_len + 1] = ',';
+      message[length - 2] = ')';
+      message[length - 1] = '\n';
+      bytes_read = read_all(client_notifications_fd, message + 1,\
+        header.key_len, &interrupted_read);
+    }
+    if (bytes_read > 0) {
+      bytes_read = read_all(client_notifications_fd,\
+        message + header.key_len + 2, header.value_len, &interrupted_read);
+    }
 
     if (bytes_read <= 0 || errno == EPIPE) {
 
@@ -53,25 +88,11 @@ void* notif_function(void *args){
       break;
     }
 
-    // Extract key and value from the buffer
-    strncpy(key, buffer, MAX_STRING_SIZE + 1);
-    key[MAX_STRING_SIZE] = '\0'; // Ensure null termination
-    strncpy(value, buffer + MAX_STRING_SIZE + 1, MAX_STRING_SIZE + 1);
-    value[MAX_STRING_SIZE] = '\0'; // Ensure null termination
-
-    // Calculate the actual length of key and value (excluding padding)
-    size_t key_len = strlen(key);
-    size_t value_len = strlen(value);
-
-    // Construct the message (key,value)\n
-    snprintf(message, sizeof(message), "(%.*s,%.*s)\n",
-             (int)key_len, key, (int)value_len, value);
-
     if (pthread_mutex_lock(&stdout_mutex)) {
       perror("Error locking stdout mutex");
     }
 
-    if (write_all(STDOUT_FILENO, message, strlen(message)) == -1) {
+    if (write_all(STDOUT_FILENO, message, length) == -1) {
       perror("Error writing notifications to stdout");
     }
 
@@ -80,6 +101,7 @@ void* notif_function(void *args){
     }
 
   }
+  free(message);
   return NULL;
 }
 
@@ -4,3 +4,4 @@
 #define MAX_PIPE_PATH_LENGTH 40 // tamanho max do caminho do pipe
 #define MAX_STRING_SIZE 40
 #define MAX_NUMBER_SUB 3
+#define MAX_VALUE_SIZE (1024 * 1024) // tamanho max de um valor (1 MiB)
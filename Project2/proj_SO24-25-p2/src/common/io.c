@@ -68,6 +68,47 @@ int write_all(int fd, const void *buffer, size_t size) {
   return 1;
 }
 
+int writev_all(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t result = writev(fd, iov, iovcnt);
+    if (result == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Failed to write to pipe");
+      return -1;
+    }
+    // Skip what was written, a partial write resumes in the middle of a buffer
+    while (iovcnt > 0 && (size_t)result >= iov->iov_len) {
+      result -= (ssize_t)iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + result;
+      iov->iov_len -= (size_t)result;
+    }
+  }
+  return 1;
+}
+
+int pwrite_all(int fd, const void *buffer, size_t size, off_t offset) {
+  size_t bytes_written = 0;
+  while (bytes_written < size) {
+    ssize_t result = pwrite(fd, buffer + bytes_written, size - bytes_written,
+                            offset + (off_t)bytes_written);
+    if (result == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Failed to write to file");
+      return -1;
+    }
+    bytes_written += (size_t)result;
+  }
+  return 1;
+}
+
 static struct timespec delay_to_timespec(unsigned int delay_ms) {
     return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
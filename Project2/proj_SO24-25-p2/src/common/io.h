@@ -2,6 +2,8 @@
 #define COMMON_IO_H
 
 #include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 /// Reads a given number of bytes from a file descriptor. Will block until all
 /// bytes are read, or fail if not all bytes could be read.
@@ -22,6 +24,26 @@ int read_string(int fd, char *str);
 /// @return On success, returns 1, on error, returns -1
 int write_all(int fd, const void *buffer, size_t size);
 
+/// Writes every buffer of an array to a file descriptor, resuming partial
+/// writes. Will block until all bytes are written, or fail if not all bytes
+/// could be written.
+/// @param fd File descriptor to write to.
+/// @param iov Buffers to write, modified while the write progresses.
+/// @param iovcnt Number of buffers in iov.
+/// @return On success, returns 1, on error, returns -1
+int writev_all(int fd, struct iovec *iov, int iovcnt);
+
+/// Writes a given number of bytes at a position of a file, without moving
+/// its offset, so several threads can write parts of one file at once.
+/// Will block until all bytes are written, or fail if not all bytes could
+/// be written.
+/// @param fd File descriptor to write to.
+/// @param buffer Buffer to write from.
+/// @param size Number of bytes to write.
+/// @param offset Position of the first byte in the file.
+/// @return On success, returns 1, on error, returns -1
+int pwrite_all(int fd, const void *buffer, size_t size, off_t offset);
+
 void delay(unsigned int time_ms);
 
 #endif  // COMMON_IO_H
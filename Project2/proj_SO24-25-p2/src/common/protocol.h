@@ -1,6 +1,8 @@
 #ifndef COMMON_PROTOCOL_H
 #define COMMON_PROTOCOL_H
 
+#include <stdint.h>
+
 // Opcodes for client-server communication
 // estes opcodes sao usados num switch case para determinar o que fazer com a mensagem recebida no server
 // usam estes opcodes tambem nos clientes quando enviam mensagens para o server
@@ -12,4 +14,12 @@ enum {
   // TODO mais opcodes para cada operacao
 };
 
+/// Header of a notification written to the notifications pipe, followed by
+/// key_len bytes of the key and value_len bytes of the value (not null
+/// terminated). A deleted key is notified with the value "DELETED".
+typedef struct NotificationHeader {
+  uint32_t key_len;    // Length of the key.
+  uint32_t value_len;  // Length of the value.
+} NotificationHeader;
+
 #endif  // COMMON_PROTOCOL_H
@@ -1,5 +1,10 @@
 #include "avl.h"
 
+/// Pool of the AVL trees (one per key and per session).
+static SlabPool avl_pool = SLAB_POOL_INITIALIZER(sizeof(AVL));
+/// Pool of the AVL trees' nodes.
+static SlabPool avl_node_pool = SLAB_POOL_INITIALIZER(sizeof(AVLNode));
+
 
 void* get_key(AVLNode *node) {
     if (node == NULL) return NULL;
@@ -104,7 +109,7 @@ int avl_destroy_secure(AVL *avl){
  * @return A pointer to the newly created AVL node.
  */
 AVLNode *create_node(KeyType key_type, void* key, int fd) {
-    AVLNode *node = malloc(sizeof(AVLNode));
+    AVLNode *node = slab_alloc(&avl_node_pool);
 
     if (!node) return NULL;
 
@@ -116,12 +121,12 @@ AVLNode *create_node(KeyType key_type, void* key, int fd) {
     else if(key_type == KEY_STRING){
         node->key.str_key = strdup((char *)key);
         if (!node->key.str_key){ // Handle memory allocation failure
-            free(node);
+            slab_free(&avl_node_pool, node);
             return NULL;
         }
     }
     else {
-        free(node);
+        slab_free(&avl_node_pool, node);
         return NULL;
     }
     node->left = NULL;
@@ -351,7 +356,7 @@ AVLNode *remove_node(AVLNode *root, void* key) {
             if (is_node_key_string(temp) && get_key(temp)) {
                 free(get_key(temp)); // Free the string key in the temp node
             }
-            free(temp);
+            slab_free(&avl_node_pool, temp);
         }
         else {  // In case both left and right nodes exist.
             AVLNode *temp = min_value_node(root->right);
@@ -385,13 +390,13 @@ AVLNode *remove_node(AVLNode *root, void* key) {
 
 
 AVL *create_avl() {
-    AVL *avl = malloc(sizeof(AVL));
+    AVL *avl = slab_alloc(&avl_pool);
 
     if (!avl) return NULL;
 
     avl->root = NULL;
     if (pthread_rwlock_init(&avl->rwl, NULL)){
-        free(avl);
+        slab_free(&avl_pool, avl);
         return NULL;
     }
 
@@ -448,27 +453,71 @@ int has_key(AVL *avl, void *key) {
 }
 
 
+/// Locks that keep notifications longer than PIPE_BUF written to the same fd
+/// from interleaving (shorter ones are written atomically by the pipe).
+static pthread_mutex_t notif_fd_locks[NOTIF_FD_LOCKS];
+static pthread_once_t notif_fd_locks_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Initializes the locks of the notifications' fds.
+ */
+static void init_notif_fd_locks() {
+    for (int i = 0; i < NOTIF_FD_LOCKS; i++)
+        pthread_mutex_init(&notif_fd_locks[i], NULL);
+}
+
+
+/**
+ * Writes a whole message to a fd.
+ *
+ * @param fd The fd.
+ * @param message Buffers of the message.
+ * @param iovcnt Number of buffers.
+ * @param size Total size of the message.
+ *
+ * @return 1 if the message was written, -1 otherwise.
+ */
+static int send_to_fd(int fd, const struct iovec *message, int iovcnt,\
+    size_t size) {
+    struct iovec iov[NOTIF_MAX_IOVCNT]; // writev_all consumes its buffers
+    pthread_mutex_t *lock = NULL;
+    int result;
+
+    memcpy(iov, message, (size_t) iovcnt * sizeof(struct iovec));
+    if (size > PIPE_BUF) {
+        lock = &notif_fd_locks[(unsigned int) fd % NOTIF_FD_LOCKS];
+        pthread_mutex_lock(lock);
+    }
+    result = writev_all(fd, iov, iovcnt);
+    if (lock != NULL) pthread_mutex_unlock(lock);
+    return result;
+}
+
+
 /**
  * Recursively sends a message to all fds in the AVL tree.
  *
  * @param node The current node in the AVL tree.
- * @param message The message to be sent.
- * @param size The size of the message.
+ * @param message Buffers of the message.
+ * @param iovcnt Number of buffers.
+ * @param size Total size of the message.
  *
  * @return The number of errors encountered during the send operation.
  */
-int send_to_all_fds_recursive(AVLNode *node, const char *message, size_t size) {
+int send_to_all_fds_recursive(AVLNode *node, const struct iovec *message,\
+    int iovcnt, size_t size) {
     int gotError = 0; // Incremented when a message couldn't be sent to a fd.
 
     if (node) {
         // send to left sub-tree
         gotError += send_to_all_fds_recursive(get_left_node(node), message,\
-            size);
+            iovcnt, size);
         // send to current fd, write returns 1 on success, so we subtract
-        gotError += 1 - write_all(get_fd(node), message, size);
+        gotError += 1 - send_to_fd(get_fd(node), message, iovcnt, size);
         // send to right sub-tree
         gotError += send_to_all_fds_recursive(get_right_node(node), message,\
-            size);
+            iovcnt, size);
 
         return gotError;
     }
@@ -476,8 +525,11 @@ int send_to_all_fds_recursive(AVLNode *node, const char *message, size_t size) {
 }
 
 
-int send_to_all_fds(AVL *avl, const char *message, size_t size) {
+int send_to_all_fds(AVL *avl, const struct iovec *message, int iovcnt) {
     int gotError = 0; // Incremented when a message couldn't be sent to a fd.
+    size_t size = 0;
+
+    if (iovcnt > NOTIF_MAX_IOVCNT) return -1;
     if(avl_rdlock_secure(avl)) return -1;
     if (get_root(avl) == NULL){
         avl_unlock_secure(avl);
@@ -489,7 +541,10 @@ int send_to_all_fds(AVL *avl, const char *message, size_t size) {
         return -1;
     }
 
-    gotError = send_to_all_fds_recursive(get_root(avl), message, size);
+    for (int i = 0; i < iovcnt; i++) size += message[i].iov_len;
+    pthread_once(&notif_fd_locks_once, init_notif_fd_locks);
+    gotError = send_to_all_fds_recursive(get_root(avl), message, iovcnt,\
+        size);
 
     avl_unlock_secure(avl);
 
@@ -510,7 +565,7 @@ void free_avl_node(AVLNode *node) {
         if (is_node_key_string(node))
             free(node->key.str_key);
 
-        free(node);
+        slab_free(&avl_node_pool, node);
     }
 }
 
@@ -524,7 +579,7 @@ int free_avl(AVL *avl) {
     avl_unlock_secure(avl);
 
     destroy_result = avl_destroy_secure(avl);
-    free(avl);
+    slab_free(&avl_pool, avl);
     return destroy_result;
 }
 
@@ -3,10 +3,19 @@
 
 #include <stdlib.h>
 #include <pthread.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/uio.h>
 
+#include "slab.h"
 #include "../common/io.h"
 #include "../common/safeFunctions.h"
 
+/// Number of locks serializing long notifications to the same fd.
+#define NOTIF_FD_LOCKS 64
+/// Maximum number of buffers of a notification.
+#define NOTIF_MAX_IOVCNT 4
+
 // Key type, can be a integer (session id) or a string (node's key).
 typedef enum KeyType {
     KEY_INT,
@@ -187,15 +196,16 @@ int has_key(AVL *avl, void* key);
 
 
 /**
- * Sends a message to all fds in the AVL tree.
+ * Sends a message to all fds in the AVL tree. Each fd gets the whole message
+ * without other messages in between.
  *
  * @param avl The AVL tree containing the fds.
- * @param message The message to be sent.
- * @param size The size of the message.
+ * @param message Buffers of the message to be sent.
+ * @param iovcnt Number of buffers (at most NOTIF_MAX_IOVCNT).
  *
  * @return 0 if the message was sent to all fds successfully, -1 otherwise.
  */
-int send_to_all_fds(AVL *avl, const char *message, size_t size);
+int send_to_all_fds(AVL *avl, const struct iovec *message, int iovcnt);
 
 
 /**
@@ -0,0 +1,41 @@
+#include "buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+int buffer_reserve(Buffer *buffer, size_t extra) {
+    size_t needed = buffer->length + extra;
+    size_t capacity = buffer->capacity;
+    char *data;
+
+    if (needed <= capacity) return 0;
+    if (capacity == 0) capacity = BUFFER_INITIAL_SIZE;
+    while (capacity < needed) capacity *= 2;
+
+    if ((data = realloc(buffer->data, capacity)) == NULL) return -1;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+
+int buffer_append(Buffer *buffer, const void *data, size_t size) {
+    if (buffer_reserve(buffer, size)) return -1;
+    memcpy(buffer->data + buffer->length, data, size);
+    buffer->length += size;
+    return 0;
+}
+
+
+void buffer_free(Buffer *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
+
+
+const char* value_list_get(const ValueList *values, size_t index) {
+    return values->buffer.data + values->offsets[index];
+}
@@ -0,0 +1,71 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+
+#include "constants.h"
+
+/// Bytes allocated by a buffer the first time it grows.
+#define BUFFER_INITIAL_SIZE 256
+
+/// Initializer of an empty buffer.
+#define BUFFER_INITIALIZER {NULL, 0, 0}
+
+
+// Bytes that grow (doubling their allocation) as they are appended.
+typedef struct Buffer {
+    char *data;                     // Bytes of the buffer, NULL if none.
+    size_t length;                  // Bytes used.
+    size_t capacity;                // Bytes allocated.
+} Buffer;
+
+
+// Values of a WRITE or CAS, stored back to back in one buffer (each one
+// null terminated) so they can be of any length up to MAX_VALUE_SIZE.
+typedef struct ValueList {
+    Buffer buffer;                  // Bytes of every value.
+    size_t offsets[MAX_WRITE_SIZE]; // Position of each value in buffer.
+    size_t lengths[MAX_WRITE_SIZE]; // Length of each value.
+} ValueList;
+
+
+/**
+ * Makes room for more bytes at the end of a buffer.
+ *
+ * @param buffer The buffer.
+ * @param extra Number of bytes that will be appended.
+ * @return 0 on success, -1 if the buffer couldn't grow.
+ */
+int buffer_reserve(Buffer *buffer, size_t extra);
+
+
+/**
+ * Appends bytes to a buffer.
+ *
+ * @param buffer The buffer.
+ * @param data Bytes to append.
+ * @param size Number of bytes to append.
+ * @return 0 on success, -1 if the buffer couldn't grow.
+ */
+int buffer_append(Buffer *buffer, const void *data, size_t size);
+
+
+/**
+ * Frees the bytes of a buffer, leaving it empty.
+ *
+ * @param buffer The buffer.
+ */
+void buffer_free(Buffer *buffer);
+
+
+/**
+ * Gets a value of a list.
+ *
+ * @param values The list.
+ * @param index Position of the value.
+ * @return The value (null terminated), valid until the list changes.
+ */
+const char* value_list_get(const ValueList *values, size_t index);
+
+
+#endif // BUFFER_H
@@ -0,0 +1,36 @@
+#include "checksum.h"
+
+#include <pthread.h>
+
+/// Reversed CRC-32C (Castagnoli) polynomial.
+#define CHECKSUM_POLYNOMIAL 0x82F63B78U
+
+
+/// Checksum of each byte, computed once on the first use.
+static uint32_t checksum_table[256];
+static pthread_once_t checksum_table_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Fills the table of the checksum of each byte.
+ */
+static void init_checksum_table() {
+    for (uint32_t byte = 0; byte < 256; byte++) {
+        uint32_t crc = byte;
+
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ CHECKSUM_POLYNOMIAL : crc >> 1;
+        checksum_table[byte] = crc;
+    }
+}
+
+
+uint32_t checksum_update(uint32_t checksum, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    uint32_t crc = ~checksum;
+
+    pthread_once(&checksum_table_once, init_checksum_table);
+    for (size_t i = 0; i < size; i++)
+        crc = checksum_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
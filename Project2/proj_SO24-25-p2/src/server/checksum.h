@@ -0,0 +1,23 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Checksum of no bytes, where a checksum starts.
+#define CHECKSUM_INITIAL 0
+
+
+/**
+ * Extends a checksum (CRC-32C) with more bytes, so the checksum of some
+ * bytes can be computed a part at a time.
+ *
+ * @param checksum Checksum of the bytes before, CHECKSUM_INITIAL if none.
+ * @param data Bytes to add.
+ * @param size Number of bytes to add.
+ * @return Checksum of the bytes before followed by data.
+ */
+uint32_t checksum_update(uint32_t checksum, const void *data, size_t size);
+
+
+#endif // CHECKSUM_H
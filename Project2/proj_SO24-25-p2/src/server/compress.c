@@ -0,0 +1,479 @@
+#include "compress.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "checksum.h"
+#include "../common/io.h"
+
+/// Shortest back reference.
+#define LZ_MIN_MATCH 4
+/// Farthest back reference (its offset is stored in 2 bytes).
+#define LZ_MAX_OFFSET 65535
+/// Bytes at the end of a block always stored as literals, so a match is
+/// never read past it.
+#define LZ_LAST_LITERALS 8
+/// Length stored in the token, longer lengths continue in the next bytes.
+#define LZ_TOKEN_LENGTH 15
+
+
+/**
+ * Reads 4 bytes, wherever they are aligned.
+ *
+ * @param bytes The bytes.
+ * @return The bytes as a number.
+ */
+static uint32_t read32(const char *bytes) {
+    uint32_t value;
+
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+
+/**
+ * Hashes the 4 bytes a match starts with.
+ *
+ * @param value The bytes (see read32).
+ * @return Position in the compressor's table.
+ */
+static size_t hash4(uint32_t value) {
+    return (size_t) ((value * 2654435761U) >> (32 - LZ_HASH_BITS));
+}
+
+
+/**
+ * Writes the rest of a length that didn't fit in its token: bytes of 255
+ * while it's at least 255, then what's left.
+ *
+ * @param out Where the length is written.
+ * @param length What's left of the length.
+ * @return Position after the length.
+ */
+static char* put_length(char *out, size_t length) {
+    for (; length >= 255; length -= 255) *out++ = (char) 255;
+    *out++ = (char) length;
+    return out;
+}
+
+
+/**
+ * Reads the rest of a length written by put_length.
+ *
+ * @param in Position of the length, moved past it.
+ * @param end End of the compressed bytes.
+ * @param length Length in the token, the rest is added to it.
+ * @return 0 on success, -1 if the bytes end first.
+ */
+static int get_length(const unsigned char **in, const unsigned char *end,\
+    size_t *length) {
+    unsigned char byte;
+
+    do {
+        if (*in == end) return -1;
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+
+/**
+ * Writes a sequence: its token, literals and, unless it's the last one,
+ * its back reference.
+ *
+ * @param out Where the sequence is written.
+ * @param literals The literals.
+ * @param num_literals Number of literals.
+ * @param offset Distance of the back reference, 0 for the last sequence.
+ * @param match_len Length of the back reference.
+ * @return Position after the sequence.
+ */
+static char* put_sequence(char *out, const char *literals,\
+    size_t num_literals, size_t offset, size_t match_len) {
+    size_t extra = offset != 0 ? match_len - LZ_MIN_MATCH : 0;
+    char *token = out++;
+
+    *token = (char) (((num_literals < LZ_TOKEN_LENGTH ? num_literals :\
+        LZ_TOKEN_LENGTH) << 4) |\
+        (extra < LZ_TOKEN_LENGTH ? extra : LZ_TOKEN_LENGTH));
+    if (num_literals >= LZ_TOKEN_LENGTH)
+        out = put_length(out, num_literals - LZ_TOKEN_LENGTH);
+    memcpy(out, literals, num_literals);
+    out += num_literals;
+
+    if (offset == 0) return out;
+    *out++ = (char) (offset & 0xFF);
+    *out++ = (char) (offset >> 8);
+    if (extra >= LZ_TOKEN_LENGTH)
+        out = put_length(out, extra - LZ_TOKEN_LENGTH);
+    return out;
+}
+
+
+size_t lz_compress_bound(size_t size) {
+    return size + size / 255 + 16;
+}
+
+
+size_t lz_compress(const char *src, size_t size, char *dst, uint32_t *table) {
+    const char *end = src + size, *anchor = src, *in = src;
+    const char *limit = size > LZ_LAST_LITERALS ? end - LZ_LAST_LITERALS : src;
+    char *out = dst;
+    size_t misses = 0;
+
+    memset(table, 0, sizeof(uint32_t) << LZ_HASH_BITS);
+    while (in + LZ_MIN_MATCH <= limit) {
+        uint32_t value = read32(in);
+        size_t hash = hash4(value);
+        const char *ref = src + table[hash], *match_end;
+
+        table[hash] = (uint32_t) (in - src);
+        if (ref >= in || in - ref > LZ_MAX_OFFSET || read32(ref) != value) {
+            // Steps grow over bytes that don't compress
+            in += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        match_end = in + LZ_MIN_MATCH;
+        ref += LZ_MIN_MATCH;
+        while (match_end < limit && *match_end == *ref) {
+            match_end++;
+            ref++;
+        }
+        out = put_sequence(out, anchor, (size_t) (in - anchor),\
+            (size_t) (match_end - ref), (size_t) (match_end - in));
+        in = anchor = match_end;
+    }
+    return (size_t) (put_sequence(out, anchor, (size_t) (end - anchor), 0, 0) -\
+        dst);
+}
+
+
+int lz_decompress(const char *src, size_t size, char *dst, size_t raw_size) {
+    const unsigned char *in = (const unsigned char *) src, *end = in + size;
+    char *out = dst, *out_end = dst + raw_size;
+
+    while (in < end) {
+        unsigned char token = *in++;
+        size_t num_literals = (size_t) (token >> 4), offset;
+        size_t match_len = (size_t) (token & 0xF);
+
+        if (num_literals == LZ_TOKEN_LENGTH &&\
+            get_length(&in, end, &num_literals))
+            return -1;
+        if ((size_t) (end - in) < num_literals ||\
+            (size_t) (out_end - out) < num_literals)
+            return -1;
+        memcpy(out, in, num_literals);
+        in += num_literals;
+        out += num_literals;
+        // The last sequence has no back reference
+        if (in == end) break;
+
+        if (end - in < 2) return -1;
+        offset = (size_t) in[0] | (size_t) in[1] << 8;
+        in += 2;
+        if (match_len == LZ_TOKEN_LENGTH && get_length(&in, end, &match_len))
+            return -1;
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t) (out - dst) ||\
+            (size_t) (out_end - out) < match_len)
+            return -1;
+
+        if (offset >= match_len) {
+            memcpy(out, out - offset, match_len);
+            out += match_len;
+        } else {
+            // Overlaps what it writes, repeating the last offset bytes
+            for (size_t i = 0; i < match_len; i++, out++)
+                *out = *(out - offset);
+        }
+    }
+    return out == out_end ? 0 : -1;
+}
+
+
+/**
+ * Appends a block to a compressed file's bytes, stored as it is if it
+ * doesn't compress.
+ *
+ * @param output Where the block is appended.
+ * @param data Bytes of the block (up to COMPRESS_BLOCK_SIZE).
+ * @param size Number of bytes.
+ * @param table Positions of the compressor's matches.
+ * @return 0 on success, -1 if output couldn't grow.
+ */
+static int append_block(Buffer *output, const char *data, size_t size,\
+    uint32_t *table) {
+    CompressBlockHeader header = {(uint32_t) size, 0,\
+        checksum_update(CHECKSUM_INITIAL, data, size)};
+    char *block;
+    size_t block_size;
+
+    if (buffer_reserve(output, sizeof(header) + lz_compress_bound(size)))
+        return -1;
+    block = output->data + output->length + sizeof(header);
+
+    block_size = lz_compress(data, size, block, table);
+    if (block_size >= size) {
+        memcpy(block, data, size);
+        block_size = size;
+        header.size = (uint32_t) block_size | COMPRESS_STORED;
+    } else {
+        header.size = (uint32_t) block_size;
+    }
+    memcpy(output->data + output->length, &header, sizeof(header));
+    output->length += sizeof(header) + block_size;
+    return 0;
+}
+
+
+int compress_append_blocks(Buffer *output, const void *data, size_t size,\
+    uint32_t *table) {
+    const char *bytes = data;
+
+    while (size > 0) {
+        size_t part = size < COMPRESS_BLOCK_SIZE ? size : COMPRESS_BLOCK_SIZE;
+
+        if (append_block(output, bytes, part, table)) return -1;
+        bytes += part;
+        size -= part;
+    }
+    return 0;
+}
+
+
+int compress_append_end(Buffer *output) {
+    CompressBlockHeader end = {0, 0, 0};
+
+    return buffer_append(output, &end, sizeof(end));
+}
+
+
+/**
+ * Compresses a block and writes it.
+ *
+ * @param writer The file.
+ * @param block The block.
+ * @return 0 on success, -1 on failure.
+ */
+static int write_block(CompressWriter *writer, const Buffer *block) {
+    writer->output.length = 0;
+    if (compress_append_blocks(&writer->output, block->data, block->length,\
+        writer->table))
+        return -1;
+    return write_all(writer->fd, writer->output.data, writer->output.length)\
+        == 1 ? 0 : -1;
+}
+
+
+/**
+ * Thread of a compressed file, writing each block handed to it until the
+ * file ends.
+ *
+ * @param arg The CompressWriter.
+ * @return NULL.
+ */
+static void* compress_thread(void *arg) {
+    CompressWriter *writer = arg;
+
+    pthread_mutex_lock(&writer->mutex);
+    while (1) {
+        int ret;
+
+        while (!writer->has_pending && !writer->ending)
+            pthread_cond_wait(&writer->cond, &writer->mutex);
+        if (!writer->has_pending) break;
+
+        // The caller fills the next block meanwhile
+        pthread_mutex_unlock(&writer->mutex);
+        ret = writer->failed ? -1 : write_block(writer, &writer->pending);
+        pthread_mutex_lock(&writer->mutex);
+
+        if (ret) writer->failed = 1;
+        writer->pending.length = 0;
+        writer->has_pending = 0;
+        pthread_cond_broadcast(&writer->cond);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+    return NULL;
+}
+
+
+/**
+ * Hands the block being filled to the writer's thread, once the block
+ * before it is written, and starts an empty one.
+ *
+ * @param writer The file.
+ * @return 0 on success, -1 if a block failed to be written.
+ */
+static int submit_block(CompressWriter *writer) {
+    Buffer block;
+    int ret;
+
+    if (!writer->threaded) {
+        ret = writer->failed ? -1 : write_block(writer, &writer->input);
+        writer->input.length = 0;
+        if (ret) writer->failed = 1;
+        return ret;
+    }
+
+    pthread_mutex_lock(&writer->mutex);
+    while (writer->has_pending)
+        pthread_cond_wait(&writer->cond, &writer->mutex);
+    ret = writer->failed ? -1 : 0;
+    if (ret == 0) {
+        // The buffers are swapped, so neither is copied
+        block = writer->pending;
+        writer->pending = writer->input;
+        writer->input = block;
+        writer->has_pending = 1;
+        pthread_cond_broadcast(&writer->cond);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+    writer->input.length = 0;
+    return ret;
+}
+
+
+int compress_writer_begin(CompressWriter *writer, int fd) {
+    char magic[COMPRESS_MAGIC_SIZE] = COMPRESS_MAGIC;
+
+    writer->table = malloc(sizeof(uint32_t) << LZ_HASH_BITS);
+    if (writer->table == NULL ||\
+        write_all(fd, magic, COMPRESS_MAGIC_SIZE) != 1) {
+        free(writer->table);
+        return -1;
+    }
+
+    writer->fd = fd;
+    writer->input = (Buffer) BUFFER_INITIALIZER;
+    writer->pending = (Buffer) BUFFER_INITIALIZER;
+    writer->output = (Buffer) BUFFER_INITIALIZER;
+    writer->has_pending = 0;
+    writer->ending = 0;
+    writer->failed = 0;
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    // Without a thread the blocks are written by the caller
+    writer->threaded = pthread_create(&writer->thread, NULL, compress_thread,\
+        writer) == 0;
+    return 0;
+}
+
+
+int compress_write(CompressWriter *writer, const void *data, size_t size) {
+    const char *bytes = data;
+
+    while (size > 0) {
+        size_t part = COMPRESS_BLOCK_SIZE - writer->input.length;
+
+        if (part > size) part = size;
+        if (buffer_append(&writer->input, bytes, part)) return -1;
+        bytes += part;
+        size -= part;
+        if (writer->input.length == COMPRESS_BLOCK_SIZE &&\
+            submit_block(writer))
+            return -1;
+    }
+    return 0;
+}
+
+
+int compress_writer_end(CompressWriter *writer, int failed) {
+    int ret = failed ? -1 : 0;
+
+    if (ret == 0 && writer->input.length > 0) ret = submit_block(writer);
+
+    if (writer->threaded) {
+        pthread_mutex_lock(&writer->mutex);
+        writer->ending = 1;
+        pthread_cond_broadcast(&writer->cond);
+        pthread_mutex_unlock(&writer->mutex);
+        pthread_join(writer->thread, NULL);
+    }
+    if (writer->failed) ret = -1;
+    writer->output.length = 0;
+    if (ret == 0 && (compress_append_end(&writer->output) ||\
+        write_all(writer->fd, writer->output.data, writer->output.length) != 1))
+        ret = -1;
+
+    pthread_mutex_destroy(&writer->mutex);
+    pthread_cond_destroy(&writer->cond);
+    buffer_free(&writer->input);
+    buffer_free(&writer->pending);
+    buffer_free(&writer->output);
+    free(writer->table);
+    return ret;
+}
+
+
+int decompress_file(int in_fd, int out_fd) {
+    char magic[COMPRESS_MAGIC_SIZE];
+    Buffer in = BUFFER_INITIALIZER, out = BUFFER_INITIALIZER;
+    int ret = -1;
+
+    if (read_all(in_fd, magic, COMPRESS_MAGIC_SIZE, NULL) != 1 ||\
+        memcmp(magic, COMPRESS_MAGIC, COMPRESS_MAGIC_SIZE) != 0) {
+        fprintf(stderr, "Not a compressed file\n");
+        return -1;
+    }
+
+    while (1) {
+        CompressBlockHeader header;
+        size_t size;
+
+        if (read_all(in_fd, &header, sizeof(header), NULL) != 1) {
+            fprintf(stderr, "Compressed file ends before its end\n");
+            break;
+        }
+        size = header.size & ~COMPRESS_STORED;
+        if (header.raw_size == 0 && size == 0) {
+            ret = 0;
+            break;
+        }
+        // No writer makes a block larger than this
+        if (header.raw_size > COMPRESS_BLOCK_SIZE ||\
+            size > lz_compress_bound(COMPRESS_BLOCK_SIZE)) {
+            fprintf(stderr, "Compressed block is corrupt\n");
+            break;
+        }
+
+        in.length = out.length = 0;
+        if (buffer_reserve(&in, size) ||\
+            buffer_reserve(&out, header.raw_size)) {
+            fprintf(stderr, "Failed to allocate a block\n");
+            break;
+        }
+        if (read_all(in_fd, in.data, size, NULL) != 1) {
+            fprintf(stderr, "Compressed file ends before its end\n");
+            break;
+        }
+        if (header.size & COMPRESS_STORED) {
+            if (size != header.raw_size) {
+                fprintf(stderr, "Compressed block is corrupt\n");
+                break;
+            }
+            memcpy(out.data, in.data, size);
+        } else if (lz_decompress(in.data, size, out.data, header.raw_size)) {
+            fprintf(stderr, "Compressed block is corrupt\n");
+            break;
+        }
+        if (checksum_update(CHECKSUM_INITIAL, out.data, header.raw_size) !=\
+            header.checksum) {
+            fprintf(stderr, "Compressed block fails its checksum\n");
+            break;
+        }
+        if (write_all(out_fd, out.data, header.raw_size) != 1) {
+            fprintf(stderr, "Failed to write a decompressed block\n");
+            break;
+        }
+    }
+
+    buffer_free(&in);
+    buffer_free(&out);
+    return ret;
+}
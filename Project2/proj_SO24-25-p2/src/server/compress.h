@@ -0,0 +1,153 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+
+/// First bytes of a compressed file.
+#define COMPRESS_MAGIC "KVSLZ01"
+/// Length of COMPRESS_MAGIC, with its terminator.
+#define COMPRESS_MAGIC_SIZE 8
+/// Bytes of input compressed together as a block.
+#define COMPRESS_BLOCK_SIZE (1024 * 1024)
+/// Flag of a block's size, set if the block is stored uncompressed.
+#define COMPRESS_STORED 0x80000000u
+/// Bits of the hash the compressor finds its matches with.
+#define LZ_HASH_BITS 14
+
+
+// Header of a block of a compressed file, followed by its bytes. A block
+// with no bytes ends the file, so a file cut short is noticed.
+typedef struct CompressBlockHeader {
+    uint32_t raw_size;              // Bytes of the block once decompressed.
+    uint32_t size;                  // Bytes that follow (| COMPRESS_STORED).
+    uint32_t checksum;              // Checksum of the decompressed bytes.
+} CompressBlockHeader;
+
+
+// Compressed file being written: the caller fills a block while the one
+// before it is compressed and written by the writer's thread.
+typedef struct CompressWriter {
+    int fd;                         // File written.
+    Buffer input;                   // Block being filled by the caller.
+    Buffer pending;                 // Block handed to the thread.
+    Buffer output;                  // Header and bytes of a compressed block.
+    uint32_t *table;                // Positions of the compressor's matches.
+    pthread_t thread;               // Thread compressing and writing blocks.
+    pthread_mutex_t mutex;          // Protects the fields below.
+    pthread_cond_t cond;            // Signaled when one of them changes.
+    int has_pending;                // 1 while pending waits to be written.
+    int ending;                     // 1 once the thread must stop.
+    int failed;                     // 1 once a block failed to be written.
+    int threaded;                   // 0 if blocks are written by the caller.
+} CompressWriter;
+
+
+/**
+ * Gets the most bytes a block can compress to.
+ *
+ * @param size Bytes of the block.
+ * @return Most bytes written by lz_compress.
+ */
+size_t lz_compress_bound(size_t size);
+
+
+/**
+ * Compresses bytes with LZ77 (literals and back references of up to 64 KiB,
+ * found through a hash of their first 4 bytes).
+ *
+ * @param src The bytes.
+ * @param size Number of bytes.
+ * @param dst Where they are compressed to (lz_compress_bound(size) bytes).
+ * @param table Positions of the matches (1 << LZ_HASH_BITS of them).
+ * @return Bytes written to dst.
+ */
+size_t lz_compress(const char *src, size_t size, char *dst, uint32_t *table);
+
+
+/**
+ * Decompresses bytes compressed by lz_compress, checking every length and
+ * reference against the bounds of src and dst.
+ *
+ * @param src The compressed bytes.
+ * @param size Number of compressed bytes.
+ * @param dst Where they are decompressed to.
+ * @param raw_size Number of bytes they must decompress to.
+ * @return 0 on success, -1 if the bytes are corrupt.
+ */
+int lz_decompress(const char *src, size_t size, char *dst, size_t raw_size);
+
+
+/**
+ * Appends bytes to a compressed file's bytes, as blocks of up to
+ * COMPRESS_BLOCK_SIZE, so bytes compressed apart (by several threads) can
+ * be put together.
+ *
+ * @param output Where the blocks are appended.
+ * @param data The bytes.
+ * @param size Number of bytes.
+ * @param table Positions of the matches (1 << LZ_HASH_BITS of them).
+ * @return 0 on success, -1 if output couldn't grow.
+ */
+int compress_append_blocks(Buffer *output, const void *data, size_t size,\
+    uint32_t *table);
+
+
+/**
+ * Appends the block that ends a compressed file.
+ *
+ * @param output Where the block is appended.
+ * @return 0 on success, -1 if output couldn't grow.
+ */
+int compress_append_end(Buffer *output);
+
+
+/**
+ * Starts a compressed file, and the thread that compresses its blocks.
+ *
+ * @param writer The file, ended with compress_writer_end.
+ * @param fd File written.
+ * @return 0 on success, -1 on failure.
+ */
+int compress_writer_begin(CompressWriter *writer, int fd);
+
+
+/**
+ * Adds bytes to a compressed file, handing each full block to the writer's
+ * thread (waiting while the block before it is still being written).
+ *
+ * @param writer The file.
+ * @param data The bytes.
+ * @param size Number of bytes.
+ * @return 0 on success, -1 on failure (of this or of an earlier block).
+ */
+int compress_write(CompressWriter *writer, const void *data, size_t size);
+
+
+/**
+ * Writes the last block and the end of a compressed file, stops its thread
+ * and frees the writer (not its file).
+ *
+ * @param writer The file.
+ * @param failed 1 to only stop and free the writer, leaving the file
+ * without its end.
+ * @return 0 on success, -1 on failure.
+ */
+int compress_writer_end(CompressWriter *writer, int failed);
+
+
+/**
+ * Decompresses a whole compressed file.
+ *
+ * @param in_fd The compressed file, read from its current position.
+ * @param out_fd Where the decompressed bytes are written.
+ * @return 0 on success, -1 if the file couldn't be read, is corrupt or
+ * ends before its end.
+ */
+int decompress_file(int in_fd, int out_fd);
+
+
+#endif // COMPRESS_H
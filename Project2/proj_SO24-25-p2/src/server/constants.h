@@ -4,3 +4,68 @@
 #define MAX_STRING_SIZE 40
 /// Maximum size of a job file name.
 #define MAX_JOB_FILE_NAME_SIZE 256
+/// Number of lock stripes of the KVS (0 picks it from the number of cores).
+#ifndef KVS_LOCK_STRIPES
+#define KVS_LOCK_STRIPES 0
+#endif
+/// Bytes the KVS's pairs may use before the least recently used ones are
+/// evicted (0 for no limit).
+#ifndef KVS_MEMORY_BUDGET
+#define KVS_MEMORY_BUDGET 0
+#endif
+/// Number of KVS shards, each one written only by its own pinned thread
+/// (0 lets the job threads write under the stripes' locks).
+#ifndef KVS_SHARDS
+#define KVS_SHARDS 0
+#endif
+/// Index of the KVS's keys: 0 for linked lists (grown by incremental rehash),
+/// 1 for an open-addressing swiss table per lock stripe.
+#ifndef KVS_SWISS_TABLE
+#define KVS_SWISS_TABLE 0
+#endif
+/// Directory the KVS logs its writes and deletes to, in segments, and
+/// keeps the log's checkpoints in ("" for no log). The KVS is recovered
+/// from it at startup.
+#ifndef KVS_WAL_PATH
+#define KVS_WAL_PATH ""
+#endif
+/// Milliseconds between checkpoints of the log (0 for none): each one dumps
+/// the KVS and removes the segments of the log it replaces, bounding the
+/// log's size and the records replayed by a recovery.
+#ifndef KVS_CHECKPOINT_MS
+#define KVS_CHECKPOINT_MS 60000
+#endif
+/// When the log is synced to disk: -1 before each change is answered (the
+/// changes waiting together share one sync), N > 0 every N ms, 0 never.
+#ifndef KVS_WAL_SYNC_MS
+#define KVS_WAL_SYNC_MS -1
+#endif
+/// 1 for the backup workers to write each backup's snapshot from a forked
+/// child of the server, 0 to write it themselves.
+#ifndef KVS_FORK_BACKUPS
+#define KVS_FORK_BACKUPS 0
+#endif
+/// 1 to write the backups as binary dumps (see dump.h), which the server can
+/// restore at startup, 0 to write them as "(key, value)" lines.
+#ifndef KVS_BINARY_BACKUPS
+#define KVS_BINARY_BACKUPS 0
+#endif
+/// 1 to compress the text backups (see compress.h) as they are written,
+/// blocks of them at a time by a second thread, 0 to write them as they
+/// are. kvs_unpack decompresses one, kvs_merge reads them either way.
+#ifndef KVS_COMPRESSED_BACKUPS
+#define KVS_COMPRESSED_BACKUPS 0
+#endif
+/// Threads writing each backup at once, each one copying whole stripes to
+/// the end of the file (so they are in no particular order): 1 to write it
+/// from one thread in stripe order, 0 for one per core.
+#ifndef KVS_BACKUP_WORKERS
+#define KVS_BACKUP_WORKERS 1
+#endif
+/// 0 for full backups only, N > 0 for chains of backups where every N-th
+/// backup of a job file is a full base and the ones between are deltas of
+/// the backup before them (kvs_merge rebuilds the state from a chain).
+/// Only for text backups.
+#ifndef KVS_DELTA_BACKUPS
+#define KVS_DELTA_BACKUPS 0
+#endif
@@ -0,0 +1,252 @@
+#include "dump.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "checksum.h"
+#include "timer_wheel.h"
+#include "../common/io.h"
+
+/// Bytes of records after which a section is written and a new one begun,
+/// so a writer never holds more and restores can split the work.
+#define DUMP_SECTION_SIZE (1024 * 1024)
+
+
+/**
+ * Reads bytes at a position of a file, retrying short reads.
+ *
+ * @param fd The file.
+ * @param buffer Where the bytes are read to.
+ * @param size Number of bytes.
+ * @param offset Position of the first byte.
+ * @return 0 on success, -1 on failure or if the file ends first.
+ */
+static int read_at(int fd, void *buffer, size_t size, uint64_t offset) {
+    char *bytes = buffer;
+
+    while (size > 0) {
+        ssize_t done = pread(fd, bytes, size, (off_t) offset);
+
+        if (done <= 0) return -1;
+        bytes += done;
+        size -= (size_t) done;
+        offset += (uint64_t) done;
+    }
+    return 0;
+}
+
+
+/**
+ * Computes the checksum of a dump's header.
+ *
+ * @param header The header.
+ * @return Checksum of everything after the checksum field.
+ */
+static uint32_t header_checksum(const DumpHeader *header) {
+    return checksum_update(CHECKSUM_INITIAL,\
+        (const char *) header + sizeof(header->checksum),\
+        sizeof(DumpHeader) - sizeof(header->checksum));
+}
+
+
+/**
+ * Computes the checksum of a section.
+ *
+ * @param header Header of the section.
+ * @param records Records of the section.
+ * @return Checksum of the header (after the checksum field) and records.
+ */
+static uint32_t section_checksum(const DumpSectionHeader *header,\
+    const void *records) {
+    uint32_t checksum = checksum_update(CHECKSUM_INITIAL,\
+        (const char *) header + sizeof(header->checksum),\
+        sizeof(DumpSectionHeader) - sizeof(header->checksum));
+
+    return checksum_update(checksum, records, (size_t) header->size);
+}
+
+
+int dump_file_begin(DumpFile *file, int fd) {
+    DumpHeader header;
+
+    // Left invalid until dump_file_end
+    memset(&header, 0, sizeof(header));
+    if (write_all(fd, DUMP_MAGIC, DUMP_MAGIC_SIZE) != 1 ||\
+        write_all(fd, &header, sizeof(header)) != 1)
+        return -1;
+
+    file->fd = fd;
+    atomic_init(&file->end, DUMP_MAGIC_SIZE + sizeof(DumpHeader));
+    atomic_init(&file->num_sections, 0);
+    atomic_init(&file->num_pairs, 0);
+    return 0;
+}
+
+
+void dump_writer_init(DumpWriter *writer, DumpFile *file) {
+    writer->file = file;
+    writer->section_pairs = 0;
+    writer->section = (Buffer) BUFFER_INITIALIZER;
+}
+
+
+int dump_add_pair(const char *key, size_t key_len, const char *value,\
+    size_t value_len, uint64_t expires_at, void *arg) {
+    DumpWriter *writer = arg;
+    DumpRecordHeader record = {(uint8_t) key_len, {0, 0, 0},\
+        (uint32_t) value_len, timer_wheel_to_wall_clock(expires_at)};
+
+    if (buffer_reserve(&writer->section, sizeof(record) + key_len +\
+        value_len))
+        return -1;
+    buffer_append(&writer->section, &record, sizeof(record));
+    buffer_append(&writer->section, key, key_len);
+    buffer_append(&writer->section, value, value_len);
+    writer->section_pairs++;
+
+    if (writer->section.length >= DUMP_SECTION_SIZE)
+        return dump_end_section(writer);
+    return 0;
+}
+
+
+int dump_end_section(DumpWriter *writer) {
+    DumpFile *file = writer->file;
+    DumpSectionHeader header = {0, writer->section_pairs,\
+        writer->section.length};
+    uint64_t offset;
+
+    if (writer->section_pairs == 0) return 0;
+    header.checksum = section_checksum(&header, writer->section.data);
+    offset = atomic_fetch_add(&file->end,\
+        sizeof(header) + writer->section.length);
+    if (pwrite_all(file->fd, &header, sizeof(header), (off_t) offset) != 1 ||\
+        pwrite_all(file->fd, writer->section.data, writer->section.length,\
+        (off_t) (offset + sizeof(header))) != 1)
+        return -1;
+
+    atomic_fetch_add(&file->num_sections, 1);
+    atomic_fetch_add(&file->num_pairs, writer->section_pairs);
+    writer->section_pairs = 0;
+    writer->section.length = 0;
+    return 0;
+}
+
+
+void dump_writer_free(DumpWriter *writer) {
+    buffer_free(&writer->section);
+    writer->section_pairs = 0;
+}
+
+
+int dump_file_end(DumpFile *file, uint64_t timestamp, int failed) {
+    DumpHeader header = {0, atomic_load(&file->num_sections),\
+        atomic_load(&file->num_pairs), timestamp};
+
+    if (failed) return -1;
+    header.checksum = header_checksum(&header);
+    // The sections are on disk before the header that makes them valid
+    if (fdatasync(file->fd) != 0 ||\
+        pwrite_all(file->fd, &header, sizeof(header), DUMP_MAGIC_SIZE) != 1 ||\
+        fdatasync(file->fd) != 0)
+        return -1;
+    return 0;
+}
+
+
+int dump_open(Dump *dump, const char *path) {
+    char magic[DUMP_MAGIC_SIZE];
+    uint64_t offset = DUMP_MAGIC_SIZE + sizeof(DumpHeader), num_pairs = 0;
+    struct stat st;
+
+    if ((dump->fd = open(path, O_RDONLY)) == -1) {
+        perror(path);
+        return -1;
+    }
+    dump->sections = NULL;
+    if (fstat(dump->fd, &st) != 0 ||\
+        read_at(dump->fd, magic, DUMP_MAGIC_SIZE, 0) ||\
+        memcmp(magic, DUMP_MAGIC, DUMP_MAGIC_SIZE) != 0 ||\
+        read_at(dump->fd, &dump->header, sizeof(DumpHeader),\
+        DUMP_MAGIC_SIZE) ||\
+        dump->header.checksum != header_checksum(&dump->header)) {
+        fprintf(stderr, "%s is not a complete dump\n", path);
+        dump_close(dump);
+        return -1;
+    }
+
+    dump->sections = malloc((dump->header.num_sections + 1) *\
+        sizeof(DumpSection));
+    if (dump->sections == NULL) {
+        fprintf(stderr, "Failed to allocate the sections of %s\n", path);
+        dump_close(dump);
+        return -1;
+    }
+    // Only the headers are read, the sections are skipped
+    for (uint32_t i = 0; i < dump->header.num_sections; i++) {
+        DumpSection *section = &dump->sections[i];
+
+        section->offset = offset;
+        if (read_at(dump->fd, &section->header, sizeof(DumpSectionHeader),\
+            offset) || section->header.size > (uint64_t) st.st_size) {
+            fprintf(stderr, "%s: section %u is corrupt\n", path, i);
+            dump_close(dump);
+            return -1;
+        }
+        offset += sizeof(DumpSectionHeader) + section->header.size;
+        num_pairs += section->header.num_pairs;
+    }
+    if (offset != (uint64_t) st.st_size ||\
+        num_pairs != dump->header.num_pairs) {
+        fprintf(stderr, "%s doesn't match its header\n", path);
+        dump_close(dump);
+        return -1;
+    }
+    return 0;
+}
+
+
+int dump_visit_section(Dump *dump, size_t section, Buffer *records,\
+    DumpVisitor visit, void *arg) {
+    const DumpSectionHeader *header = &dump->sections[section].header;
+    size_t size = (size_t) header->size, offset = 0;
+
+    records->length = 0;
+    if (buffer_reserve(records, size) ||\
+        read_at(dump->fd, records->data, size,\
+        dump->sections[section].offset + sizeof(DumpSectionHeader)) ||\
+        section_checksum(header, records->data) != header->checksum)
+        return -1;
+    records->length = size;
+
+    for (uint32_t i = 0; i < header->num_pairs; i++) {
+        DumpRecordHeader record;
+        const char *key;
+        int ret;
+
+        if (size - offset < sizeof(record)) return -1;
+        memcpy(&record, records->data + offset, sizeof(record));
+        offset += sizeof(record);
+        if (size - offset < (size_t) record.key_len + record.value_len)
+            return -1;
+        key = records->data + offset;
+        offset += record.key_len;
+
+        ret = visit(key, record.key_len, records->data + offset,\
+            record.value_len, timer_wheel_from_wall_clock(record.expires_at),\
+            arg);
+        if (ret != 0) return ret;
+        offset += record.value_len;
+    }
+    return offset == size ? 0 : -1;
+}
+
+
+void dump_close(Dump *dump) {
+    free(dump->sections);
+    dump->sections = NULL;
+    close(dump->fd);
+}
@@ -0,0 +1,185 @@
+#ifndef DUMP_H
+#define DUMP_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+
+/// First bytes of a dump file.
+#define DUMP_MAGIC "KVSDMP2"
+/// Length of DUMP_MAGIC, with its terminator.
+#define DUMP_MAGIC_SIZE 8
+
+
+// Header of a dump, after its magic. Written last, so a dump whose writer
+// stopped halfway has no valid header.
+typedef struct DumpHeader {
+    uint32_t checksum;              // Checksum of the rest of the header.
+    uint32_t num_sections;          // Sections after the header.
+    uint64_t num_pairs;             // Pairs in all the sections.
+    uint64_t timestamp;             // Commit timestamp the dump was cut at.
+} DumpHeader;
+
+
+// Header of a section of a dump (the pairs of a lock stripe, or some of
+// them), followed by its records.
+typedef struct DumpSectionHeader {
+    uint32_t checksum;              // Checksum of the rest of the section.
+    uint32_t num_pairs;             // Records in the section.
+    uint64_t size;                  // Bytes of the records.
+} DumpSectionHeader;
+
+
+// Header of a record of a section, followed by its key and its value.
+typedef struct DumpRecordHeader {
+    uint8_t key_len;                // Length of the key.
+    uint8_t reserved[3];            // Always 0.
+    uint32_t value_len;             // Length of the value.
+    uint64_t expires_at;            // Wall clock time (ms) it expires, or 0.
+} DumpRecordHeader;
+
+
+// Binary snapshot of the KVS being written: its sections, then its header
+// (numbers are in the host's byte order). Sections can be written by
+// several threads at once, each one at the end of the bytes reserved
+// before it, so they are in no particular order.
+typedef struct DumpFile {
+    int fd;                         // File of the dump.
+    atomic_uint_least64_t end;      // End of the bytes reserved so far.
+    atomic_uint_least32_t num_sections; // Sections written.
+    atomic_uint_least64_t num_pairs; // Pairs in the sections written.
+} DumpFile;
+
+
+// Section of a dump being filled by one thread.
+typedef struct DumpWriter {
+    DumpFile *file;                 // The dump.
+    uint32_t section_pairs;         // Records in section.
+    Buffer section;                 // Records of the current section.
+} DumpWriter;
+
+
+// Section of a dump found by dump_open.
+typedef struct DumpSection {
+    uint64_t offset;                // Position of the section's header.
+    DumpSectionHeader header;       // Header of the section.
+} DumpSection;
+
+
+// Dump being read. Its sections can be read by several threads at once.
+typedef struct Dump {
+    int fd;                         // File of the dump.
+    DumpHeader header;              // Header of the dump.
+    DumpSection *sections;          // Sections of the dump.
+} Dump;
+
+
+/// Function called with each pair of a section (and the time it expires,
+/// see timer_wheel_now, 0 if never), stops the visit if not 0.
+typedef int (*DumpVisitor)(const char *key, size_t key_len,\
+    const char *value, size_t value_len, uint64_t expires_at, void *arg);
+
+
+/**
+ * Starts a dump in a file, leaving room for its header.
+ *
+ * @param file The dump, ended with dump_file_end.
+ * @param fd File of the dump (empty).
+ * @return 0 on success, -1 on failure.
+ */
+int dump_file_begin(DumpFile *file, int fd);
+
+
+/**
+ * Starts a writer of sections of a dump.
+ *
+ * @param writer The writer, freed with dump_writer_free.
+ * @param file The dump.
+ */
+void dump_writer_init(DumpWriter *writer, DumpFile *file);
+
+
+/**
+ * Adds a pair to the current section of a dump. Matches DumpVisitor, so
+ * the pairs of a scan can be passed to it.
+ *
+ * @param key The key.
+ * @param key_len Length of the key.
+ * @param value The value.
+ * @param value_len Length of the value.
+ * @param expires_at Time the pair expires (see timer_wheel_now), 0 if
+ * never. Stored as wall clock time, so it holds after a restart.
+ * @param arg The DumpWriter.
+ * @return 0 on success, -1 if the section couldn't grow.
+ */
+int dump_add_pair(const char *key, size_t key_len, const char *value,\
+    size_t value_len, uint64_t expires_at, void *arg);
+
+
+/**
+ * Writes the current section of a dump, if it has any pair, at the end of
+ * the bytes reserved so far.
+ *
+ * @param writer The writer.
+ * @return 0 on success, -1 if the section couldn't be written.
+ */
+int dump_end_section(DumpWriter *writer);
+
+
+/**
+ * Frees a writer of sections, dropping the records of its current section.
+ *
+ * @param writer The writer.
+ */
+void dump_writer_free(DumpWriter *writer);
+
+
+/**
+ * Writes the header of a dump, once every section is written and synced
+ * to disk.
+ *
+ * @param file The dump.
+ * @param timestamp Commit timestamp the dump was cut at.
+ * @param failed 1 to leave the dump invalid, without its header.
+ * @return 0 on success, -1 on failure.
+ */
+int dump_file_end(DumpFile *file, uint64_t timestamp, int failed);
+
+
+/**
+ * Opens a dump, checking its header and finding its sections.
+ *
+ * @param dump The dump, closed with dump_close.
+ * @param path Path of the dump's file.
+ * @return 0 on success, -1 if it couldn't be read or isn't a valid dump.
+ */
+int dump_open(Dump *dump, const char *path);
+
+
+/**
+ * Reads a section of a dump and visits its pairs, once its checksum and
+ * records are checked.
+ *
+ * @param dump The dump.
+ * @param section Position of the section.
+ * @param records Buffer the records are read to (reused between calls).
+ * @param visit Function called with each pair.
+ * @param arg Argument passed to visit.
+ * @return 0 on success, the value returned by visit if it stopped, -1 if
+ * the section couldn't be read or is corrupt.
+ */
+int dump_visit_section(Dump *dump, size_t section, Buffer *records,\
+    DumpVisitor visit, void *arg);
+
+
+/**
+ * Closes a dump.
+ *
+ * @param dump The dump.
+ */
+void dump_close(Dump *dump);
+
+
+#endif // DUMP_H
@@ -0,0 +1,185 @@
+#include "epoch.h"
+
+#include <sched.h>
+
+
+// Per-thread epoch state, padded so threads don't share cache lines.
+typedef struct EpochSlot {
+    _Alignas(64) atomic_uint_fast64_t local; // (epoch << 1) | 1 if active.
+    atomic_bool in_use;                      // Slot owned by a thread.
+} EpochSlot;
+
+
+// Pointer waiting for the epoch to advance before being freed.
+typedef struct Retired {
+    void *ptr;                 // Retired pointer.
+    void (*free_fn)(void *);   // Function that frees ptr.
+    uint64_t epoch;            // Global epoch when ptr was retired.
+    struct Retired *next;      // Next retired pointer.
+} Retired;
+
+
+static EpochSlot slots[EPOCH_MAX_THREADS];
+static atomic_uint_fast64_t global_epoch = 1;
+
+static pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Retired *retired_list = NULL;
+static size_t num_retired = 0;
+
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+static _Thread_local EpochSlot *my_slot = NULL;
+
+
+/**
+ * Releases the slot of a thread that is exiting.
+ *
+ * @param slot The slot owned by the thread.
+ */
+static void release_slot(void *slot) {
+    EpochSlot *epoch_slot = slot;
+
+    atomic_store(&epoch_slot->local, 0);
+    atomic_store(&epoch_slot->in_use, false);
+}
+
+
+/**
+ * Creates the thread-specific key used to release slots on thread exit.
+ */
+static void create_slot_key() {
+    pthread_key_create(&slot_key, release_slot);
+}
+
+
+/**
+ * Gets (claiming it on first use) the slot of the calling thread.
+ *
+ * @return The slot, or NULL if every slot is in use.
+ */
+static EpochSlot *get_slot() {
+    if (my_slot != NULL) return my_slot;
+
+    pthread_once(&slot_key_once, create_slot_key);
+    for (int i = 0; i < EPOCH_MAX_THREADS; i++) {
+        bool expected = false;
+
+        if (atomic_compare_exchange_strong(&slots[i].in_use, &expected, true)) {
+            my_slot = &slots[i];
+            pthread_setspecific(slot_key, my_slot);
+            return my_slot;
+        }
+    }
+    return NULL;
+}
+
+
+int epoch_enter() {
+    EpochSlot *slot = get_slot();
+
+    if (slot == NULL) return -1;
+
+    atomic_store(&slot->local, (atomic_load(&global_epoch) << 1) | 1);
+    return 0;
+}
+
+
+void epoch_exit() {
+    atomic_store_explicit(&my_slot->local, 0, memory_order_release);
+}
+
+
+void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+    Retired *retired = malloc(sizeof(Retired));
+    size_t pending;
+
+    if (retired == NULL) {
+        // Can't defer it, wait until no reader can still hold it instead.
+        uint64_t epoch = atomic_load(&global_epoch);
+
+        while (atomic_load(&global_epoch) < epoch + 2) {
+            epoch_try_reclaim();
+            sched_yield();
+        }
+        free_fn(ptr);
+        return;
+    }
+    retired->ptr = ptr;
+    retired->free_fn = free_fn;
+    retired->epoch = atomic_load(&global_epoch);
+
+    pthread_mutex_lock(&retired_mutex);
+    retired->next = retired_list;
+    retired_list = retired;
+    pending = ++num_retired;
+    pthread_mutex_unlock(&retired_mutex);
+
+    if (pending >= EPOCH_RECLAIM_THRESHOLD) epoch_try_reclaim();
+}
+
+
+/**
+ * Checks if every active thread already observed the given epoch.
+ *
+ * @param epoch The current global epoch.
+ * @return 1 if the epoch can advance, 0 otherwise.
+ */
+static int all_threads_in_epoch(uint64_t epoch) {
+    for (int i = 0; i < EPOCH_MAX_THREADS; i++) {
+        uint64_t local;
+
+        if (!atomic_load(&slots[i].in_use)) continue;
+        local = atomic_load(&slots[i].local);
+        if ((local & 1) && (local >> 1) != epoch) return 0;
+    }
+    return 1;
+}
+
+
+void epoch_try_reclaim() {
+    Retired *to_free = NULL, **link;
+    uint64_t epoch;
+
+    if (pthread_mutex_trylock(&retired_mutex)) return; // Someone is on it.
+
+    epoch = atomic_load(&global_epoch);
+    if (all_threads_in_epoch(epoch)) atomic_store(&global_epoch, ++epoch);
+
+    // Pointers retired two epochs ago can't be reached by any reader.
+    link = &retired_list;
+    while (*link != NULL) {
+        Retired *retired = *link;
+
+        if (retired->epoch + 2 <= epoch) {
+            *link = retired->next;
+            retired->next = to_free;
+            to_free = retired;
+            num_retired--;
+        } else {
+            link = &retired->next;
+        }
+    }
+    pthread_mutex_unlock(&retired_mutex);
+
+    while (to_free != NULL) {
+        Retired *next = to_free->next;
+
+        to_free->free_fn(to_free->ptr);
+        free(to_free);
+        to_free = next;
+    }
+}
+
+
+void epoch_reclaim_all() {
+    pthread_mutex_lock(&retired_mutex);
+    while (retired_list != NULL) {
+        Retired *next = retired_list->next;
+
+        retired_list->free_fn(retired_list->ptr);
+        free(retired_list);
+        retired_list = next;
+    }
+    num_retired = 0;
+    pthread_mutex_unlock(&retired_mutex);
+}
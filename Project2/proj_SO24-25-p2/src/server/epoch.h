@@ -0,0 +1,54 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/// Maximum number of threads that can be inside an epoch at the same time.
+#define EPOCH_MAX_THREADS 128
+/// Number of retired pointers that triggers an attempt to reclaim memory.
+#define EPOCH_RECLAIM_THRESHOLD 64
+
+
+/**
+ * Enters an epoch (read-side critical section). Memory retired after this
+ * call won't be freed until the thread calls epoch_exit.
+ *
+ * @return 0 on success, -1 if every epoch slot is in use (the caller must
+ *         then protect its accesses with locks instead).
+ */
+int epoch_enter();
+
+
+/**
+ * Leaves the epoch entered with epoch_enter.
+ */
+void epoch_exit();
+
+
+/**
+ * Retires memory that was unlinked from every shared structure, it is freed
+ * once no thread can still be reading it.
+ *
+ * @param ptr Pointer to retire.
+ * @param free_fn Function that frees ptr.
+ */
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+
+/**
+ * Tries to advance the global epoch and frees what became unreachable.
+ */
+void epoch_try_reclaim();
+
+
+/**
+ * Frees every retired pointer, only safe when no thread is in an epoch.
+ */
+void epoch_reclaim_all();
+
+
+#endif // EPOCH_H
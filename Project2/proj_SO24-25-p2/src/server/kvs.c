@@ -1,123 +1,1388 @@
 #include "kvs.h"
 
-int hash(const char *key) {
-    int first_letter = tolower(key[0]);
-    if (first_letter >= 'a' && first_letter <= 'z') {
-        return first_letter - 'a';
-    } else if (first_letter >= '0' && first_letter <= '9') {
-        return first_letter - '0';
+/// Pool of the key nodes of every hash table.
+static SlabPool key_node_pool = SLAB_POOL_INITIALIZER(sizeof(KeyNode));
+/// Pool of the values up to MAX_STRING_SIZE long, longer ones are malloc'd.
+static SlabPool small_value_pool =\
+    SLAB_POOL_INITIALIZER(sizeof(KeyValue) + MAX_STRING_SIZE + 1);
+
+int visit_stripe_key_nodes(HashTable *ht, size_t stripe,\
+    int (*visit)(KeyNode *key_node, void *arg), void *arg);
+int remove_node_subscriptions(AVL *avl_kvs_node, AVLSessions *avl_sessions,\
+    const char* key);
+
+uint64_t hash(const char *key) {
+    uint64_t hash_value = 14695981039346656037ULL; // FNV offset basis
+
+    // A key that fills MAX_STRING_SIZE may have no terminator
+    for (size_t i = 0; i < MAX_STRING_SIZE && key[i] != '\0'; i++) {
+        hash_value ^= (unsigned char) key[i];
+        hash_value *= 1099511628211ULL; // FNV prime
+    }
+    return hash_value;
+}
+
+
+void make_key_probe(KeyProbe *probe, const char *key) {
+    probe->len = strnlen(key, MAX_STRING_SIZE);
+    memset(probe->bytes, 0, KEY_SIZE);
+    memcpy(probe->bytes, key, probe->len);
+    probe->hash = hash(probe->bytes);
+}
+
+
+/**
+ * Function to create an array of lock stripes.
+ *
+ * @param num_stripes Number of stripes to create.
+ * @return a pointer to the new stripes or NULL on failure.
+ */
+LockStripe* create_LockStripes(size_t num_stripes){
+  LockStripe *stripes = aligned_alloc(CACHE_LINE_SIZE,\
+    num_stripes * sizeof(LockStripe));
+  if (!stripes) return NULL;
+
+  for (size_t i = 0; i < num_stripes; i++){
+    stripes[i].version_clock = 0;
+    stripes[i].tombstones = NULL;
+    stripes[i].pruned_horizon = 0;
+    if (pthread_rwlock_init(&stripes[i].rwl, NULL)){
+      while (i-- > 0) pthread_rwlock_destroy(&stripes[i].rwl);
+      free(stripes);
+      return NULL;
+    }
+  }
+  return stripes;
+}
+
+
+/**
+ * Function to destroy an array of lock stripes.
+ *
+ * @param stripes Stripes to destroy.
+ * @param num_stripes Number of stripes in the array.
+ */
+void destroy_LockStripes(LockStripe *stripes, size_t num_stripes){
+  for (size_t i = 0; i < num_stripes; i++){
+    while (stripes[i].tombstones != NULL){
+      Tombstone *next = stripes[i].tombstones->next;
+
+      free(stripes[i].tombstones);
+      stripes[i].tombstones = next;
+    }
+    pthread_rwlock_destroy(&stripes[i].rwl);
+  }
+  free(stripes);
+}
+
+
+/**
+ * Function to create the (zeroed) counters of a Bloom filter.
+ *
+ * @param size Number of counters (power of two).
+ * @return a pointer to the new counters or NULL on failure.
+ */
+FilterCounters* create_FilterCounters(size_t size){
+  FilterCounters *counters = malloc(sizeof(FilterCounters) +\
+    size * sizeof(_Atomic uint8_t));
+  if (!counters) return NULL;
+
+  counters->mask = size - 1;
+  for (size_t i = 0; i < size; i++)
+    atomic_init(&counters->counters[i], 0);
+  return counters;
+}
+
+
+/**
+ * Function to create the (empty) Bloom filters of the lock stripes.
+ *
+ * @param num_stripes Number of stripes.
+ * @return a pointer to the new filters or NULL on failure.
+ */
+BloomFilter* create_BloomFilters(size_t num_stripes){
+  BloomFilter *filters = aligned_alloc(CACHE_LINE_SIZE,\
+    num_stripes * sizeof(BloomFilter));
+  if (!filters) return NULL;
+
+  for (size_t i = 0; i < num_stripes; i++){
+    FilterCounters *counters = create_FilterCounters(BLOOM_FILTER_COUNTERS);
+
+    if (!counters){
+      while (i-- > 0) free(atomic_load(&filters[i].counters));
+      free(filters);
+      return NULL;
+    }
+    atomic_init(&filters[i].negatives, 0);
+    atomic_init(&filters[i].false_positives, 0);
+    atomic_init(&filters[i].counters, counters);
+    filters[i].num_keys = 0;
+  }
+  return filters;
+}
+
+
+/**
+ * Function to destroy the Bloom filters of the lock stripes.
+ *
+ * @param filters Filters to destroy.
+ * @param num_stripes Number of stripes.
+ */
+void destroy_BloomFilters(BloomFilter *filters, size_t num_stripes){
+  for (size_t i = 0; i < num_stripes; i++)
+    free(atomic_load(&filters[i].counters));
+  free(filters);
+}
+
+
+#if KVS_SWISS_TABLE
+/**
+ * Function to get the hash of a key node, used by its swiss table to grow.
+ *
+ * @param item The key node.
+ * @return Hash of the node's key.
+ */
+uint64_t key_node_hash(const void *item){
+  return ((const KeyNode *) item)->hash;
+}
+
+
+/**
+ * Function to create the (empty) swiss tables of the lock stripes.
+ *
+ * @param num_stripes Number of stripes.
+ * @return a pointer to the new tables or NULL on failure.
+ */
+SwissTable** create_SwissTables(size_t num_stripes){
+  SwissTable **indexes = malloc(num_stripes * sizeof(SwissTable *));
+  if (!indexes) return NULL;
+
+  for (size_t i = 0; i < num_stripes; i++){
+    if ((indexes[i] = create_swiss_table(key_node_hash)) == NULL){
+      while (i-- > 0) free_swiss_table(indexes[i]);
+      free(indexes);
+      return NULL;
+    }
+  }
+  return indexes;
+}
+#endif
+
+
+/**
+ * Function to create the (empty) index of a new table.
+ *
+ * @param ht The table, its stripes already created.
+ * @return 0 on success, -1 on failure.
+ */
+int create_index(HashTable *ht){
+#if KVS_SWISS_TABLE
+  ht->indexes = create_SwissTables(ht->num_stripes);
+  return ht->indexes ? 0 : -1;
+#else
+  // At least one index list per stripe
+  ht->size = TABLE_INITIAL_SIZE;
+  while (ht->size < ht->num_stripes) ht->size *= 2;
+  ht->table = calloc(ht->size, sizeof(IndexList));
+  ht->old_table = NULL;
+  ht->old_size = 0;
+  ht->rehash_index = 0;
+  return ht->table ? 0 : -1;
+#endif
+}
+
+
+/**
+ * Function to free the index of a table (not its key nodes).
+ *
+ * @param ht The table.
+ */
+void free_index(HashTable *ht){
+#if KVS_SWISS_TABLE
+  for (size_t i = 0; i < ht->num_stripes; i++)
+    free_swiss_table(ht->indexes[i]);
+  free(ht->indexes);
+#else
+  free(ht->old_table);
+  free(ht->table);
+#endif
+}
+
+
+/**
+ * Chooses the number of lock stripes of a new table.
+ *
+ * @param requested Requested number of stripes, 0 to derive it from cores.
+ * @return A power of two between 1 and MAX_LOCK_STRIPES.
+ */
+size_t choose_num_stripes(size_t requested){
+  size_t num_stripes = 1;
+
+  if (requested == 0){
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    requested = (cores > 0 ? (size_t) cores : 1) * LOCK_STRIPES_PER_CORE;
+  }
+  while (num_stripes < requested && num_stripes < MAX_LOCK_STRIPES)
+    num_stripes *= 2;
+  return num_stripes;
+}
+
+
+HashTable* create_hash_table(size_t num_stripes) {
+  HashTable *ht = malloc(sizeof(HashTable));
+  if (!ht) return NULL;
+  if (pthread_rwlock_init(&ht->rwl, NULL)){
+    free(ht);
+    return NULL;
+  }
+  if (pthread_mutex_init(&ht->snapshots_lock, NULL)){
+    pthread_rwlock_destroy(&ht->rwl);
+    free(ht);
+    return NULL;
+  }
+  if (pthread_cond_init(&ht->cut_changed, NULL)){
+    pthread_mutex_destroy(&ht->snapshots_lock);
+    pthread_rwlock_destroy(&ht->rwl);
+    free(ht);
+    return NULL;
+  }
+  ht->num_stripes = choose_num_stripes(num_stripes);
+  ht->stripes = create_LockStripes(ht->num_stripes);
+  ht->filters = create_BloomFilters(ht->num_stripes);
+  if (!ht->stripes || !ht->filters){
+    if (ht->stripes) destroy_LockStripes(ht->stripes, ht->num_stripes);
+    if (ht->filters) destroy_BloomFilters(ht->filters, ht->num_stripes);
+    pthread_cond_destroy(&ht->cut_changed);
+    pthread_mutex_destroy(&ht->snapshots_lock);
+    pthread_rwlock_destroy(&ht->rwl);
+    free(ht);
+    return NULL;
+  }
+  ht->ordered_index = create_skiplist();
+  if (!ht->ordered_index || create_index(ht)){
+    if (ht->ordered_index) free_skiplist(ht->ordered_index);
+    destroy_LockStripes(ht->stripes, ht->num_stripes);
+    destroy_BloomFilters(ht->filters, ht->num_stripes);
+    pthread_cond_destroy(&ht->cut_changed);
+    pthread_mutex_destroy(&ht->snapshots_lock);
+    pthread_rwlock_destroy(&ht->rwl);
+    free(ht);
+    return NULL;
+  }
+  atomic_init(&ht->num_keys, 0);
+  atomic_init(&ht->mem_used, 0);
+  atomic_init(&ht->clock_hand, 0);
+  atomic_init(&ht->layout_seq, 0);
+  atomic_init(&ht->commit_clock, 0);
+  atomic_init(&ht->tombstone_horizon, UINT64_MAX);
+  ht->snapshots = NULL;
+  atomic_init(&ht->num_snapshots, 0);
+  ht->split_batches = 0;
+  ht->snapshots_waiting = 0;
+  return ht;
+}
+
+
+#if !KVS_SWISS_TABLE
+/**
+ * Gets the index list of a hash, as get_index_list does for a key.
+ *
+ * @param ht Hash table to search.
+ * @param hash_value Hash of the key.
+ * @return Index list of the key.
+ */
+IndexList *get_index_list_by_hash(HashTable *ht, uint64_t hash_value) {
+    // Loaded atomically since lock-free readers race with the rehash
+    IndexList *old_table = __atomic_load_n(&ht->old_table, __ATOMIC_RELAXED);
+    IndexList *table = __atomic_load_n(&ht->table, __ATOMIC_RELAXED);
+    size_t size = __atomic_load_n(&ht->size, __ATOMIC_RELAXED);
+
+    if (old_table != NULL) {
+        size_t old_size = __atomic_load_n(&ht->old_size, __ATOMIC_RELAXED);
+        size_t old_index = (size_t) (hash_value & (old_size - 1));
+        // Lists before rehash_index were already moved to the new table
+        if (old_index >= __atomic_load_n(&ht->rehash_index, __ATOMIC_RELAXED))
+            return &old_table[old_index];
+    }
+    return &table[(size_t) (hash_value & (size - 1))];
+}
+
+
+IndexList *get_index_list(HashTable *ht, const char *key) {
+    return get_index_list_by_hash(ht, hash(key));
+}
+#endif
+
+
+size_t get_lock_stripe(HashTable *ht, const char *key) {
+    return (size_t) (hash(key) & (ht->num_stripes - 1));
+}
+
+
+/**
+ * Gets the position of one of a key's counters in its stripe's filter, by
+ * double hashing the bits of the hash above the ones that pick the stripe.
+ *
+ * @param counters Counters of the filter.
+ * @param hash_value Hash of the key.
+ * @param i Which of the key's BLOOM_FILTER_HASHES counters.
+ * @return Position of the counter.
+ */
+size_t filter_position(const FilterCounters *counters, uint64_t hash_value,\
+    unsigned int i) {
+    uint32_t h1 = (uint32_t) (hash_value >> 32);
+    uint32_t h2 = (uint32_t) (hash_value >> 12) | 1;
+
+    return (size_t) ((h1 + i * h2) & counters->mask);
+}
+
+
+/**
+ * Adds (delta 1) or removes (delta -1) a key from the counters of a filter.
+ *
+ * @param counters Counters of the filter.
+ * @param hash_value Hash of the key.
+ * @param delta 1 to add the key, -1 to remove it.
+ */
+void update_counters(FilterCounters *counters, uint64_t hash_value,\
+    int delta) {
+    for (unsigned int i = 0; i < BLOOM_FILTER_HASHES; i++) {
+        _Atomic uint8_t *counter =\
+            &counters->counters[filter_position(counters, hash_value, i)];
+        uint8_t count = atomic_load_explicit(counter, memory_order_relaxed);
+
+        // A saturated counter lost track of its keys, it can't go down
+        if (count == UINT8_MAX) continue;
+        atomic_store_explicit(counter, (uint8_t) (count + delta),\
+            memory_order_relaxed);
+    }
+}
+
+
+/**
+ * Adds a key node to the counters of a filter being rebuilt.
+ *
+ * @param key_node Key node of the stripe.
+ * @param arg The new counters.
+ * @return 0.
+ */
+int count_key_node(KeyNode *key_node, void *arg) {
+    update_counters(arg, key_node->hash, 1);
+    return 0;
+}
+
+
+/**
+ * Rebuilds the filter of a stripe from its keys with enough counters for a
+ * number of keys, if it has fewer. Readers may still be checking the old
+ * counters, so they are retired. The caller must hold the hash table's lock
+ * and, unless it holds the table's lock to write, the stripe's lock to write.
+ *
+ * @param ht Hash table of the stripe.
+ * @param stripe Position of the stripe.
+ * @param num_keys Number of keys the filter will count.
+ * @return 0 on success, -1 if the new counters couldn't be allocated.
+ */
+int resize_filter(HashTable *ht, size_t stripe, size_t num_keys) {
+    BloomFilter *filter = &ht->filters[stripe];
+    FilterCounters *old_counters = atomic_load_explicit(&filter->counters,\
+        memory_order_relaxed);
+    FilterCounters *counters;
+    size_t size = old_counters->mask + 1;
+
+    while (size < num_keys * BLOOM_FILTER_COUNTERS_PER_KEY) size *= 2;
+    if (size == old_counters->mask + 1) return 0;
+    if ((counters = create_FilterCounters(size)) == NULL) return -1;
+
+    // Also clears the counters that saturated
+    visit_stripe_key_nodes(ht, stripe, count_key_node, counters);
+    atomic_store_explicit(&filter->counters, counters, memory_order_release);
+    epoch_retire(old_counters, free);
+    return 0;
+}
+
+
+/**
+ * Adds (delta 1) or removes (delta -1) a key from its stripe's filter,
+ * rebuilding the filter twice as big if its keys outgrew it. A new key is
+ * added before it is linked, so a rebuild doesn't count it twice. The caller
+ * must hold the hash table's lock and the stripe's lock to write.
+ *
+ * @param ht Hash table of the key.
+ * @param hash_value Hash of the key.
+ * @param delta 1 to add the key, -1 to remove it.
+ */
+void update_filter(HashTable *ht, uint64_t hash_value, int delta) {
+    size_t stripe = (size_t) (hash_value & (ht->num_stripes - 1));
+    BloomFilter *filter = &ht->filters[stripe];
+    FilterCounters *counters;
+
+    if (delta > 0) filter->num_keys++;
+    else filter->num_keys--;
+    counters = atomic_load_explicit(&filter->counters, memory_order_relaxed);
+    // If it can't grow, it keeps working with more false positives
+    if (filter->num_keys * BLOOM_FILTER_COUNTERS_PER_KEY > counters->mask + 1\
+        && resize_filter(ht, stripe, 2 * filter->num_keys) == 0)
+        counters = atomic_load_explicit(&filter->counters,\
+            memory_order_relaxed);
+    update_counters(counters, hash_value, delta);
+}
+
+
+/**
+ * Checks the Bloom filter of a hash, as pair_may_exist does for a key.
+ *
+ * @param ht Hash table to check.
+ * @param hash_value Hash of the key.
+ * @return 0 if the key isn't in the table, 1 if it may be.
+ */
+int filter_may_contain(HashTable *ht, uint64_t hash_value) {
+    BloomFilter *filter = &ht->filters[hash_value & (ht->num_stripes - 1)];
+    FilterCounters *counters;
+
+    // Without an epoch the counters could be freed by a rebuild
+    if (epoch_enter()) return 1;
+    counters = atomic_load_explicit(&filter->counters, memory_order_acquire);
+    for (unsigned int i = 0; i < BLOOM_FILTER_HASHES; i++) {
+        if (atomic_load_explicit(&counters->counters[filter_position(counters,\
+            hash_value, i)], memory_order_relaxed) == 0) {
+            epoch_exit();
+            atomic_fetch_add_explicit(&filter->negatives, 1,\
+                memory_order_relaxed);
+            return 0;
+        }
+    }
+    epoch_exit();
+    return 1;
+}
+
+
+int pair_may_exist(HashTable *ht, const char *key) {
+    return filter_may_contain(ht, hash(key));
+}
+
+
+/**
+ * Counts a key the filter said may exist but wasn't found.
+ *
+ * @param ht Hash table of the key.
+ * @param hash_value Hash of the key.
+ */
+void count_false_positive(HashTable *ht, uint64_t hash_value) {
+    atomic_fetch_add_explicit(&ht->filters[hash_value &\
+        (ht->num_stripes - 1)].false_positives, 1, memory_order_relaxed);
+}
+
+
+void get_filter_stats(HashTable *ht, size_t *negatives,\
+    size_t *false_positives, size_t *counters) {
+    *negatives = 0;
+    *false_positives = 0;
+    *counters = 0;
+    for (size_t i = 0; i < ht->num_stripes; i++) {
+        *negatives += atomic_load_explicit(&ht->filters[i].negatives,\
+            memory_order_relaxed);
+        *false_positives += atomic_load_explicit(\
+            &ht->filters[i].false_positives, memory_order_relaxed);
+        // Read without the stripe's lock, a rebuild only ever grows it
+        if (epoch_enter() == 0) {
+            *counters += atomic_load_explicit(&ht->filters[i].counters,\
+                memory_order_acquire)->mask + 1;
+            epoch_exit();
+        }
+    }
+}
+
+
+/**
+ * Grows the Bloom filters so each holds its share of a number of keys.
+ * The caller must hold the hash table's lock to write.
+ *
+ * @param ht Hash table to grow.
+ * @param num_keys Number of keys the table will hold.
+ * @return 0 on success, -1 if a filter couldn't grow.
+ */
+int presize_filters(HashTable *ht, size_t num_keys) {
+    // Keys spread evenly over the stripes, with room for the unlucky ones
+    size_t per_stripe = num_keys / ht->num_stripes;
+
+    per_stripe += per_stripe / 8;
+    for (size_t i = 0; i < ht->num_stripes; i++)
+        if (resize_filter(ht, i, per_stripe)) return -1;
+    return 0;
+}
+
+
+#if KVS_SWISS_TABLE
+int hash_table_needs_rehash(HashTable *ht) {
+    (void) ht;
+    return 0;
+}
+
+
+int hash_table_rehash_step(HashTable *ht) {
+    (void) ht;
+    return 0;
+}
+
+
+int hash_table_presize(HashTable *ht, size_t num_keys) {
+    // Keys spread evenly over the stripes, with room for the unlucky ones
+    size_t per_stripe = num_keys / ht->num_stripes;
+
+    if (presize_filters(ht, num_keys)) return -1;
+    per_stripe += per_stripe / 8 + SWISS_GROUP_SIZE;
+    for (size_t i = 0; i < ht->num_stripes; i++)
+        if (swiss_table_presize(ht->indexes[i], per_stripe)) return -1;
+    return 0;
+}
+#else
+size_t get_num_index_lists(HashTable *ht) {
+    return ht->old_size + ht->size;
+}
+
+
+IndexList *get_index_list_at(HashTable *ht, size_t position) {
+    if (position < ht->old_size) return &ht->old_table[position];
+    return &ht->table[position - ht->old_size];
+}
+
+
+int hash_table_needs_rehash(HashTable *ht) {
+    return ht->old_table != NULL ||\
+        atomic_load(&ht->num_keys) > ht->size * TABLE_MAX_LOAD_FACTOR;
+}
+
+
+/**
+ * Moves every node of an old index list to its list in the new table.
+ *
+ * @param ht Hash table being rehashed.
+ * @param old_list Index list to migrate.
+ */
+void migrate_index_list(HashTable *ht, IndexList *old_list) {
+    KeyNode *key_node = old_list->head;
+
+    while (key_node != NULL) {
+        KeyNode *next = key_node->next;
+        size_t new_index = (size_t) (key_node->hash & (ht->size - 1));
+        IndexList *new_list = &ht->table[new_index];
+
+        key_node->next = new_list->head;
+        new_list->head = key_node;
+        key_node = next;
+    }
+    old_list->head = NULL;
+}
+
+
+int hash_table_rehash_step(HashTable *ht) {
+    unsigned int seq = atomic_load_explicit(&ht->layout_seq,\
+        memory_order_relaxed);
+    IndexList *new_table = NULL;
+
+    if (ht->old_table == NULL) {
+        if (atomic_load(&ht->num_keys) <= ht->size * TABLE_MAX_LOAD_FACTOR)
+            return 0;
+
+        // Double the table, the old lists are migrated in the next steps
+        new_table = calloc(ht->size * 2, sizeof(IndexList));
+        if (!new_table) return -1;
+    }
+
+    // Make lock-free readers retry the lookups that overlap this step
+    atomic_store_explicit(&ht->layout_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    if (new_table != NULL) {
+        ht->old_table = ht->table;
+        ht->old_size = ht->size;
+        ht->rehash_index = 0;
+        ht->table = new_table;
+        ht->size *= 2;
+    }
+
+    for (int step = 0; step < TABLE_REHASH_STEP &&\
+        ht->rehash_index < ht->old_size; step++)
+        migrate_index_list(ht, &ht->old_table[ht->rehash_index++]);
+
+    // Every old list was migrated
+    if (ht->rehash_index == ht->old_size) {
+        epoch_retire(ht->old_table, free); // Readers may still be using it
+        ht->old_table = NULL;
+        ht->old_size = 0;
+        ht->rehash_index = 0;
+    }
+
+    atomic_store_explicit(&ht->layout_seq, seq + 2, memory_order_release);
+    return 0;
+}
+
+
+int hash_table_presize(HashTable *ht, size_t num_keys) {
+    unsigned int seq = atomic_load_explicit(&ht->layout_seq,\
+        memory_order_relaxed);
+    size_t size = ht->size;
+    IndexList *new_table;
+
+    if (presize_filters(ht, num_keys)) return -1;
+    while (size * TABLE_MAX_LOAD_FACTOR < num_keys) size *= 2;
+    // A rehash in progress is left to finish, it grows the table anyway
+    if (size == ht->size || ht->old_table != NULL) return 0;
+    if ((new_table = calloc(size, sizeof(IndexList))) == NULL) return -1;
+
+    // Moved at once, as the last step of a rehash would
+    atomic_store_explicit(&ht->layout_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    ht->old_table = ht->table;
+    ht->old_size = ht->size;
+    ht->table = new_table;
+    ht->size = size;
+    for (size_t i = 0; i < ht->old_size; i++)
+        migrate_index_list(ht, &ht->old_table[i]);
+    epoch_retire(ht->old_table, free); // Readers may still be using it
+    ht->old_table = NULL;
+    ht->old_size = 0;
+    ht->rehash_index = 0;
+    atomic_store_explicit(&ht->layout_seq, seq + 2, memory_order_release);
+    return 0;
+}
+#endif
+
+
+/**
+ * Gets the bytes used by the block of a value.
+ *
+ * @param value_len Length of the value.
+ * @return Size of the block.
+ */
+size_t key_value_size(size_t value_len) {
+    if (value_len <= MAX_STRING_SIZE)
+        return sizeof(KeyValue) + MAX_STRING_SIZE + 1;
+    return sizeof(KeyValue) + value_len + 1;
+}
+
+
+/**
+ * Creates the block of a value, its version and commit timestamp are set
+ * once it is written.
+ *
+ * @param value The value.
+ * @param value_len Length of the value.
+ * @param expires_at Time the value expires, 0 if never.
+ * @return The block, NULL on failure.
+ */
+KeyValue* create_key_value(const char *value, size_t value_len,\
+    uint64_t expires_at) {
+    KeyValue *key_value;
+
+    if (value_len <= MAX_STRING_SIZE) key_value = slab_alloc(&small_value_pool);
+    else key_value = malloc(key_value_size(value_len));
+    if (key_value == NULL) return NULL;
+
+    key_value->version = 0;
+    key_value->timestamp = 0;
+    key_value->expires_at = expires_at;
+    key_value->len = value_len;
+    memcpy(key_value->data, value, value_len);
+    key_value->data[value_len] = '\0';
+    return key_value;
+}
+
+
+/**
+ * Frees the block of a value that was replaced or whose node was freed.
+ *
+ * @param value The KeyValue to free.
+ */
+void free_key_value(void *value) {
+    KeyValue *key_value = value;
+
+    if (key_value->len <= MAX_STRING_SIZE)
+        slab_free(&small_value_pool, key_value);
+    else
+        free(key_value);
+}
+
+
+/**
+ * Frees a key node that was unlinked from its list, with its value.
+ *
+ * @param node The KeyNode to free.
+ */
+void free_key_node(void *node) {
+    KeyNode *key_node = node;
+
+    free_key_value(key_node->value);
+    slab_free(&key_node_pool, key_node);
+}
+
+
+/**
+ * Sends a notification of a key to its subscribers.
+ *
+ * @param avl_notif_fds Subscribers of the key.
+ * @param key The key.
+ * @param key_len Length of the key.
+ * @param value New value of the key, "DELETED" if it was deleted.
+ * @param value_len Length of the value.
+ */
+void notify_subscribers(AVL *avl_notif_fds, const char *key, size_t key_len,\
+    const char *value, size_t value_len) {
+    NotificationHeader header = {(uint32_t) key_len, (uint32_t) value_len};
+    struct iovec message[3] = {
+        {&header, sizeof(header)},
+        {(char *) key, key_len},
+        {(char *) value, value_len}
+    };
+
+    send_to_all_fds(avl_notif_fds, message, 3);
+}
+
+
+/**
+ * Checks if a key node holds the given key. Most nodes are told apart by
+ * their hash, the others compare the whole padded key a word at a time
+ * without stopping at the first difference.
+ *
+ * @param key_node Node to check.
+ * @param probe Key to compare with.
+ * @return 1 if the node holds the key, 0 otherwise.
+ */
+int key_node_matches(const KeyNode *key_node, const KeyProbe *probe) {
+    uint64_t diff = 0;
+
+    if (key_node->hash != probe->hash) return 0;
+    for (size_t i = 0; i < KEY_SIZE; i += sizeof(uint64_t)) {
+        uint64_t node_word, probe_word;
+
+        memcpy(&node_word, key_node->key + i, sizeof(uint64_t));
+        memcpy(&probe_word, probe->bytes + i, sizeof(uint64_t));
+        diff |= node_word ^ probe_word;
+    }
+    return diff == 0;
+}
+
+
+#if KVS_SWISS_TABLE
+/**
+ * Gets the swiss table of the stripe of a hash.
+ *
+ * @param ht Hash table of the key.
+ * @param hash_value Hash of the key.
+ * @return Swiss table of the key.
+ */
+SwissTable *get_swiss_table(HashTable *ht, uint64_t hash_value) {
+    return ht->indexes[hash_value & (ht->num_stripes - 1)];
+}
+
+
+/**
+ * Checks if a key node holds a key, as key_node_matches does, for the
+ * lookups of the swiss tables.
+ *
+ * @param item Key node to check.
+ * @param key KeyProbe of the key.
+ * @return 1 if the node holds the key, 0 otherwise.
+ */
+int key_node_matches_item(const void *item, const void *key) {
+    return key_node_matches(item, key);
+}
+#endif
+
+
+/**
+ * Searches the node of a key. The caller must hold the key's stripe, or be
+ * inside an epoch and validate the table's layout.
+ *
+ * @param ht Hash table to search.
+ * @param probe The key.
+ * @return Node of the key, NULL if it isn't in the table.
+ */
+KeyNode *find_probed_node(HashTable *ht, const KeyProbe *probe) {
+#if KVS_SWISS_TABLE
+    return swiss_table_find(get_swiss_table(ht, probe->hash), probe->hash,\
+        key_node_matches_item, probe);
+#else
+    IndexList *index_list = get_index_list_by_hash(ht, probe->hash);
+    KeyNode *key_node = __atomic_load_n(&index_list->head, __ATOMIC_ACQUIRE);
+
+    while (key_node != NULL && !key_node_matches(key_node, probe))
+        key_node = __atomic_load_n(&key_node->next, __ATOMIC_ACQUIRE);
+    return key_node;
+#endif
+}
+
+
+/**
+ * Makes room in the index for new key nodes, so linking them can't fail.
+ * The caller must hold their stripe locked to write.
+ *
+ * @param ht Hash table of the keys.
+ * @param hash_value Hash of one of the keys (all in the same stripe).
+ * @param num_nodes Number of nodes about to be linked in the stripe.
+ * @return 0 on success, -1 if the index couldn't grow.
+ */
+int reserve_key_nodes(HashTable *ht, uint64_t hash_value, size_t num_nodes) {
+#if KVS_SWISS_TABLE
+    return swiss_table_reserve(get_swiss_table(ht, hash_value), num_nodes);
+#else
+    // Lists grow with their nodes, the table with hash_table_rehash_step
+    (void) ht;
+    (void) hash_value;
+    (void) num_nodes;
+    return 0;
+#endif
+}
+
+
+/**
+ * Publishes a fully initialized key node in the index. The caller must hold
+ * its stripe locked to write and have reserved room with reserve_key_nodes.
+ *
+ * @param ht Hash table of the key.
+ * @param key_node The new node.
+ */
+void link_key_node(HashTable *ht, KeyNode *key_node) {
+#if KVS_SWISS_TABLE
+    swiss_table_insert(get_swiss_table(ht, key_node->hash), key_node->hash,\
+        key_node);
+#else
+    IndexList *index_list = get_index_list_by_hash(ht, key_node->hash);
+
+    // Insert the new key node at the beginning of the list
+    key_node->next = index_list->head;
+    __atomic_store_n(&index_list->head, key_node, __ATOMIC_RELEASE);
+#endif
+}
+
+
+/**
+ * Removes a key node from the index. Lock-free readers may still be using
+ * it, so it must be freed through epochs. The caller must hold its stripe
+ * locked to write.
+ *
+ * @param ht Hash table of the key.
+ * @param key_node Node to remove.
+ */
+void unlink_key_node(HashTable *ht, KeyNode *key_node) {
+#if KVS_SWISS_TABLE
+    swiss_table_remove(get_swiss_table(ht, key_node->hash), key_node->hash,\
+        key_node);
+#else
+    IndexList *index_list = get_index_list_by_hash(ht, key_node->hash);
+    KeyNode **link = &index_list->head;
+
+    // Bypass the node from the link (head or previous node) pointing to it
+    while (*link != key_node) link = &(*link)->next;
+    __atomic_store_n(link, key_node->next, __ATOMIC_RELEASE);
+#endif
+}
+
+
+KeyNode *find_key_node(HashTable *ht, const char *key) {
+    KeyProbe probe;
+
+    make_key_probe(&probe, key);
+    return find_probed_node(ht, &probe);
+}
+
+
+/**
+ * Marks a key node as recently used, so the next eviction sweep keeps it.
+ * Only writes the flag if it isn't set, not to bounce its cache line between
+ * readers.
+ *
+ * @param key_node Node used.
+ */
+void touch_key_node(KeyNode *key_node) {
+    if (!atomic_load_explicit(&key_node->referenced, memory_order_relaxed))
+        atomic_store_explicit(&key_node->referenced, true,\
+            memory_order_relaxed);
+}
+
+
+/**
+ * Copies the value of a key node. The caller must be inside an epoch or hold
+ * the node's stripe, so the value isn't freed while it is copied.
+ *
+ * @param key_node Node to read.
+ * @param output Buffer the value is appended to, NULL to skip the copy.
+ * @param version Where the value's version is stored, may be NULL.
+ * @return Length of the value, -1 if the output couldn't grow.
+ */
+ssize_t read_node_value(KeyNode *key_node, Buffer *output,\
+    uint64_t *version) {
+    KeyValue *key_value = __atomic_load_n(&key_node->value, __ATOMIC_ACQUIRE);
+
+    if (output != NULL &&\
+        buffer_append(output, key_value->data, key_value->len)) return -1;
+    if (version != NULL) *version = key_value->version;
+    return (ssize_t) key_value->len;
+}
+
+
+/**
+ * Replaces the value of a key node with a block made by create_key_value,
+ * the old one is freed once lock-free readers are done with it. The caller
+ * must hold the node's stripe locked to write.
+ *
+ * @param ht Hash table of the node.
+ * @param key_node Node to modify.
+ * @param new_value New value, with its version and timestamp set.
+ */
+void write_node_value(HashTable *ht, KeyNode *key_node, KeyValue *new_value) {
+    KeyValue *old_value = key_node->value;
+    size_t mem_usage = sizeof(KeyNode) + sizeof(AVL) +\
+        key_value_size(new_value->len);
+
+    __atomic_store_n(&key_node->value, new_value, __ATOMIC_RELEASE);
+
+    if (old_value != NULL) {
+        epoch_retire(old_value, free_key_value);
+        atomic_fetch_sub(&ht->mem_used, key_node->mem_usage);
+        atomic_fetch_add(&ht->mem_used, mem_usage);
+    }
+    key_node->mem_usage = mem_usage;
+}
+
+
+uint64_t next_commit_timestamp(HashTable *ht) {
+    return atomic_fetch_add(&ht->commit_clock, 1) + 1;
+}
+
+
+void split_batch_begin(HashTable *ht) {
+    pthread_mutex_lock(&ht->snapshots_lock);
+    // Snapshots go first, or a steady stream of batches would starve them
+    while (ht->snapshots_waiting > 0)
+        pthread_cond_wait(&ht->cut_changed, &ht->snapshots_lock);
+    ht->split_batches++;
+    pthread_mutex_unlock(&ht->snapshots_lock);
+}
+
+
+void split_batch_end(HashTable *ht) {
+    pthread_mutex_lock(&ht->snapshots_lock);
+    if (--ht->split_batches == 0) pthread_cond_broadcast(&ht->cut_changed);
+    pthread_mutex_unlock(&ht->snapshots_lock);
+}
+
+
+/**
+ * Checks if a snapshot has visited a stripe. The caller must hold the
+ * table's snapshots_lock.
+ *
+ * @param snapshot The snapshot.
+ * @param stripe Position of the stripe.
+ * @return 1 if the stripe was visited, 0 otherwise.
+ */
+int snapshot_visited(const Snapshot *snapshot, size_t stripe) {
+    return (snapshot->visited.bits[stripe / 64] >> (stripe % 64)) & 1;
+}
+
+
+/**
+ * Saves a copy of a key node's pair for the snapshots that need it before a
+ * write replaces it (or a delete removes it): the ones the pair is in, that
+ * the change isn't in, and that haven't visited its stripe yet. The caller
+ * must hold the node's stripe locked to write.
+ *
+ * @param ht Hash table of the node.
+ * @param key_node Node about to change.
+ * @param timestamp Commit timestamp of the change.
+ */
+void save_for_snapshots(HashTable *ht, const KeyNode *key_node,\
+    uint64_t timestamp) {
+    const KeyValue *value = key_node->value;
+    size_t stripe = (size_t) (key_node->hash & (ht->num_stripes - 1));
+
+    // Checked after the timestamp was taken, so a snapshot missed here was
+    // cut after it (and sees the change)
+    if (atomic_load(&ht->num_snapshots) == 0) return;
+
+    pthread_mutex_lock(&ht->snapshots_lock);
+    for (Snapshot *snapshot = ht->snapshots; snapshot != NULL;\
+        snapshot = snapshot->next) {
+        SnapshotPair *pair;
+
+        if (value->timestamp > snapshot->timestamp ||\
+            timestamp <= snapshot->timestamp ||\
+            snapshot_visited(snapshot, stripe))
+            continue;
+
+        pair = malloc(sizeof(SnapshotPair) + value->len + 1);
+        if (pair == NULL) {
+            snapshot->failed = 1;
+            continue;
+        }
+        pair->timestamp = value->timestamp;
+        pair->expires_at = value->expires_at;
+        pair->stripe = stripe;
+        pair->key_len = key_node->key_len;
+        pair->value_len = value->len;
+        memcpy(pair->key, key_node->key, KEY_SIZE);
+        memcpy(pair->value, value->data, value->len + 1);
+        pair->next = snapshot->saved;
+        snapshot->saved = pair;
     }
-    return -1; // Invalid index for non-alphabetic or number strings
+    pthread_mutex_unlock(&ht->snapshots_lock);
 }
 
 
 /**
- * Function to create a new IndexList.
+ * Gets the timestamp deletes need a tombstone after: the tombstone horizon,
+ * or the since of a delta snapshot being taken if it's earlier.
  *
- * @return a pointer to the new IndexList or NULL on failure.
+ * @param ht Hash table of the deletes.
+ * @return The timestamp, UINT64_MAX if no tombstone is needed.
  */
-IndexList* create_IndexList(){
-  IndexList *index_list = malloc(sizeof(IndexList));
-  if (!index_list) return NULL;
-  if (pthread_rwlock_init(&index_list->rwl, NULL)){
-    free(index_list);
-    return NULL;
-  }
-  index_list->head = NULL;
-  return index_list;
+uint64_t get_tombstone_horizon(HashTable *ht) {
+    uint64_t horizon = atomic_load(&ht->tombstone_horizon);
+
+    if (atomic_load(&ht->num_snapshots) == 0) return horizon;
+    pthread_mutex_lock(&ht->snapshots_lock);
+    for (Snapshot *snapshot = ht->snapshots; snapshot != NULL;\
+        snapshot = snapshot->next)
+        if (snapshot->since != 0 && snapshot->since < horizon)
+            horizon = snapshot->since;
+    pthread_mutex_unlock(&ht->snapshots_lock);
+    return horizon;
 }
 
 
-HashTable* create_hash_table() {
-  HashTable *ht = malloc(sizeof(HashTable));
-  if (!ht) return NULL;
-  if (pthread_rwlock_init(&ht->rwl, NULL)){
-    free(ht);
-    return NULL;
-  }
-  // Initialize the index lists
-  for (int i = 0; i < TABLE_SIZE; i++){
-    ht->table[i] = create_IndexList();
-  }
-  return ht;
-}
+/**
+ * Drops the tombstones of a stripe no delta needs anymore, once per change
+ * of the horizon. The caller must hold the stripe locked to write.
+ *
+ * @param stripe The stripe.
+ * @param horizon Timestamp the tombstones are needed after.
+ */
+void prune_tombstones(LockStripe *stripe, uint64_t horizon) {
+    if (horizon == stripe->pruned_horizon) return;
+    stripe->pruned_horizon = horizon;
 
+    for (Tombstone **link = &stripe->tombstones; *link != NULL;) {
+        Tombstone *tombstone = *link;
 
+        if (tombstone->timestamp <= horizon) {
+            *link = tombstone->next;
+            free(tombstone);
+        } else {
+            link = &tombstone->next;
+        }
+    }
+}
 
-int write_pair(HashTable *ht, const char *key, const char *value,\
-    const char *notif_message) {
 
-    int index = hash(key);
-    KeyNode *key_node, *new_key_node;
-    IndexList *index_list = ht->table[index];
+void set_tombstone_horizon(HashTable *ht, uint64_t horizon) {
+    atomic_store(&ht->tombstone_horizon, horizon);
+}
 
-    key_node = index_list->head;
-    // Search for the key node
 
-    while (key_node != NULL) {
-        // If the key is found, update the value
+void init_pair_change(PairChange *change, const char *key,\
+    const char *value, size_t value_len, uint64_t expires_at) {
+    change->value = value;
+    change->value_len = value_len;
+    change->expires_at = expires_at;
+    make_key_probe(&change->probe, key);
+    change->key_node = NULL;
+    change->new_value = NULL;
+    change->new_key_node = NULL;
+    change->index_node = NULL;
+    change->tombstone = NULL;
+}
 
-        if (strcmp(key_node->key, key) == 0) {
-            free(key_node->value);
-            key_node->value = strdup_error_check(value);
 
-            if (key_node->value == NULL) return -1;
-            send_to_all_fds(key_node->avl_notif_fds, notif_message,\
-                2 * MAX_STRING_SIZE + 2);
+/**
+ * Allocates what a change needs (see reserve_pair_changes). The caller must
+ * hold the key's stripe locked to write.
+ *
+ * @param ht Hash table of the key.
+ * @param change The change.
+ * @return 0 on success, -1 on failure (what was allocated is left in the
+ * change, for release_pair_changes).
+ */
+int reserve_pair_change(HashTable *ht, PairChange *change) {
+    KeyNode *new_key_node;
 
+    change->key_node = find_probed_node(ht, &change->probe);
+    if (change->value == NULL) {
+        if (change->key_node == NULL) {
+            count_false_positive(ht, change->probe.hash);
             return 0;
         }
-        key_node = key_node->next; // Move to the next node
+        // The horizon may move before the delete, it's only used after it
+        change->tombstone = malloc(sizeof(Tombstone));
+        return change->tombstone == NULL ? -1 : 0;
     }
+
+    change->new_value = create_key_value(change->value, change->value_len,\
+        change->expires_at);
+    if (change->new_value == NULL) return -1;
+    if (change->key_node != NULL) return 0;
+
     // Key not found; create a new key node
-    new_key_node = malloc(sizeof(KeyNode));
-    if (!new_key_node) return -1;
-    // Copy the key to the new key node
-    new_key_node->key = strdup_error_check(key);
-    if (new_key_node->key == NULL){
-        free(new_key_node);
-        return -1;
+    new_key_node = slab_alloc(&key_node_pool);
+    if (new_key_node == NULL) return -1;
+    // Copy the key (padded with zeros) to the new key node
+    memcpy(new_key_node->key, change->probe.bytes, KEY_SIZE);
+    new_key_node->key_len = change->probe.len;
+    new_key_node->hash = change->probe.hash;
+    atomic_init(&new_key_node->referenced, true);
+    new_key_node->value = NULL;
+    new_key_node->avl_notif_fds = create_avl();
+    change->new_key_node = new_key_node;
+    if (new_key_node->avl_notif_fds == NULL) return -1;
+
+    change->index_node = skiplist_new_node(ht->ordered_index,\
+        new_key_node->key, new_key_node);
+    return change->index_node == NULL ? -1 : 0;
+}
+
+
+void release_pair_changes(PairChange *changes, size_t num_changes) {
+    for (size_t i = 0; i < num_changes; i++) {
+        PairChange *change = &changes[i];
+
+        if (change->new_value != NULL) free_key_value(change->new_value);
+        if (change->new_key_node != NULL) {
+            if (change->new_key_node->avl_notif_fds != NULL)
+                free_avl(change->new_key_node->avl_notif_fds);
+            slab_free(&key_node_pool, change->new_key_node);
+        }
+        free(change->index_node);
+        free(change->tombstone);
+        change->new_value = NULL;
+        change->new_key_node = NULL;
+        change->index_node = NULL;
+        change->tombstone = NULL;
     }
-    // Copy the value to the new key node
-    new_key_node->value = strdup_error_check(value);
-    if (new_key_node->value == NULL) {
-        free(new_key_node->key);
-        free(new_key_node);
-        return -1;
+}
+
+
+int reserve_pair_changes(HashTable *ht, PairChange *changes,\
+    size_t num_changes) {
+#if KVS_SWISS_TABLE
+    size_t new_keys[MAX_LOCK_STRIPES] = {0}; // New keys of each stripe
+#endif
+
+    for (size_t i = 0; i < num_changes; i++) {
+        PairChange *change = &changes[i];
+
+        if (reserve_pair_change(ht, change)) {
+            release_pair_changes(changes, i + 1);
+            return -1;
+        }
+#if KVS_SWISS_TABLE
+        if (change->new_key_node != NULL &&\
+            reserve_key_nodes(ht, change->probe.hash,\
+            ++new_keys[change->probe.hash & (ht->num_stripes - 1)])) {
+            release_pair_changes(changes, i + 1);
+            return -1;
+        }
+#endif
     }
+    return 0;
+}
 
-    new_key_node->avl_notif_fds = create_avl();
 
-    if(new_key_node->avl_notif_fds == NULL) {
-        free(new_key_node->value);
-        free(new_key_node->key);
-        free(new_key_node);
-        return -1;
+/**
+ * Deletes the pair of a reserved change and notifies the key's subscribers.
+ * A delete after the tombstone horizon leaves the reserved tombstone.
+ *
+ * @param ht Hash table to delete from.
+ * @param avl_sessions List of all AVL tree subscriptions for all clients.
+ * @param change The change, its key is in the table.
+ * @param timestamp Commit timestamp, 0 to take a new one.
+ */
+void delete_key_node(HashTable *ht, AVLSessions *avl_sessions,\
+    PairChange *change, uint64_t timestamp) {
+
+    KeyNode *key_node = change->key_node;
+    const char *key = change->probe.bytes;
+    LockStripe *stripe =\
+        &ht->stripes[change->probe.hash & (ht->num_stripes - 1)];
+    uint64_t horizon;
+
+    if (timestamp == 0) timestamp = next_commit_timestamp(ht);
+    horizon = get_tombstone_horizon(ht);
+    prune_tombstones(stripe, horizon);
+    // Kept until no delta starts before it
+    if (timestamp > horizon) {
+        Tombstone *tombstone = change->tombstone;
+
+        change->tombstone = NULL;
+        tombstone->timestamp = timestamp;
+        tombstone->key_len = change->probe.len;
+        memcpy(tombstone->key, change->probe.bytes, KEY_SIZE);
+        tombstone->next = stripe->tombstones;
+        stripe->tombstones = tombstone;
     }
-    // Insert the new key node at the beginning of the list
-    new_key_node->next = (index_list->head != NULL)? index_list->head : NULL;
-    index_list->head = new_key_node;
+    save_for_snapshots(ht, key_node, timestamp);
+    unlink_key_node(ht, key_node);
+    notify_subscribers(key_node->avl_notif_fds, key, change->probe.len,\
+        "DELETED", 7);
+
+    remove_node_subscriptions(key_node->avl_notif_fds, avl_sessions, key);
+
+    free_avl(key_node->avl_notif_fds);
+    key_node->avl_notif_fds = NULL;
+
+    // Waits for the scans that may be visiting the node
+    skiplist_remove(ht->ordered_index, key_node->key);
+
+    update_filter(ht, change->probe.hash, -1);
+    // Lock-free readers may still be walking through this node
+    epoch_retire(key_node, free_key_node);
+    atomic_fetch_sub(&ht->num_keys, 1);
+    atomic_fetch_sub(&ht->mem_used, key_node->mem_usage);
+    change->key_node = NULL;
+}
+
+
+int apply_pair_change(HashTable *ht, AVLSessions *avl_sessions,\
+    PairChange *change, uint64_t timestamp, uint64_t *version) {
+
+    LockStripe *stripe =\
+        &ht->stripes[change->probe.hash & (ht->num_stripes - 1)];
+    KeyNode *key_node = change->key_node;
+    KeyValue *new_value = change->new_value;
+
+    if (change->value == NULL) {
+        if (key_node == NULL) return -1;
+        delete_key_node(ht, avl_sessions, change, timestamp);
+        return 0;
+    }
+
+    if (timestamp == 0) timestamp = next_commit_timestamp(ht);
+    // Taken once nothing can fail, a failed write uses no version
+    new_value->version = ++stripe->version_clock;
+    new_value->timestamp = timestamp;
+    change->new_value = NULL;
+    if (version != NULL) *version = new_value->version;
+
+    // If the key is found, update the value
+    if (key_node != NULL) {
+        save_for_snapshots(ht, key_node, timestamp);
+        write_node_value(ht, key_node, new_value);
+        touch_key_node(key_node);
+
+        notify_subscribers(key_node->avl_notif_fds, change->probe.bytes,\
+            change->probe.len, change->value, change->value_len);
+
+        return 0;
+    }
+    key_node = change->new_key_node;
+    change->new_key_node = NULL;
+    write_node_value(ht, key_node, new_value);
+    skiplist_link_node(ht->ordered_index, change->index_node);
+    change->index_node = NULL;
+    // Counted by the filter before readers can find it
+    update_filter(ht, change->probe.hash, 1);
+    // Only published once it is fully initialized
+    link_key_node(ht, key_node);
+    atomic_fetch_add(&ht->num_keys, 1);
+    atomic_fetch_add(&ht->mem_used, key_node->mem_usage);
+    change->key_node = key_node;
+
+    return 0;
+}
+
+
+int write_pair(HashTable *ht, const char *key, const char *value,\
+    size_t value_len, uint64_t expires_at, uint64_t timestamp,\
+    uint64_t *version) {
+
+    PairChange change;
 
+    init_pair_change(&change, key, value, value_len, expires_at);
+    if (reserve_pair_changes(ht, &change, 1)) return -1;
+    apply_pair_change(ht, NULL, &change, timestamp, version);
     return 0;
 }
 
 
-char* read_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    char* value;
-    IndexList *index_list = ht->table[index];
-    KeyNode *key_node = index_list->head;
+int cas_pair(HashTable *ht, const char *key, const char *value,\
+    size_t value_len, uint64_t timestamp, uint64_t *version) {
 
-    // Search for the key node
-    while (key_node != NULL) {
-        // If the key is found, return a copy of the value
-        if (strcmp(key_node->key, key) == 0) {
-            value = strdup_error_check(key_node->value);
-            return value; // Return copy of the value if found
+    KeyNode *key_node = find_key_node(ht, key);
+    uint64_t current = (key_node != NULL)? key_node->value->version : 0;
+
+    if (current != *version) {
+        *version = current;
+        return 1;
+    }
+    return write_pair(ht, key, value, value_len, 0, timestamp, version);
+}
+
+
+/**
+ * Searches the value of a key without locks. The caller must be inside an
+ * epoch (or hold the key's stripe) and must validate the table's layout.
+ *
+ * @param ht Hash table to read from.
+ * @param probe Key of the pair to read.
+ * @param output Buffer the value is appended to.
+ * @param version Where the value's version is stored, may be NULL.
+ * @return Length of the value if the key was found, -1 if it wasn't or the
+ * output couldn't grow.
+ */
+ssize_t search_value(HashTable *ht, const KeyProbe *probe, Buffer *output,\
+    uint64_t *version) {
+
+    KeyNode *key_node = find_probed_node(ht, probe);
+
+    if (key_node == NULL) return -1; // Key not found
+
+    // The key is found, copy its value
+    touch_key_node(key_node);
+    return read_node_value(key_node, output, version);
+}
+
+
+ssize_t read_pair(HashTable *ht, const char *key, Buffer *output,\
+    uint64_t *version) {
+    KeyProbe probe;
+    size_t stripe;
+    ssize_t found;
+
+    make_key_probe(&probe, key);
+    if (!filter_may_contain(ht, probe.hash)) return -1;
+
+    for (int attempt = 0; attempt < READ_OPTIMISTIC_RETRIES; attempt++) {
+        unsigned int seq = atomic_load_explicit(&ht->layout_seq,\
+            memory_order_acquire);
+
+        if (seq & 1) continue; // A rehash step is moving nodes
+        if (epoch_enter()) break;
+
+        found = search_value(ht, &probe, output, version);
+        epoch_exit();
+
+        // A miss may be a node being moved, so it is only final if the layout
+        // stayed the same
+        atomic_thread_fence(memory_order_acquire);
+        if (found >= 0) return found;
+        if (atomic_load_explicit(&ht->layout_seq, memory_order_relaxed) ==\
+            seq) {
+            count_false_positive(ht, probe.hash);
+            return found;
         }
-        key_node = key_node->next; // Move to the next node
     }
-    return NULL; // Key not found
+
+    // Fall back to a locked lookup
+    if (pthread_rwlock_rdlock_error_check(&ht->rwl, NULL)) return -1;
+    stripe = (size_t) (probe.hash & (ht->num_stripes - 1));
+    if (pthread_rwlock_rdlock_error_check(&ht->stripes[stripe].rwl, &ht->rwl))
+        return -1;
+
+    found = search_value(ht, &probe, output, version);
+
+    pthread_rwlock_unlock(&ht->stripes[stripe].rwl);
+    pthread_rwlock_unlock(&ht->rwl);
+    if (found < 0) count_false_positive(ht, probe.hash);
+    return found;
 }
 
 
@@ -193,102 +1458,478 @@ int remove_node_subscriptions(AVL *avl_kvs_node, AVLSessions *avl_sessions,\
 
 
 int delete_pair(HashTable *ht, AVLSessions *avl_sessions, const char *key,\
-    const char *notif_message) {
+    uint64_t timestamp) {
 
-    int index = hash(key);
-    IndexList *index_list;
-    KeyNode *key_node, *prevNode = NULL;
-    index_list = ht->table[index];
-    key_node = index_list->head;
+    PairChange change;
+    int ret;
 
-    // Search for the key node
-    while (key_node != NULL) {
-        // Key found; delete this node
-        if (strcmp(key_node->key, key) == 0) {
-            // Node to delete is the first node in the list
-            if (prevNode == NULL) {
-                // Update the table to point to the next node
-                index_list->head = key_node->next;
-            } else {// Node to delete is not the first; bypass it
-                // Link the previous node to the next node
-                prevNode->next = key_node->next;
-            }
-            send_to_all_fds(key_node->avl_notif_fds, notif_message,\
-                2 * MAX_STRING_SIZE + 2);
-
-            remove_node_subscriptions(key_node->avl_notif_fds, avl_sessions,\
-                key);
-
-            free_avl(key_node->avl_notif_fds);
-
-            free(key_node->key);
-            free(key_node->value);
-            free(key_node);
+    init_pair_change(&change, key, NULL, 0, 0);
+    // Nothing was changed yet, the pair stays
+    if (reserve_pair_changes(ht, &change, 1)) return -2;
+    ret = apply_pair_change(ht, avl_sessions, &change, timestamp, NULL);
+    release_pair_changes(&change, 1);
+    return ret;
+}
 
-            return 0;
-        }
-        prevNode = key_node;        // Move prevNode to current node
-        key_node = key_node->next;  // Move to the next node
+
+/// Visitor given to the ordered index by scan_pairs.
+typedef struct ScanVisitor {
+    PairVisitor visit; // Function called with each pair.
+    void *arg; // Argument passed to visit.
+} ScanVisitor;
+
+
+/**
+ * Passes the pair of a key node found by a scan on, its value is used in
+ * place as the scan is inside an epoch.
+ *
+ * @param item Key node of the pair.
+ * @param arg The scan's ScanVisitor.
+ * @return The value returned by the scan's visitor.
+ */
+int visit_key_node(void *item, void *arg) {
+    KeyNode *key_node = item;
+    ScanVisitor *scan_visitor = arg;
+    KeyValue *key_value = __atomic_load_n(&key_node->value, __ATOMIC_ACQUIRE);
+
+    return scan_visitor->visit(key_node->key, key_node->key_len,\
+        key_value->data, key_value->len, key_value->expires_at,\
+        scan_visitor->arg);
+}
+
+
+int scan_pairs(HashTable *ht, const char *start, const char *end,\
+    PairVisitor visit, void *arg) {
+    ScanVisitor scan_visitor = {visit, arg};
+    int ret;
+
+    // Values written during the scan are retired, not freed under it (the
+    // stripes can't be taken instead, deletes hold them to wait for scans)
+    if (epoch_enter()) return -1;
+    if (end == NULL)
+        ret = skiplist_scan_prefix(ht->ordered_index, start, visit_key_node,\
+            &scan_visitor);
+    else
+        ret = skiplist_scan_range(ht->ordered_index, start, end,\
+            visit_key_node, &scan_visitor);
+    epoch_exit();
+    return ret;
+}
+
+
+/// Progress of evict_pairs, passed to the visits of the swiss tables.
+typedef struct Eviction {
+    HashTable *ht; // Hash table being evicted from.
+    AVLSessions *avl_sessions; // Sessions of the subscribers.
+    size_t budget; // Bytes the pairs may use.
+    KeyVisitor visit; // Function called before each eviction, or NULL.
+    void *arg; // Argument passed to visit.
+    size_t evicted; // Pairs evicted so far.
+} Eviction;
+
+
+/**
+ * Evicts a key node reached by the clock hand, unless it was used since the
+ * hand last passed. The caller must hold its stripe locked to write.
+ *
+ * @param item Key node to evict.
+ * @param arg The Eviction in progress.
+ * @return 1 if the pairs are already within the budget, 0 otherwise.
+ */
+int evict_key_node(void *item, void *arg) {
+    KeyNode *key_node = item;
+    Eviction *eviction = arg;
+    char key[KEY_SIZE]; // Copied, the node is retired by the delete
+    size_t key_len = key_node->key_len;
+
+    if (atomic_load(&eviction->ht->mem_used) <= eviction->budget) return 1;
+    // Used since the last turn, give it a second chance
+    if (atomic_exchange(&key_node->referenced, false)) return 0;
+
+    memcpy(key, key_node->key, KEY_SIZE);
+    // Told before the delete (a delete that wasn't logged would come back on
+    // a replay), the pair stays if it fails
+    if (eviction->visit != NULL &&\
+        eviction->visit(key, key_len, eviction->arg))
+        return 1;
+    if (delete_pair(eviction->ht, eviction->avl_sessions, key, 0) == 0)
+        eviction->evicted++;
+    return 0;
+}
+
+
+#if KVS_SWISS_TABLE
+/**
+ * Gets the number of positions of the clock hand, one per group of the
+ * largest swiss table in each stripe.
+ *
+ * @param ht Hash table to evict from.
+ * @return Number of positions.
+ */
+size_t get_num_clock_positions(HashTable *ht) {
+    size_t max_groups = 1;
+
+    for (size_t i = 0; i < ht->num_stripes; i++) {
+        size_t num_groups = swiss_table_num_groups(ht->indexes[i]);
+
+        if (num_groups > max_groups) max_groups = num_groups;
+    }
+    return ht->num_stripes * max_groups;
+}
+
+
+/**
+ * Evicts the pairs of the group of a swiss table at a clock position. The
+ * caller must hold the position's stripe locked to write.
+ *
+ * @param ht Hash table to evict from.
+ * @param position Position of the clock hand.
+ * @param eviction The Eviction in progress.
+ */
+void evict_clock_position(HashTable *ht, size_t position, Eviction *eviction) {
+    SwissTable *table = ht->indexes[position & (ht->num_stripes - 1)];
+    size_t group = (position / ht->num_stripes) &\
+        (swiss_table_num_groups(table) - 1);
+
+    swiss_table_visit_group(table, group, evict_key_node, eviction);
+}
+#else
+/**
+ * Gets the number of positions of the clock hand, one per index list.
+ *
+ * @param ht Hash table to evict from.
+ * @return Number of positions.
+ */
+size_t get_num_clock_positions(HashTable *ht) {
+    return get_num_index_lists(ht);
+}
+
+
+/**
+ * Evicts the pairs of the index list at a clock position. The caller must
+ * hold the position's stripe locked to write.
+ *
+ * @param ht Hash table to evict from.
+ * @param position Position of the clock hand.
+ * @param eviction The Eviction in progress.
+ */
+void evict_clock_position(HashTable *ht, size_t position, Eviction *eviction) {
+    KeyNode *key_node, *next;
+
+    for (key_node = get_index_list_at(ht, position)->head; key_node != NULL;\
+        key_node = next) {
+        next = key_node->next;
+        if (evict_key_node(key_node, eviction)) break;
+    }
+}
+#endif
+
+
+size_t evict_pairs(HashTable *ht, AVLSessions *avl_sessions, size_t budget,\
+    KeyVisitor visit, void *arg) {
+
+    size_t num_positions = get_num_clock_positions(ht);
+    Eviction eviction = {ht, avl_sessions, budget, visit, arg, 0};
+
+    // Two turns of the hand clear every reference, any pair can go after them
+    for (size_t visited = 0; visited < 2 * num_positions &&\
+        atomic_load(&ht->mem_used) > budget; visited++) {
+
+        size_t position =\
+            atomic_fetch_add(&ht->clock_hand, 1) % num_positions;
+        // The positions are a multiple of the stripes (the table never has
+        // fewer lists than stripes, nor an old_size that isn't a multiple of
+        // them), so a position's low bits are its stripe
+        size_t stripe = position & (ht->num_stripes - 1);
+
+        if (pthread_rwlock_wrlock_error_check(&ht->stripes[stripe].rwl, NULL))
+            break;
+        evict_clock_position(ht, position, &eviction);
+        pthread_rwlock_unlock(&ht->stripes[stripe].rwl);
     }
-    return -1;
+    return eviction.evicted;
+}
+
+
+int expire_pair(HashTable *ht, AVLSessions *avl_sessions, const char *key,\
+    uint64_t now) {
+
+    KeyNode *key_node = find_key_node(ht, key);
+    uint64_t expires_at;
+
+    if (key_node == NULL) return -1;
+    expires_at = key_node->value->expires_at;
+    if (expires_at == 0 || expires_at > now) return 1;
+    return delete_pair(ht, avl_sessions, key, 0);
 }
 
 
 int subscribe_pair(HashTable *ht, char key[MAX_STRING_SIZE + 1],\
     int session_id, int notif_fd){
 
-    int index = hash(key);
-    IndexList *index_list = ht->table[index];
-    KeyNode *key_node = index_list->head;
-    // Search for the key node
-    while (key_node != NULL) {
-        if (strcmp(key_node->key, key) == 0) { // Key is found
-            avl_add(key_node->avl_notif_fds, &session_id, notif_fd);
-            return 0;
-        }
-        key_node = key_node->next; // Move to the next node
-    }
-    return -1;
+    KeyNode *key_node = find_key_node(ht, key);
+
+    if (key_node == NULL) return -1;
+    avl_add(key_node->avl_notif_fds, &session_id, notif_fd);
+    return 0;
 }
 
 
 int unsubscribe_pair(HashTable *ht, char key[MAX_STRING_SIZE + 1],\
     int session_id){
 
-    int index = hash(key);
-    IndexList *index_list = ht->table[index];
-    KeyNode *key_node = index_list->head;
-    // Search for the key node
-    while (key_node != NULL) {
-        if (strcmp(key_node->key, key) == 0) { // Key is found
-            avl_remove(key_node->avl_notif_fds, &session_id);
-            return 0;
+    KeyNode *key_node = find_key_node(ht, key);
+
+    if (key_node == NULL) return -1;
+    avl_remove(key_node->avl_notif_fds, &session_id);
+    return 0;
+}
+
+
+#if KVS_SWISS_TABLE
+/// Visitor given to the swiss tables by visit_key_nodes.
+typedef struct KeyNodeVisitor {
+    int (*visit)(KeyNode *key_node, void *arg); // Function called.
+    void *arg; // Argument passed to visit.
+} KeyNodeVisitor;
+
+
+/**
+ * Passes a key node found by visit_key_nodes on.
+ *
+ * @param item The key node.
+ * @param arg The KeyNodeVisitor.
+ * @return The value returned by the visitor.
+ */
+int visit_swiss_item(void *item, void *arg) {
+    KeyNodeVisitor *visitor = arg;
+
+    return visitor->visit(item, visitor->arg);
+}
+#endif
+
+
+int visit_key_nodes(HashTable *ht,\
+    int (*visit)(KeyNode *key_node, void *arg), void *arg) {
+#if KVS_SWISS_TABLE
+    KeyNodeVisitor visitor = {visit, arg};
+
+    for (size_t i = 0; i < ht->num_stripes; i++) {
+        int ret = swiss_table_visit(ht->indexes[i], visit_swiss_item,\
+            &visitor);
+
+        if (ret != 0) return ret;
+    }
+#else
+    for (size_t i = 0; i < get_num_index_lists(ht); i++) {
+        KeyNode *key_node = get_index_list_at(ht, i)->head;
+
+        while (key_node != NULL) {
+            // Read before visit, which may free the node
+            KeyNode *next = key_node->next;
+            int ret = visit(key_node, arg);
+
+            if (ret != 0) return ret;
+            key_node = next;
         }
-        key_node = key_node->next; // Move to the next node
     }
-    return -1;
+#endif
+    return 0;
 }
 
 
-void free_table(HashTable *ht) {
-    // Iterate over the hash table
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        IndexList *index_list = ht->table[i];
-        // If the index list is NULL, continue to the next index
-        if (index_list == NULL) continue;
-        KeyNode *key_node = index_list->head;
-        // Iterate over the key nodes
-        while (key_node != NULL) {
-            KeyNode *temp = key_node;
-            key_node = key_node->next;
-            free(temp->avl_notif_fds);
-            free(temp->key);
-            free(temp->value);
-            free(temp);
+/**
+ * Visits the key nodes of a lock stripe. The caller must hold the hash
+ * table's lock and the stripe's lock.
+ *
+ * @param ht Hash table to visit.
+ * @param stripe Position of the stripe.
+ * @param visit Function called with each key node, stops the visit if not 0.
+ * @param arg Argument passed to visit.
+ * @return 0 on success, the value returned by visit if it stopped.
+ */
+int visit_stripe_key_nodes(HashTable *ht, size_t stripe,\
+    int (*visit)(KeyNode *key_node, void *arg), void *arg) {
+#if KVS_SWISS_TABLE
+    KeyNodeVisitor visitor = {visit, arg};
+
+    return swiss_table_visit(ht->indexes[stripe], visit_swiss_item, &visitor);
+#else
+    // Both tables have a multiple of num_stripes lists, so the stripe's
+    // lists are every num_stripes-th one
+    for (size_t i = stripe; i < get_num_index_lists(ht); i += ht->num_stripes)
+        for (KeyNode *key_node = get_index_list_at(ht, i)->head;\
+            key_node != NULL; key_node = key_node->next) {
+            int ret = visit(key_node, arg);
+
+            if (ret != 0) return ret;
+        }
+    return 0;
+#endif
+}
+
+
+void snapshot_begin(HashTable *ht, Snapshot *snapshot, uint64_t since) {
+    memset(&snapshot->visited, 0, sizeof(StripeMask));
+    snapshot->since = since;
+    snapshot->saved = NULL;
+    snapshot->failed = 0;
+
+    pthread_mutex_lock(&ht->snapshots_lock);
+    // A split batch between its parts would be cut in two
+    ht->snapshots_waiting++;
+    while (ht->split_batches > 0)
+        pthread_cond_wait(&ht->cut_changed, &ht->snapshots_lock);
+    if (--ht->snapshots_waiting == 0)
+        pthread_cond_broadcast(&ht->cut_changed);
+    snapshot->next = ht->snapshots;
+    ht->snapshots = snapshot;
+    atomic_fetch_add(&ht->num_snapshots, 1);
+    // Cut after being counted, so a write with a later timestamp saves what
+    // it replaces
+    snapshot->timestamp = atomic_load(&ht->commit_clock);
+    pthread_mutex_unlock(&ht->snapshots_lock);
+}
+
+
+int snapshot_visit_tombstones(HashTable *ht, const Snapshot *snapshot,\
+    size_t stripe, KeyVisitor visit, void *arg) {
+    if (snapshot->since == 0) return 0;
+
+    for (Tombstone *tombstone = ht->stripes[stripe].tombstones;\
+        tombstone != NULL; tombstone = tombstone->next) {
+        int ret;
+
+        // Deleted after the cut, the pair (if in the snapshot) was saved
+        if (tombstone->timestamp <= snapshot->since ||\
+            tombstone->timestamp > snapshot->timestamp)
+            continue;
+        ret = visit(tombstone->key, tombstone->key_len, arg);
+        if (ret != 0) return ret;
+    }
+    return 0;
+}
+
+
+/// Visit of the pairs of a snapshot in one stripe.
+typedef struct SnapshotVisitor {
+    uint64_t timestamp; // Last commit timestamp in the snapshot.
+    uint64_t since; // Pairs written up to it are skipped.
+    PairVisitor visit; // Function called with each pair.
+    void *arg; // Argument passed to visit.
+} SnapshotVisitor;
+
+
+/**
+ * Passes the pair of a key node on if it is in the snapshot.
+ *
+ * @param key_node The key node.
+ * @param arg The SnapshotVisitor.
+ * @return The value returned by the snapshot's visitor, 0 if skipped.
+ */
+int visit_snapshot_key_node(KeyNode *key_node, void *arg) {
+    SnapshotVisitor *visitor = arg;
+    const KeyValue *value = key_node->value;
+
+    // Written after the cut, what it replaced (if anything) was saved
+    if (value->timestamp > visitor->timestamp) return 0;
+    // Unchanged since the delta's start
+    if (value->timestamp <= visitor->since) return 0;
+    return visitor->visit(key_node->key, key_node->key_len, value->data,\
+        value->len, value->expires_at, visitor->arg);
+}
+
+
+int snapshot_visit_stripe(HashTable *ht, Snapshot *snapshot, size_t stripe,\
+    PairVisitor visit, void *arg) {
+    SnapshotVisitor visitor = {snapshot->timestamp, snapshot->since, visit,\
+        arg};
+    int ret = visit_stripe_key_nodes(ht, stripe, visit_snapshot_key_node,\
+        &visitor);
+
+    // Still holding the stripe, so no write falls between the visit and this
+    pthread_mutex_lock(&ht->snapshots_lock);
+    snapshot->visited.bits[stripe / 64] |= (uint64_t) 1 << (stripe % 64);
+    pthread_mutex_unlock(&ht->snapshots_lock);
+    return ret;
+}
+
+
+int snapshot_visit_saved(Snapshot *snapshot, PairVisitor visit, void *arg) {
+    // Every stripe was visited, nothing is saved anymore
+    for (SnapshotPair *pair = snapshot->saved; pair != NULL;\
+        pair = pair->next) {
+        int ret;
+
+        if (pair->timestamp <= snapshot->since) continue;
+        ret = visit(pair->key, pair->key_len, pair->value, pair->value_len,\
+            pair->expires_at, arg);
+        if (ret != 0) return ret;
+    }
+    return snapshot->failed ? -1 : 0;
+}
+
+
+void snapshot_end(HashTable *ht, Snapshot *snapshot) {
+    pthread_mutex_lock(&ht->snapshots_lock);
+    for (Snapshot **link = &ht->snapshots; *link != NULL;\
+        link = &(*link)->next) {
+        if (*link == snapshot) {
+            *link = snapshot->next;
+            break;
         }
-        pthread_rwlock_destroy(&index_list->rwl);
-        free(index_list);
     }
+    atomic_fetch_sub(&ht->num_snapshots, 1);
+    pthread_mutex_unlock(&ht->snapshots_lock);
+
+    while (snapshot->saved != NULL) {
+        SnapshotPair *next = snapshot->saved->next;
+
+        free(snapshot->saved);
+        snapshot->saved = next;
+    }
+}
+
+
+size_t get_index_memory(HashTable *ht) {
+#if KVS_SWISS_TABLE
+    size_t memory = ht->num_stripes * sizeof(SwissTable *);
+
+    for (size_t i = 0; i < ht->num_stripes; i++)
+        memory += swiss_table_memory(ht->indexes[i]);
+    return memory;
+#else
+    return get_num_index_lists(ht) * sizeof(IndexList);
+#endif
+}
+
+
+/**
+ * Frees a key node of a table being freed, with its subscribers.
+ *
+ * @param key_node The key node.
+ * @param arg Not used.
+ * @return 0, so every node is visited.
+ */
+int free_table_key_node(KeyNode *key_node, void *arg) {
+    (void) arg;
+    free_avl(key_node->avl_notif_fds);
+    free_key_node(key_node);
+    return 0;
+}
+
+
+void free_table(HashTable *ht) {
+    visit_key_nodes(ht, free_table_key_node, NULL);
+    free_index(ht);
+    free_skiplist(ht->ordered_index);
+    epoch_reclaim_all();
+    slab_pool_destroy(&key_node_pool);
+    slab_pool_destroy(&small_value_pool);
+    destroy_LockStripes(ht->stripes, ht->num_stripes);
+    destroy_BloomFilters(ht->filters, ht->num_stripes);
+    pthread_cond_destroy(&ht->cut_changed);
+    pthread_mutex_destroy(&ht->snapshots_lock);
     pthread_rwlock_destroy(&ht->rwl);
     free(ht);
 }
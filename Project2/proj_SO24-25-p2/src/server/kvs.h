@@ -1,9 +1,33 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
 
-#define TABLE_SIZE 26
+/// Initial number of index lists of the hash table (must be a power of two).
+#define TABLE_INITIAL_SIZE 64
+/// Average number of keys per index list above which the table grows.
+#define TABLE_MAX_LOAD_FACTOR 1
+/// Number of old index lists migrated by each incremental rehash step.
+#define TABLE_REHASH_STEP 16
+/// Maximum number of lock stripes (power of two, multiple of 64).
+#define MAX_LOCK_STRIPES 1024
+/// Lock stripes created per online core when the count isn't configured.
+#define LOCK_STRIPES_PER_CORE 4
+/// Size of a cache line, locks are padded to it to avoid false sharing.
+#define CACHE_LINE_SIZE 64
+/// Lock-free read attempts before read_pair falls back to the table's lock.
+#define READ_OPTIMISTIC_RETRIES 4
+/// Bytes a key is stored in: MAX_STRING_SIZE + 1 rounded up to whole words.
+#define KEY_SIZE 48
+/// Counters a Bloom filter starts with (power of two).
+#define BLOOM_FILTER_COUNTERS 4096
+/// Counters a Bloom filter keeps per key of its stripe, at least: with
+/// BLOOM_FILTER_HASHES 3, at most ~3% of the misses get through.
+#define BLOOM_FILTER_COUNTERS_PER_KEY 8
+/// Counters set by each key in its stripe's Bloom filter.
+#define BLOOM_FILTER_HASHES 3
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <string.h>
 #include <stdio.h>
@@ -14,7 +38,13 @@
 #include "operations.h"
 #include "constants.h"
 #include "../common/constants.h"
+#include "../common/protocol.h"
 #include "avl.h"
+#include "epoch.h"
+#include "slab.h"
+#include "skiplist.h"
+#include "swiss_table.h"
+#include "buffer.h"
 #include "../common/safeFunctions.h"
 
 // Forward declaration of ClientData
@@ -31,29 +61,221 @@ typedef struct ClientData {
 }ClientData;
 
 
-/// Node of the linked list.
+/// Value of a pair, prefixed by its length (up to MAX_VALUE_SIZE).
+/// Values are never changed in place, a write swaps in a new block so a
+/// lock-free reader always sees a value with its own length, version and
+/// expiry time.
+typedef struct KeyValue {
+    uint64_t version; // Version of the value, grows with every write.
+    uint64_t timestamp; // Commit timestamp of the write (see commit_clock).
+    uint64_t expires_at; // Time (ms, monotonic) it expires, 0 if never.
+    size_t len; // Length of the value.
+    char data[]; // The value (null terminated).
+} KeyValue;
+
+
+/// Node of a key value pair, linked in an index list (or pointed to by a
+/// slot of its stripe's swiss table).
+/// The key is stored inline (it is bounded by MAX_STRING_SIZE), zero padded
+/// to KEY_SIZE, the value in its own block. Walks through a list only read
+/// the first words of each node (its hash and next) until a hash matches.
+/// Readers walk the lists without locks: next and value are published with
+/// atomic stores, replaced values and unlinked nodes are freed through
+/// epochs.
 typedef struct KeyNode {
-    char *key; // Key of the pair.
-    char *value; // Value of the pair.
+    uint64_t hash; // Hash of the key.
+#if !KVS_SWISS_TABLE
     struct KeyNode *next; // Pointer to the next node.
+#endif
+    _Alignas(uint64_t) char key[KEY_SIZE]; // Key of the pair.
+    size_t key_len; // Length of the key.
+    KeyValue *value; // Current value of the pair.
+    size_t mem_usage; // Bytes used by the pair.
+    atomic_bool referenced; // Pair used since the clock hand last passed.
     struct AVL *avl_notif_fds; // AVL tree for client's notification fd.
 } KeyNode;
 
 
+_Static_assert(KEY_SIZE > MAX_STRING_SIZE && KEY_SIZE % sizeof(uint64_t) == 0,\
+    "KEY_SIZE must hold a key and its terminator in whole words");
+
+
+/// Key being looked up, hashed once and zero padded like the nodes' keys so
+/// it is compared with them a word at a time.
+typedef struct KeyProbe {
+    uint64_t hash; // Hash of the key.
+    size_t len; // Length of the key.
+    _Alignas(uint64_t) char bytes[KEY_SIZE]; // The key, zero padded.
+} KeyProbe;
+
+
 /// List of key value pairs.
 typedef struct IndexList {
     KeyNode *head; // Pointer to the first node.
-    pthread_rwlock_t rwl; // Read-write lock.
 } IndexList;
 
 
+/// Key deleted after the tombstone horizon of its table, so the delta
+/// snapshots that start before the delete can tell it was deleted.
+typedef struct Tombstone {
+    struct Tombstone *next; // Next tombstone of the stripe.
+    uint64_t timestamp; // Commit timestamp of the delete.
+    size_t key_len; // Length of the key.
+    char key[KEY_SIZE]; // The key, zero padded.
+} Tombstone;
+
+
+/// Write (or delete) of a pair, with the memory it needs allocated by
+/// reserve_pair_changes so making it with apply_pair_change can't fail.
+typedef struct PairChange {
+    const char *value; // Value written, NULL for a delete.
+    size_t value_len; // Length of the value.
+    uint64_t expires_at; // Time the value expires, 0 if never.
+    KeyProbe probe; // Key of the pair.
+    KeyNode *key_node; // Node of the key, NULL if it isn't in the table.
+    KeyValue *new_value; // Block of the value written.
+    KeyNode *new_key_node; // Node of a key written that isn't in the table.
+    SkipListNode *index_node; // Node of the new key in the ordered index.
+    Tombstone *tombstone; // Tombstone the delete may leave.
+} PairChange;
+
+
+/// Read-write lock guarding every index list whose hash falls in the stripe,
+/// aligned so each lock owns a cache line.
+/// Writes take their version from the stripe's clock, a key always maps to
+/// the same stripe so its versions keep growing even across deletes.
+/// tombstones has the keys deleted in the stripe that delta snapshots may
+/// still need, the ones up to pruned_horizon were already dropped.
+typedef struct LockStripe {
+    _Alignas(CACHE_LINE_SIZE) pthread_rwlock_t rwl; // Read-write lock.
+    uint64_t version_clock; // Last version given to a write in the stripe.
+    Tombstone *tombstones; // Keys deleted in it, newest first.
+    uint64_t pruned_horizon; // Tombstone horizon of the last pruning.
+} LockStripe;
+
+
+/// Counters of a Bloom filter, replaced whole when the filter grows.
+typedef struct FilterCounters {
+    size_t mask; // Number of counters minus one (a power of two minus one).
+    _Atomic uint8_t counters[]; // Keys on each position.
+} FilterCounters;
+
+
+/// Counting Bloom filter of the keys of a lock stripe, so lookups of missing
+/// keys (most of them) end without a lock or a walk through a list.
+/// Counters only change with the stripe locked to write, a counter that
+/// reaches UINT8_MAX stays there (its keys may no longer be counted).
+/// The filter is rebuilt twice as big once its keys outgrow
+/// BLOOM_FILTER_COUNTERS_PER_KEY, lock-free readers check the counters in an
+/// epoch so the old ones are retired.
+typedef struct BloomFilter {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t negatives; // Misses it answered.
+    atomic_size_t false_positives; // Misses it let through.
+    _Atomic(FilterCounters *) counters; // Current counters.
+    size_t num_keys; // Keys of the stripe, counted with the stripe locked.
+} BloomFilter;
+
+
+/// Set of lock stripes, one bit per stripe.
+typedef struct StripeMask {
+    uint64_t bits[MAX_LOCK_STRIPES / 64]; // Bit i is set if stripe i is in.
+} StripeMask;
+
+
+/// Pair saved for a snapshot before a write replaced it (or a delete
+/// removed it).
+typedef struct SnapshotPair {
+    struct SnapshotPair *next; // Next saved pair.
+    uint64_t timestamp; // Commit timestamp of the pair's write.
+    uint64_t expires_at; // Time the pair expires, 0 if never.
+    size_t stripe; // Stripe of the key.
+    size_t key_len; // Length of the key.
+    size_t value_len; // Length of the value.
+    char key[KEY_SIZE]; // The key, zero padded.
+    char value[]; // The value (null terminated).
+} SnapshotPair;
+
+
+/// Point-in-time view of a hash table: the pairs of the writes (and
+/// deletes) whose commit timestamp isn't above timestamp.
+/// The snapshot visits the table a stripe at a time while writes go on.
+/// A write to a stripe not visited yet that replaces a pair of the snapshot
+/// saves a copy of it first, so each key is seen once, as it was.
+/// A delta snapshot only visits the pairs written after since, and the
+/// tombstones of the keys deleted after it.
+/// visited, saved and failed are guarded by the table's snapshots_lock
+/// (stripes can be visited by several threads at once).
+typedef struct Snapshot {
+    uint64_t timestamp; // Last commit timestamp in the snapshot.
+    uint64_t since; // Commit timestamp the delta starts after, 0 if whole.
+    StripeMask visited; // Stripes already visited.
+    SnapshotPair *saved; // Pairs replaced before their stripe was visited.
+    int failed; // 1 if a pair couldn't be saved.
+    struct Snapshot *next; // Next snapshot being taken of the table.
+} Snapshot;
+
+
 /// Hash table structure.
+/// With KVS_SWISS_TABLE each stripe indexes its keys in its own swiss table,
+/// which grows with the stripe locked to write, so the layout never changes.
+/// Otherwise, while the table grows, keys live either in old_table (lists
+/// not migrated yet) or in table, the layout is only changed with rwl locked
+/// to write.
+/// A list is guarded by the stripe given by the low bits of its keys' hash,
+/// the table never has fewer lists than stripes so a list has one stripe.
+/// layout_seq is odd while the layout changes, lock-free readers retry if it
+/// changed during their lookup.
+/// ordered_index keeps every key node in key order for scans, filters has a
+/// Bloom filter per stripe.
+/// Evictions sweep the index lists with clock_hand, so recently used pairs
+/// get a second chance without keeping a global LRU list.
+/// Every write or delete takes a commit timestamp from commit_clock (all the
+/// pairs of a locked batch may share one), snapshots are cut by it.
+/// A batch that locks its stripes in parts (one per shard) is split, a
+/// snapshot is only cut with no split batch running (see split_batch_begin).
+/// Deletes after tombstone_horizon (or the since of a delta snapshot being
+/// taken) leave a tombstone in their stripe, UINT64_MAX keeps none.
 typedef struct HashTable {
-    IndexList *table[TABLE_SIZE]; // Array of linked lists.
+#if KVS_SWISS_TABLE
+    SwissTable **indexes; // Swiss table of the keys of each stripe.
+#else
+    IndexList *table; // Array of linked lists.
+    size_t size; // Number of lists in table (power of two).
+    IndexList *old_table; // Lists being migrated to table, NULL if none.
+    size_t old_size; // Number of lists in old_table.
+    size_t rehash_index; // Next list of old_table to be migrated.
+#endif
+    atomic_size_t num_keys; // Number of keys stored in the table.
+    atomic_size_t mem_used; // Bytes used by the pairs in the table.
+    atomic_size_t clock_hand; // Next index list (or group) evictions visit.
+    LockStripe *stripes; // Locks of the index lists.
+    BloomFilter *filters; // Bloom filter of the keys of each stripe.
+    size_t num_stripes; // Number of lock stripes (power of two).
+    atomic_uint layout_seq; // Sequence counter of layout changes.
+    SkipList *ordered_index; // Key nodes sorted by key.
+    _Atomic uint64_t commit_clock; // Last commit timestamp given.
+    _Atomic uint64_t tombstone_horizon; // Deletes up to it need no tombstone.
+    Snapshot *snapshots; // Snapshots being taken.
+    atomic_size_t num_snapshots; // Snapshots being taken, read without lock.
+    size_t split_batches; // Split batches running.
+    size_t snapshots_waiting; // Snapshots waiting to be cut.
+    pthread_mutex_t snapshots_lock; // Guards the snapshots and the counts.
+    pthread_cond_t cut_changed; // Signaled when a split batch or a cut ends.
     pthread_rwlock_t rwl; // Read-write lock.
 } HashTable;
 
 
+/// Function called with each pair of a scan (and the time it expires, see
+/// KeyNode), stops the scan if not 0.
+typedef int (*PairVisitor)(const char *key, size_t key_len,\
+    const char *value, size_t value_len, uint64_t expires_at, void *arg);
+
+
+/// Function called with each deleted key of a delta snapshot, or key about
+/// to be evicted, stops the visit if not 0.
+typedef int (*KeyVisitor)(const char *key, size_t key_len, void *arg);
+
+
 typedef struct AVLSessions {
   struct ClientData *clients_data[MAX_SESSION_COUNT];
   struct AVL *avl_clients_node[MAX_SESSION_COUNT];
@@ -64,56 +286,469 @@ typedef struct AVLSessions {
 
 
 /**
- * Hash function to calculate the index of the key.
+ * Hash function (64-bit FNV-1a) of the key.
+ *
+ * @param key The key to hash (up to MAX_STRING_SIZE bytes are used).
+ * @return Hash of the key.
+ */
+uint64_t hash(const char *key);
+
+
+/**
+ * Prepares the lookup of a key.
+ *
+ * @param probe Where the key, its length and its hash are stored.
+ * @param key The key.
+ */
+void make_key_probe(KeyProbe *probe, const char *key);
+
+
+/**
+ * Searches the node of a key. The caller must hold the key's stripe (to
+ * read or to write) and the hash table's lock.
+ *
+ * @param ht Hash table to search.
+ * @param key The key.
+ * @return Node of the key, NULL if it isn't in the table.
+ */
+KeyNode *find_key_node(HashTable *ht, const char *key);
+
+
+#if !KVS_SWISS_TABLE
+/**
+ * Gets the index list where the key is (or would be) stored.
+ * The caller must hold the hash table's lock (to read or to write), or check
+ * layout_seq didn't change while it used the list.
  *
- * @param key The key to hash.
- * @return Index of the key.
+ * @param ht Hash table to search.
+ * @param key The key to locate.
+ * @return Index list of the key.
  */
-int hash(const char *key);
+IndexList *get_index_list(HashTable *ht, const char *key);
+#endif
+
+
+/**
+ * Gets the lock stripe that guards the index list of the key.
+ *
+ * @param ht Hash table of the key.
+ * @param key The key to locate.
+ * @return Position of the stripe in ht->stripes.
+ */
+size_t get_lock_stripe(HashTable *ht, const char *key);
+
+
+#if !KVS_SWISS_TABLE
+/**
+ * Gets the number of index lists of the hash table, including the ones of a
+ * rehash still in progress. The caller must hold the hash table's lock.
+ *
+ * @param ht Hash table to inspect.
+ * @return Number of index lists.
+ */
+size_t get_num_index_lists(HashTable *ht);
+
+
+/**
+ * Gets the index list at a position between 0 and get_num_index_lists(ht).
+ * The caller must hold the hash table's lock.
+ *
+ * @param ht Hash table to inspect.
+ * @param position Position of the index list.
+ * @return Index list at the given position.
+ */
+IndexList *get_index_list_at(HashTable *ht, size_t position);
+#endif
+
+
+/**
+ * Visits every key node of the hash table. The caller must hold the hash
+ * table's lock to write (or be the only thread using the table).
+ *
+ * @param ht Hash table to visit.
+ * @param visit Function called with each key node, stops the visit if not 0.
+ * @param arg Argument passed to visit.
+ * @return 0 on success, the value returned by visit if it stopped.
+ */
+int visit_key_nodes(HashTable *ht,\
+    int (*visit)(KeyNode *key_node, void *arg), void *arg);
+
+
+/**
+ * Gets the bytes used by the index of the hash table (its lists or swiss
+ * tables, not the key nodes). The caller must hold the hash table's lock to
+ * write.
+ *
+ * @param ht Hash table to inspect.
+ * @return Size of the index.
+ */
+size_t get_index_memory(HashTable *ht);
+
+
+/**
+ * Checks if the hash table has a rehash in progress or is over its load
+ * factor (never with KVS_SWISS_TABLE, whose stripes grow their own swiss
+ * tables). The caller must hold the hash table's lock.
+ *
+ * @param ht Hash table to inspect.
+ * @return 1 if hash_table_rehash_step should be called, 0 otherwise.
+ */
+int hash_table_needs_rehash(HashTable *ht);
+
+
+/**
+ * Starts growing the hash table if it is over its load factor and migrates
+ * up to TABLE_REHASH_STEP lists of a rehash in progress.
+ * The caller must hold the hash table's lock to write.
+ *
+ * @param ht Hash table to rehash.
+ * @return 0 on success, -1 if the new lists couldn't be allocated.
+ */
+int hash_table_rehash_step(HashTable *ht);
+
+
+/**
+ * Grows the index and the Bloom filters, if needed, so they hold a number of
+ * keys without growing again (e.g. before a restore). The caller must hold
+ * the hash table's lock to write.
+ *
+ * @param ht Hash table to grow.
+ * @param num_keys Number of keys the table will hold.
+ * @return 0 on success, -1 if the index or a filter couldn't grow.
+ */
+int hash_table_presize(HashTable *ht, size_t num_keys);
 
 
 /**
  * Creates a new hash table.
  *
+ * @param num_stripes Number of lock stripes, rounded up to a power of two and
+ * capped at MAX_LOCK_STRIPES, 0 to use LOCK_STRIPES_PER_CORE per core.
  * @return Newly created hash table, NULL on failure.
  */
-HashTable *create_hash_table();
+HashTable *create_hash_table(size_t num_stripes);
 
 
 /**
- * Appends a new key value pair to the hash table.
+ * Takes a new commit timestamp, for a batch of writes and deletes whose
+ * stripes are already locked (so snapshots see all of them or none).
+ *
+ * @param ht Hash table to be modified.
+ * @return The timestamp.
+ */
+uint64_t next_commit_timestamp(HashTable *ht);
+
+
+/**
+ * Starts a split batch of writes and deletes, whose parts lock their
+ * stripes (and take their commit timestamps) one after the other. No
+ * snapshot is cut until split_batch_end, so snapshots see all of the parts
+ * or none. Waits for the snapshots waiting to be cut first.
+ *
+ * @param ht Hash table to be modified.
+ */
+void split_batch_begin(HashTable *ht);
+
+
+/**
+ * Ends a split batch once every part of it ran.
+ *
+ * @param ht Hash table modified.
+ */
+void split_batch_end(HashTable *ht);
+
+
+/**
+ * Starts a change of a pair, to be reserved by reserve_pair_changes.
+ *
+ * @param change The change.
+ * @param key Key of the pair.
+ * @param value Value to write (at most MAX_VALUE_SIZE bytes), NULL to
+ * delete the pair.
+ * @param value_len Length of the value.
+ * @param expires_at Time (ms, see timer_wheel_now) the value expires, 0 if
+ * never.
+ */
+void init_pair_change(PairChange *change, const char *key,\
+    const char *value, size_t value_len, uint64_t expires_at);
+
+
+/**
+ * Allocates what a group of changes needs before any of them is made, so
+ * they are all made or none is: the values written, the nodes of the new
+ * keys (and room in the index for them) and the tombstones of the deletes.
+ * The caller must hold the keys' stripes locked to write until the changes
+ * are applied, and a key can only be in one change. A delete of a key that
+ * isn't in the table is left with no key_node.
+ *
+ * @param ht Hash table to be modified.
+ * @param changes The changes.
+ * @param num_changes Number of changes.
+ * @return 0 on success, -1 if memory ran out (nothing is reserved).
+ */
+int reserve_pair_changes(HashTable *ht, PairChange *changes,\
+    size_t num_changes);
+
+
+/**
+ * Makes a change reserved by reserve_pair_changes and notifies the key's
+ * subscribers, as write_pair or delete_pair would.
+ *
+ * @param ht Hash table to be modified.
+ * @param avl_sessions List of all AVL tree subscriptions for all clients.
+ * @param change The change.
+ * @param timestamp Commit timestamp (see next_commit_timestamp), 0 to take
+ * a new one.
+ * @param version Where the new version of a written pair is stored, may be
+ * NULL.
+ * @return 0 if the pair was written or deleted, -1 if the pair deleted
+ * wasn't found.
+ */
+int apply_pair_change(HashTable *ht, AVLSessions *avl_sessions,\
+    PairChange *change, uint64_t timestamp, uint64_t *version);
+
+
+/**
+ * Frees what reserved changes didn't use (e.g. the tombstone of a delete
+ * before the tombstone horizon), or all of it if they weren't applied.
+ *
+ * @param changes The changes.
+ * @param num_changes Number of changes.
+ */
+void release_pair_changes(PairChange *changes, size_t num_changes);
+
+
+/**
+ * Appends a new key value pair to the hash table and notifies the key's
+ * subscribers.
  *
  * @param ht Hash table to be modified.
  * @param key Key of the pair to be written.
  * @param value Value of the pair to be written.
- * @param notif_message String to write to all fd stores inside the node.
+ * @param value_len Length of the value (at most MAX_VALUE_SIZE).
+ * @param expires_at Time (ms, see timer_wheel_now) the pair expires, 0 if
+ * never.
+ * @param timestamp Commit timestamp (see next_commit_timestamp), 0 to take
+ * a new one.
+ * @param version Where the pair's new version is stored, may be NULL.
  * @return 0 if the node was appended successfully, -1 otherwise.
  */
 int write_pair(HashTable *ht, const char *key, const char *value,\
-    const char *notif_message);
+    size_t value_len, uint64_t expires_at, uint64_t timestamp,\
+    uint64_t *version);
+
+
+/**
+ * Writes a pair only if the key's version is the expected one.
+ *
+ * @param ht Hash table to be modified.
+ * @param key Key of the pair to be written.
+ * @param value Value of the pair to be written.
+ * @param value_len Length of the value (at most MAX_VALUE_SIZE).
+ * @param timestamp Commit timestamp (see next_commit_timestamp), 0 to take
+ * a new one.
+ * @param version Expected version (0 if the key must not exist), replaced
+ * by the new version on success or by the current one (0 if missing).
+ * @return 0 if the pair was written, 1 if the version didn't match, -1 on
+ * failure.
+ */
+int cas_pair(HashTable *ht, const char *key, const char *value,\
+    size_t value_len, uint64_t timestamp, uint64_t *version);
 
 
 /**
- * Deletes the value of given key.
+ * Checks the Bloom filter of a key's stripe, without taking any lock. A key
+ * written (or deleted) concurrently may be seen either way.
+ *
+ * @param ht Hash table to check.
+ * @param key The key.
+ * @return 0 if the key isn't in the table, 1 if it may be.
+ */
+int pair_may_exist(HashTable *ht, const char *key);
+
+
+/**
+ * Gets how well the Bloom filters answered the lookups of missing keys.
+ *
+ * @param ht Hash table to inspect.
+ * @param negatives Where the number of misses answered by the filters is
+ * stored.
+ * @param false_positives Where the number of misses the filters let through
+ * (that had to walk a list) is stored.
+ * @param counters Where the number of counters of every filter is stored.
+ */
+void get_filter_stats(HashTable *ht, size_t *negatives,\
+    size_t *false_positives, size_t *counters);
+
+
+/**
+ * Reads the value of given key without taking any lock (the table's lock is
+ * only taken if the layout keeps changing under the lookup). Keys the Bloom
+ * filter rules out aren't searched.
  *
  * @param ht Hash table to read from.
  * @param key Key of the pair to read.
- * @return 0 if the node was deleted successfully, -1 otherwise.
+ * @param output Buffer the value is appended to (not null terminated), NULL
+ * to only get its version.
+ * @param version Where the value's version is stored, may be NULL.
+ * @return Length of the value if the key was found, -1 if it wasn't or the
+ * output couldn't grow.
+ */
+ssize_t read_pair(HashTable *ht, const char *key, Buffer *output,\
+    uint64_t *version);
+
+
+/**
+ * Visits, in key order, the pairs whose key is between start and end (both
+ * inclusive) or, if end is NULL, the pairs whose key starts with start.
+ * Keys aren't deleted while the scan runs, and the values passed to visit
+ * aren't freed until it ends.
+ *
+ * @param ht Hash table to scan.
+ * @param start First key of the range, or the prefix if end is NULL.
+ * @param end Last key of the range, NULL to scan by prefix.
+ * @param visit Function called with each pair.
+ * @param arg Argument passed to visit.
+ * @return 0 on success, the value returned by visit if it stopped the scan,
+ * -1 if the scan couldn't enter an epoch.
  */
-char* read_pair(HashTable *ht, const char *key);
+int scan_pairs(HashTable *ht, const char *start, const char *end,\
+    PairVisitor visit, void *arg);
 
 
 /**
- * Appends a new node to the list.
+ * Deletes a pair and notifies the key's subscribers. A delete after the
+ * tombstone horizon leaves a tombstone of the key (see set_tombstone_horizon).
  *
  * @param ht Hash table to delete from.
  * @param avl_sessions List of all AVL tree subscriptions for all clients.
  * @param key Key of the pair to be deleted.
- * @param notif_message String to write to all fd stores inside the node.
- * @return 0 if the node was appended successfully, -1 otherwise.
+ * @param timestamp Commit timestamp (see next_commit_timestamp), 0 to take
+ * a new one.
+ * @return 0 if the pair was deleted, -1 if it wasn't found, -2 if its
+ * tombstone couldn't be allocated (the pair is kept).
  */
 int delete_pair(HashTable *ht, AVLSessions *avl_sessions, const char *key,\
-    const char *notif_message);
+    uint64_t timestamp);
+
+
+/**
+ * Evicts pairs (as delete_pair does, notifying their subscribers) until the
+ * pairs use at most budget bytes. The clock hand sweeps the index lists,
+ * a pair used since the hand last passed is kept and loses its reference.
+ * The hash table's lock must be held to read and the caller can't hold any
+ * stripe.
+ *
+ * @param ht Hash table to evict from.
+ * @param avl_sessions List of all AVL tree subscriptions for all clients.
+ * @param budget Maximum number of bytes the pairs may use.
+ * @param visit Function called with each key about to be evicted, its stripe
+ * locked (to log its delete), or NULL. If it doesn't return 0, the pair is
+ * kept and the eviction stops.
+ * @param arg Argument passed to visit.
+ * @return Number of pairs evicted.
+ */
+size_t evict_pairs(HashTable *ht, AVLSessions *avl_sessions, size_t budget,\
+    KeyVisitor visit, void *arg);
+
+
+/**
+ * Deletes a pair, as delete_pair does, if its expiry time has passed (it
+ * may have been written again since its timer was set).
+ *
+ * @param ht Hash table to delete from.
+ * @param avl_sessions List of all AVL tree subscriptions for all clients.
+ * @param key Key of the pair to expire.
+ * @param now Current time (ms, see timer_wheel_now).
+ * @return 0 if the pair expired, 1 if it didn't, -1 if it wasn't found, -2
+ * if it couldn't be deleted (see delete_pair).
+ */
+int expire_pair(HashTable *ht, AVLSessions *avl_sessions, const char *key,\
+    uint64_t now);
+
+
+/**
+ * Sets the commit timestamp the delta snapshots to come start after, at the
+ * earliest: deletes up to it no longer need tombstones, which are dropped
+ * as their stripes get more deletes. Delta snapshots being taken keep the
+ * ones after their since.
+ *
+ * @param ht Hash table of the deltas.
+ * @param horizon The timestamp, UINT64_MAX if no delta is to come.
+ */
+void set_tombstone_horizon(HashTable *ht, uint64_t horizon);
+
+
+/**
+ * Starts a snapshot of the hash table at the last commit timestamp given,
+ * once no split batch is running. Writes keep going, the snapshot only slows
+ * down the writes to the stripes it hasn't visited yet (they save the pairs
+ * they replace).
+ *
+ * @param ht Hash table to snapshot.
+ * @param snapshot The snapshot, ended with snapshot_end.
+ * @param since Timestamp of an earlier snapshot, to only visit what changed
+ * after it (the tombstone horizon must not be past it), 0 to visit every
+ * pair.
+ */
+void snapshot_begin(HashTable *ht, Snapshot *snapshot, uint64_t since);
+
+
+/**
+ * Visits the keys of a stripe a delta snapshot has to delete: the ones
+ * deleted after its since, up to its timestamp. Whole snapshots have none.
+ * The caller must hold the stripe's lock (to read) and call it before
+ * snapshot_visit_stripe.
+ *
+ * @param ht Hash table of the snapshot.
+ * @param snapshot The snapshot.
+ * @param stripe Position of the stripe.
+ * @param visit Function called with each key.
+ * @param arg Argument passed to visit.
+ * @return 0 on success, the value returned by visit if it stopped.
+ */
+int snapshot_visit_tombstones(HashTable *ht, const Snapshot *snapshot,\
+    size_t stripe, KeyVisitor visit, void *arg);
+
+
+/**
+ * Visits the pairs of a stripe that are in the snapshot (written after its
+ * since) and marks the stripe visited.
+ * The caller must hold the hash table's lock and the stripe's lock (to
+ * read), and visit each stripe once.
+ *
+ * @param ht Hash table of the snapshot.
+ * @param snapshot The snapshot.
+ * @param stripe Position of the stripe.
+ * @param visit Function called with each pair.
+ * @param arg Argument passed to visit.
+ * @return 0 on success, the value returned by visit if it stopped.
+ */
+int snapshot_visit_stripe(HashTable *ht, Snapshot *snapshot, size_t stripe,\
+    PairVisitor visit, void *arg);
+
+
+/**
+ * Visits the pairs of the snapshot that were replaced before their stripe
+ * was visited (skipping, as snapshot_visit_stripe does, the ones a delta
+ * doesn't need). Every stripe must have been visited.
+ *
+ * @param snapshot The snapshot.
+ * @param visit Function called with each pair.
+ * @param arg Argument passed to visit.
+ * @return 0 on success, the value returned by visit if it stopped, -1 if
+ * some pair couldn't be saved (the snapshot is incomplete).
+ */
+int snapshot_visit_saved(Snapshot *snapshot, PairVisitor visit, void *arg);
+
+
+/**
+ * Ends a snapshot, freeing its saved pairs.
+ *
+ * @param ht Hash table of the snapshot.
+ * @param snapshot The snapshot.
+ */
+void snapshot_end(HashTable *ht, Snapshot *snapshot);
 
 
 /**
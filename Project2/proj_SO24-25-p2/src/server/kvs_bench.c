@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "constants.h"
+#include "kvs.h"
+#include "buffer.h"
+
+/// Keys written when the number isn't given.
+#define BENCH_DEFAULT_KEYS 1000000
+/// Length of the values written.
+#define BENCH_VALUE_SIZE 16
+
+
+/// Gets the time of a monotonic clock.
+/// @return Time in seconds.
+static double now_seconds() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+
+/// Prints the throughput of a phase.
+/// @param phase Name of the phase.
+/// @param ops Operations done.
+/// @param start Time (see now_seconds) the phase started.
+static void report(const char *phase, size_t ops, double start) {
+  double elapsed = now_seconds() - start;
+
+  printf("%-10s %12.0f ops/s\n", phase, (double) ops / elapsed);
+}
+
+
+/// Writes (or updates) the pairs of some keys, locking their stripes as the
+/// server does and growing the table between writes.
+/// @param ht The table.
+/// @param keys The keys.
+/// @param num_keys Number of keys.
+/// @param value Value written to every key.
+/// @return 0 on success, -1 on failure.
+static int write_keys(HashTable *ht, char (*keys)[MAX_STRING_SIZE],\
+  size_t num_keys, const char *value) {
+  for (size_t i = 0; i < num_keys; i++) {
+    size_t stripe = get_lock_stripe(ht, keys[i]);
+    int ret;
+
+    pthread_rwlock_wrlock(&ht->stripes[stripe].rwl);
+    ret = write_pair(ht, keys[i], value, BENCH_VALUE_SIZE, 0, 0, NULL);
+    pthread_rwlock_unlock(&ht->stripes[stripe].rwl);
+    if (ret) return -1;
+
+    if (hash_table_needs_rehash(ht) && hash_table_rehash_step(ht))
+      return -1;
+  }
+  return 0;
+}
+
+
+/// Reads the pairs of some keys.
+/// @param ht The table.
+/// @param keys The keys.
+/// @param num_keys Number of keys.
+/// @return Number of keys found.
+static size_t read_keys(HashTable *ht, char (*keys)[MAX_STRING_SIZE],\
+  size_t num_keys) {
+  Buffer output = BUFFER_INITIALIZER;
+  size_t found = 0;
+
+  for (size_t i = 0; i < num_keys; i++) {
+    output.length = 0;
+    if (read_pair(ht, keys[i], &output, NULL) >= 0) found++;
+  }
+  buffer_free(&output);
+  return found;
+}
+
+
+/// Shuffles the keys (Fisher-Yates with xorshift64), so lookups don't
+/// follow the insertion order.
+/// @param keys The keys.
+/// @param num_keys Number of keys.
+static void shuffle_keys(char (*keys)[MAX_STRING_SIZE], size_t num_keys) {
+  uint64_t seed = 0x9E3779B97F4A7C15ULL;
+
+  for (size_t i = num_keys; i > 1; i--) {
+    char temp[MAX_STRING_SIZE];
+    size_t j;
+
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    j = (size_t) (seed % i);
+    memcpy(temp, keys[i - 1], MAX_STRING_SIZE);
+    memcpy(keys[i - 1], keys[j], MAX_STRING_SIZE);
+    memcpy(keys[j], temp, MAX_STRING_SIZE);
+  }
+}
+
+
+int main(int argc, char *argv[]) {
+  size_t num_keys = BENCH_DEFAULT_KEYS;
+  char (*keys)[MAX_STRING_SIZE], (*misses)[MAX_STRING_SIZE];
+  char value[BENCH_VALUE_SIZE + 1];
+  struct rusage usage;
+  HashTable *ht;
+  double start;
+  size_t found;
+
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [num_keys]\n", argv[0]);
+    return 1;
+  }
+  if (argc == 2 && (num_keys = strtoul(argv[1], NULL, 10)) == 0) {
+    fprintf(stderr, "Invalid number of keys\n");
+    return 1;
+  }
+
+  keys = malloc(num_keys * sizeof(*keys));
+  misses = malloc(num_keys * sizeof(*misses));
+  ht = create_hash_table(KVS_LOCK_STRIPES);
+  if (!keys || !misses || !ht) {
+    fprintf(stderr, "Failed to allocate the benchmark\n");
+    return 1;
+  }
+  for (size_t i = 0; i < num_keys; i++) {
+    snprintf(keys[i], MAX_STRING_SIZE, "key%zu", i);
+    snprintf(misses[i], MAX_STRING_SIZE, "miss%zu", i);
+  }
+  memset(value, 'v', BENCH_VALUE_SIZE);
+  value[BENCH_VALUE_SIZE] = '\0';
+
+  printf("index      %s\n", KVS_SWISS_TABLE ? "swiss" : "chained");
+  printf("keys       %zu\n", num_keys);
+
+  start = now_seconds();
+  if (write_keys(ht, keys, num_keys, value)) {
+    fprintf(stderr, "Failed to write the pairs\n");
+    return 1;
+  }
+  report("insert", num_keys, start);
+
+  shuffle_keys(keys, num_keys);
+  start = now_seconds();
+  found = read_keys(ht, keys, num_keys);
+  report("read", num_keys, start);
+  if (found != num_keys)
+    fprintf(stderr, "Missing %zu keys\n", num_keys - found);
+
+  // Most of these end at the Bloom filters
+  start = now_seconds();
+  read_keys(ht, misses, num_keys);
+  report("read miss", num_keys, start);
+
+  start = now_seconds();
+  if (write_keys(ht, keys, num_keys, value)) {
+    fprintf(stderr, "Failed to update the pairs\n");
+    return 1;
+  }
+  report("update", num_keys, start);
+
+  printf("%-10s %12.1f bytes/key\n", "index",\
+    (double) get_index_memory(ht) / (double) num_keys);
+  printf("%-10s %12.1f bytes/key\n", "total",\
+    (double) (get_index_memory(ht) + atomic_load(&ht->mem_used)) /\
+    (double) num_keys);
+
+  start = now_seconds();
+  for (size_t i = 0; i < num_keys; i++) {
+    size_t stripe = get_lock_stripe(ht, keys[i]);
+
+    pthread_rwlock_wrlock(&ht->stripes[stripe].rwl);
+    delete_pair(ht, NULL, keys[i], 0);
+    pthread_rwlock_unlock(&ht->stripes[stripe].rwl);
+  }
+  report("delete", num_keys, start);
+
+  getrusage(RUSAGE_SELF, &usage);
+  printf("%-10s %12ld KiB\n", "max rss", usage.ru_maxrss);
+
+  free_table(ht);
+  free(keys);
+  free(misses);
+  return 0;
+}
@@ -0,0 +1,269 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "kvs.h"
+#include "buffer.h"
+#include "compress.h"
+
+
+/// Pairs of a KVS being rebuilt from a chain of backups.
+typedef struct MergeState {
+  HashTable *ht;        // Pairs of the backups merged so far.
+  uint64_t timestamp;   // Commit timestamp of the last backup merged.
+  size_t num_stripes;   // Lock stripes of the server that wrote the chain.
+} MergeState;
+
+
+/// Keeps the key of a pair, gathered by a scan (the pairs can't be deleted
+/// while it runs).
+/// @param key The key (null terminated).
+/// @param key_len Length of the key.
+/// @param value The value (unused).
+/// @param value_len Length of the value (unused).
+/// @param expires_at Time the pair expires (unused).
+/// @param arg Buffer of null terminated keys, back to back.
+/// @return 0 on success, -1 if the keys couldn't grow.
+static int gather_key(const char *key, size_t key_len, const char *value,\
+  size_t value_len, uint64_t expires_at, void *arg) {
+  (void) value;
+  (void) value_len;
+  (void) expires_at;
+  return buffer_append(arg, key, key_len + 1);
+}
+
+
+/// Deletes the pairs of some keys (missing ones are skipped).
+/// @param ht The table.
+/// @param keys Null terminated keys, back to back.
+static void delete_keys(HashTable *ht, const Buffer *keys) {
+  size_t offset = 0;
+
+  while (offset < keys->length) {
+    const char *key = keys->data + offset;
+
+    delete_pair(ht, NULL, key, 0);
+    offset += strlen(key) + 1;
+  }
+}
+
+
+/// Writes a "(key, value)" line of a backup to the table.
+/// @param ht The table.
+/// @param line The line, without its newline.
+/// @param len Length of the line.
+/// @return 0 on success, -1 if the line isn't a pair or couldn't be written.
+static int merge_pair(HashTable *ht, char *line, size_t len) {
+  char key[MAX_STRING_SIZE];
+  char *separator = strstr(line, ", ");
+  size_t key_len, stripe;
+  int ret;
+
+  if (len < 2 || line[0] != '(' || line[len - 1] != ')' ||\
+    separator == NULL || (key_len = (size_t) (separator - line - 1)) == 0 ||\
+    key_len >= MAX_STRING_SIZE)
+    return -1;
+  memcpy(key, line + 1, key_len);
+  key[key_len] = '\0';
+
+  stripe = get_lock_stripe(ht, key);
+  pthread_rwlock_wrlock(&ht->stripes[stripe].rwl);
+  ret = write_pair(ht, key, separator + 2,\
+    (size_t) (line + len - 1 - (separator + 2)), 0, 0, NULL);
+  pthread_rwlock_unlock(&ht->stripes[stripe].rwl);
+  if (ret) return -1;
+
+  if (hash_table_needs_rehash(ht) && hash_table_rehash_step(ht)) return -1;
+  return 0;
+}
+
+
+/// Reads the header of a backup and checks that it follows the backups
+/// merged so far.
+/// @param state The merge.
+/// @param path Path of the backup (for errors).
+/// @param line The header, without its newline.
+/// @param deleted Where the keys of the pairs the backup replaces are added.
+/// @return 0 on success, -1 on failure.
+static int merge_header(MergeState *state, const char *path,\
+  const char *line, Buffer *deleted) {
+  uint64_t since, timestamp;
+  size_t num_stripes;
+
+  if (sscanf(line, "BASE %" SCNu64 " %zu", &timestamp, &num_stripes) == 2) {
+    // A base replaces everything before it
+    if (state->ht != NULL &&\
+      scan_pairs(state->ht, "", NULL, gather_key, deleted)) {
+      fprintf(stderr, "Failed to gather the pairs before %s\n", path);
+      return -1;
+    }
+  } else if (sscanf(line, "DELTA %" SCNu64 " %" SCNu64 " %zu", &since,\
+    &timestamp, &num_stripes) == 3) {
+    if (state->ht == NULL) {
+      fprintf(stderr, "%s: a chain must start with a base\n", path);
+      return -1;
+    }
+    if (since != state->timestamp) {
+      fprintf(stderr, "%s: delta of %" PRIu64 ", not of the backup before"\
+        " it (%" PRIu64 ")\n", path, since, state->timestamp);
+      return -1;
+    }
+  } else {
+    fprintf(stderr, "%s: not a backup of a chain (see KVS_DELTA_BACKUPS)\n",\
+      path);
+    return -1;
+  }
+
+  if (state->ht == NULL) {
+    state->num_stripes = num_stripes;
+    if ((state->ht = create_hash_table(num_stripes)) == NULL) {
+      fprintf(stderr, "Failed to allocate the table\n");
+      return -1;
+    }
+  }
+  // Kept the same along a chain, as the server's
+  if (num_stripes != state->num_stripes ||\
+    state->ht->num_stripes != num_stripes) {
+    fprintf(stderr, "%s: written with %zu stripes, not %zu\n", path,\
+      num_stripes, state->num_stripes);
+    return -1;
+  }
+  state->timestamp = timestamp;
+  return 0;
+}
+
+
+/// Opens a backup, decompressed to a temporary file if it was written with
+/// KVS_COMPRESSED_BACKUPS.
+/// @param path Path of the backup.
+/// @return The backup's text, NULL on failure.
+static FILE* open_backup(const char *path) {
+  char magic[COMPRESS_MAGIC_SIZE];
+  FILE *file = fopen(path, "r"), *text;
+
+  if (file == NULL) {
+    perror(path);
+    return NULL;
+  }
+  if (fread(magic, 1, COMPRESS_MAGIC_SIZE, file) != COMPRESS_MAGIC_SIZE ||\
+    memcmp(magic, COMPRESS_MAGIC, COMPRESS_MAGIC_SIZE) != 0) {
+    rewind(file);
+    return file;
+  }
+
+  // Read twice by merge_backup, so it's decompressed once to a file
+  if ((text = tmpfile()) == NULL ||\
+    lseek(fileno(file), 0, SEEK_SET) != 0 ||\
+    decompress_file(fileno(file), fileno(text))) {
+    fprintf(stderr, "%s: failed to decompress\n", path);
+    if (text != NULL) fclose(text);
+    fclose(file);
+    return NULL;
+  }
+  fclose(file);
+  rewind(text);
+  return text;
+}
+
+
+/// Merges a backup with the ones before it: the keys it deletes (found by a
+/// first pass, every key for a base) are deleted first, then its pairs are
+/// written, as a key deleted and written again since the last backup has
+/// both.
+/// @param state The merge.
+/// @param path Path of the backup.
+/// @return 0 on success, -1 on failure.
+static int merge_backup(MergeState *state, const char *path) {
+  FILE *file = open_backup(path);
+  Buffer deleted = BUFFER_INITIALIZER; // Null terminated keys
+  char *line = NULL;
+  size_t capacity = 0, line_number = 0;
+  ssize_t len;
+  int ended = 0, ret = 0;
+
+  if (file == NULL) return -1;
+
+  while (ret == 0 && (len = getline(&line, &capacity, file)) != -1) {
+    if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+    if (ended) {
+      fprintf(stderr, "%s:%zu: line after END\n", path, line_number + 1);
+      ret = -1;
+    } else if (line_number++ == 0) {
+      ret = merge_header(state, path, line, &deleted);
+    } else if (strcmp(line, "END") == 0) {
+      ended = 1;
+    } else if (strncmp(line, "DELETE ", 7) == 0) {
+      if (len == 7 || len - 7 >= MAX_STRING_SIZE ||\
+        buffer_append(&deleted, line + 7, (size_t) len - 7 + 1)) {
+        fprintf(stderr, "%s:%zu: invalid delete\n", path, line_number);
+        ret = -1;
+      }
+    }
+  }
+  if (ret == 0 && !ended) {
+    fprintf(stderr, "%s: incomplete backup, without END\n", path);
+    ret = -1;
+  }
+
+  if (ret == 0) delete_keys(state->ht, &deleted);
+  buffer_free(&deleted);
+
+  rewind(file);
+  line_number = 0;
+  while (ret == 0 && (len = getline(&line, &capacity, file)) != -1) {
+    if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+    if (line_number++ == 0 || line[0] != '(') continue;
+    if (merge_pair(state->ht, line, (size_t) len)) {
+      fprintf(stderr, "%s:%zu: invalid pair\n", path, line_number);
+      ret = -1;
+    }
+  }
+
+  free(line);
+  fclose(file);
+  return ret;
+}
+
+
+/// Prints a pair of the merged state as "(key, value)".
+/// @param key The key.
+/// @param key_len Length of the key.
+/// @param value The value.
+/// @param value_len Length of the value.
+/// @param expires_at Time the pair expires (unused).
+/// @param arg Unused.
+/// @return 0 on success, -1 if the output failed.
+static int print_pair(const char *key, size_t key_len, const char *value,\
+  size_t value_len, uint64_t expires_at, void *arg) {
+  (void) expires_at;
+  (void) arg;
+  return printf("(%.*s, %.*s)\n", (int) key_len, key, (int) value_len,\
+    value) < 0 ? -1 : 0;
+}
+
+
+/// Rebuilds the state of the KVS from a chain of backups written with
+/// KVS_DELTA_BACKUPS (a base and the deltas after it, in order) and prints
+/// its pairs in key order, as "(key, value)" lines.
+int main(int argc, char *argv[]) {
+  MergeState state = {NULL, 0, 0};
+  int ret = 0;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <base.bck> [delta.bck...]\n", argv[0]);
+    return 1;
+  }
+
+  for (int i = 1; i < argc && ret == 0; i++)
+    ret = merge_backup(&state, argv[i]);
+  if (ret == 0 && scan_pairs(state.ht, "", NULL, print_pair, NULL)) {
+    fprintf(stderr, "Failed to print the pairs\n");
+    ret = -1;
+  }
+
+  if (state.ht != NULL) free_table(state.ht);
+  return ret ? 1 : 0;
+}
@@ -0,0 +1,26 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "compress.h"
+
+
+/// Decompresses a backup written with KVS_COMPRESSED_BACKUPS to the
+/// standard output.
+int main(int argc, char *argv[]) {
+  int fd, ret;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <backup.bck>\n", argv[0]);
+    return 1;
+  }
+  if ((fd = open(argv[1], O_RDONLY)) == -1) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  ret = decompress_file(fd, STDOUT_FILENO);
+  if (ret) fprintf(stderr, "%s: failed to decompress\n", argv[1]);
+  close(fd);
+  return ret ? 1 : 0;
+}
@@ -5,7 +5,6 @@
 #include <string.h>
 #include <dirent.h>
 #include <fcntl.h>
-#include <sys/wait.h>
 #include <sys/stat.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -17,6 +16,7 @@
 #include "parser.h"
 #include "operations.h"
 #include "avl.h"
+#include "slab.h"
 #include "../common/constants.h"
 #include "../common/protocol.h"
 #include "../common/safeFunctions.h"
@@ -38,6 +38,10 @@ typedef struct ClientNode{
 }ClientNode;
 
 
+/// Pool of the queue's client nodes.
+static SlabPool client_node_pool = SLAB_POOL_INITIALIZER(sizeof(ClientNode));
+
+
 //Queue struct, implemented as a linked list
 typedef struct Queue{
   struct ClientNode* head;
@@ -46,7 +50,6 @@ typedef struct Queue{
 
 
 int max_backups = 1;          // Max number of concurrent backups.
-int active_backups = 0;       // Number of active backups.
 DIR *directory;               // Directory to process.
 
 Queue queue = {NULL, NULL};// Queue to hold clients before getting a session.
@@ -103,12 +106,20 @@ volatile sig_atomic_t sig_flag;
     }
 
     char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
+    ValueList values = {.buffer = BUFFER_INITIALIZER}; // Values of a command.
+    uint64_t versions[MAX_WRITE_SIZE]; // Versions expected by a CAS.
+    KvsTransaction txn = KVS_TRANSACTION_INITIALIZER; // Open transaction.
+    int in_transaction = 0; // 1 between a BEGIN and its COMMIT.
+    int txn_failed = 0; // 1 once a command couldn't be added to it.
     char in_path[MAX_JOB_FILE_NAME_SIZE];
     char out_path[MAX_JOB_FILE_NAME_SIZE];
     char bck_path[MAX_JOB_FILE_NAME_SIZE];
     unsigned int delay;   // Delay of the WAIT command.
+    unsigned int ttl;     // Time to live of the WRITE_TTL command.
     size_t num_pairs;     // Number of pairs.
+    char scan_start[MAX_STRING_SIZE + 1]; // First key or prefix of a SCAN.
+    char scan_end[MAX_STRING_SIZE + 1];   // Last key of a SCAN.
+    int scan_type;        // Type of the SCAN command (range or prefix).
     JobThreadArgs *thread_args = (JobThreadArgs*) args;
 
     // Get the name of the current file.
@@ -141,6 +152,8 @@ volatile sig_atomic_t sig_flag;
 
     // Number of backups made in the current file.
     int backups_made = 0;
+    // Backups of the current file, deltas are taken against them.
+    BackupChain backup_chain = BACKUP_CHAIN_INITIALIZER;
 
     int reading_commands = 1; // flag to let commands from the file.
     while(reading_commands){
@@ -148,13 +161,54 @@ volatile sig_atomic_t sig_flag;
       // Get the next command.
       switch (get_next(in_fd)) {
         case CMD_WRITE:
-          num_pairs = parse_write(in_fd, keys, values, MAX_WRITE_SIZE,\
+          num_pairs = parse_write(in_fd, keys, &values, MAX_WRITE_SIZE,\
+            MAX_STRING_SIZE);
+          if (num_pairs == 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+          }
+          if (in_transaction) {
+            if (kvs_txn_write(&txn, num_pairs, keys, &values)) {
+              fprintf(stderr, "Failed to add the write to the transaction\n");
+              txn_failed = 1;
+            }
+          } else if (kvs_write(num_pairs, keys, &values, 0)) {
+            fprintf(stderr, "Failed to write pair\n");
+          }
+          break;
+
+        case CMD_WRITE_TTL:
+          if (parse_ttl(in_fd, &ttl) == -1) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+          }
+          num_pairs = parse_write(in_fd, keys, &values, MAX_WRITE_SIZE,\
             MAX_STRING_SIZE);
           if (num_pairs == 0) {
             fprintf(stderr, "Invalid command. See HELP for usage\n");
             continue;
           }
-          if (kvs_write(num_pairs, keys, values)) {
+          if (in_transaction) {
+            fprintf(stderr, "WRITE_TTL can't be used in a transaction\n");
+            continue;
+          }
+          if (kvs_write(num_pairs, keys, &values, ttl)) {
+            fprintf(stderr, "Failed to write pair\n");
+          }
+          break;
+
+        case CMD_CAS:
+          num_pairs = parse_cas(in_fd, keys, versions, &values, MAX_WRITE_SIZE,\
+            MAX_STRING_SIZE);
+          if (num_pairs == 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+          }
+          if (in_transaction) {
+            fprintf(stderr, "CAS can't be used in a transaction\n");
+            continue;
+          }
+          if (kvs_cas(out_fd, num_pairs, keys, versions, &values)) {
             fprintf(stderr, "Failed to write pair\n");
           }
           break;
@@ -168,7 +222,30 @@ volatile sig_atomic_t sig_flag;
             continue;
           }
 
-          if (kvs_read(out_fd, num_pairs, keys)) {
+          if (in_transaction) {
+            if (kvs_txn_read(&txn, num_pairs, keys)) {
+              fprintf(stderr, "Failed to add the read to the transaction\n");
+              txn_failed = 1;
+            }
+          } else if (kvs_read(out_fd, num_pairs, keys, 0)) {
+            fprintf(stderr, "Failed to read pair\n");
+          }
+          break;
+
+        case CMD_READV:
+          num_pairs = parse_read_delete(in_fd, keys, MAX_WRITE_SIZE,\
+            MAX_STRING_SIZE);
+
+          if (num_pairs == 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+          }
+
+          if (in_transaction) {
+            fprintf(stderr, "READV can't be used in a transaction\n");
+            continue;
+          }
+          if (kvs_read(out_fd, num_pairs, keys, 1)) {
             fprintf(stderr, "Failed to read pair\n");
           }
           break;
@@ -182,20 +259,84 @@ volatile sig_atomic_t sig_flag;
             continue;
           }
 
-          if (kvs_delete(out_fd, num_pairs, keys)) {
+          if (in_transaction) {
+            if (kvs_txn_delete(&txn, num_pairs, keys)) {
+              fprintf(stderr, "Failed to add the delete to the transaction\n");
+              txn_failed = 1;
+            }
+          } else if (kvs_delete(out_fd, num_pairs, keys)) {
             fprintf(stderr, "Failed to delete pair\n");
           }
           break;
 
+        case CMD_BEGIN:
+          if (in_transaction) {
+            fprintf(stderr, "A transaction is already open\n");
+            continue;
+          }
+          in_transaction = 1;
+          break;
+
+        case CMD_COMMIT:
+          if (!in_transaction) {
+            fprintf(stderr, "No transaction to commit\n");
+            continue;
+          }
+          in_transaction = 0;
+          // Committing what's left of it would not be all or nothing
+          if (txn_failed) {
+            fprintf(stderr, "Transaction with a failed command discarded\n");
+            kvs_txn_clear(&txn);
+            txn_failed = 0;
+          } else if (kvs_commit(out_fd, &txn)) {
+            fprintf(stderr, "Failed to commit transaction\n");
+          }
+          break;
+
         case CMD_SHOW:
+          if (in_transaction) {
+            fprintf(stderr, "SHOW can't be used in a transaction\n");
+            continue;
+          }
           kvs_show(out_fd);
           break;
 
+        case CMD_SCAN:
+          scan_type = parse_scan(in_fd, scan_start, scan_end, MAX_STRING_SIZE);
+
+          if (scan_type == -1) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+          }
+          if (in_transaction) {
+            fprintf(stderr, "SCAN can't be used in a transaction\n");
+            continue;
+          }
+
+          if (kvs_scan(out_fd, scan_start, scan_type == 0 ? scan_end : NULL)) {
+            fprintf(stderr, "Failed to scan pairs\n");
+          }
+          break;
+
+        case CMD_STATS:
+          if (in_transaction) {
+            fprintf(stderr, "STATS can't be used in a transaction\n");
+            continue;
+          }
+          if (kvs_stats(out_fd)) {
+            fprintf(stderr, "Failed to write stats\n");
+          }
+          break;
+
         case CMD_WAIT:
           if (parse_wait(in_fd, &delay, NULL) == -1) {
             fprintf(stderr, "Invalid command. See HELP for usage\n");
             continue;
           }
+          if (in_transaction) {
+            fprintf(stderr, "WAIT can't be used in a transaction\n");
+            continue;
+          }
 
           if (delay > 0) {
             if (write(out_fd, "Waiting...\n", 11) == -1) {
@@ -206,52 +347,22 @@ volatile sig_atomic_t sig_flag;
           break;
 
         case CMD_BACKUP:
-          // Lock the mutex to check if we can make a backup.
-          if (pthread_mutex_lock(&mutex)){
-            fprintf(stderr, "Error trying to lock a mutex\n");
+          if (in_transaction) {
+            fprintf(stderr, "BACKUP can't be used in a transaction\n");
             continue;
           }
-
-          // Check if the number of active backups is less than the
-          //maximum number of backups.
-          if (active_backups >= max_backups) {
-            int status;
-            if (wait(&status) == -1) {
-              perror("Error waiting for backup to be finished.");
-            }
-          }
-          else active_backups++;
           backups_made++;
-
-          // Unlock the mutex after checking if we can make a backup.
-          pthread_mutex_unlock(&mutex);
-          // Create safely a child process to make the backup.
-          pid_t pid = do_fork();
-          // Check if the child process was created successfully.
-          if(pid == -1){
-            fprintf(stderr, "Failed to create child process\n");
-            continue;
-          }
-          if (pid == 0){ // Check if we are in the child process.
-            // Create the path for the backup file.
-            snprintf(bck_path, size_path + 3, "%s/%.*s-%d.bck",\
-              thread_args->dir_name, (int)length_entry_name - 4, entry_name,\
-              backups_made);
-            // Open the backup file.
-            int bck_fd = open(bck_path, O_CREAT | O_TRUNC | O_WRONLY ,\
-              S_IRUSR | S_IWUSR);
-            // Check if the backup file was opened successfully.
-            if(bck_fd == -1) perror("File could not be open.\n");
-            else{
-              if (kvs_backup(bck_fd))
-                fprintf(stderr, "Failed to perform backup\n");
-            }
-            kvs_terminate();
-            close(in_fd);
-            close(out_fd);
-            closedir(directory);
-            exit(0);
-          }
+          // Create the path for the backup file.
+          snprintf(bck_path, size_path + 3, "%s/%.*s-%d.bck",\
+            thread_args->dir_name, (int)length_entry_name - 4, entry_name,\
+            backups_made);
+          int bck_fd = open(bck_path, O_CREAT | O_TRUNC | O_WRONLY ,\
+            S_IRUSR | S_IWUSR);
+          if (bck_fd == -1) perror("File could not be open.\n");
+          // Queued for the backup workers, from a snapshot taken now.
+          else if (kvs_backup_start(bck_fd, (size_t) max_backups,\
+            &backup_chain))
+            fprintf(stderr, "Failed to perform backup\n");
           break;
 
         case CMD_INVALID:
@@ -262,9 +373,16 @@ volatile sig_atomic_t sig_flag;
           printf(
               "Available commands:\n"
               "  WRITE [(key,value)(key2,value2),...]\n"
+              "  WRITE_TTL <ttl_ms> [(key,value)(key2,value2),...]\n"
+              "  CAS [(key,version,value)(key2,version2,value2),...]\n"
               "  READ [key,key2,...]\n"
+              "  READV [key,key2,...]\n"
               "  DELETE [key,key2,...]\n"
+              "  BEGIN\n"
+              "  COMMIT\n"
               "  SHOW\n"
+              "  SCAN [start,end] | SCAN prefix*\n"
+              "  STATS\n"
               "  WAIT <delay_ms>\n"
               "  BACKUP\n"
               "  HELP\n"
@@ -280,6 +398,11 @@ volatile sig_atomic_t sig_flag;
       }
     }
 
+    if (in_transaction)
+      fprintf(stderr, "Transaction without COMMIT discarded\n");
+    kvs_txn_free(&txn);
+    kvs_backup_chain_end(&backup_chain);
+    buffer_free(&values.buffer);
     close(in_fd);
     close(out_fd);
     // Lock the mutex to read the directory.
@@ -351,14 +474,14 @@ void* client_thread(void *args) {
     sem_post(&sem_add_to_queue);
 
     data = client->data;
-    free(client); // From here we only need ClientData and not the clientNode.
+    slab_free(&client_node_pool, client); // From here we only need ClientData and not the clientNode.
 
     response_connection[0] = OP_CODE_CONNECT;
     response_connection[1] = '1'; // Result is 1 and changes to 0 on success.
 
     data->resp_pipe_fd = open(data->resp_pipe_path, O_WRONLY);
     if (data->resp_pipe_fd == -1){
-      free(data);
+      slab_free(&client_data_pool, data);
       perror("Error opening client response pipe");
       continue;
     }
@@ -374,7 +497,7 @@ void* client_thread(void *args) {
       }
       perror("Error opening client request pipe");
       close(data->resp_pipe_fd);
-      free(data);
+      slab_free(&client_data_pool, data);
       continue;
     }
 
@@ -390,7 +513,7 @@ void* client_thread(void *args) {
       perror("Error opening client notification pipe");
       close(data->resp_pipe_fd);
       close(data->req_pipe_fd);
-      free(data);
+      slab_free(&client_data_pool, data);
       continue;
     }
 
@@ -405,7 +528,7 @@ void* client_thread(void *args) {
       close(data->resp_pipe_fd);
       close(data->req_pipe_fd);
       close(data->notif_pipe_fd);
-      free(data);
+      slab_free(&client_data_pool, data);
       continue;
     }
 
@@ -422,14 +545,14 @@ void* client_thread(void *args) {
         close(data->resp_pipe_fd);
         close(data->req_pipe_fd);
         close(data->notif_pipe_fd);
-        free(data);
+        slab_free(&client_data_pool, data);
         perror("Couldn't read message from client.");
         continue;
       }else if(read_output == 0){
         close(data->resp_pipe_fd);
         close(data->req_pipe_fd);
         close(data->notif_pipe_fd);
-        free(data);
+        slab_free(&client_data_pool, data);
         perror("Got EOF while trying to read message from client.");
         continue;
       }
@@ -522,10 +645,10 @@ void* client_thread(void *args) {
 int main(int argc, char *argv[]) {
 
   // Check if the number of arguments is correct.
-  if (argc != 5){
+  if (argc != 5 && argc != 6){
     fprintf(stderr, "Incorrect arguments.\n Correct use: %s\
-    <jobs_directory> <concurrent_backups> <max_threads> <server_FIFO_name>\n",\
-    argv[0]);
+    <jobs_directory> <concurrent_backups> <max_threads> <server_FIFO_name>\
+    [dump_to_restore]\n", argv[0]);
     return -1;
   }
 
@@ -587,21 +710,32 @@ int main(int argc, char *argv[]) {
     return -1;
   }
 
+  // Initialize the AVL sessions, before keys recovered with a TTL can expire.
+  if (avl_sessions_init()) {
+    fprintf(stderr, "Failed to initialize AVL sessions\n");
+    close(server_pipe_fd);
+    unlink(server_pipe_path);     // Close the server pipe in case of error.
+    closedir(directory);
+    return -1;
+  }
+
   // Initialize the KVS.
   if (kvs_init()) {
     fprintf(stderr, "Failed to initialize KVS\n");
     close(server_pipe_fd);
-    unlink(server_pipe_path);     // Close the server pipe in case of error.
+    unlink(server_pipe_path);
     closedir(directory);
+    avl_sessions_terminate();
     return -1;
   }
 
-  // Initialize the AVL sessions.
-  if (avl_sessions_init()) {
-    fprintf(stderr, "Failed to initialize AVL sessions\n");
+  // Restore the state of the dump given, before any job or client runs.
+  if (argc == 6 && kvs_restore(argv[5])) {
+    fprintf(stderr, "Failed to restore %s\n", argv[5]);
     close(server_pipe_fd);
     unlink(server_pipe_path);
     closedir(directory);
+    avl_sessions_terminate();
     kvs_terminate();
     return -1;
   }
@@ -690,16 +824,16 @@ int main(int argc, char *argv[]) {
       continue;
     }
 
-    client = malloc(sizeof(ClientNode));
+    client = slab_alloc(&client_node_pool);
     if (client == NULL){
       perror("Could not allocate memory to client structure.");
       continue;
     }
 
-    data = malloc(sizeof(ClientData));
+    data = slab_alloc(&client_data_pool);
     if (data == NULL){
       perror("Could not allocate memory to client data structure.");
-      free(client);
+      slab_free(&client_node_pool, client);
       continue;
     }
 
@@ -754,18 +888,11 @@ int main(int argc, char *argv[]) {
   // Destroy the global mutex.
   pthread_mutex_destroy(&mutex);
 
-  // Terminate the KVS.
+  // Terminate the KVS (after the backups queued are written).
   kvs_terminate();
 
   // Terminate the AVL sessions.
   avl_sessions_terminate();
 
-  // Wait for the backups to finish.
-  while (active_backups-- > 0){
-    if(wait(NULL) == -1){
-      perror("Error waiting for backup to be finished.");
-    }
-  };
-
   return 0;
 }
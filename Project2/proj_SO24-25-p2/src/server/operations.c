@@ -6,6 +6,75 @@ AVLSessions *avl_sessions = NULL;
 /// Hash table to store the key value pairs.
 static struct HashTable *kvs_table = NULL;
 
+/// Owner threads of the KVS shards (none unless KVS_SHARDS is set).
+static ShardEngine shard_engine;
+
+/// Log of the KVS's changes (NULL unless KVS_WAL_PATH is set).
+static Wal *kvs_wal = NULL;
+
+/// Timers of the keys written with a TTL and the thread that expires them.
+static struct {
+  TimerWheel *wheel;        // Timers, NULL until the first WRITE_TTL.
+  pthread_t thread;         // Thread that expires the keys.
+  pid_t pid;                // Process where the thread runs.
+  int running;              // Cleared to stop the thread.
+  pthread_mutex_t mutex;    // Protects the fields above.
+  pthread_cond_t wake;      // Wakes the thread up to stop.
+} ttl_state = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/// Checkpoints of the log and the thread that takes them (see
+/// KVS_CHECKPOINT_MS).
+static struct {
+  pthread_t thread;         // Thread that takes the checkpoints.
+  int running;              // Cleared to stop the thread.
+  pthread_mutex_t mutex;    // Protects running.
+  pthread_cond_t wake;      // Wakes the thread up to stop.
+  pthread_mutex_t taking;   // Held while a checkpoint is taken.
+} checkpoint_state = {.mutex = PTHREAD_MUTEX_INITIALIZER,\
+  .taking = PTHREAD_MUTEX_INITIALIZER};
+
+static void stop_ttl_thread();
+static void stop_backup_workers();
+static int recover_from_log();
+static int checkpoint_log(int force);
+static void evict_over_budget();
+static int start_checkpoint_thread();
+static void stop_checkpoint_thread();
+
+#if KVS_DELTA_BACKUPS > 0
+/// Chains of backups whose next backup is a delta (see KVS_DELTA_BACKUPS),
+/// which needs the tombstones of the keys deleted after the chain's last
+/// backup.
+static struct {
+  BackupChain *head;        // First chain waiting for a delta.
+  pthread_mutex_t mutex;    // Protects the chains and the tombstone horizon.
+} chain_state = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+#endif
+
+#if KVS_BINARY_BACKUPS && KVS_DELTA_BACKUPS > 0
+#error "Dumps are always whole, KVS_DELTA_BACKUPS needs text backups"
+#endif
+
+#if KVS_BINARY_BACKUPS && KVS_COMPRESSED_BACKUPS
+#error "Dumps are read a section at a time, compress text backups only"
+#endif
+
+/// Backups queued for the backup workers (see kvs_backup_start).
+static struct {
+  struct BackupTask *head;  // Oldest backup waiting for a worker.
+  struct BackupTask *tail;  // Newest backup waiting for a worker.
+  size_t pending;           // Backups queued or being written.
+  pthread_t *threads;       // Workers, NULL until the first backup.
+  size_t num_threads;       // Number of workers.
+  int stopping;             // Set to stop the workers once the queue empties.
+  pthread_mutex_t mutex;    // Protects the fields above.
+  pthread_cond_t queued;    // Signaled when a backup is queued, or on stop.
+  pthread_cond_t done;      // Signaled when a backup is written.
+} backup_state = {.mutex = PTHREAD_MUTEX_INITIALIZER,\
+  .queued = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+
+SlabPool client_data_pool = SLAB_POOL_INITIALIZER(sizeof(ClientData));
+
 
 AVL* get_avl_client(int session_id){
   return avl_sessions->avl_clients_node[session_id];
@@ -88,7 +157,7 @@ void clean_session_avl(int session_id){
     close(data->notif_pipe_fd);
     close(data->req_pipe_fd);
     close(data->resp_pipe_fd);
-    free(data);
+    slab_free(&client_data_pool, data);
   }
 
   reset_num_subs(session_id);
@@ -109,12 +178,49 @@ int remove_key_session_avl(int session_id, const char *key){
 }
 
 int kvs_init() {
+  Wal *wal = NULL;
+
   if (kvs_table != NULL) {
     fprintf(stderr, "KVS state has already been initialized\n");
     return -1;
   }
-  kvs_table = create_hash_table();
-  return kvs_table == NULL;
+  kvs_table = create_hash_table(KVS_LOCK_STRIPES);
+  if (kvs_table == NULL) return 1;
+  // Recovered before the log is opened, so replaying isn't logged again
+  if (KVS_WAL_PATH[0] != '\0' && (recover_from_log() ||\
+    (wal = wal_open(KVS_WAL_PATH, KVS_WAL_SYNC_MS)) == NULL)) {
+    fprintf(stderr, "Failed to open the log %s\n", KVS_WAL_PATH);
+    stop_ttl_thread();
+    free_table(kvs_table);
+    kvs_table = NULL;
+    return 1;
+  }
+  // Set with the table locked, recovered keys with a TTL may be expiring
+  if (wal != NULL) {
+    pthread_rwlock_wrlock_error_check(&kvs_table->rwl, NULL);
+    kvs_wal = wal;
+    // Recovered pairs over the budget go once their deletes are logged
+    if (KVS_MEMORY_BUDGET > 0) evict_over_budget();
+    pthread_rwlock_unlock(&kvs_table->rwl);
+  }
+  if (KVS_SHARDS > 0 && shard_engine_start(&shard_engine, KVS_SHARDS)) {
+    fprintf(stderr, "Failed to start the KVS shards\n");
+    if (kvs_wal != NULL) wal_close(kvs_wal);
+    kvs_wal = NULL;
+    free_table(kvs_table);
+    kvs_table = NULL;
+    return 1;
+  }
+  if (kvs_wal != NULL && KVS_CHECKPOINT_MS > 0 && start_checkpoint_thread()) {
+    fprintf(stderr, "Failed to start the checkpoints of the log\n");
+    shard_engine_stop(&shard_engine);
+    wal_close(kvs_wal);
+    kvs_wal = NULL;
+    free_table(kvs_table);
+    kvs_table = NULL;
+    return 1;
+  }
+  return 0;
 }
 
 
@@ -123,6 +229,15 @@ int kvs_terminate() {
     fprintf(stderr, "KVS state must be initialized\n");
     return -1;
   }
+  // Backups and owners may still be using the table
+  kvs_wait_backups();
+  stop_backup_workers();
+  stop_checkpoint_thread();
+  shard_engine_stop(&shard_engine);
+  stop_ttl_thread();
+  // Only closed once nothing else can change the table
+  if (kvs_wal != NULL) wal_close(kvs_wal);
+  kvs_wal = NULL;
   free_table(kvs_table);
   return 0;
 }
@@ -199,32 +314,341 @@ int hash_table_unlock(){
 }
 
 
-/// Activate lock to write of hash table's index list and checks if it gets any
-/// error, if an error ocurred reports it and won't execute the lock.
-/// @param index To get the corresponding list of that index in the hash table.
+/// Activate lock to write of a hash table's lock stripe and checks if it gets
+/// any error, if an error ocurred reports it and won't execute the lock.
+/// @param stripe Position of the stripe guarding the index lists to lock.
 /// @return 0 if executes successfully and 1 if it gets an error.
-int hash_table_list_wrlock(size_t index){
-  return pthread_rwlock_wrlock_error_check(&kvs_table->table[index]->rwl,\
-    &kvs_table->rwl);
+int hash_table_stripe_wrlock(size_t stripe){
+  return pthread_rwlock_wrlock_error_check(&kvs_table->stripes[stripe].rwl,\
+    NULL);
 }
 
 
-/// Activate lock to read of hash table's index list and checks if it gets any
-/// error, if an error ocurred reports it and won't execute the lock.
-/// @param index To get the corresponding list of that index in the hash table.
+/// Activate lock to read of a hash table's lock stripe and checks if it gets
+/// any error, if an error ocurred reports it and won't execute the lock.
+/// @param stripe Position of the stripe guarding the index lists to lock.
 /// @return 0 if executes successfully and 1 if it gets an error.
-int hash_table_list_rdlock(size_t index){
-  return pthread_rwlock_rdlock_error_check(&kvs_table->table[index]->rwl,\
-    &kvs_table->rwl);
+int hash_table_stripe_rdlock(size_t stripe){
+  return pthread_rwlock_rdlock_error_check(&kvs_table->stripes[stripe].rwl,\
+    NULL);
 }
 
 
-/// Desactivate lock (unlock) of hash table's index list and checks if it gets
-/// any error, if an error ocurred reports it and won't execute the unlock.
-/// @param index To get the corresponding list of that index in the hash table.
+/// Desactivate lock (unlock) of a hash table's lock stripe and checks if it
+/// gets any error, if an error ocurred reports it and won't execute the unlock.
+/// @param stripe Position of the stripe guarding the index lists to unlock.
 /// @return 0 if executes successfully and 1 if it gets an error.
-int hash_table_list_unlock(size_t index){
-  return pthread_rwlock_unlock(&kvs_table->table[index]->rwl);
+int hash_table_stripe_unlock(size_t stripe){
+  return pthread_rwlock_unlock(&kvs_table->stripes[stripe].rwl);
+}
+
+
+/// Unlocks the stripes of a mask whose position is lower than end.
+/// @param mask Stripes to unlock.
+/// @param end First stripe not to unlock.
+static void unlock_stripes_until(const StripeMask *mask, size_t end){
+  for (size_t word = 0; word * 64 < end; word++) {
+    uint64_t bits = mask->bits[word];
+
+    while (bits) {
+      size_t stripe = word * 64 + (size_t) __builtin_ctzll(bits);
+      if (stripe >= end) return;
+      hash_table_stripe_unlock(stripe);
+      bits &= bits - 1;
+    }
+  }
+}
+
+
+/// Locks the stripes of a mask. Stripes are taken in ascending order so
+/// concurrent operations never wait on each other in a cycle. The hash
+/// table's lock must be held to read.
+/// @param mask Stripes to lock.
+/// @param write 1 to lock the stripes to write, 0 to lock them to read.
+/// @return 0 if every stripe was locked, -1 otherwise (none stay locked).
+static int lock_stripe_mask(const StripeMask *mask, int write){
+  for (size_t word = 0; word < MAX_LOCK_STRIPES / 64; word++) {
+    uint64_t bits = mask->bits[word];
+
+    while (bits) {
+      size_t stripe = word * 64 + (size_t) __builtin_ctzll(bits);
+
+      if (write ? hash_table_stripe_wrlock(stripe) :\
+        hash_table_stripe_rdlock(stripe)){
+
+        unlock_stripes_until(mask, stripe);
+        return -1;
+      }
+      bits &= bits - 1;
+    }
+  }
+  return 0;
+}
+
+
+/// Adds the stripe guarding a key to a mask.
+/// @param mask The mask.
+/// @param key The key.
+static void stripe_mask_add(StripeMask *mask, const char *key){
+  size_t stripe = get_lock_stripe(kvs_table, key);
+
+  mask->bits[stripe / 64] |= (uint64_t) 1 << (stripe % 64);
+}
+
+
+/// Locks every stripe guarding one of the keys, as lock_stripe_mask does.
+/// The hash table's lock must be held to read.
+/// @param mask Filled with the stripes that were locked.
+/// @param num_pairs Number of keys.
+/// @param indexs Indexs of the keys to lock.
+/// @param keys Array of keys' strings.
+/// @param write 1 to lock the stripes to write, 0 to lock them to read.
+/// @return 0 if every stripe was locked, -1 otherwise (none stay locked).
+static int lock_stripes(StripeMask *mask, size_t num_pairs,\
+  const size_t *indexs, char keys[][MAX_STRING_SIZE], int write){
+
+  memset(mask, 0, sizeof(StripeMask));
+  for (size_t i = 0; i < num_pairs; i++)
+    stripe_mask_add(mask, keys[indexs[i]]);
+
+  return lock_stripe_mask(mask, write);
+}
+
+
+/// Unlocks the stripes locked by lock_stripes.
+/// @param mask Locked stripes.
+static void unlock_stripes(const StripeMask *mask){
+  unlock_stripes_until(mask, MAX_LOCK_STRIPES);
+}
+
+
+/// Checks if the hash table needs to grow and, if so, advances its
+/// incremental rehash. The hash table's lock must be held to read and is
+/// released by this function.
+static void hash_table_unlock_and_rehash(){
+  int needs_rehash = hash_table_needs_rehash(kvs_table);
+
+  hash_table_unlock();
+  if (!needs_rehash || hash_table_wrlock()) return;
+
+  if (hash_table_rehash_step(kvs_table))
+    fprintf(stderr, "Failed to grow the hash table\n");
+  hash_table_unlock();
+}
+
+
+/// Adds the record of a change to the records of an operation, if the KVS
+/// has a log.
+/// @param records Records of the operation.
+/// @param type WAL_WRITE or WAL_DELETE.
+/// @param key Key of the pair.
+/// @param value Value written, NULL for a delete.
+/// @param value_len Length of the value, 0 for a delete.
+/// @param expires_at Time the value expires (see timer_wheel_now), 0 if
+/// never (or for a delete).
+/// @return 0 on success (or without a log), -1 if the record couldn't be
+/// added.
+static int log_change(Buffer *records, uint8_t type, const char *key,\
+  const char *value, size_t value_len, uint64_t expires_at) {
+
+  if (kvs_wal == NULL) return 0;
+  // Logged as wall clock time, the monotonic clock starts over on a reboot
+  if (wal_encode(records, type, key, strnlen(key, MAX_STRING_SIZE), value,\
+    value_len, timer_wheel_to_wall_clock(expires_at))) {
+    fprintf(stderr, "Failed to log the change of %.*s\n", MAX_STRING_SIZE,\
+      key);
+    return -1;
+  }
+  return 0;
+}
+
+
+/// Appends the records of an operation to the log. Called with the stripes
+/// of its keys still locked, so the log has the changes of each key in the
+/// order they were made.
+/// @param records Records of the operation.
+/// @param end Where the position to wait for with wait_for_log is stored, 0
+/// if nothing was logged.
+/// @return 0 on success (or without a log), -1 if the records couldn't be
+/// appended.
+static int append_to_log(const Buffer *records, uint64_t *end) {
+  *end = 0;
+  if (kvs_wal == NULL || records->length == 0) return 0;
+  if (wal_append(kvs_wal, records, end)) {
+    fprintf(stderr, "Failed to append to the log\n");
+    *end = 0;
+    return -1;
+  }
+  return 0;
+}
+
+
+/// Waits until an operation's records are durable (see KVS_WAL_SYNC_MS),
+/// with no lock held so other operations join the same sync.
+/// @param end Position returned by append_to_log.
+/// @return 0 on success, -1 if the log couldn't be written.
+static int wait_for_log(uint64_t end) {
+  if (end == 0) return 0;
+  return wal_wait(kvs_wal, end);
+}
+
+
+/// Logs the delete of a pair about to be evicted, as expire_keys does.
+/// @param key Key of the pair.
+/// @param key_len Length of the key.
+/// @param arg Buffer for its record.
+/// @return 0 if it was logged, -1 otherwise (the pair is kept).
+static int log_eviction(const char *key, size_t key_len, void *arg) {
+  Buffer *records = arg;
+  uint64_t end;
+  int ret;
+
+  (void) key_len;
+  ret = log_change(records, WAL_DELETE, key, NULL, 0, 0) ||\
+    append_to_log(records, &end) ? -1 : 0;
+  records->length = 0;
+  return ret;
+}
+
+
+/// Evicts pairs until they fit in KVS_MEMORY_BUDGET, logging their deletes
+/// so a replay doesn't bring them back. The hash table's lock must be held
+/// and no stripe.
+static void evict_over_budget() {
+  Buffer records = BUFFER_INITIALIZER; // Log record of an eviction
+
+  evict_pairs(kvs_table, avl_sessions, KVS_MEMORY_BUDGET, log_eviction,\
+    &records);
+  buffer_free(&records);
+}
+
+
+/// Deletes the keys whose timers expired, notifying their subscribers.
+/// @param expired Expired timers.
+static void expire_keys(TimerEntry *expired) {
+  uint64_t now = timer_wheel_now();
+  Buffer records = BUFFER_INITIALIZER; // Log records of an expiry
+  uint64_t log_end;         // Not waited for, nobody waits for an expiry
+
+  for (TimerEntry *entry = expired; entry != NULL; entry = entry->next) {
+    size_t stripe;
+    int result;
+
+    if (hash_table_rdlock()) continue;
+    stripe = get_lock_stripe(kvs_table, entry->key);
+    if (hash_table_stripe_wrlock(stripe)) {
+      hash_table_unlock();
+      continue;
+    }
+    result = expire_pair(kvs_table, avl_sessions, entry->key, now);
+    // Logged so a replay doesn't bring the key back (if that fails, the
+    // replay still drops it, its expiry time is logged)
+    if (result == 0 &&\
+      log_change(&records, WAL_DELETE, entry->key, NULL, 0, 0) == 0)
+      append_to_log(&records, &log_end);
+    // Still there, tried again on the next tick
+    if (result == -2 && timer_wheel_add(ttl_state.wheel, entry->key,\
+      now + TIMER_WHEEL_TICK_MS))
+      fprintf(stderr, "Failed to set the timer of %.*s\n", MAX_STRING_SIZE,\
+        entry->key);
+    records.length = 0;
+    hash_table_stripe_unlock(stripe);
+    hash_table_unlock_and_rehash();
+  }
+  free_timer_entries(expired);
+  buffer_free(&records);
+}
+
+
+/// Thread that advances the timer wheel every tick and expires the keys.
+/// @param arg Not used.
+/// @return NULL.
+static void* ttl_thread(void *arg) {
+  (void) arg;
+
+  pthread_mutex_lock(&ttl_state.mutex);
+  while (ttl_state.running) {
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += TIMER_WHEEL_TICK_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&ttl_state.wake, &ttl_state.mutex, &deadline);
+    pthread_mutex_unlock(&ttl_state.mutex);
+
+    expire_keys(timer_wheel_advance(ttl_state.wheel));
+
+    pthread_mutex_lock(&ttl_state.mutex);
+  }
+  pthread_mutex_unlock(&ttl_state.mutex);
+  return NULL;
+}
+
+
+/// Starts the TTL thread and its timer wheel, if not started yet.
+/// @return 0 if they are running, -1 otherwise.
+static int start_ttl_thread() {
+  pthread_condattr_t attr;
+  int ret = 0;
+
+  pthread_mutex_lock(&ttl_state.mutex);
+  if (ttl_state.wheel != NULL) {
+    pthread_mutex_unlock(&ttl_state.mutex);
+    return 0;
+  }
+
+  if ((ttl_state.wheel = create_timer_wheel()) == NULL) {
+    pthread_mutex_unlock(&ttl_state.mutex);
+    return -1;
+  }
+  // Ticks are measured in monotonic time, as the timers
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&ttl_state.wake, &attr);
+  pthread_condattr_destroy(&attr);
+
+  ttl_state.running = 1;
+  ttl_state.pid = getpid();
+  if (pthread_create(&ttl_state.thread, NULL, ttl_thread, NULL)) {
+    pthread_cond_destroy(&ttl_state.wake);
+    free_timer_wheel(ttl_state.wheel);
+    ttl_state.wheel = NULL;
+    ttl_state.running = 0;
+    ret = -1;
+  }
+  pthread_mutex_unlock(&ttl_state.mutex);
+  return ret;
+}
+
+
+/// Stops the TTL thread and frees the timers left. In a forked child (where
+/// the thread doesn't exist) only frees the timers.
+static void stop_ttl_thread() {
+  if (ttl_state.wheel == NULL) return;
+
+  if (ttl_state.pid == getpid()) {
+    pthread_mutex_lock(&ttl_state.mutex);
+    ttl_state.running = 0;
+    pthread_cond_signal(&ttl_state.wake);
+    pthread_mutex_unlock(&ttl_state.mutex);
+    pthread_join(ttl_state.thread, NULL);
+    pthread_cond_destroy(&ttl_state.wake);
+  }
+  free_timer_wheel(ttl_state.wheel);
+  ttl_state.wheel = NULL;
+}
+
+
+/// Sets the timer of a pair loaded with an expiry time (by a restore or a
+/// replay of the log), starting the TTL thread if it isn't running.
+/// @param key Key of the pair.
+/// @param expires_at Time the pair expires (see timer_wheel_now).
+static void set_loaded_timer(const char *key, uint64_t expires_at) {
+  if (start_ttl_thread() || timer_wheel_add(ttl_state.wheel, key, expires_at))
+    fprintf(stderr, "Failed to set the TTL of %s\n", key);
 }
 
 
@@ -259,6 +683,37 @@ int write_error_check(int fd, char *buffer) {
 }
 
 
+/// Tries to write every buffer of iov to fd received (with a single writev
+/// unless it is interrupted or partial) and checks errors.
+/// @param fd File descriptor to write the output.
+/// @param iov Buffers to write, modified while the write progresses.
+/// @param iovcnt Number of buffers in iov.
+/// @return 0 if the write was successful, -1 otherwise.
+int writev_error_check(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t written = writev(fd, iov, iovcnt);
+
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      write_error_check(STDERR_FILENO, "Failed to write to .out file\n");
+      return -1;
+    }
+
+    // Skip what was written, a partial write resumes in the middle of a buffer
+    while (iovcnt > 0 && (size_t) written >= iov->iov_len) {
+      written -= (ssize_t) iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + written;
+      iov->iov_len -= (size_t) written;
+    }
+  }
+  return 0;
+}
+
+
 /// A variation of insertion sort that sorts an index list based on it's keys.
 /// @param indexs List of indexs to be sorted.
 /// @param num_pairs Amount of indexs that need to be sorted by their key.
@@ -281,15 +736,233 @@ void insertion_sort(size_t *indexs, size_t num_pairs,\
 }
 
 
+/// Keys of a WRITE, CAS or DELETE, with their values and results.
+typedef struct KvsBatch {
+  char (*keys)[MAX_STRING_SIZE];     // Array of keys' strings.
+  ValueList *values;                 // Values of the pairs, or NULL.
+  uint64_t *versions;                // Versions expected by a CAS, or NULL.
+  char *failed;                      // Keys a CAS or DELETE didn't change.
+  uint64_t expires_at;               // Expiry time of a WRITE_TTL, or 0.
+} KvsBatch;
+
+
+/// Writes pairs to the hash table and notifies the keys' subscribers. A CAS
+/// only writes the keys whose version is the expected one and leaves the
+/// resulting (or current) version in versions. The stripes of the keys must
+/// be locked to write.
+/// @param num_pairs Number of pairs to write.
+/// @param indexs Indexs of the pairs to write.
+/// @param batch Pairs of the WRITE or CAS.
+/// @param timestamp Commit timestamp of the writes.
+/// @param records Where the log records of the writes are added.
+/// @return 0 on success, -1 if a write couldn't be logged.
+static int write_pairs(size_t num_pairs, const size_t *indexs,\
+  KvsBatch *batch, uint64_t timestamp, Buffer *records) {
+  int ret = 0;
+
+  for(size_t ind = 0; ind < num_pairs; ind++) {
+    size_t indexNodes = indexs[ind]; // index of the node to write
+    char *key = batch->keys[indexNodes];
+    const char *value = value_list_get(batch->values, indexNodes);
+    size_t value_len = batch->values->lengths[indexNodes];
+    int result;
+
+    // Try to write the key value pair to the hash table
+    if (batch->versions == NULL)
+      result = write_pair(kvs_table, key, value, value_len,\
+        batch->expires_at, timestamp, NULL);
+    else
+      result = cas_pair(kvs_table, key, value, value_len, timestamp,\
+        &batch->versions[indexNodes]);
+
+    if (result == -1)
+      fprintf(stderr, "Failed to write keypair (%s,%zu bytes)\n", key,\
+        value_len);
+    if (result == 0 && log_change(records, WAL_WRITE, key, value,\
+      value_len, batch->expires_at))
+      ret = -1;
+    if (result != 0 && batch->failed != NULL) batch->failed[indexNodes] = 1;
+  }
+  return ret;
+}
+
+
+/// Deletes pairs from the hash table and notifies the keys' subscribers. The
+/// stripes of the keys must be locked to write.
+/// @param num_pairs Number of pairs to delete.
+/// @param indexs Indexs of the keys to delete.
+/// @param batch Keys of the DELETE, the ones not found are set in failed.
+/// @param timestamp Commit timestamp of the deletes.
+/// @param records Where the log records of the deletes are added.
+/// @return 0 on success, -1 if a key found couldn't be deleted or its delete
+/// couldn't be logged.
+static int delete_pairs(size_t num_pairs, const size_t *indexs,\
+  KvsBatch *batch, uint64_t timestamp, Buffer *records) {
+  int ret = 0;
+
+  for (size_t i = 0; i < num_pairs; i++) {
+    size_t indexNodes = indexs[i];
+    int result = delete_pair(kvs_table, avl_sessions,\
+      batch->keys[indexNodes], timestamp);
+
+    if (result == -2) {
+      fprintf(stderr, "Failed to delete the pair of %.*s\n",\
+        MAX_STRING_SIZE, batch->keys[indexNodes]);
+      ret = -1;
+    } else if (result == -1)
+      batch->failed[indexNodes] = 1;
+    else if (log_change(records, WAL_DELETE, batch->keys[indexNodes], NULL,\
+      0, 0))
+      ret = -1;
+  }
+  return ret;
+}
+
+
+/// Writes (values not NULL) or deletes pairs with their stripes locked.
+/// With a log, returns once the changes are durable.
+/// @param num_pairs Number of pairs.
+/// @param indexs Indexs of the pairs, sorted by key.
+/// @param batch Pairs of the WRITE, CAS or DELETE.
+/// @return 0 if the pairs were written or deleted, -1 otherwise.
+static int modify_pairs(size_t num_pairs, const size_t *indexs,\
+  KvsBatch *batch) {
+
+  StripeMask stripes;       // Lock stripes held by this operation
+  uint64_t timestamp;       // Shared by the pairs, snapshots see all or none
+  Buffer records = BUFFER_INITIALIZER; // Log records of the changes
+  uint64_t log_end;         // Position of the records in the log
+  int ret;
+
+  if (hash_table_rdlock()) return -1;
+
+  if (lock_stripes(&stripes, num_pairs, indexs, batch->keys, 1)) {
+    hash_table_unlock();
+    return -1;
+  }
+
+  timestamp = next_commit_timestamp(kvs_table);
+  if (batch->values != NULL)
+    ret = write_pairs(num_pairs, indexs, batch, timestamp, &records);
+  else ret = delete_pairs(num_pairs, indexs, batch, timestamp, &records);
+  // A change missing from the log isn't durable, the operation fails
+  if (append_to_log(&records, &log_end)) ret = -1;
+
+  // Unlock the hash table's stripes that have been locked
+  unlock_stripes(&stripes);
+
+  // Make room for what was written, as a bounded cache
+  if (KVS_MEMORY_BUDGET > 0 && batch->values != NULL)
+    evict_over_budget();
+
+  hash_table_unlock_and_rehash();
+  buffer_free(&records);
+  if (wait_for_log(log_end)) ret = -1;
+  return ret;
+}
+
+
+/// Part of a WRITE, CAS or DELETE run by the owner of one shard.
+typedef struct KvsShardTask {
+  ShardTask task;                    // Task of the shard (must be first).
+  size_t num_pairs;                  // Number of pairs in the shard.
+  size_t *indexs;                    // Indexs of the shard's pairs.
+  KvsBatch *batch;                   // Pairs of the whole operation.
+  int result;                        // Result of modify_pairs.
+} KvsShardTask;
+
+
+/// Runs the part of a WRITE, CAS or DELETE of a shard, in the shard's owner.
+/// @param task The KvsShardTask.
+static void run_shard_task(ShardTask *task) {
+  KvsShardTask *kvs_task = (KvsShardTask*) task;
+
+  kvs_task->result = modify_pairs(kvs_task->num_pairs, kvs_task->indexs,\
+    kvs_task->batch);
+}
+
+
+/// Splits a WRITE, CAS or DELETE by shard and waits for the shards' owners to
+/// run each part. Without shards (or free producer queues) runs it right away.
+/// Each part takes its commit timestamp once its stripes are locked (one
+/// taken before could be overtaken by a later write to the same key), no
+/// snapshot is cut until every part ran, so snapshots see all or none.
+/// @param num_pairs Number of pairs.
+/// @param indexs Indexs of the pairs, sorted by key.
+/// @param batch Pairs of the WRITE, CAS or DELETE.
+/// @return 0 if the pairs were written or deleted, -1 otherwise.
+static int modify_pairs_by_shard(size_t num_pairs, size_t *indexs,\
+  KvsBatch *batch) {
+
+  size_t num_shards = shard_engine.num_shards;
+  KvsShardTask *tasks;
+  size_t *shard_indexs, *pair_shards, num_tasks = 0;
+  ShardBatch shard_batch;
+  int ret = 0;
+
+  if (num_shards == 0 || !shard_can_submit(&shard_engine))
+    return modify_pairs(num_pairs, indexs, batch);
+
+  tasks = calloc(num_shards, sizeof(KvsShardTask));
+  shard_indexs = malloc(num_pairs * sizeof(size_t));
+  pair_shards = malloc(num_pairs * sizeof(size_t));
+  if (tasks == NULL || shard_indexs == NULL || pair_shards == NULL) {
+    free(tasks);
+    free(shard_indexs);
+    free(pair_shards);
+    return modify_pairs(num_pairs, indexs, batch);
+  }
+
+  // Count the pairs of each shard
+  for (size_t i = 0; i < num_pairs; i++) {
+    pair_shards[i] = get_lock_stripe(kvs_table, batch->keys[indexs[i]]) %\
+      num_shards;
+    if (tasks[pair_shards[i]].num_pairs++ == 0) num_tasks++;
+  }
+  // Give each shard its slice of shard_indexs, keeping the keys sorted
+  for (size_t shard = 0, start = 0; shard < num_shards; shard++) {
+    tasks[shard].indexs = shard_indexs + start;
+    start += tasks[shard].num_pairs;
+    tasks[shard].num_pairs = 0;
+  }
+  for (size_t i = 0; i < num_pairs; i++) {
+    KvsShardTask *task = &tasks[pair_shards[i]];
+    task->indexs[task->num_pairs++] = indexs[i];
+  }
+
+  if (shard_batch_init(&shard_batch, num_tasks)) {
+    free(tasks);
+    free(shard_indexs);
+    free(pair_shards);
+    return modify_pairs(num_pairs, indexs, batch);
+  }
+  split_batch_begin(kvs_table);
+  for (size_t shard = 0; shard < num_shards; shard++) {
+    if (tasks[shard].num_pairs == 0) continue;
+    tasks[shard].task.run = run_shard_task;
+    tasks[shard].task.batch = &shard_batch;
+    tasks[shard].batch = batch;
+    shard_submit(&shard_engine, shard, &tasks[shard].task);
+  }
+  shard_batch_wait(&shard_batch);
+  split_batch_end(kvs_table);
+
+  for (size_t shard = 0; shard < num_shards; shard++)
+    if (tasks[shard].result) ret = -1;
+
+  free(tasks);
+  free(shard_indexs);
+  free(pair_shards);
+  return ret;
+}
+
+
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], \
-  char values[][MAX_STRING_SIZE]) {
+  ValueList *values, unsigned int ttl_ms) {
 
-  int is_locked[26] = {0};  // To indicate which indices are lock
-  int error = 0;
   size_t *indexs;           // index of each par
-
-  char notif_message[MAX_STRING_SIZE * 2 + 2];
-  char *aux_message;
+  size_t num_writes = 0;    // Number of pairs left after removing repeats
+  int ret;
 
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
@@ -304,17 +977,10 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], \
 
   for (size_t i = 0; i < num_pairs; i++) indexs[i] = i;
 
-  if (hash_table_rdlock()){
-    free(indexs);
-    return -1;
-  }
-
-
   insertion_sort(indexs, num_pairs, keys); // Sort the indexs based on the keys
   // Iterate over the pairs
   for (size_t ind = 0; ind < num_pairs; ind++) {
     size_t indexNodes = indexs[ind]; // index of the node to write
-    size_t indexList = (size_t) hash(keys[indexNodes]);
 
     if(ind < num_pairs - 1 && !strcmp(keys[indexNodes], keys[indexs[ind + 1]])){
 
@@ -322,56 +988,136 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], \
       if (indexNodes > indexs[ind + 1])
         indexs[ind+1] = indexNodes;
 
-      indexs[ind] = num_pairs;
+      continue;
     }
+    indexs[num_writes++] = indexNodes;
+  }
 
-    if (is_locked[indexList] == 0){
-      if (hash_table_list_wrlock(indexList)) continue;
+  KvsBatch batch = {keys, values, NULL, NULL, 0};
 
-      is_locked[indexList] = 1;
+  if (ttl_ms > 0) {
+    if (start_ttl_thread()) {
+      fprintf(stderr, "Failed to start the TTL thread\n");
+      free(indexs);
+      return -1;
     }
+    batch.expires_at = timer_wheel_now() + ttl_ms;
   }
 
-  for(size_t ind = 0; ind < num_pairs; ind++) {
-    size_t indexNodes = indexs[ind]; // index of the node to write
+  ret = modify_pairs_by_shard(num_writes, indexs, &batch);
+
+  // The timers are only set once the keys exist, so none fires too early
+  for (size_t i = 0; ret == 0 && ttl_ms > 0 && i < num_writes; i++) {
+    if (timer_wheel_add(ttl_state.wheel, keys[indexs[i]], batch.expires_at))
+      fprintf(stderr, "Failed to set the TTL of %s\n", keys[indexs[i]]);
+  }
+  free(indexs);
+  return ret;
+}
 
-    if (indexNodes == num_pairs) continue; // skip same key with with low ind
 
-    aux_message = notif_message;
-    strncpy(aux_message, keys[indexNodes], MAX_STRING_SIZE + 1);
 
-    aux_message += MAX_STRING_SIZE + 1;
-    strncpy(aux_message, values[indexNodes], MAX_STRING_SIZE + 1);
+/// Writes the decimal digits of a version (not null terminated).
+/// @param buffer Where the digits are written (at least 20 bytes).
+/// @param version The version.
+/// @return Number of digits written.
+static size_t format_version(char *buffer, uint64_t version) {
+  char digits[20];
+  size_t len = 0;
 
-    // Try to write the key value pair to the hash table
-    if ((error = write_pair(kvs_table, keys[indexNodes], values[indexNodes], notif_message)) == -1) {
-      fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[indexNodes],\
-        values[indexNodes]);
+  do {
+    digits[len++] = (char) ('0' + version % 10);
+    version /= 10;
+  } while (version > 0);
+
+  for (size_t i = 0; i < len; i++) buffer[i] = digits[len - 1 - i];
+  return len;
+}
+
+
+int kvs_cas(int fd, size_t num_pairs, char keys[][MAX_STRING_SIZE],\
+  uint64_t versions[], ValueList *values) {
+
+  struct iovec iov[3];      // "[", the results and "]\n"
+  char *buffer, *cursor;    // Buffer with the result of every pair
+  size_t *indexs;           // index of each par
+  char *failed;             // Pairs whose version didn't match
+  int ret;
+
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return -1;
+  }
+
+  indexs = malloc(num_pairs * sizeof(size_t));
+  failed = calloc(num_pairs, sizeof(char));
+  // Each result takes at most "(" key ",KVSMISMATCH," version ")"
+  buffer = malloc(num_pairs * (MAX_STRING_SIZE + 35));
+  if (indexs == NULL || failed == NULL || buffer == NULL) {
+    fprintf(stderr, "Failed to allocate memory for indexs\n");
+    free(indexs);
+    free(failed);
+    free(buffer);
+    return -1;
+  }
+
+  for (size_t i = 0; i < num_pairs; i++) indexs[i] = i;
+
+  // The sort is stable, repeated keys are swapped in the order given
+  insertion_sort(indexs, num_pairs, keys);
+
+  KvsBatch batch = {keys, values, versions, failed, 0};
+
+  if (modify_pairs_by_shard(num_pairs, indexs, &batch)) {
+    free(indexs);
+    free(failed);
+    free(buffer);
+    return -1;
+  }
+
+  cursor = buffer;
+  for (size_t i = 0; i < num_pairs; i++) {
+    size_t index = indexs[i];
+    size_t key_len = strnlen(keys[index], MAX_STRING_SIZE);
+
+    *cursor++ = '(';
+    memcpy(cursor, keys[index], key_len);
+    cursor += key_len;
+    if (failed[index]) {
+      memcpy(cursor, ",KVSMISMATCH", 12);
+      cursor += 12;
     }
+    *cursor++ = ',';
+    cursor += format_version(cursor, versions[index]);
+    *cursor++ = ')';
   }
-  // Unlock the hash table's index list that have been locked
-  for (size_t ind = 0; ind < 26; ind++)
-    if (is_locked[ind]) hash_table_list_unlock(ind);
 
-  hash_table_unlock();
+  iov[0].iov_base = "[";
+  iov[0].iov_len = 1;
+  iov[1].iov_base = buffer;
+  iov[1].iov_len = (size_t) (cursor - buffer);
+  iov[2].iov_base = "]\n";
+  iov[2].iov_len = 2;
+  ret = writev_error_check(fd, iov, 3);
+
   free(indexs);
-  return 0;
+  free(failed);
+  free(buffer);
+  return ret;
 }
 
 
-
-int kvs_read(int fd, size_t num_pairs, char keys[][MAX_STRING_SIZE]) {
-  int is_locked[26] = {0};      // To indicate which indices are lock
-  char buffer[MAX_WRITE_SIZE];  // Buffer to store the read content
+int kvs_read(int fd, size_t num_pairs, char keys[][MAX_STRING_SIZE],\
+  int with_versions) {
+  struct iovec iov[3];          // "[", the pairs and "]\n"
+  Buffer output = BUFFER_INITIALIZER; // Every read pair
   size_t *indexs;               // index of each par
+  int ret = 0;
 
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return -1;
   }
-  if (write_error_check(fd, "[") == -1) {
-      return -1;
-  }
   indexs = malloc(num_pairs * sizeof(size_t));
   if (indexs == NULL) {
     fprintf(stderr, "Failed to allocate memory for indexs\n");
@@ -381,77 +1127,78 @@ int kvs_read(int fd, size_t num_pairs, char keys[][MAX_STRING_SIZE]) {
   for (size_t i = 0; i < num_pairs; i++) indexs[i] = i;
 
   insertion_sort(indexs, num_pairs, keys); // Sort the indexs based on the keys
-  // Iterate over the pairs
-  for (size_t i = 0; i < num_pairs; i++) {
+
+  // No locks are taken, read_pair walks the lists optimistically and copies
+  // each value straight into the output buffer
+  for (size_t i = 0; i < num_pairs && ret == 0; i++) {
     size_t index = indexs[i]; // index of the node to read
-    size_t indexList = (size_t) hash(keys[index]);
+    size_t key_len = strnlen(keys[index], MAX_STRING_SIZE);
+    uint64_t version;
 
-    if (is_locked[indexList] == 0){
-      if (hash_table_list_rdlock(indexList)) continue;
-      is_locked[indexList] = 1;
+    // Room for "(" key "," and the ",version)" that may follow the value
+    if (buffer_reserve(&output, key_len + 24)) {
+      ret = -1;
+      break;
     }
-  }
+    output.data[output.length++] = '(';
+    memcpy(output.data + output.length, keys[index], key_len);
+    output.length += key_len;
+    output.data[output.length++] = ',';
 
-  for (size_t i = 0; i < num_pairs; i++) {
-    size_t index = indexs[i]; // index of the node to read
     // Try to read the key value pair from the hash table
-    char* result = read_pair(kvs_table, keys[index]);
-    if (result == NULL) {
-      snprintf(buffer, MAX_WRITE_SIZE, "(%s,KVSERROR)", keys[index]);
-      if (write_error_check(fd, buffer) == -1) {
-        free(indexs);
-
-        // Unlock the hash table's index list that have been locked
-        for (size_t ind = 0; ind < 26; ind++)
-          if (is_locked[ind]) hash_table_list_unlock(ind);
-        return -1;
-      }
-    } else {
-      snprintf(buffer, MAX_WRITE_SIZE, "(%s,%s)", keys[index], result);
-      if (write_error_check(fd, buffer) == -1) {
-        free(indexs);
-
-        // Unlock the hash table's index list that have been locked
-        for (size_t ind = 0; ind < 26; ind++)
-          if (is_locked[ind]) hash_table_list_unlock(ind);
-        return -1;
-      }
+    if (read_pair(kvs_table, keys[index], &output, &version) < 0) {
+      ret = buffer_append(&output, "KVSERROR)", 9);
+      continue;
+    }
+    if (buffer_reserve(&output, 22)) {
+      ret = -1;
+      break;
     }
-    free(result);
+    if (with_versions) {
+      output.data[output.length++] = ',';
+      output.length += format_version(output.data + output.length, version);
+    }
+    output.data[output.length++] = ')';
   }
-  if (write_error_check(fd, "]\n") == -1) {
-    free(indexs);
-    // Unlock the hash table's index list that have been locked
-    for (size_t ind = 0; ind < 26; ind++)
-      if (is_locked[ind]) hash_table_list_unlock(ind);
-    return -1;
+
+  if (ret) {
+    fprintf(stderr, "Failed to allocate memory for the read values\n");
+  } else {
+    iov[0].iov_base = "[";
+    iov[0].iov_len = 1;
+    iov[1].iov_base = output.data;
+    iov[1].iov_len = output.length;
+    iov[2].iov_base = "]\n";
+    iov[2].iov_len = 2;
+    ret = writev_error_check(fd, iov, 3);
   }
+
   free(indexs);
-  // Unlock the hash table's index list that have been locked
-  for (size_t ind = 0; ind < 26; ind++)
-    if (is_locked[ind]) hash_table_list_unlock(ind);
-  return 0;
+  buffer_free(&output);
+  return ret;
 }
 
 
 int kvs_delete(int fd, size_t num_pairs, char keys[][MAX_STRING_SIZE]) {
-  int is_locked[26] = {0}; // To indicate witch indices have been locked
   size_t *indexs;          // index of each par
+  size_t *deletes;         // Indexs of the keys that may exist
+  size_t num_deletes = 0;  // Number of keys that may exist
+  char *missing;           // Keys that weren't found
   int aux = 0;
   int ret = 0;
 
-  char notif_message[MAX_STRING_SIZE * 2 + 2] = {0};
-  char *aux_message;
-
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return -1;
   }
 
-  indexs = malloc(num_pairs * sizeof(size_t));
+  indexs = malloc(2 * num_pairs * sizeof(size_t));
+  missing = calloc(num_pairs, sizeof(char));
   // Check if the memory was allocated successfully
-  if (indexs == NULL) {
+  if (indexs == NULL || missing == NULL) {
     fprintf(stderr, "Failed to allocate memory for indexs\n");
+    free(indexs);
+    free(missing);
     return -1;
   }
 
@@ -460,34 +1207,32 @@ int kvs_delete(int fd, size_t num_pairs, char keys[][MAX_STRING_SIZE]) {
     indexs[i] = i;
   }
 
-  // Lock the hash table for reading
-  if (hash_table_rdlock()) return -1;
-
   // Sort the indexs based on the keys
   insertion_sort(indexs, num_pairs, keys);
   char buffer[MAX_WRITE_SIZE];
-  for (size_t i = 0; i < num_pairs; i++) {
-    size_t indexNodes = indexs[i];
-    size_t indexList = (size_t) hash(keys[indexNodes]);
-
-    if (is_locked[indexList] == 0){
-      // Lock the index list for writing
-      if (hash_table_list_wrlock(indexList)) continue;
 
-      is_locked[indexList] = 1;
-    }
-  }
+  KvsBatch batch = {keys, NULL, NULL, missing, 0};
 
+  // Keys the Bloom filters rule out are missing, their stripes aren't locked
+  deletes = indexs + num_pairs;
   for (size_t i = 0; i < num_pairs; i++) {
-    size_t indexNodes = indexs[i];
+    if (pair_may_exist(kvs_table, keys[indexs[i]]))
+      deletes[num_deletes++] = indexs[i];
+    else
+      missing[indexs[i]] = 1;
+  }
 
-    aux_message = notif_message;
-    strncpy(aux_message, keys[indexNodes], MAX_STRING_SIZE + 1);
+  if (num_deletes > 0 &&\
+    modify_pairs_by_shard(num_deletes, deletes, &batch)) {
+    free(indexs);
+    free(missing);
+    return -1;
+  }
 
-    aux_message += MAX_STRING_SIZE + 1;
-    strncpy(aux_message, "DELETED", MAX_STRING_SIZE + 1);
+  for (size_t i = 0; i < num_pairs; i++) {
+    size_t indexNodes = indexs[i];
 
-    if (delete_pair(kvs_table, avl_sessions, keys[indexNodes], notif_message) != 0) {
+    if (missing[indexNodes]) {
       snprintf(buffer, MAX_WRITE_SIZE, "(%s,KVSMISSING)", keys[indexNodes]);
       if (!aux) {
         if (write_error_check(fd, "[") == -1){
@@ -506,127 +1251,1628 @@ int kvs_delete(int fd, size_t num_pairs, char keys[][MAX_STRING_SIZE]) {
     if (write_error_check(fd, "]\n") == -1) ret = -1;
   }
 
-  // Unlock the hash table's index list that have been locked
-  for (size_t ind = 0; ind < 26; ind++)
-    if (is_locked[ind]) hash_table_list_unlock(ind);
-
-  hash_table_unlock();
   free(indexs);
+  free(missing);
   return ret;
 }
 
 
-int kvs_show(int fd) {
+/// Appends a pair visited by a scan to its output.
+/// @param key Key of the pair.
+/// @param key_len Length of the key.
+/// @param value Value of the pair.
+/// @param value_len Length of the value.
+/// @param expires_at Time the pair expires (unused).
+/// @param arg The scan's output Buffer.
+/// @return 0 on success, -1 if the output couldn't grow.
+int append_scanned_pair(const char *key, size_t key_len, const char *value,\
+  size_t value_len, uint64_t expires_at, void *arg) {
+  Buffer *output = arg;
+  size_t needed = key_len + value_len + 3;
+  char *cursor;
+
+  (void) expires_at;
+  if (buffer_reserve(output, needed)) return -1;
+
+  cursor = output->data + output->length;
+  *cursor++ = '(';
+  memcpy(cursor, key, key_len);
+  cursor += key_len;
+  *cursor++ = ',';
+  memcpy(cursor, value, value_len);
+  cursor += value_len;
+  *cursor++ = ')';
+  output->length += needed;
+  return 0;
+}
+
+
+/// Kind of a command of a transaction.
+typedef enum TxnCommandType {
+  TXN_READ,                          // READ.
+  TXN_WRITE,                         // WRITE.
+  TXN_DELETE                         // DELETE.
+} TxnCommandType;
+
+
+/// Command of a transaction.
+typedef struct TxnCommand {
+  TxnCommandType type;               // Kind of command.
+  size_t first_key;                  // Position of its first TxnKey.
+  size_t num_keys;                   // Number of keys.
+} TxnCommand;
+
+
+/// Key of a command of a transaction.
+typedef struct TxnKey {
+  char key[MAX_STRING_SIZE];         // The key.
+  size_t value_offset;               // Position of a write's value.
+  size_t value_len;                  // Length of a write's value.
+} TxnKey;
+
+
+/// Key used by a COMMIT, with what its commands did to it.
+typedef struct TxnEntry {
+  const char *key;                   // The key.
+  uint64_t read_version;             // Version first read, 0 if missing.
+  int read;                          // 1 if the key was read from the KVS.
+  int written;                       // 1 if the key is written or deleted.
+  const TxnKey *write;               // Last write of the key, NULL if deleted.
+} TxnEntry;
+
+
+/// Adds a command to a transaction.
+/// @param txn The transaction.
+/// @param type Kind of command.
+/// @param num_pairs Number of keys.
+/// @param keys Array of keys' strings.
+/// @param values Values of a WRITE, NULL for the other commands.
+/// @return 0 if the command was added, -1 otherwise (the transaction is left
+/// as it was).
+static int txn_add(KvsTransaction *txn, TxnCommandType type,\
+  size_t num_pairs, char keys[][MAX_STRING_SIZE], ValueList *values) {
+
+  TxnCommand command = {type, txn->keys.length / sizeof(TxnKey), num_pairs};
+  size_t keys_length = txn->keys.length;
+  size_t values_length = txn->values.length;
+  size_t *indexs = malloc(num_pairs * sizeof(size_t));
+
+  // The values are never NULL, even if every one is empty
+  if (indexs == NULL || buffer_reserve(&txn->values, 1)) {
+    fprintf(stderr, "Failed to allocate memory for the transaction\n");
+    free(indexs);
+    return -1;
+  }
+
+  for (size_t i = 0; i < num_pairs; i++) indexs[i] = i;
+  // Reads and deletes write their keys sorted, as kvs_read and kvs_delete,
+  // writes keep their order so the last write of a key wins
+  if (type != TXN_WRITE) insertion_sort(indexs, num_pairs, keys);
+
+  for (size_t i = 0; i < num_pairs; i++) {
+    TxnKey txn_key = {.value_offset = txn->values.length};
+    size_t index = indexs[i];
+
+    memcpy(txn_key.key, keys[index], MAX_STRING_SIZE);
+    if (values != NULL) {
+      txn_key.value_len = values->lengths[index];
+      if (buffer_append(&txn->values, value_list_get(values, index),\
+        txn_key.value_len)) break;
+    }
+    if (buffer_append(&txn->keys, &txn_key, sizeof(TxnKey))) break;
+  }
+
+  free(indexs);
+  if (txn->keys.length != keys_length + num_pairs * sizeof(TxnKey) ||\
+    buffer_append(&txn->commands, &command, sizeof(TxnCommand))) {
+
+    fprintf(stderr, "Failed to allocate memory for the transaction\n");
+    txn->keys.length = keys_length;
+    txn->values.length = values_length;
+    return -1;
+  }
+  return 0;
+}
+
+
+int kvs_txn_write(KvsTransaction *txn, size_t num_pairs,\
+  char keys[][MAX_STRING_SIZE], ValueList *values) {
+  return txn_add(txn, TXN_WRITE, num_pairs, keys, values);
+}
+
+
+int kvs_txn_read(KvsTransaction *txn, size_t num_pairs,\
+  char keys[][MAX_STRING_SIZE]) {
+  return txn_add(txn, TXN_READ, num_pairs, keys, NULL);
+}
+
+
+int kvs_txn_delete(KvsTransaction *txn, size_t num_pairs,\
+  char keys[][MAX_STRING_SIZE]) {
+  return txn_add(txn, TXN_DELETE, num_pairs, keys, NULL);
+}
+
+
+void kvs_txn_clear(KvsTransaction *txn) {
+  txn->commands.length = 0;
+  txn->keys.length = 0;
+  txn->values.length = 0;
+}
+
+
+void kvs_txn_free(KvsTransaction *txn) {
+  buffer_free(&txn->commands);
+  buffer_free(&txn->keys);
+  buffer_free(&txn->values);
+}
+
+
+/// Compares two keys of a transaction, for qsort and bsearch.
+/// @param a Pointer to the first key.
+/// @param b Pointer to the second key.
+/// @return Negative, 0 or positive as the first key is smaller, equal or
+/// greater than the second.
+static int compare_txn_keys(const void *a, const void *b) {
+  return strncmp(*(const char * const *) a, *(const char * const *) b,\
+    MAX_STRING_SIZE);
+}
 
-  if (hash_table_wrlock()) return -1;
 
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    char buffer[MAX_WRITE_SIZE]; // Buffer to store the show content
-    IndexList *indexList = kvs_table->table[i]; // Get the index list
+/// Appends "(key," to an output.
+/// @param output The output.
+/// @param key The key.
+/// @return 0 on success, -1 if the output couldn't grow.
+static int txn_append_key(Buffer *output, const char *key) {
+  return buffer_append(output, "(", 1) ||\
+    buffer_append(output, key, strnlen(key, MAX_STRING_SIZE)) ||\
+    buffer_append(output, ",", 1) ? -1 : 0;
+}
+
+
+/// Records the version a COMMIT saw of a key, only the first read of each
+/// key is validated (a later one that saw a newer version fails it).
+/// @param entry Entry of the key.
+/// @param found 1 if the key was found.
+/// @param version Version of the key, if it was found.
+static void txn_record_read(TxnEntry *entry, int found, uint64_t version) {
+  if (entry->read) return;
+  entry->read = 1;
+  entry->read_version = found ? version : 0;
+}
+
+
+/// Runs the commands of a transaction against the KVS without changing it:
+/// the writes and deletes are kept in the entries of their keys, the
+/// output of the reads and deletes in output.
+/// @param txn The transaction.
+/// @param entries Entry of each key, reset.
+/// @param key_entries Position in entries of each key of the commands.
+/// @param output Where the output is written.
+/// @return 0 on success, -1 if the output couldn't grow.
+static int txn_run(KvsTransaction *txn, TxnEntry *entries,\
+  const size_t *key_entries, Buffer *output) {
+
+  const TxnCommand *commands = (const TxnCommand *) txn->commands.data;
+  const TxnKey *keys = (const TxnKey *) txn->keys.data;
+  size_t num_commands = txn->commands.length / sizeof(TxnCommand);
+
+  output->length = 0;
+  for (size_t c = 0; c < num_commands; c++) {
+    const TxnCommand *command = &commands[c];
+    size_t end = command->first_key + command->num_keys;
+    size_t missing = 0;     // Keys a DELETE didn't find
+
+    if (command->type == TXN_READ && buffer_append(output, "[", 1))
+      return -1;
+
+    for (size_t k = command->first_key; k < end; k++) {
+      TxnEntry *entry = &entries[key_entries[k]];
+      uint64_t version = 0;
+      int found;
+
+      switch (command->type) {
+        case TXN_WRITE:
+          entry->written = 1;
+          entry->write = &keys[k];
+          break;
+
+        case TXN_DELETE:
+          // A key written by the transaction is seen as it left it
+          if (entry->written) found = entry->write != NULL;
+          else {
+            found = read_pair(kvs_table, entry->key, NULL, &version) >= 0;
+            txn_record_read(entry, found, version);
+          }
+          entry->written = 1;
+          entry->write = NULL;
+
+          if (!found && ((missing++ == 0 && buffer_append(output, "[", 1)) ||\
+            txn_append_key(output, entry->key) ||\
+            buffer_append(output, "KVSMISSING)", 11)))
+            return -1;
+          break;
+
+        case TXN_READ:
+          if (txn_append_key(output, entry->key)) return -1;
+          if (entry->written) {
+            found = entry->write != NULL;
+            if (found && buffer_append(output, txn->values.data +\
+              entry->write->value_offset, entry->write->value_len))
+              return -1;
+          } else {
+            found = read_pair(kvs_table, entry->key, output, &version) >= 0;
+            txn_record_read(entry, found, version);
+          }
+          if (buffer_append(output, found ? ")" : "KVSERROR)",\
+            found ? 1 : 9))
+            return -1;
+          break;
+      }
+    }
+
+    if ((command->type == TXN_READ || missing > 0) &&\
+      buffer_append(output, "]\n", 2))
+      return -1;
+  }
+  return 0;
+}
+
+
+/// Checks that no key read by a COMMIT changed since it was read. The
+/// stripes of the keys must be locked.
+/// @param entries Entry of each key.
+/// @param num_entries Number of entries.
+/// @return 0 if every key has the version read, -1 otherwise.
+static int txn_validate(const TxnEntry *entries, size_t num_entries) {
+  for (size_t e = 0; e < num_entries; e++) {
     KeyNode *key_node;
 
-    if (indexList == NULL) continue;
+    if (!entries[e].read) continue;
+    key_node = find_key_node(kvs_table, entries[e].key);
+    if ((key_node != NULL ? key_node->value->version : 0) !=\
+      entries[e].read_version)
+      return -1;
+  }
+  return 0;
+}
+
 
-    key_node = indexList->head; // Get the entry's first key node
-    // Iterate over the key nodes
-    while (key_node != NULL) {
-      snprintf(buffer, MAX_WRITE_SIZE, "(%s, %s)\n", key_node->key, \
-      key_node->value);
+/// Writes and deletes the keys changed by a COMMIT, notifying their
+/// subscribers. The stripes of the keys must be locked to write. The memory
+/// of every change and its log record are made first, so the changes are
+/// all made or none is.
+/// @param txn The transaction.
+/// @param entries Entry of each key.
+/// @param num_entries Number of entries.
+/// @param records Where the log records of the changes are added.
+/// @return 0 on success, -1 if memory ran out (nothing was changed).
+static int txn_apply(KvsTransaction *txn, const TxnEntry *entries,\
+  size_t num_entries, Buffer *records) {
+
+  PairChange *changes = malloc(num_entries * sizeof(PairChange));
+  size_t num_changes = 0;
+  uint64_t timestamp;
+
+  if (num_entries > 0 && changes == NULL) return -1;
+  for (size_t e = 0; e < num_entries; e++) {
+    const TxnEntry *entry = &entries[e];
+
+    if (!entry->written) continue;
+    if (entry->write != NULL)
+      init_pair_change(&changes[num_changes++], entry->key,\
+        txn->values.data + entry->write->value_offset,\
+        entry->write->value_len, 0);
+    else init_pair_change(&changes[num_changes++], entry->key, NULL, 0, 0);
+  }
+  if (reserve_pair_changes(kvs_table, changes, num_changes)) {
+    free(changes);
+    return -1;
+  }
+  for (size_t c = 0; c < num_changes; c++) {
+    const PairChange *change = &changes[c];
+    const char *key = change->probe.bytes;
+
+    // A delete of a missing key changes nothing
+    if (change->value == NULL && change->key_node == NULL) continue;
+    if (log_change(records, change->value != NULL ? WAL_WRITE : WAL_DELETE,\
+      key, change->value, change->value_len, 0)) {
+      release_pair_changes(changes, num_changes);
+      free(changes);
+      records->length = 0;
+      return -1;
+    }
+  }
 
-      //Try to write the key value pair to the file descriptor
-      if (write_error_check(fd, buffer) == -1) {
-        pthread_rwlock_unlock(&kvs_table->rwl);
-        return -1;
+  // Shared by the changes, snapshots see all or none
+  timestamp = next_commit_timestamp(kvs_table);
+  for (size_t c = 0; c < num_changes; c++)
+    apply_pair_change(kvs_table, avl_sessions, &changes[c], timestamp, NULL);
+  release_pair_changes(changes, num_changes);
+  free(changes);
+  return 0;
+}
+
+
+/// Locks the hash table to read and the stripes of a COMMIT's keys to write.
+/// @param stripes Stripes of the keys.
+/// @return 0 if they were locked, -1 otherwise (none stay locked).
+static int txn_lock(const StripeMask *stripes) {
+  if (hash_table_rdlock()) return -1;
+  if (lock_stripe_mask(stripes, 1)) {
+    hash_table_unlock();
+    return -1;
+  }
+  return 0;
+}
+
+
+/// Unlocks what txn_lock locked, growing the table (and evicting pairs over
+/// the memory budget) after a COMMIT's writes.
+/// @param stripes Stripes of the keys.
+/// @param applied 1 if the COMMIT changed the KVS.
+static void txn_unlock(const StripeMask *stripes, int applied) {
+  unlock_stripes(stripes);
+  if (applied && KVS_MEMORY_BUDGET > 0)
+    evict_over_budget();
+  hash_table_unlock_and_rehash();
+}
+
+
+int kvs_commit(int fd, KvsTransaction *txn) {
+  const TxnKey *keys = (const TxnKey *) txn->keys.data;
+  size_t num_keys = txn->keys.length / sizeof(TxnKey);
+  Buffer output = BUFFER_INITIALIZER; // Output of the reads and deletes
+  const char **sorted;      // Keys of the transaction, sorted and unique
+  size_t num_entries = 0;   // Number of different keys
+  size_t *key_entries;      // Entry of each key of the commands
+  TxnEntry *entries;        // What the transaction did to each key
+  StripeMask stripes;       // Lock stripes of the keys
+  Buffer records = BUFFER_INITIALIZER; // Log records of the changes
+  uint64_t log_end;         // Position of the records in the log
+  int ret = -1;
+
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    kvs_txn_clear(txn);
+    return -1;
+  }
+
+  sorted = malloc(num_keys * sizeof(const char *));
+  key_entries = malloc(num_keys * sizeof(size_t));
+  entries = malloc(num_keys * sizeof(TxnEntry));
+  if (num_keys > 0 && (sorted == NULL || key_entries == NULL ||\
+    entries == NULL)) {
+    fprintf(stderr, "Failed to allocate memory for the transaction\n");
+    free(sorted);
+    free(key_entries);
+    free(entries);
+    kvs_txn_clear(txn);
+    return -1;
+  }
+
+  for (size_t k = 0; k < num_keys; k++) sorted[k] = keys[k].key;
+  if (num_keys > 0)
+    qsort(sorted, num_keys, sizeof(const char *), compare_txn_keys);
+  memset(&stripes, 0, sizeof(StripeMask));
+  for (size_t k = 0; k < num_keys; k++) {
+    if (num_entries > 0 &&\
+      compare_txn_keys(&sorted[k], &sorted[num_entries - 1]) == 0)
+      continue;
+    sorted[num_entries++] = sorted[k];
+    stripe_mask_add(&stripes, sorted[k]);
+  }
+  for (size_t k = 0; k < num_keys; k++) {
+    const char *key = keys[k].key;
+    const char **found = bsearch(&key, sorted, num_entries,\
+      sizeof(const char *), compare_txn_keys);
+
+    key_entries[k] = (size_t) (found - sorted);
+  }
+
+  for (int attempt = 0; ; attempt++) {
+    // After too many conflicts, run with the stripes locked so it can't fail
+    int locked = attempt >= TXN_OPTIMISTIC_ATTEMPTS;
+
+    for (size_t e = 0; e < num_entries; e++)
+      entries[e] = (TxnEntry) {sorted[e], 0, 0, 0, NULL};
+
+    if (locked && txn_lock(&stripes)) break;
+    if (txn_run(txn, entries, key_entries, &output)) {
+      fprintf(stderr, "Failed to allocate memory for the transaction\n");
+      if (locked) txn_unlock(&stripes, 0);
+      break;
+    }
+    if (!locked) {
+      if (txn_lock(&stripes)) break;
+      // Another operation changed a key read, run the commands again
+      if (txn_validate(entries, num_entries)) {
+        txn_unlock(&stripes, 0);
+        continue;
       }
-      key_node = key_node->next; // Move to the next node
     }
+    // Nothing was changed if it fails
+    if ((ret = txn_apply(txn, entries, num_entries, &records)) != 0) {
+      fprintf(stderr, "Failed to allocate memory for the transaction\n");
+      txn_unlock(&stripes, 0);
+      break;
+    }
+    // A change missing from the log isn't durable, the COMMIT fails
+    if (append_to_log(&records, &log_end)) ret = -1;
+    txn_unlock(&stripes, 1);
+    if (wait_for_log(log_end)) ret = -1;
+    break;
+  }
+
+  if (ret == 0 && output.length > 0) {
+    struct iovec iov = {output.data, output.length};
+    ret = writev_error_check(fd, &iov, 1);
+  }
+
+  buffer_free(&output);
+  buffer_free(&records);
+  free(sorted);
+  free(key_entries);
+  free(entries);
+  kvs_txn_clear(txn);
+  return ret;
+}
+
+
+int kvs_scan(int fd, const char *start, const char *end) {
+  Buffer output = BUFFER_INITIALIZER;
+  struct iovec iov[3];  // "[", the pairs and "]\n"
+  int ret;
+
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return -1;
+  }
+
+  // The table's lock keeps the ordered index consistent across a fork
+  if (hash_table_rdlock()) return -1;
+  ret = scan_pairs(kvs_table, start, end, append_scanned_pair, &output);
+  hash_table_unlock();
+
+  if (ret) {
+    buffer_free(&output);
+    return -1;
+  }
+
+  iov[0].iov_base = "[";
+  iov[0].iov_len = 1;
+  iov[1].iov_base = output.data;
+  iov[1].iov_len = output.length;
+  iov[2].iov_base = "]\n";
+  iov[2].iov_len = 2;
+  ret = writev_error_check(fd, iov, 3);
+
+  buffer_free(&output);
+  return ret;
+}
+
+
+int kvs_stats(int fd) {
+  char buffer[MAX_WRITE_SIZE];
+  size_t negatives, false_positives, counters, num_keys;
+  double rate = 0;
+
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return -1;
+  }
+
+  get_filter_stats(kvs_table, &negatives, &false_positives, &counters);
+  if (negatives + false_positives > 0)
+    rate = (double) false_positives / (double) (negatives + false_positives);
+  num_keys = atomic_load(&kvs_table->num_keys);
+
+  // Counters per key never drop below BLOOM_FILTER_COUNTERS_PER_KEY, which
+  // bounds the rate however many keys there are
+  snprintf(buffer, MAX_WRITE_SIZE, "[(bloom_negatives,%zu)"\
+    "(bloom_false_positives,%zu)(bloom_false_positive_rate,%.4f)"\
+    "(bloom_counters,%zu)(bloom_counters_per_key,%.1f)]\n",\
+    negatives, false_positives, rate, counters,\
+    num_keys > 0 ? (double) counters / (double) num_keys : 0);
+  return write_error_check(fd, buffer);
+}
+
+
+/// Appends a pair of a snapshot as "(key, value)\n" to a buffer.
+/// @param key The key.
+/// @param key_len Length of the key.
+/// @param value The value.
+/// @param value_len Length of the value.
+/// @param expires_at Time the pair expires (unused).
+/// @param arg The output buffer.
+/// @return 0 on success, -1 if the output couldn't grow.
+static int append_snapshot_pair(const char *key, size_t key_len,\
+  const char *value, size_t value_len, uint64_t expires_at, void *arg) {
+
+  Buffer *output = arg;
+
+  (void) expires_at;
+  return buffer_append(output, "(", 1) ||\
+    buffer_append(output, key, key_len) ||\
+    buffer_append(output, ", ", 2) ||\
+    buffer_append(output, value, value_len) ||\
+    buffer_append(output, ")\n", 2) ? -1 : 0;
+}
+
+
+/// Writes the pairs in a buffer and empties it.
+/// @param fd File descriptor to write the output.
+/// @param compress Compressed file the pairs are added to instead, NULL to
+/// write them to fd as they are.
+/// @param output The buffer.
+/// @return 0 if the write was successful, -1 otherwise.
+static int flush_output(int fd, CompressWriter *compress, Buffer *output) {
+  struct iovec iov = {output->data, output->length};
+  int ret = 0;
+
+  if (output->length > 0)
+    ret = compress != NULL ?\
+      compress_write(compress, output->data, output->length) :\
+      writev_error_check(fd, &iov, 1);
+  output->length = 0;
+  return ret ? -1 : 0;
+}
+
+
+/// Appends a key a delta snapshot deletes as "DELETE key\n" to a buffer.
+/// @param key The key.
+/// @param key_len Length of the key.
+/// @param arg The output buffer.
+/// @return 0 on success, -1 if the output couldn't grow.
+static int append_snapshot_tombstone(const char *key, size_t key_len,\
+  void *arg) {
+  Buffer *output = arg;
+
+  return buffer_append(output, "DELETE ", 7) ||\
+    buffer_append(output, key, key_len) ||\
+    buffer_append(output, "\n", 1) ? -1 : 0;
+}
+
+
+/// Copies the pairs of a stripe of a snapshot, locked to read only while it
+/// is copied, so writes go on during the copy. In a delta they come after a
+/// "DELETE <key>\n" line per key deleted in the stripe since its start.
+/// @param snapshot Snapshot started by snapshot_begin.
+/// @param stripe Position of the stripe.
+/// @param lock 0 if this is the only thread using the KVS (a forked backup,
+/// whose copies of the locks can't be trusted), 1 otherwise.
+/// @param visit Function the pairs are copied with.
+/// @param arg Argument passed to visit.
+/// @param output Text the DELETE lines are appended to.
+/// @return 0 if the stripe was copied successfully, -1 otherwise.
+static int copy_snapshot_stripe(Snapshot *snapshot, size_t stripe, int lock,\
+  PairVisitor visit, void *arg, Buffer *output) {
+  int ret;
+
+  if (lock && hash_table_rdlock()) return -1;
+  if (lock && hash_table_stripe_rdlock(stripe)) {
+    hash_table_unlock();
+    return -1;
+  }
+  ret = snapshot_visit_tombstones(kvs_table, snapshot, stripe,\
+    append_snapshot_tombstone, output);
+  if (ret == 0)
+    ret = snapshot_visit_stripe(kvs_table, snapshot, stripe, visit, arg);
+  if (lock) {
+    hash_table_stripe_unlock(stripe);
+    hash_table_unlock();
+  }
+  return ret ? -1 : 0;
+}
+
+
+/// Writes the pairs of a snapshot of the KVS as "(key, value)\n" lines (see
+/// copy_snapshot_stripe), or as the sections of a dump (a stripe per
+/// section), a stripe at a time in order.
+/// @param fd File descriptor to write the output.
+/// @param snapshot Snapshot started by snapshot_begin.
+/// @param lock 0 if this is the only thread using the KVS, 1 otherwise.
+/// @param dump Dump the pairs are added to, NULL to write them as text.
+/// @param compress Compressed file the text is added to, NULL to write it
+/// to fd as it is.
+/// @return 0 if the snapshot was written successfully, -1 otherwise.
+static int write_snapshot_pairs(int fd, Snapshot *snapshot, int lock,\
+  DumpWriter *dump, CompressWriter *compress) {
+  Buffer output = BUFFER_INITIALIZER; // Pairs of the current stripe
+  PairVisitor visit = dump != NULL ? dump_add_pair : append_snapshot_pair;
+  void *arg = dump != NULL ? (void *) dump : (void *) &output;
+  int ret = 0;
+
+  for (size_t stripe = 0; stripe < kvs_table->num_stripes && ret == 0;\
+    stripe++) {
+    ret = copy_snapshot_stripe(snapshot, stripe, lock, visit, arg, &output);
+    if (ret == 0)
+      ret = dump != NULL ? dump_end_section(dump) :\
+        flush_output(fd, compress, &output);
+  }
+
+  // The pairs changed before their stripe was copied
+  if (ret == 0) ret = snapshot_visit_saved(snapshot, visit, arg);
+  if (ret == 0)
+    ret = dump != NULL ? dump_end_section(dump) :\
+      flush_output(fd, compress, &output);
+
+  buffer_free(&output);
+  return ret ? -1 : 0;
+}
+
+
+/// Writes the pairs of a (whole) snapshot of the KVS as a dump, which is
+/// only valid once every pair was written.
+/// @param fd File descriptor of the dump's file (empty).
+/// @param snapshot Snapshot started by snapshot_begin.
+/// @param lock 0 if this is the only thread using the KVS, 1 otherwise.
+/// @return 0 if the dump was written successfully, -1 otherwise.
+static int write_snapshot_dump(int fd, Snapshot *snapshot, int lock) {
+  DumpFile file;
+  DumpWriter dump;
+  int ret;
+
+  if (dump_file_begin(&file, fd)) return -1;
+  dump_writer_init(&dump, &file);
+  ret = write_snapshot_pairs(fd, snapshot, lock, &dump, NULL);
+  dump_writer_free(&dump);
+  return dump_file_end(&file, snapshot->timestamp, ret != 0);
+}
+
+
+#if KVS_DELTA_BACKUPS > 0
+/// Formats the first line of a backup of a chain.
+/// @param header Where the line is written (MAX_WRITE_SIZE bytes).
+/// @param snapshot Snapshot of the backup.
+/// @return Length of the line.
+static size_t format_backup_header(char *header, const Snapshot *snapshot) {
+  int len;
+
+  if (snapshot->since == 0)
+    len = snprintf(header, MAX_WRITE_SIZE, "BASE %" PRIu64 " %zu\n",\
+      snapshot->timestamp, kvs_table->num_stripes);
+  else
+    len = snprintf(header, MAX_WRITE_SIZE, "DELTA %" PRIu64 " %" PRIu64\
+      " %zu\n", snapshot->since, snapshot->timestamp, kvs_table->num_stripes);
+  return (size_t) len;
+}
+
+
+/// Adds a line to a text backup.
+/// @param fd File descriptor of the backup.
+/// @param compress Compressed file of the backup, NULL if it isn't.
+/// @param line The line (null terminated).
+/// @return 0 if the line was written successfully, -1 otherwise.
+static int write_backup_line(int fd, CompressWriter *compress, char *line) {
+  if (compress != NULL) return compress_write(compress, line, strlen(line));
+  return write_error_check(fd, line);
+}
+#endif
+
+
+/// Backup written by several workers at once (see KVS_BACKUP_WORKERS), each
+/// one copying whole stripes and writing them at the end of the bytes
+/// reserved so far, so the stripes are in no particular order.
+typedef struct BackupWorkers {
+  Snapshot *snapshot;       // Snapshot written.
+  int fd;                   // File descriptor of the backup file.
+  int lock;                 // 0 if this is the only thread using the KVS.
+  DumpFile dump;            // The dump (with KVS_BINARY_BACKUPS).
+  atomic_uint_least64_t end; // End of the text reserved so far.
+  atomic_size_t next;       // Next stripe to copy.
+  atomic_int failed;        // Set once a worker failed.
+} BackupWorkers;
+
+
+/// Worker of a backup, with what it copies a stripe to.
+typedef struct BackupWorker {
+  BackupWorkers *workers;   // The backup.
+  pthread_t thread;         // Thread of the worker.
+  Buffer output;            // Text of the stripe being copied.
+  Buffer blocks;            // The text, compressed.
+  uint32_t *table;          // Matches of the compressor, NULL if unused.
+  DumpWriter dump;          // Section of the dump being copied.
+} BackupWorker;
+
+
+/// Writes text to a backup written by workers, compressed with
+/// KVS_COMPRESSED_BACKUPS, at the end of the bytes reserved so far.
+/// @param worker The worker.
+/// @param text The text (whole lines).
+/// @param size Length of the text.
+/// @return 0 if the text was written successfully, -1 otherwise.
+static int append_backup_text(BackupWorker *worker, const char *text,\
+  size_t size) {
+  BackupWorkers *workers = worker->workers;
+  uint64_t offset;
+
+  if (size == 0) return 0;
+  // Compressed apart, the blocks of each worker stay whole
+  if (KVS_COMPRESSED_BACKUPS) {
+    worker->blocks.length = 0;
+    if (compress_append_blocks(&worker->blocks, text, size, worker->table))
+      return -1;
+    text = worker->blocks.data;
+    size = worker->blocks.length;
   }
-  pthread_rwlock_unlock(&kvs_table->rwl);
+  offset = atomic_fetch_add(&workers->end, size);
+  return pwrite_all(workers->fd, text, size, (off_t) offset) == 1 ? 0 : -1;
+}
+
+
+/// Writes what a worker copied of a stripe.
+/// @param worker The worker.
+/// @return 0 if it was written successfully, -1 otherwise.
+static int flush_backup_worker(BackupWorker *worker) {
+  int ret;
+
+  if (KVS_BINARY_BACKUPS) return dump_end_section(&worker->dump);
+  ret = append_backup_text(worker, worker->output.data, worker->output.length);
+  worker->output.length = 0;
+  return ret;
+}
+
+
+/// Worker of a backup, copying and writing stripes until none is left.
+/// @param arg The BackupWorker.
+/// @return NULL.
+static void* backup_worker(void *arg) {
+  BackupWorker *worker = arg;
+  BackupWorkers *workers = worker->workers;
+  PairVisitor visit = KVS_BINARY_BACKUPS ? dump_add_pair :\
+    append_snapshot_pair;
+  void *visit_arg = KVS_BINARY_BACKUPS ? (void *) &worker->dump :\
+    (void *) &worker->output;
+  size_t stripe;
+
+  while (!atomic_load(&workers->failed) &&\
+    (stripe = atomic_fetch_add(&workers->next, 1)) < kvs_table->num_stripes)
+    if (copy_snapshot_stripe(workers->snapshot, stripe, workers->lock,\
+      visit, visit_arg, &worker->output) || flush_backup_worker(worker))
+      atomic_store(&workers->failed, 1);
+  return NULL;
+}
+
+
+/// Writes a snapshot of the KVS as a backup (see write_backup_snapshot)
+/// from several workers, the caller being one of them.
+/// @param fd File descriptor of the backup file.
+/// @param snapshot Snapshot started by snapshot_begin.
+/// @param lock 0 if this is the only thread using the KVS, 1 otherwise.
+/// @param num_workers Number of workers.
+/// @return 0 if the backup was written successfully, -1 otherwise.
+static int write_backup_parallel(int fd, Snapshot *snapshot, int lock,\
+  size_t num_workers) {
+  BackupWorkers workers = {.snapshot = snapshot, .fd = fd, .lock = lock};
+  BackupWorker *worker = calloc(num_workers, sizeof(BackupWorker));
+  size_t started = 1;
+  int ret = 0;
+
+  if (worker == NULL) return -1;
+  atomic_init(&workers.end, 0);
+  atomic_init(&workers.next, 0);
+  atomic_init(&workers.failed, 0);
+  for (size_t i = 0; i < num_workers; i++) {
+    worker[i].workers = &workers;
+    dump_writer_init(&worker[i].dump, &workers.dump);
+    if (KVS_COMPRESSED_BACKUPS &&\
+      (worker[i].table = malloc(sizeof(uint32_t) << LZ_HASH_BITS)) == NULL)
+      ret = -1;
+  }
+
+  // What comes first is written before the workers start
+  if (ret == 0 && KVS_BINARY_BACKUPS) {
+    ret = dump_file_begin(&workers.dump, fd);
+  } else if (ret == 0 && KVS_COMPRESSED_BACKUPS) {
+    ret = write_all(fd, COMPRESS_MAGIC, COMPRESS_MAGIC_SIZE) == 1 ? 0 : -1;
+    atomic_store(&workers.end, COMPRESS_MAGIC_SIZE);
+  }
+#if KVS_DELTA_BACKUPS > 0
+  char header[MAX_WRITE_SIZE];
+
+  if (ret == 0)
+    ret = append_backup_text(&worker[0], header,\
+      format_backup_header(header, snapshot));
+#endif
+
+  if (ret == 0) {
+    for (; started < num_workers; started++)
+      if (pthread_create(&worker[started].thread, NULL, backup_worker,\
+        &worker[started]))
+        break;
+    backup_worker(&worker[0]);
+    for (size_t i = 1; i < started; i++)
+      pthread_join(worker[i].thread, NULL);
+    if (atomic_load(&workers.failed)) ret = -1;
+  }
+
+  // The pairs changed before their stripe was copied, and what comes last
+  if (ret == 0)
+    ret = snapshot_visit_saved(snapshot, KVS_BINARY_BACKUPS ? dump_add_pair :\
+      append_snapshot_pair, KVS_BINARY_BACKUPS ? (void *) &worker[0].dump :\
+      (void *) &worker[0].output);
+  if (ret == 0) ret = flush_backup_worker(&worker[0]);
+#if KVS_DELTA_BACKUPS > 0
+  // Only a complete backup ends, kvs_merge refuses the others
+  if (ret == 0) ret = append_backup_text(&worker[0], "END\n", 4);
+#endif
+  if (KVS_BINARY_BACKUPS) {
+    if (dump_file_end(&workers.dump, snapshot->timestamp, ret != 0)) ret = -1;
+  } else if (ret == 0 && KVS_COMPRESSED_BACKUPS) {
+    worker[0].blocks.length = 0;
+    ret = compress_append_end(&worker[0].blocks) ||\
+      pwrite_all(fd, worker[0].blocks.data, worker[0].blocks.length,\
+      (off_t) atomic_load(&workers.end)) != 1 ? -1 : 0;
+  }
+
+  for (size_t i = 0; i < num_workers; i++) {
+    buffer_free(&worker[i].output);
+    buffer_free(&worker[i].blocks);
+    free(worker[i].table);
+    dump_writer_free(&worker[i].dump);
+  }
+  free(worker);
+  return ret;
+}
+
+
+/// Gets the number of workers a backup is written by.
+/// @return KVS_BACKUP_WORKERS, or the number of cores if it's 0, at most one
+/// per stripe.
+static size_t backup_num_workers() {
+  size_t num_workers = KVS_BACKUP_WORKERS;
+
+  if (num_workers == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    num_workers = cores > 1 ? (size_t) cores : 1;
+  }
+  return num_workers < kvs_table->num_stripes ? num_workers :\
+    kvs_table->num_stripes;
+}
+
+
+/// Writes a snapshot of the KVS as a backup: a dump with
+/// KVS_BINARY_BACKUPS, otherwise its pairs as text (between the header and
+/// the end of a chain's backup with KVS_DELTA_BACKUPS), compressed with
+/// KVS_COMPRESSED_BACKUPS.
+/// @param fd File descriptor of the backup file.
+/// @param snapshot Snapshot started by snapshot_begin.
+/// @param lock 0 if this is the only thread using the KVS, 1 otherwise.
+/// @return 0 if the backup was written successfully, -1 otherwise.
+static int write_backup_snapshot(int fd, Snapshot *snapshot, int lock) {
+  CompressWriter writer, *compress = NULL;
+  size_t num_workers = backup_num_workers();
+  int ret = 0;
+
+  if (num_workers > 1)
+    return write_backup_parallel(fd, snapshot, lock, num_workers);
+  if (KVS_BINARY_BACKUPS) return write_snapshot_dump(fd, snapshot, lock);
+
+  // Blocks are compressed by the writer's thread while the stripes are
+  // copied by this one
+  if (KVS_COMPRESSED_BACKUPS) {
+    if (compress_writer_begin(&writer, fd)) return -1;
+    compress = &writer;
+  }
+
+#if KVS_DELTA_BACKUPS > 0
+  char header[MAX_WRITE_SIZE];
+
+  format_backup_header(header, snapshot);
+  ret = write_backup_line(fd, compress, header);
+#endif
+  if (ret == 0)
+    ret = write_snapshot_pairs(fd, snapshot, lock, NULL, compress);
+#if KVS_DELTA_BACKUPS > 0
+  // Only a complete backup ends, kvs_merge refuses the others
+  if (ret == 0) ret = write_backup_line(fd, compress, "END\n");
+#endif
+
+  if (compress != NULL && compress_writer_end(compress, ret != 0)) ret = -1;
+  return ret;
+}
+
+
+int kvs_show(int fd) {
+  Snapshot snapshot;
+  int ret;
+
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return -1;
+  }
+
+  snapshot_begin(kvs_table, &snapshot, 0);
+  ret = write_snapshot_pairs(fd, &snapshot, 1, NULL, NULL);
+  snapshot_end(kvs_table, &snapshot);
+  return ret;
+}
+
+
+/// Backup waiting for, or being written by, a backup worker.
+typedef struct BackupTask {
+  Snapshot snapshot;        // State of the KVS when the backup was asked.
+  int fd;                   // File descriptor of the backup file.
+  struct BackupTask *next;  // Next backup in the queue.
+} BackupTask;
+
+
+#if KVS_FORK_BACKUPS
+/// Writes a backup's snapshot from a forked child, the only thread using its
+/// copy of the KVS, and waits for that child (and no other) to end.
+/// @param task The backup.
+/// @return 0 if the backup was written successfully, -1 otherwise.
+static int fork_backup(BackupTask *task) {
+  int status;
+  pid_t pid = do_fork();
+
+  if (pid == -1) {
+    perror("Failed to create child process");
+    return -1;
+  }
+  // The child leaves without flushing or freeing its copy of the server
+  if (pid == 0) _exit(write_backup_snapshot(task->fd, &task->snapshot, 0));
+
+  while (waitpid(pid, &status, 0) == -1) {
+    if (errno != EINTR) {
+      perror("Error waiting for backup to be finished");
+      return -1;
+    }
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+#endif
+
+
+/// Writes a backup's snapshot, closes its file and frees it.
+/// @param task The backup.
+/// @return 0 if the backup was written successfully, -1 otherwise.
+static int write_backup(BackupTask *task) {
+#if KVS_FORK_BACKUPS
+  int ret = fork_backup(task);
+#else
+  int ret = write_backup_snapshot(task->fd, &task->snapshot, 1);
+#endif
+
+  if (ret) fprintf(stderr, "Failed to perform backup\n");
+  snapshot_end(kvs_table, &task->snapshot);
+  close(task->fd);
+  free(task);
+  return ret;
+}
+
+
+/// Backup worker: writes the queued backups, oldest first, until the workers
+/// are stopped and the queue is empty.
+/// @param arg Unused.
+/// @return NULL.
+static void* backup_queue_worker(void *arg) {
+  BackupTask *task;
+  (void)arg;
+
+  pthread_mutex_lock(&backup_state.mutex);
+  for (;;) {
+    while (backup_state.head == NULL && !backup_state.stopping)
+      pthread_cond_wait(&backup_state.queued, &backup_state.mutex);
+    if ((task = backup_state.head) == NULL) break;
+    if ((backup_state.head = task->next) == NULL) backup_state.tail = NULL;
+    pthread_mutex_unlock(&backup_state.mutex);
+
+    write_backup(task);
+
+    pthread_mutex_lock(&backup_state.mutex);
+    backup_state.pending--;
+    pthread_cond_broadcast(&backup_state.done);
+  }
+  pthread_mutex_unlock(&backup_state.mutex);
+  return NULL;
+}
+
+
+/// Starts the backup workers, as many as can be started up to max_backups.
+/// The backup_state mutex must be held.
+/// @param max_backups Most backups written at once.
+static void start_backup_workers(size_t max_backups) {
+  if ((backup_state.threads = malloc(max_backups * sizeof(pthread_t))) ==\
+      NULL)
+    return;
+  while (backup_state.num_threads < max_backups &&\
+      pthread_create(&backup_state.threads[backup_state.num_threads], NULL,\
+        backup_queue_worker, NULL) == 0)
+    backup_state.num_threads++;
+}
+
+
+/// Stops the backup workers once the backups queued are written.
+static void stop_backup_workers() {
+  pthread_mutex_lock(&backup_state.mutex);
+  backup_state.stopping = 1;
+  pthread_cond_broadcast(&backup_state.queued);
+  pthread_mutex_unlock(&backup_state.mutex);
+
+  for (size_t i = 0; i < backup_state.num_threads; i++)
+    pthread_join(backup_state.threads[i], NULL);
+  free(backup_state.threads);
+  backup_state.threads = NULL;
+  backup_state.num_threads = 0;
+  backup_state.stopping = 0;
+}
+
+
+#if KVS_DELTA_BACKUPS > 0
+/// Adds a chain to (or removes it from) the chains waiting for a delta and
+/// moves the tombstone horizon to the earliest of their last backups. The
+/// caller must hold chain_state's mutex.
+/// @param chain The chain.
+/// @param waiting 1 if its next backup is a delta, 0 otherwise.
+static void set_chain_waiting(BackupChain *chain, int waiting) {
+  BackupChain **link = &chain_state.head;
+  uint64_t horizon = UINT64_MAX;
+
+  while (*link != NULL && *link != chain) link = &(*link)->next;
+  if (waiting && *link == NULL) {
+    chain->next = NULL;
+    *link = chain;
+  } else if (!waiting && *link != NULL) {
+    *link = chain->next;
+  }
+
+  for (BackupChain *other = chain_state.head; other != NULL;\
+    other = other->next)
+    if (other->timestamp < horizon) horizon = other->timestamp;
+  set_tombstone_horizon(kvs_table, horizon);
+}
+#endif
+
+
+int kvs_backup_start(int fd, size_t max_backups, BackupChain *chain) {
+  BackupTask *task = malloc(sizeof(BackupTask));
+  uint64_t since = 0;
+
+  if (kvs_table == NULL || task == NULL) {
+    fprintf(stderr, kvs_table == NULL ? "KVS state must be initialized\n" :\
+      "Failed to allocate the backup\n");
+    free(task);
+    close(fd);
+    return -1;
+  }
+  task->fd = fd;
+  task->next = NULL;
+
+#if KVS_DELTA_BACKUPS > 0
+  int waiting = (chain->num_backups + 1) % KVS_DELTA_BACKUPS != 0;
+  uint64_t now;
+
+  pthread_mutex_lock(&chain_state.mutex);
+  if (chain->num_backups % KVS_DELTA_BACKUPS != 0) since = chain->timestamp;
+  // The deletes after the cut need tombstones for the next delta, even
+  // before the chain is moved to the cut
+  now = atomic_load(&kvs_table->commit_clock);
+  if (waiting && now < atomic_load(&kvs_table->tombstone_horizon))
+    set_tombstone_horizon(kvs_table, now);
+#endif
+  // Taken now, so the backup has exactly the commands before it
+  snapshot_begin(kvs_table, &task->snapshot, since);
+  chain->timestamp = task->snapshot.timestamp;
+  chain->num_backups++;
+#if KVS_DELTA_BACKUPS > 0
+  set_chain_waiting(chain, waiting);
+  pthread_mutex_unlock(&chain_state.mutex);
+#endif
+
+  pthread_mutex_lock(&backup_state.mutex);
+  if (backup_state.threads == NULL) start_backup_workers(max_backups);
+  // Without workers the backup is written right away
+  if (backup_state.num_threads == 0) {
+    pthread_mutex_unlock(&backup_state.mutex);
+    write_backup(task);
+    return 0;
+  }
+  if (backup_state.tail != NULL) backup_state.tail->next = task;
+  else backup_state.head = task;
+  backup_state.tail = task;
+  backup_state.pending++;
+  pthread_cond_signal(&backup_state.queued);
+  pthread_mutex_unlock(&backup_state.mutex);
   return 0;
 }
 
 
-int kvs_backup(int fd) {
-  char buffer[MAX_WRITE_SIZE]; // Buffer to store the backup content
+/// Restore of a dump, its sections loaded by several threads.
+typedef struct RestoreTask {
+  Dump dump;                // The dump.
+  atomic_size_t next;       // Next section to load.
+  atomic_int failed;        // Set once a section failed to load.
+} RestoreTask;
+
+
+/// Writes a pair of a dump to the KVS, with its stripe locked. The hash
+/// table's lock must be held to read.
+/// @param key The key (not null terminated).
+/// @param key_len Length of the key.
+/// @param value The value.
+/// @param value_len Length of the value.
+/// @param expires_at Time the pair expires, 0 if never.
+/// @param arg Unused.
+/// @return 0 on success, -1 if the pair is invalid or couldn't be written.
+static int restore_pair(const char *key, size_t key_len, const char *value,\
+  size_t value_len, uint64_t expires_at, void *arg) {
+
+  char key_string[MAX_STRING_SIZE];
+  size_t stripe;
+  int ret;
+
+  (void) arg;
+  if (key_len == 0 || key_len >= MAX_STRING_SIZE ||\
+    value_len > MAX_VALUE_SIZE)
+    return -1;
+  // Expired since the dump was written
+  if (expires_at != 0 && expires_at <= timer_wheel_now()) return 0;
+  memcpy(key_string, key, key_len);
+  key_string[key_len] = '\0';
+
+  stripe = get_lock_stripe(kvs_table, key_string);
+  if (hash_table_stripe_wrlock(stripe)) return -1;
+  ret = write_pair(kvs_table, key_string, value, value_len, expires_at, 0,\
+    NULL);
+  hash_table_stripe_unlock(stripe);
+  if (ret == 0 && expires_at != 0) set_loaded_timer(key_string, expires_at);
+  return ret;
+}
+
+
+/// Thread of a restore, loads sections until none is left.
+/// @param arg The RestoreTask.
+/// @return NULL.
+static void* restore_thread(void *arg) {
+  RestoreTask *task = arg;
+  Buffer records = BUFFER_INITIALIZER; // Records of the current section
+  size_t section;
 
-  // Iterate over the hash table
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    IndexList *indexList = kvs_table->table[i]; // Get the index list
-    KeyNode *key_node;
+  while (!atomic_load(&task->failed) &&\
+    (section = atomic_fetch_add(&task->next, 1)) <\
+    task->dump.header.num_sections) {
+    int ret;
+
+    if (hash_table_rdlock()) {
+      atomic_store(&task->failed, 1);
+      break;
+    }
+    ret = dump_visit_section(&task->dump, section, &records, restore_pair,\
+      NULL);
+    hash_table_unlock_and_rehash();
+
+    if (ret) {
+      fprintf(stderr, "Failed to restore section %zu of the dump\n",\
+        section);
+      atomic_store(&task->failed, 1);
+    }
+  }
+  buffer_free(&records);
+  return NULL;
+}
+
+
+int kvs_restore(const char *path) {
+  RestoreTask task;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t num_threads = cores > 1 ? (size_t) cores - 1 : 0;
+  pthread_t *threads;
+  size_t started = 0;
+  int ret;
+
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return -1;
+  }
+  if (dump_open(&task.dump, path)) return -1;
+  atomic_init(&task.next, 0);
+  atomic_init(&task.failed, 0);
+
+  // Sized once, so the threads never wait for the table to grow
+  if (hash_table_wrlock()) {
+    dump_close(&task.dump);
+    return -1;
+  }
+  ret = hash_table_presize(kvs_table, atomic_load(&kvs_table->num_keys) +\
+    task.dump.header.num_pairs);
+  hash_table_unlock();
+  if (ret) fprintf(stderr, "Failed to presize the hash table\n");
+
+  // The caller loads sections too, the other cores help with the rest
+  if (num_threads > task.dump.header.num_sections)
+    num_threads = task.dump.header.num_sections;
+  threads = num_threads > 0 ? malloc(num_threads * sizeof(pthread_t)) : NULL;
+  for (; threads != NULL && started < num_threads; started++)
+    if (pthread_create(&threads[started], NULL, restore_thread, &task))
+      break;
+  restore_thread(&task);
+  for (size_t i = 0; i < started; i++) pthread_join(threads[i], NULL);
+  free(threads);
+
+  dump_close(&task.dump);
+  if (atomic_load(&task.failed)) return -1;
+
+  // Its pairs were not logged, a checkpoint makes them durable (none is
+  // taken while recovering, the log is opened after)
+  if (kvs_wal != NULL && checkpoint_log(1)) {
+    fprintf(stderr, "Failed to checkpoint the log after restoring %s\n",\
+      path);
+    return -1;
+  }
+  return 0;
+}
+
+
+/// Records of the log's tail being replayed, split in parts by the lock
+/// stripes of their keys. A key's records are all in one part, in log order,
+/// so the parts can be replayed at once and each key still ends with its
+/// last change.
+typedef struct ReplayTask {
+  const Buffer *records;    // The records, as wal_load_segment read them.
+  Buffer *parts;            // Positions (size_t) of the records of each part.
+  size_t num_parts;         // Number of parts.
+  atomic_size_t next;       // Next part to replay.
+  atomic_int failed;        // Set once a record failed to be replayed.
+} ReplayTask;
+
+
+/// Records replayed between two releases of the hash table's lock (which
+/// let the table grow).
+#define REPLAY_BATCH_RECORDS 256
+
+
+/// Gets the key of a record of the log.
+/// @param record The record.
+/// @param header Where the record's header is stored.
+/// @param key Where the key is stored (null terminated).
+/// @return 0 on success, -1 if the record is too large for the KVS.
+static int record_key(const char *record, WalRecordHeader *header,\
+  char key[MAX_STRING_SIZE]) {
+
+  memcpy(header, record, sizeof(*header));
+  if (header->key_len >= MAX_STRING_SIZE || header->value_len > MAX_VALUE_SIZE)
+    return -1;
+  memcpy(key, record + sizeof(*header), header->key_len);
+  key[header->key_len] = '\0';
+  return 0;
+}
+
+
+/// Makes the change of a record of the log again, with its stripe locked.
+/// The hash table's lock must be held to read.
+/// @param record The record.
+/// @return 0 on success, -1 if the change couldn't be made.
+static int replay_record(const char *record) {
+  WalRecordHeader header;
+  char key[MAX_STRING_SIZE];
+  uint64_t expires_at;
+  size_t stripe;
+  int write, ret = 0;
+
+  if (record_key(record, &header, key)) return -1;
+  expires_at = timer_wheel_from_wall_clock(header.expires_at);
+  // A write that expired since leaves the key deleted
+  write = header.type == WAL_WRITE &&\
+    (expires_at == 0 || expires_at > timer_wheel_now());
+
+  stripe = get_lock_stripe(kvs_table, key);
+  if (hash_table_stripe_wrlock(stripe)) return -1;
+  if (write)
+    ret = write_pair(kvs_table, key, record + sizeof(header) + header.key_len,\
+      header.value_len, expires_at, 0, NULL);
+  // A delete of a key that is already gone changes nothing
+  else if (delete_pair(kvs_table, NULL, key, 0) == -2) ret = -1;
+  hash_table_stripe_unlock(stripe);
+  if (ret == 0 && write && expires_at != 0) set_loaded_timer(key, expires_at);
+  return ret;
+}
+
+
+/// Thread of a replay, replays parts until none is left.
+/// @param arg The ReplayTask.
+/// @return NULL.
+static void* replay_thread(void *arg) {
+  ReplayTask *task = arg;
+  size_t part, position;
+
+  while (!atomic_load(&task->failed) &&\
+    (part = atomic_fetch_add(&task->next, 1)) < task->num_parts) {
+    const Buffer *positions = &task->parts[part];
+    size_t num_records = positions->length / sizeof(position);
+
+    for (size_t i = 0; i < num_records && !atomic_load(&task->failed);\
+      i += REPLAY_BATCH_RECORDS) {
+      if (hash_table_rdlock()) {
+        atomic_store(&task->failed, 1);
+        break;
+      }
+      for (size_t j = i; j < num_records && j < i + REPLAY_BATCH_RECORDS;\
+        j++) {
+        memcpy(&position, positions->data + j * sizeof(position),\
+          sizeof(position));
+        if (replay_record(task->records->data + position)) {
+          fprintf(stderr, "Failed to replay a record of the log\n");
+          atomic_store(&task->failed, 1);
+          break;
+        }
+      }
+      hash_table_unlock_and_rehash();
+    }
+  }
+  return NULL;
+}
+
+
+/// Replays records of the log, split by stripe between a thread per core.
+/// @param records The records, as wal_load_segment read them.
+/// @return 0 if every record was replayed, -1 otherwise.
+static int replay_records(const Buffer *records) {
+  ReplayTask task;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  WalRecordHeader header;
+  char key[MAX_STRING_SIZE];
+  pthread_t *threads;
+  size_t started = 0;
+  int ret = 0;
+
+  if (records->length == 0) return 0;
+  task.records = records;
+  task.num_parts = cores > 1 ? (size_t) cores : 1;
+  if ((task.parts = calloc(task.num_parts, sizeof(Buffer))) == NULL)
+    return -1;
+  atomic_init(&task.next, 0);
+  atomic_init(&task.failed, 0);
+
+  for (size_t position = 0; ret == 0 && position < records->length;\
+    position += sizeof(header) + header.key_len + header.value_len) {
+    if (record_key(records->data + position, &header, key)) ret = -1;
+    else ret = buffer_append(&task.parts[get_lock_stripe(kvs_table, key) %\
+      task.num_parts], &position, sizeof(position));
+  }
+
+  // The caller replays parts too, the other cores help with the rest
+  threads = ret == 0 && task.num_parts > 1 ?\
+    malloc((task.num_parts - 1) * sizeof(pthread_t)) : NULL;
+  for (; threads != NULL && started < task.num_parts - 1; started++)
+    if (pthread_create(&threads[started], NULL, replay_thread, &task)) break;
+  if (ret == 0) replay_thread(&task);
+  for (size_t i = 0; i < started; i++) pthread_join(threads[i], NULL);
+  free(threads);
+
+  for (size_t part = 0; part < task.num_parts; part++)
+    buffer_free(&task.parts[part]);
+  free(task.parts);
+  return ret || atomic_load(&task.failed) ? -1 : 0;
+}
+
+
+/// Gets a file number of a list made by wal_list_files.
+/// @param numbers The list.
+/// @param i Position of the number.
+/// @return The number.
+static uint64_t file_number(const Buffer *numbers, size_t i) {
+  uint64_t number;
+
+  memcpy(&number, numbers->data + i * sizeof(number), sizeof(number));
+  return number;
+}
 
-    if (indexList == NULL) continue;
 
-    key_node = indexList->head; // First node of the hash table's entry list
+/// Recovers the KVS from its log: loads the latest checkpoint, then replays
+/// the records of the segments written since (see replay_records).
+/// @return 0 if the KVS was recovered, -1 otherwise.
+static int recover_from_log() {
+  Buffer checkpoints = BUFFER_INITIALIZER, segments = BUFFER_INITIALIZER;
+  Buffer records = BUFFER_INITIALIZER; // Records of the segments
+  char path[PATH_MAX];
+  uint64_t first = 0; // First segment not in the checkpoint
+  int ret = 0;
+
+  if (wal_list_files(KVS_WAL_PATH, WAL_CHECKPOINT_EXTENSION, &checkpoints) ||\
+    wal_list_files(KVS_WAL_PATH, WAL_SEGMENT_EXTENSION, &segments))
+    ret = -1;
+  // A checkpoint only gets its name once it is whole
+  if (ret == 0 && checkpoints.length > 0) {
+    first = file_number(&checkpoints, checkpoints.length / sizeof(first) - 1);
+    if (wal_file_path(path, sizeof(path), KVS_WAL_PATH, first,\
+      WAL_CHECKPOINT_EXTENSION) || kvs_restore(path)) {
+      fprintf(stderr, "Failed to load the checkpoint %s\n", path);
+      ret = -1;
+    }
+  }
+  for (size_t i = 0; ret == 0 && i < segments.length / sizeof(first); i++) {
+    uint64_t segment = file_number(&segments, i);
 
-    // Iterate over the key nodes
-    while (key_node != NULL) {
-      char *key = key_node->key;
-      char *value = key_node->value;
-      char *buf_ptr = buffer;
+    if (segment < first) continue;
+    if (wal_file_path(path, sizeof(path), KVS_WAL_PATH, segment,\
+      WAL_SEGMENT_EXTENSION) || wal_load_segment(path, &records))
+      ret = -1;
+  }
+  if (ret == 0) ret = replay_records(&records);
+
+  // Left behind if the server stopped before the checkpoint removed them
+  if (ret == 0 && first > 0 &&\
+    (wal_remove_files(KVS_WAL_PATH, WAL_SEGMENT_EXTENSION, first) ||\
+    wal_remove_files(KVS_WAL_PATH, WAL_CHECKPOINT_EXTENSION, first)))
+    fprintf(stderr, "Failed to remove the files of the log before %s\n",\
+      path);
+
+  buffer_free(&records);
+  buffer_free(&segments);
+  buffer_free(&checkpoints);
+  return ret;
+}
 
-      *buf_ptr++ = '(';
 
-      // Write the key to the buffer
-      while(*key && buf_ptr < buffer + MAX_WRITE_SIZE - 4)
-        *buf_ptr++ = *key++;
+/// Takes a checkpoint of the log: starts a new segment, dumps a snapshot
+/// taken after that (every change of the segments before it was made before
+/// its record was appended, so the dump has it) and, once the dump is
+/// durable, removes those segments and the checkpoint before.
+/// @param force Takes it even if nothing was logged since the last one (to
+/// keep changes that were not logged).
+/// @return 0 if the checkpoint was taken, or nothing was logged since the
+/// last one, -1 otherwise.
+static int checkpoint_log(int force) {
+  char path[PATH_MAX], tmp_path[PATH_MAX];
+  Snapshot snapshot;
+  uint64_t segment;
+  int fd, ret;
+
+  // The log is rotated by one thread at a time
+  pthread_mutex_lock(&checkpoint_state.taking);
+  if ((ret = wal_rotate(kvs_wal, force, &segment)) != 0) {
+    pthread_mutex_unlock(&checkpoint_state.taking);
+    return ret > 0 ? 0 : -1;
+  }
+  // Written under a name recovery ignores, overwriting one a crash left
+  if (wal_file_path(path, sizeof(path), KVS_WAL_PATH, segment,\
+    WAL_CHECKPOINT_EXTENSION) ||\
+    snprintf(tmp_path, sizeof(tmp_path), "%s/checkpoint.tmp", KVS_WAL_PATH)\
+    >= (int) sizeof(tmp_path) ||\
+    (fd = open(tmp_path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR))\
+    == -1) {
+    pthread_mutex_unlock(&checkpoint_state.taking);
+    return -1;
+  }
 
-      *buf_ptr++ = ',';
-      *buf_ptr++ = ' ';
+  snapshot_begin(kvs_table, &snapshot, 0);
+  ret = write_snapshot_dump(fd, &snapshot, 1);
+  snapshot_end(kvs_table, &snapshot);
+  close(fd);
+
+  // Named once it is synced, recovery never loads a partial checkpoint
+  if (ret == 0 && (rename(tmp_path, path) ||\
+    wal_sync_directory(KVS_WAL_PATH)))
+    ret = -1;
+  if (ret) {
+    unlink(tmp_path);
+    pthread_mutex_unlock(&checkpoint_state.taking);
+    return -1;
+  }
+  if (wal_remove_files(KVS_WAL_PATH, WAL_SEGMENT_EXTENSION, segment) ||\
+    wal_remove_files(KVS_WAL_PATH, WAL_CHECKPOINT_EXTENSION, segment))
+    fprintf(stderr, "Failed to remove the files replaced by %s\n", path);
+  pthread_mutex_unlock(&checkpoint_state.taking);
+  return 0;
+}
 
-      // Write the value to the buffer
-      while(*value && buf_ptr < buffer + MAX_WRITE_SIZE - 2)
-        *buf_ptr++ = *value++;
 
-      *buf_ptr++ = ')';
-      *buf_ptr++ = '\n';
-      *buf_ptr++ = '\0';
+/// Thread that takes a checkpoint of the log every KVS_CHECKPOINT_MS.
+/// @param arg Not used.
+/// @return NULL.
+static void* checkpoint_thread(void *arg) {
+  (void) arg;
 
-      // Write the buffer to the file
-      if (write_error_check(fd, buffer) == -1) return -1;
+  pthread_mutex_lock(&checkpoint_state.mutex);
+  while (checkpoint_state.running) {
+    struct timespec deadline;
 
-      // Move to the next node
-      key_node = key_node->next;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += KVS_CHECKPOINT_MS / 1000;
+    deadline.tv_nsec += (KVS_CHECKPOINT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
     }
+    if (pthread_cond_timedwait(&checkpoint_state.wake,\
+      &checkpoint_state.mutex, &deadline) != ETIMEDOUT)
+      continue;
+    pthread_mutex_unlock(&checkpoint_state.mutex);
+
+    if (checkpoint_log(0)) fprintf(stderr, "Failed to checkpoint the log\n");
+
+    pthread_mutex_lock(&checkpoint_state.mutex);
+  }
+  pthread_mutex_unlock(&checkpoint_state.mutex);
+  return NULL;
+}
+
+
+/// Starts the thread that takes the checkpoints of the log.
+/// @return 0 if it is running, -1 otherwise.
+static int start_checkpoint_thread() {
+  pthread_condattr_t attr;
+
+  // Intervals are measured in monotonic time
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&checkpoint_state.wake, &attr);
+  pthread_condattr_destroy(&attr);
+
+  checkpoint_state.running = 1;
+  if (pthread_create(&checkpoint_state.thread, NULL, checkpoint_thread,\
+    NULL)) {
+    pthread_cond_destroy(&checkpoint_state.wake);
+    checkpoint_state.running = 0;
+    return -1;
   }
   return 0;
 }
 
 
+/// Stops the thread that takes the checkpoints of the log, if it runs.
+static void stop_checkpoint_thread() {
+  if (!checkpoint_state.running) return;
+
+  pthread_mutex_lock(&checkpoint_state.mutex);
+  checkpoint_state.running = 0;
+  pthread_cond_signal(&checkpoint_state.wake);
+  pthread_mutex_unlock(&checkpoint_state.mutex);
+  pthread_join(checkpoint_state.thread, NULL);
+  pthread_cond_destroy(&checkpoint_state.wake);
+}
+
+
+void kvs_backup_chain_end(BackupChain *chain) {
+#if KVS_DELTA_BACKUPS > 0
+  if (kvs_table == NULL) return;
+  pthread_mutex_lock(&chain_state.mutex);
+  set_chain_waiting(chain, 0);
+  pthread_mutex_unlock(&chain_state.mutex);
+#else
+  (void) chain;
+#endif
+}
+
+
+void kvs_wait_backups() {
+  pthread_mutex_lock(&backup_state.mutex);
+  while (backup_state.pending > 0)
+    pthread_cond_wait(&backup_state.done, &backup_state.mutex);
+  pthread_mutex_unlock(&backup_state.mutex);
+}
+
+
 int kvs_remove_subscription(int client_id, char *key) {
-  size_t indexList = (size_t) hash(key);
+  size_t stripe;
 
   if(hash_table_rdlock()) return -1;
 
-  if(hash_table_list_rdlock(indexList)){
+  stripe = get_lock_stripe(kvs_table, key);
+
+  if(hash_table_stripe_rdlock(stripe)){
     hash_table_unlock();
     return -1;
   }
 
-  KeyNode *key_node = kvs_table->table[indexList]->head;
+  KeyNode *key_node = find_key_node(kvs_table, key);
 
   if (key_node == NULL){
-    hash_table_list_unlock(indexList);
+    hash_table_stripe_unlock(stripe);
     hash_table_unlock();
     return -1;
   }
 
-  while (key_node != NULL) {
-    if (strcmp(key_node->key, key) == 0) {
-      avl_remove(key_node->avl_notif_fds, &client_id);
-
-      remove_key_session_avl(client_id, key);
-      dec_num_subs(client_id);
+  avl_remove(key_node->avl_notif_fds, &client_id);
 
-      hash_table_list_unlock(indexList);
-      hash_table_unlock();
-      return 0;
-    }
-    key_node = key_node->next; // Move to the next node
-  }
+  remove_key_session_avl(client_id, key);
+  dec_num_subs(client_id);
 
-  hash_table_list_unlock(indexList);
+  hash_table_stripe_unlock(stripe);
   hash_table_unlock();
-  return -1;
+  return 0;
 }
 
 
@@ -643,7 +2889,7 @@ int kvs_disconnect(int client_id){
 
 
 int kvs_subscribe(int client_id, int notif_fd, char *key){
-  size_t indexList = (size_t) hash(key);
+  size_t stripe;
 
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
@@ -652,19 +2898,21 @@ int kvs_subscribe(int client_id, int notif_fd, char *key){
 
   if (hash_table_rdlock()) return -1;
 
-  if (hash_table_list_rdlock(indexList)){
+  stripe = get_lock_stripe(kvs_table, key);
+
+  if (hash_table_stripe_rdlock(stripe)){
     hash_table_unlock();
     return -1;
   }
 
   if(get_avl_num_subs(client_id) == MAX_NUMBER_SUB){
-    hash_table_list_unlock(indexList);
+    hash_table_stripe_unlock(stripe);
     hash_table_unlock();
     return -1;
   }
 
   if(has_key(get_avl_client(client_id), key)){
-    hash_table_list_unlock(indexList);
+    hash_table_stripe_unlock(stripe);
     hash_table_unlock();
     return 0;
   }
@@ -672,27 +2920,27 @@ int kvs_subscribe(int client_id, int notif_fd, char *key){
   if (subscribe_pair(kvs_table, key, client_id, notif_fd) != 0) {
     fprintf(stderr, "Failed to subscribe client %d to key %s.\n", client_id,\
     key);
-    hash_table_list_unlock(indexList);
+    hash_table_stripe_unlock(stripe);
     hash_table_unlock();
     return -1;
   }
 
   if (add_key_session_avl(client_id, key) != 0) {
-    hash_table_list_unlock(indexList);
+    hash_table_stripe_unlock(stripe);
     hash_table_unlock();
     return -1;
   }
 
   inc_num_subs(client_id);
 
-  hash_table_list_unlock(indexList);
+  hash_table_stripe_unlock(stripe);
   hash_table_unlock();
   return 0;
 }
 
 
 int kvs_unsubscribe(int client_id, char *key){
-  size_t indexList = (size_t) hash(key);
+  size_t stripe;
 
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
@@ -701,13 +2949,15 @@ int kvs_unsubscribe(int client_id, char *key){
 
   if (hash_table_rdlock()) return -1;
 
-  if (hash_table_list_rdlock(indexList)){
+  stripe = get_lock_stripe(kvs_table, key);
+
+  if (hash_table_stripe_rdlock(stripe)){
     hash_table_unlock();
     return -1;
   }
 
   if(!has_key(get_avl_client(client_id), key)){
-    hash_table_list_unlock(indexList);
+    hash_table_stripe_unlock(stripe);
     hash_table_unlock();
     return -1;
   }
@@ -715,20 +2965,20 @@ int kvs_unsubscribe(int client_id, char *key){
   if (unsubscribe_pair(kvs_table, key, client_id) != 0) {
     fprintf(stderr, "Failed to unsubscribe client %d to key %s.\n", client_id,\
     key);
-    hash_table_list_unlock(indexList);
+    hash_table_stripe_unlock(stripe);
     hash_table_unlock();
     return -1;
   }
 
   if (remove_key_session_avl(client_id, key) != 0) {
-    hash_table_list_unlock(indexList);
+    hash_table_stripe_unlock(stripe);
     hash_table_unlock();
     return -1;
   }
 
   dec_num_subs(client_id);
 
-  hash_table_list_unlock(indexList);
+  hash_table_stripe_unlock(stripe);
   hash_table_unlock();
   return 0;
 
@@ -745,7 +2995,10 @@ void kvs_wait(unsigned int delay_ms) {
 /// @return value of the child's pid to parent process and 0 to child process.
 pid_t do_fork(){
   if (hash_table_wrlock()) return -1;
+  // Nor in the middle of starting or ending a snapshot (the child writes one)
+  pthread_mutex_lock(&kvs_table->snapshots_lock);
   pid_t pid = fork();
+  pthread_mutex_unlock(&kvs_table->snapshots_lock);
   hash_table_unlock();
   return pid;
 }
@@ -9,15 +9,33 @@
 #include <strings.h>
 #include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 
 #include "avl.h"
+#include "buffer.h"
+#include "compress.h"
+#include "dump.h"
 #include "kvs.h"
+#include "slab.h"
+#include "shard.h"
+#include "timer_wheel.h"
+#include "wal.h"
 #include "constants.h"
 #include "../common/safeFunctions.h"
 
 // Forward declaration of ClientData
 typedef struct ClientData ClientData;
 
+/// Pool of the clients' ClientData.
+extern SlabPool client_data_pool;
+
 /// Initializes the KVS state.
 /// @return 0 if the KVS state was initialized successfully, -1 otherwise.
 int kvs_init();
@@ -48,19 +66,34 @@ int avl_clean_sessions();
 /// Writes a key value pair to the KVS. If key already exists it is updated.
 /// @param num_pairs Number of pairs being written.
 /// @param keys Array of keys' strings.
-/// @param values Array of values' strings.
+/// @param values Values of the pairs (up to MAX_VALUE_SIZE bytes each).
+/// @param ttl_ms Time to live of the pairs in milliseconds, 0 if they don't
+/// expire. Expired pairs are deleted (and their subscribers notified).
 /// @return 0 if the pairs were written successfully, -1 otherwise.
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],\
-    char values[][MAX_STRING_SIZE]);
+    ValueList *values, unsigned int ttl_ms);
+
+
+/// Writes key value pairs whose keys still have the expected versions.
+/// @param fd File descriptor to write the output.
+/// @param num_pairs Number of pairs being written.
+/// @param keys Array of keys' strings.
+/// @param versions Versions expected for the keys (0 if the key must not
+/// exist), replaced by the new version or, if it didn't match, the current.
+/// @param values Values of the pairs (up to MAX_VALUE_SIZE bytes each).
+/// @return 0 if the pairs were checked successfully, -1 otherwise.
+int kvs_cas(int fd, size_t num_pairs, char keys[][MAX_STRING_SIZE],\
+    uint64_t versions[], ValueList *values);
 
 
 /// Reads values from the KVS.
 /// @param fd File descriptor to write the output.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
-/// @param fd File descriptor to write the (successful) output.
+/// @param with_versions 1 to also write the version of each value.
 /// @return 0 if the key reading, -1 otherwise.
-int kvs_read(int fd, size_t num_pairs, char keys[][MAX_STRING_SIZE]);
+int kvs_read(int fd, size_t num_pairs, char keys[][MAX_STRING_SIZE],\
+    int with_versions);
 
 
 /// Deletes key value pairs from the KVS.
@@ -71,16 +104,141 @@ int kvs_read(int fd, size_t num_pairs, char keys[][MAX_STRING_SIZE]);
 int kvs_delete(int fd, size_t num_pairs, char keys[][MAX_STRING_SIZE]);
 
 
-/// Writes the state of the KVS.
+/// Optimistic attempts of a COMMIT before it runs with its keys' stripes
+/// locked from the start.
+#define TXN_OPTIMISTIC_ATTEMPTS 4
+
+/// Initializer of an empty transaction.
+#define KVS_TRANSACTION_INITIALIZER\
+  {BUFFER_INITIALIZER, BUFFER_INITIALIZER, BUFFER_INITIALIZER}
+
+/// Commands of a transaction (between a BEGIN and a COMMIT of a job file),
+/// kept until the COMMIT runs them as a single atomic operation.
+typedef struct KvsTransaction {
+  Buffer commands;      // Kind and keys of each command.
+  Buffer keys;          // Keys of the commands, with their values.
+  Buffer values;        // Values of the writes, back to back.
+} KvsTransaction;
+
+
+/// Adds a WRITE to a transaction.
+/// @param txn The transaction.
+/// @param num_pairs Number of pairs being written.
+/// @param keys Array of keys' strings.
+/// @param values Values of the pairs (up to MAX_VALUE_SIZE bytes each).
+/// @return 0 if the write was added, -1 otherwise.
+int kvs_txn_write(KvsTransaction *txn, size_t num_pairs,\
+    char keys[][MAX_STRING_SIZE], ValueList *values);
+
+
+/// Adds a READ to a transaction, its values are written by the COMMIT.
+/// @param txn The transaction.
+/// @param num_pairs Number of pairs to read.
+/// @param keys Array of keys' strings.
+/// @return 0 if the read was added, -1 otherwise.
+int kvs_txn_read(KvsTransaction *txn, size_t num_pairs,\
+    char keys[][MAX_STRING_SIZE]);
+
+
+/// Adds a DELETE to a transaction, its missing keys are written by the
+/// COMMIT.
+/// @param txn The transaction.
+/// @param num_pairs Number of pairs to delete.
+/// @param keys Array of keys' strings.
+/// @return 0 if the delete was added, -1 otherwise.
+int kvs_txn_delete(KvsTransaction *txn, size_t num_pairs,\
+    char keys[][MAX_STRING_SIZE]);
+
+
+/// Runs the commands of a transaction as one atomic operation and empties
+/// it. The commands run without locks and are validated (by the versions of
+/// the keys they read) with only their keys' stripes locked, being run
+/// again if another operation changed those keys.
+/// @param fd File descriptor to write the output of the reads and deletes.
+/// @param txn The transaction.
+/// @return 0 if the transaction was committed, -1 otherwise.
+int kvs_commit(int fd, KvsTransaction *txn);
+
+
+/// Empties a transaction without running it.
+/// @param txn The transaction.
+void kvs_txn_clear(KvsTransaction *txn);
+
+
+/// Frees the memory of a transaction.
+/// @param txn The transaction.
+void kvs_txn_free(KvsTransaction *txn);
+
+
+/// Writes, in key order, the pairs whose key is in a range or has a prefix.
 /// @param fd File descriptor to write the output.
-int kvs_show(int fd);
+/// @param start First key of the range, or the prefix if end is NULL.
+/// @param end Last key of the range (inclusive), NULL to scan by prefix.
+/// @return 0 if the scan was successful, -1 otherwise.
+int kvs_scan(int fd, const char *start, const char *end);
+
+
+/// Writes the KVS's stats: the lookups of missing keys the Bloom filters
+/// answered, the ones they let through, the rate of the latter and the
+/// counters the filters have (in total and per key).
+/// @param fd File descriptor to write the output.
+/// @return 0 if the stats were written successfully, -1 otherwise.
+int kvs_stats(int fd);
 
 
-/// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
+/// Writes the state of the KVS at one point in time (a snapshot), while
+/// writes to it go on.
 /// @param fd File descriptor to write the output.
-/// @return 0 if the backup was successful, -1 otherwise.
-int kvs_backup(int fd);
+/// @return 0 if the state was written successfully, -1 otherwise.
+int kvs_show(int fd);
+
+
+/// Initializer of a chain with no backups yet.
+#define BACKUP_CHAIN_INITIALIZER {0, 0, NULL}
+
+/// Backups of one job file, each one a delta of the one before it except
+/// every KVS_DELTA_BACKUPS-th, a full base (see kvs_merge.c).
+typedef struct BackupChain {
+  uint64_t timestamp;   // Commit timestamp the last backup was cut at.
+  size_t num_backups;   // Backups started in the chain.
+  struct BackupChain *next; // Next chain waiting for a delta.
+} BackupChain;
+
+
+/// Starts a backup of the KVS state: the snapshot is taken now and queued,
+/// and the caller goes on. A pool of max_backups backup workers (started by
+/// the first backup, stopped by kvs_terminate) writes the queued backups to
+/// their files, oldest first, each one with the threads of KVS_BACKUP_WORKERS
+/// or from a forked child (see KVS_FORK_BACKUPS). A queued backup's snapshot
+/// keeps the pairs replaced after it until it is written.
+/// With KVS_DELTA_BACKUPS the backup starts with a "BASE <timestamp>
+/// <stripes>" or "DELTA <since> <timestamp> <stripes>" line and ends with
+/// "END". A delta only has the pairs written after the last backup of its
+/// chain, and a "DELETE <key>" line per key deleted since (deletes keep a
+/// tombstone of the key while a chain's next backup may need it).
+/// @param fd File descriptor of the backup file, closed once written.
+/// @param max_backups Most backups written at once.
+/// @param chain Earlier backups of the job file.
+/// @return 0 if the backup was started, -1 otherwise (fd is closed).
+int kvs_backup_start(int fd, size_t max_backups, BackupChain *chain);
+
+
+/// Ends a chain of backups, whose deletes no longer need tombstones.
+/// @param chain The chain.
+void kvs_backup_chain_end(BackupChain *chain);
+
+
+/// Waits until every backup started by kvs_backup_start is written.
+void kvs_wait_backups();
+
+
+/// Loads the pairs of a dump (a backup written with KVS_BINARY_BACKUPS)
+/// into the KVS, growing the table for them first. Its sections are loaded
+/// by a thread per core. With KVS_WAL_PATH, the log is then checkpointed so
+/// the pairs survive a restart.
+/// @param path Path of the dump.
+/// @return 0 if every pair was loaded, -1 otherwise.
+int kvs_restore(const char *path);
 
 
 /// Gets the AVL tree subscritions of a session.
@@ -1,11 +1,70 @@
 #include "parser.h"
 
+#include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "constants.h"
+#include "../common/constants.h"
+
+
+/// Bytes read ahead from the file being parsed, so a value isn't read one
+/// byte per system call. A thread parses one file at a time, always up to
+/// its end (where nothing is left read ahead).
+static _Thread_local struct {
+  int fd;                          // File the bytes were read from.
+  size_t start;                    // Next byte to be parsed.
+  size_t end;                      // End of the bytes read ahead.
+  char data[PARSER_READ_AHEAD];    // Bytes read ahead.
+} read_ahead = {-1, 0, 0, {0}};
+
+
+/// Reads bytes from the file being parsed, through the read ahead buffer.
+/// @param fd File descriptor to read from.
+/// @param buffer Buffer to read into.
+/// @param size Number of bytes to read.
+/// @return Number of bytes read (less than size only at the end of the
+/// file), -1 on error.
+static ssize_t read_buffered(int fd, void *buffer, size_t size) {
+  size_t done = 0;
+
+  if (read_ahead.fd != fd) {
+    read_ahead.fd = fd;
+    read_ahead.start = read_ahead.end = 0;
+  }
+
+  while (done < size) {
+    size_t chunk = read_ahead.end - read_ahead.start;
+
+    if (chunk == 0) {
+      ssize_t bytes_read = read(fd, read_ahead.data, PARSER_READ_AHEAD);
+
+      if (bytes_read == -1 && errno == EINTR) {
+        continue;
+      }
+
+      if (bytes_read <= 0) {
+        return done > 0 ? (ssize_t)done : bytes_read;
+      }
+
+      read_ahead.start = 0;
+      read_ahead.end = (size_t)bytes_read;
+      chunk = (size_t)bytes_read;
+    }
+
+    if (chunk > size - done) {
+      chunk = size - done;
+    }
+
+    memcpy((char *)buffer + done, read_ahead.data + read_ahead.start, chunk);
+    read_ahead.start += chunk;
+    done += chunk;
+  }
+
+  return (ssize_t)done;
+}
 
 
 static int read_string(int fd, char *buffer, size_t max) {
@@ -15,7 +74,7 @@ static int read_string(int fd, char *buffer, size_t max) {
   int value = -1;
 
   while (i < max) {
-    bytes_read = read(fd, &ch, 1);
+    bytes_read = read_buffered(fd, &ch, 1);
 
     if (bytes_read <= 0) {
         return -1;
@@ -47,12 +106,60 @@ static int read_string(int fd, char *buffer, size_t max) {
 }
 
 
+/// Reads a value, up to the ')' that ends it, to the end of a list.
+/// @param fd File descriptor to read from.
+/// @param values List the value is added to.
+/// @param index Position of the value in the list.
+/// @return 0 if the value was read, 1 if the line ended before it did, -1
+/// on error.
+static int read_value(int fd, ValueList *values, size_t index) {
+  Buffer *buffer = &values->buffer;
+  size_t start = buffer->length;
+  char ch;
+
+  while (1) {
+    if (read_buffered(fd, &ch, 1) != 1) {
+      return -1;
+    }
+
+    if (ch == ')') {
+      break;
+    }
+
+    if (ch == '\n') {
+      return 1;
+    }
+
+    if (ch == ' ' || ch == ',' || ch == ']' ||
+        buffer->length - start == MAX_VALUE_SIZE) {
+      return -1;
+    }
+
+    if (buffer_reserve(buffer, 2) != 0) {
+      return -1;
+    }
+
+    buffer->data[buffer->length++] = ch;
+  }
+
+  values->offsets[index] = start;
+  values->lengths[index] = buffer->length - start;
+
+  if (buffer_reserve(buffer, 1) != 0) {
+    return -1;
+  }
+
+  buffer->data[buffer->length++] = '\0';
+  return 0;
+}
+
+
 static int read_uint(int fd, unsigned int *value, char *next) {
   char buf[16];
 
   int i = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    if (read_buffered(fd, buf + i, 1) == 0) {
       *next = '\0';
       break;
     }
@@ -81,21 +188,28 @@ static int read_uint(int fd, unsigned int *value, char *next) {
 
 static void cleanup(int fd) {
   char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
+  while (read_buffered(fd, &ch, 1) == 1 && ch != '\n')
     ;
 }
 
 
 enum Command get_next(int fd) {
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  if (read_buffered(fd, buf, 1) != 1) {
     return EOC;
   }
 
   switch (buf[0]) {
     case 'W':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-        if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
+      if (read_buffered(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+        if (read_buffered(fd, buf + 5, 1) == 1 && strncmp(buf, "WRITE_", 6) == 0) {
+          if (read_buffered(fd, buf + 6, 4) != 4 || strncmp(buf, "WRITE_TTL ", 10) != 0) {
+            cleanup(fd);
+            return CMD_INVALID;
+          }
+          return CMD_WRITE_TTL;
+        }
+        if (strncmp(buf, "WRITE ", 6) != 0) {
           cleanup(fd);
           return CMD_INVALID;
         }
@@ -105,15 +219,56 @@ enum Command get_next(int fd) {
       return CMD_WAIT;
 
     case 'R':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+      if (read_buffered(fd, buf + 1, 4) != 4 || strncmp(buf, "READ", 4) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      if (buf[4] == 'V') {
+        if (read_buffered(fd, buf + 5, 1) != 1 || buf[5] != ' ') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+
+        return CMD_READV;
+      }
+
+      if (buf[4] != ' ') {
         cleanup(fd);
         return CMD_INVALID;
       }
 
       return CMD_READ;
 
+    case 'C':
+      if (read_buffered(fd, buf + 1, 1) != 1) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      if (buf[1] == 'O') {
+        if (read_buffered(fd, buf + 2, 4) != 4 || strncmp(buf, "COMMIT", 6) != 0) {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+
+        if (read_buffered(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+
+        return CMD_COMMIT;
+      }
+
+      if (read_buffered(fd, buf + 2, 2) != 2 || strncmp(buf, "CAS ", 4) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_CAS;
+
     case 'D':
-      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
+      if (read_buffered(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -121,12 +276,40 @@ enum Command get_next(int fd) {
       return CMD_DELETE;
 
     case 'S':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
+      if (read_buffered(fd, buf + 1, 3) != 3) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+      if (strncmp(buf, "SCAN", 4) == 0) {
+        if (read_buffered(fd, buf + 4, 1) != 1 || buf[4] != ' ') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+
+        return CMD_SCAN;
+      }
+
+      if (strncmp(buf, "STAT", 4) == 0) {
+        if (read_buffered(fd, buf + 4, 1) != 1 || buf[4] != 'S') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+
+        if (read_buffered(fd, buf + 5, 1) != 0 && buf[5] != '\n') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+
+        return CMD_STATS;
+      }
+
+      if (strncmp(buf, "SHOW", 4) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      if (read_buffered(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -134,12 +317,31 @@ enum Command get_next(int fd) {
       return CMD_SHOW;
 
     case 'B':
-      if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
+      if (read_buffered(fd, buf + 1, 1) != 1) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      if (buf[1] == 'E') {
+        if (read_buffered(fd, buf + 2, 3) != 3 || strncmp(buf, "BEGIN", 5) != 0) {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+
+        if (read_buffered(fd, buf + 5, 1) != 0 && buf[5] != '\n') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+
+        return CMD_BEGIN;
+      }
+
+      if (read_buffered(fd, buf + 2, 4) != 4 || strncmp(buf, "BACKUP", 6) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
+      if (read_buffered(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -147,12 +349,12 @@ enum Command get_next(int fd) {
       return CMD_BACKUP;
 
     case 'H':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+      if (read_buffered(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+      if (read_buffered(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -173,14 +375,18 @@ enum Command get_next(int fd) {
 }
 
 
-int parse_pair(int fd, char *key, char *value) {
+int parse_pair(int fd, char *key, ValueList *values, size_t index) {
+  int result;
+
   if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
     cleanup(fd);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
-    cleanup(fd);
+  if ((result = read_value(fd, values, index)) != 0) {
+    if (result == -1) {
+      cleanup(fd);
+    }
     return 0;
   }
 
@@ -188,32 +394,106 @@ int parse_pair(int fd, char *key, char *value) {
 }
 
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], ValueList *values, size_t max_pairs, size_t max_string_size) {
+  char ch;
+
+  if (read_buffered(fd, &ch, 1) != 1 || ch != '[') {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read_buffered(fd, &ch, 1) != 1 || ch != '(') {
+    cleanup(fd);
+    return 0;
+  }
+
+  size_t num_pairs = 0;
+  char key[max_string_size];
+  values->buffer.length = 0;
+  while (num_pairs < max_pairs) {
+    if(parse_pair(fd, key, values, num_pairs) == 0) {
+      return 0;
+    }
+
+    strcpy(keys[num_pairs++], key);
+
+    if (read_buffered(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+      cleanup(fd);
+      return 0;
+    }
+
+    if (ch == ']') {
+      break;
+    }
+  }
+
+  if (num_pairs == max_pairs) {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read_buffered(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    return 0;
+  }
+
+  return num_pairs;
+}
+
+
+int parse_ttl(int fd, unsigned int *ttl_ms) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
+  if (read_uint(fd, ttl_ms, &ch) != 0 || ch != ' ' || *ttl_ms == 0) {
+    cleanup(fd);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+size_t parse_cas(int fd, char keys[][MAX_STRING_SIZE], uint64_t versions[], ValueList *values, size_t max_pairs, size_t max_string_size) {
+  char ch;
+
+  if (read_buffered(fd, &ch, 1) != 1 || ch != '[') {
     cleanup(fd);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '(') {
+  if (read_buffered(fd, &ch, 1) != 1 || ch != '(') {
     cleanup(fd);
     return 0;
   }
 
   size_t num_pairs = 0;
   char key[max_string_size];
-  char value[max_string_size];
+  char version[max_string_size];
+  int result;
+  values->buffer.length = 0;
   while (num_pairs < max_pairs) {
-    if(parse_pair(fd, key, value) == 0) {
+    if (read_string(fd, key, max_string_size - 1) != 0 ||
+        read_string(fd, version, max_string_size - 1) != 0) {
       cleanup(fd);
       return 0;
     }
 
+    if (version[0] == '\0' || strspn(version, "0123456789") != strlen(version)) {
+      cleanup(fd);
+      return 0;
+    }
+
+    if ((result = read_value(fd, values, num_pairs)) != 0) {
+      if (result == -1) {
+        cleanup(fd);
+      }
+      return 0;
+    }
+
     strcpy(keys[num_pairs], key);
-    strcpy(values[num_pairs++], value);
+    versions[num_pairs++] = strtoull(version, NULL, 10);
 
-    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+    if (read_buffered(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
       cleanup(fd);
       return 0;
     }
@@ -228,7 +508,7 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+  if (read_buffered(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
     cleanup(fd);
     return 0;
   }
@@ -240,7 +520,7 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
 size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
+  if (read_buffered(fd, &ch, 1) != 1 || ch != '[') {
     cleanup(fd);
     return 0;
   }
@@ -266,7 +546,7 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+  if (read_buffered(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
     cleanup(fd);
     return 0;
   }
@@ -275,6 +555,52 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
 }
 
 
+int parse_scan(int fd, char *start, char *end, size_t max_string_size) {
+  char ch;
+  int type;
+
+  if (read_buffered(fd, &ch, 1) != 1) {
+    return -1;
+  }
+
+  if (ch == '[') {
+    if (read_string(fd, start, max_string_size) != 0 ||
+        read_string(fd, end, max_string_size) != 2) {
+      cleanup(fd);
+      return -1;
+    }
+
+    type = 0;
+  } else {
+    size_t i = 0;
+
+    // The prefix goes up to the '*'
+    while (ch != '*') {
+      if (i == max_string_size || strchr(" ,()[]\n", ch) != NULL) {
+        if (ch != '\n') cleanup(fd);
+        return -1;
+      }
+
+      start[i++] = ch;
+
+      if (read_buffered(fd, &ch, 1) != 1) {
+        return -1;
+      }
+    }
+
+    start[i] = '\0';
+    type = 1;
+  }
+
+  if (read_buffered(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    return -1;
+  }
+
+  return type;
+}
+
+
 int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   char ch;
 
@@ -2,13 +2,25 @@
 #define KVS_PARSER_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include "constants.h"
+#include "buffer.h"
+
+/// Bytes the parser reads ahead from the file being parsed.
+#define PARSER_READ_AHEAD 4096
 
 enum Command {
   CMD_WRITE,
+  CMD_WRITE_TTL,
+  CMD_CAS,
   CMD_READ,
+  CMD_READV,
   CMD_DELETE,
   CMD_SHOW,
+  CMD_SCAN,
+  CMD_STATS,
+  CMD_BEGIN,
+  CMD_COMMIT,
   CMD_WAIT,
   CMD_BACKUP,
   CMD_HELP,
@@ -22,14 +34,33 @@ enum Command {
 /// @return The command read.
 enum Command get_next(int fd);
 
-/// Parses a WRITE command.
+/// Parses a WRITE command. Values are streamed into the list, so they can be
+/// up to MAX_VALUE_SIZE bytes long.
 /// @param fd File descriptor to read from.
 /// @param keys Array of keys to be written.
-/// @param values Array of values to be written.
+/// @param values List replaced by the values to be written.
 /// @param max_pairs number of pairs to be written.
-/// @param max_string_size maximum size for keys and values.
-/// @return 0 if the command was parsed successfully, 1 otherwise.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
+/// @param max_string_size maximum size for keys.
+/// @return Number of pairs parsed. 0 on failure.
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], ValueList *values, size_t max_pairs, size_t max_string_size);
+
+/// Parses the time to live of a WRITE_TTL command, the pairs that follow it
+/// are parsed with parse_write.
+/// @param fd File descriptor to read from.
+/// @param ttl_ms Pointer to the variable to store the time to live in.
+/// @return 0 if the time to live was parsed successfully, -1 otherwise.
+int parse_ttl(int fd, unsigned int *ttl_ms);
+
+/// Parses a CAS command.
+/// @param fd File descriptor to read from.
+/// @param keys Array of keys to be written.
+/// @param versions Array of versions expected for the keys.
+/// @param values List replaced by the values to be written (up to
+/// MAX_VALUE_SIZE bytes each).
+/// @param max_pairs number of pairs to be written.
+/// @param max_string_size maximum size for keys and versions.
+/// @return Number of pairs parsed. 0 on failure.
+size_t parse_cas(int fd, char keys[][MAX_STRING_SIZE], uint64_t versions[], ValueList *values, size_t max_pairs, size_t max_string_size);
 
 /// Parses a READ or DELETE command.
 /// @param fd File descriptor to read from.
@@ -39,6 +70,14 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
 /// @return Number of keys read or deleted. 0 on failure.
 size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
 
+/// Parses a SCAN command, either SCAN [start,end] or SCAN prefix*.
+/// @param fd File descriptor to read from.
+/// @param start Buffer to store the first key of the range or the prefix.
+/// @param end Buffer to store the last key of the range.
+/// @param max_string_size maximum size for keys.
+/// @return 0 if a range was parsed, 1 if a prefix was parsed, -1 on error.
+int parse_scan(int fd, char *start, char *end, size_t max_string_size);
+
 /// Parses a WAIT command.
 /// @param fd File descriptor to read from.
 /// @param delay Pointer to the variable to store the wait delay in.
@@ -0,0 +1,257 @@
+#ifdef __linux__
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
+#include "shard.h"
+
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+
+static _Thread_local size_t producer_id = SHARD_MAX_PRODUCERS;
+
+
+/**
+ * Takes the next task of a queue, only called by the shard's owner.
+ *
+ * @param queue The queue.
+ * @return The task, NULL if the queue is empty.
+ */
+static ShardTask* queue_pop(ShardQueue *queue) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    ShardTask *task;
+
+    if (head == atomic_load_explicit(&queue->tail, memory_order_acquire))
+        return NULL;
+    task = queue->tasks[head & (SHARD_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return task;
+}
+
+
+/**
+ * Runs a task and, if it was the last of its batch, wakes the submitter.
+ *
+ * @param task The task.
+ */
+static void run_task(ShardTask *task) {
+    ShardBatch *batch = task->batch;
+
+    task->run(task);
+
+    pthread_mutex_lock(&batch->mutex);
+    if (--batch->pending == 0) pthread_cond_signal(&batch->done);
+    pthread_mutex_unlock(&batch->mutex);
+}
+
+
+/**
+ * Runs every task queued in a shard.
+ *
+ * @param shard The shard.
+ * @return Number of tasks run.
+ */
+static size_t drain_shard(Shard *shard) {
+    size_t num_producers = atomic_load(&shard->engine->num_producers);
+    size_t ran = 0;
+
+    if (num_producers > SHARD_MAX_PRODUCERS)
+        num_producers = SHARD_MAX_PRODUCERS;
+
+    for (size_t i = 0; i < num_producers; i++) {
+        ShardTask *task;
+
+        while ((task = queue_pop(&shard->queues[i])) != NULL) {
+            run_task(task);
+            ran++;
+        }
+    }
+    return ran;
+}
+
+
+/**
+ * Checks if any queue of a shard has tasks.
+ *
+ * @param shard The shard.
+ * @return 1 if a task is queued, 0 otherwise.
+ */
+static int shard_has_tasks(Shard *shard) {
+    for (size_t i = 0; i < SHARD_MAX_PRODUCERS; i++) {
+        if (atomic_load(&shard->queues[i].head) !=\
+            atomic_load(&shard->queues[i].tail))
+            return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Pins the calling thread to one of the online cores.
+ *
+ * @param id Position of the thread's shard.
+ */
+static void pin_to_core(size_t id) {
+#ifdef __linux__
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpu_set;
+
+    if (cores <= 0) return;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(id % (size_t) cores, &cpu_set);
+    // Not being pinned only costs locality
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_set);
+#else
+    (void) id;
+#endif
+}
+
+
+/**
+ * Owner thread of a shard, runs its tasks until the engine stops.
+ *
+ * @param arg The shard.
+ * @return NULL.
+ */
+static void* shard_owner(void *arg) {
+    Shard *shard = arg;
+
+    pin_to_core(shard->id);
+    while (1) {
+        if (drain_shard(shard) > 0) continue;
+
+        pthread_mutex_lock(&shard->mutex);
+        atomic_store(&shard->sleeping, true);
+        // Producers check sleeping after queueing, look again before waiting
+        if (!shard_has_tasks(shard)) {
+            if (!atomic_load(&shard->running)) {
+                pthread_mutex_unlock(&shard->mutex);
+                break;
+            }
+            pthread_cond_wait(&shard->wake, &shard->mutex);
+        }
+        atomic_store(&shard->sleeping, false);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    return NULL;
+}
+
+
+/**
+ * Wakes up the owner of a shard if it is waiting for tasks.
+ *
+ * @param shard The shard.
+ * @param stop 1 to also tell the owner to stop.
+ */
+static void wake_owner(Shard *shard, int stop) {
+    if (!stop && !atomic_load(&shard->sleeping)) return;
+
+    pthread_mutex_lock(&shard->mutex);
+    if (stop) atomic_store(&shard->running, false);
+    pthread_cond_signal(&shard->wake);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+
+int shard_engine_start(ShardEngine *engine, size_t num_shards) {
+    engine->shards = aligned_alloc(_Alignof(Shard), num_shards * sizeof(Shard));
+    if (engine->shards == NULL) return -1;
+    engine->num_shards = num_shards;
+    engine->pid = getpid();
+    atomic_init(&engine->num_producers, 0);
+
+    for (size_t i = 0; i < num_shards; i++) {
+        Shard *shard = &engine->shards[i];
+
+        for (size_t j = 0; j < SHARD_MAX_PRODUCERS; j++) {
+            atomic_init(&shard->queues[j].head, 0);
+            atomic_init(&shard->queues[j].tail, 0);
+        }
+        shard->engine = engine;
+        shard->id = i;
+        atomic_init(&shard->sleeping, false);
+        atomic_init(&shard->running, true);
+        pthread_mutex_init(&shard->mutex, NULL);
+        pthread_cond_init(&shard->wake, NULL);
+
+        if (pthread_create(&shard->thread, NULL, shard_owner, shard)) {
+            // Stop the owners already started
+            engine->num_shards = i;
+            shard_engine_stop(engine);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+void shard_engine_stop(ShardEngine *engine) {
+    if (engine->shards == NULL) return;
+
+    // A forked child has the shards' memory but not their owners
+    if (engine->pid == getpid()) {
+        for (size_t i = 0; i < engine->num_shards; i++)
+            wake_owner(&engine->shards[i], 1);
+        for (size_t i = 0; i < engine->num_shards; i++)
+            pthread_join(engine->shards[i].thread, NULL);
+    }
+    for (size_t i = 0; i < engine->num_shards; i++) {
+        pthread_mutex_destroy(&engine->shards[i].mutex);
+        pthread_cond_destroy(&engine->shards[i].wake);
+    }
+    free(engine->shards);
+    engine->shards = NULL;
+}
+
+
+int shard_batch_init(ShardBatch *batch, size_t num_tasks) {
+    batch->pending = num_tasks;
+    if (pthread_mutex_init(&batch->mutex, NULL)) return -1;
+    if (pthread_cond_init(&batch->done, NULL)) {
+        pthread_mutex_destroy(&batch->mutex);
+        return -1;
+    }
+    return 0;
+}
+
+
+void shard_batch_wait(ShardBatch *batch) {
+    pthread_mutex_lock(&batch->mutex);
+    while (batch->pending > 0) pthread_cond_wait(&batch->done, &batch->mutex);
+    pthread_mutex_unlock(&batch->mutex);
+
+    pthread_mutex_destroy(&batch->mutex);
+    pthread_cond_destroy(&batch->done);
+}
+
+
+int shard_can_submit(ShardEngine *engine) {
+    if (producer_id == SHARD_MAX_PRODUCERS) {
+        size_t id = atomic_load(&engine->num_producers);
+
+        // Claim the next queue, if any is left
+        do {
+            if (id >= SHARD_MAX_PRODUCERS) return 0;
+        } while (!atomic_compare_exchange_weak(&engine->num_producers, &id,\
+            id + 1));
+        producer_id = id;
+    }
+    return 1;
+}
+
+
+void shard_submit(ShardEngine *engine, size_t shard_id, ShardTask *task) {
+    Shard *shard = &engine->shards[shard_id];
+    ShardQueue *queue = &shard->queues[producer_id];
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    // Full queue, the owner is still running this producer's older tasks
+    while (tail - atomic_load_explicit(&queue->head, memory_order_acquire) ==\
+        SHARD_QUEUE_SIZE)
+        sched_yield();
+
+    queue->tasks[tail & (SHARD_QUEUE_SIZE - 1)] = task;
+    atomic_store(&queue->tail, tail + 1);
+    wake_owner(shard, 0);
+}
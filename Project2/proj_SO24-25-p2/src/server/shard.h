@@ -0,0 +1,120 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/// Maximum number of threads that can submit tasks to the shards.
+#define SHARD_MAX_PRODUCERS 64
+/// Number of tasks each producer can have queued in a shard (power of two).
+#define SHARD_QUEUE_SIZE 16
+
+
+// Tasks submitted together, the submitter waits for all of them.
+typedef struct ShardBatch {
+    size_t pending;                 // Tasks not finished yet.
+    pthread_mutex_t mutex;          // Protects pending.
+    pthread_cond_t done;            // Signaled when pending reaches 0.
+} ShardBatch;
+
+
+// Work run by the owner of a shard, embedded in the submitter's task data.
+typedef struct ShardTask {
+    void (*run)(struct ShardTask *task); // Function run by the owner.
+    ShardBatch *batch;              // Batch of the task.
+} ShardTask;
+
+
+// Single-producer single-consumer ring of tasks.
+typedef struct ShardQueue {
+    _Alignas(64) atomic_size_t head; // Next task to run (owner side).
+    _Alignas(64) atomic_size_t tail; // Next free slot (producer side).
+    ShardTask *tasks[SHARD_QUEUE_SIZE]; // Queued tasks.
+} ShardQueue;
+
+
+// Shard owned by one thread, with a queue for each producer.
+typedef struct Shard {
+    ShardQueue queues[SHARD_MAX_PRODUCERS]; // Queues of the producers.
+    struct ShardEngine *engine;     // Engine of the shard.
+    size_t id;                      // Position of the shard.
+    pthread_t thread;               // Owner thread.
+    pthread_mutex_t mutex;          // Mutex of the owner's sleep.
+    pthread_cond_t wake;            // Wakes up the owner.
+    atomic_bool sleeping;           // Owner is (about to be) waiting.
+    atomic_bool running;            // Cleared to stop the owner.
+} Shard;
+
+
+// Set of shards and their owner threads.
+typedef struct ShardEngine {
+    Shard *shards;                  // The shards.
+    size_t num_shards;              // Number of shards.
+    atomic_size_t num_producers;    // Producers that submitted tasks.
+    pid_t pid;                      // Process where the owners run.
+} ShardEngine;
+
+
+/**
+ * Starts the owner thread of each shard, pinned to a core.
+ *
+ * @param engine Engine to start.
+ * @param num_shards Number of shards.
+ * @return 0 on success, -1 otherwise.
+ */
+int shard_engine_start(ShardEngine *engine, size_t num_shards);
+
+
+/**
+ * Stops the owner threads after their queued tasks and frees the shards.
+ * In a forked child (where the owners don't exist) only frees the shards.
+ *
+ * @param engine Engine to stop.
+ */
+void shard_engine_stop(ShardEngine *engine);
+
+
+/**
+ * Prepares a batch of tasks.
+ *
+ * @param batch The batch.
+ * @param num_tasks Number of tasks that will be submitted.
+ * @return 0 on success, -1 otherwise.
+ */
+int shard_batch_init(ShardBatch *batch, size_t num_tasks);
+
+
+/**
+ * Waits until every task of the batch has run and destroys it.
+ *
+ * @param batch The batch.
+ */
+void shard_batch_wait(ShardBatch *batch);
+
+
+/**
+ * Checks if the calling thread can submit tasks, claiming it a queue in
+ * each shard on first use.
+ *
+ * @param engine The engine.
+ * @return 1 if it can, 0 if every producer queue is taken.
+ */
+int shard_can_submit(ShardEngine *engine);
+
+
+/**
+ * Queues a task in a shard, to be run by its owner. The calling thread must
+ * be able to submit (see shard_can_submit).
+ *
+ * @param engine The engine.
+ * @param shard Position of the shard.
+ * @param task Task to run, stays owned by the caller until its batch ends.
+ */
+void shard_submit(ShardEngine *engine, size_t shard, ShardTask *task);
+
+
+#endif // SHARD_H
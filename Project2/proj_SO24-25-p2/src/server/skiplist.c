@@ -0,0 +1,196 @@
+#include "skiplist.h"
+
+
+/**
+ * Creates a skip list node.
+ *
+ * @param key Key of the node.
+ * @param item Item stored with the key.
+ * @param level Number of levels of the node.
+ * @return The new node, NULL on failure.
+ */
+static SkipListNode* create_skiplist_node(const char *key, void *item,\
+    int level) {
+    SkipListNode *node = malloc(sizeof(SkipListNode) +\
+        (size_t) level * sizeof(SkipListNode *));
+
+    if (node == NULL) return NULL;
+    node->key = key;
+    node->item = item;
+    node->level = level;
+    for (int i = 0; i < level; i++) node->next[i] = NULL;
+    return node;
+}
+
+
+/**
+ * Chooses the level of a new node, each level has a 1/4 chance of the next.
+ * The list must be locked to write.
+ *
+ * @param skiplist The skip list.
+ * @return Level of the new node.
+ */
+static int random_level(SkipList *skiplist) {
+    int level = 1;
+
+    // xorshift64, the list's lock already serializes the generator
+    skiplist->seed ^= skiplist->seed << 13;
+    skiplist->seed ^= skiplist->seed >> 7;
+    skiplist->seed ^= skiplist->seed << 17;
+
+    for (uint64_t bits = skiplist->seed; level < SKIPLIST_MAX_LEVEL &&\
+        (bits & 3) == 0; bits >>= 2)
+        level++;
+    return level;
+}
+
+
+/**
+ * Finds, in each level, the last node whose key is smaller than key.
+ *
+ * @param skiplist The skip list.
+ * @param key The key to look for.
+ * @param update Where the node of each level is stored, may be NULL.
+ * @return First node whose key isn't smaller than key, NULL if none.
+ */
+static SkipListNode* find_node(SkipList *skiplist, const char *key,\
+    SkipListNode *update[SKIPLIST_MAX_LEVEL]) {
+    SkipListNode *node = skiplist->head;
+
+    for (int i = skiplist->level - 1; i >= 0; i--) {
+        while (node->next[i] != NULL && strcmp(node->next[i]->key, key) < 0)
+            node = node->next[i];
+        if (update != NULL) update[i] = node;
+    }
+    return node->next[0];
+}
+
+
+SkipList* create_skiplist() {
+    SkipList *skiplist = malloc(sizeof(SkipList));
+
+    if (skiplist == NULL) return NULL;
+    skiplist->head = create_skiplist_node(NULL, NULL, SKIPLIST_MAX_LEVEL);
+    if (skiplist->head == NULL) {
+        free(skiplist);
+        return NULL;
+    }
+    if (pthread_rwlock_init(&skiplist->rwl, NULL)) {
+        free(skiplist->head);
+        free(skiplist);
+        return NULL;
+    }
+    skiplist->level = 1;
+    skiplist->seed = (uint64_t) (uintptr_t) skiplist | 1;
+    return skiplist;
+}
+
+
+SkipListNode* skiplist_new_node(SkipList *skiplist, const char *key,\
+    void *item) {
+    int level;
+
+    // The generator is only drawn from with the list locked
+    pthread_rwlock_wrlock(&skiplist->rwl);
+    level = random_level(skiplist);
+    pthread_rwlock_unlock(&skiplist->rwl);
+    return create_skiplist_node(key, item, level);
+}
+
+
+void skiplist_link_node(SkipList *skiplist, SkipListNode *node) {
+    SkipListNode *update[SKIPLIST_MAX_LEVEL];
+
+    pthread_rwlock_wrlock(&skiplist->rwl);
+    find_node(skiplist, node->key, update);
+
+    // New levels start at the head
+    for (int i = skiplist->level; i < node->level; i++)
+        update[i] = skiplist->head;
+    if (node->level > skiplist->level) skiplist->level = node->level;
+
+    for (int i = 0; i < node->level; i++) {
+        node->next[i] = update[i]->next[i];
+        update[i]->next[i] = node;
+    }
+    pthread_rwlock_unlock(&skiplist->rwl);
+}
+
+
+int skiplist_insert(SkipList *skiplist, const char *key, void *item) {
+    SkipListNode *node = skiplist_new_node(skiplist, key, item);
+
+    if (node == NULL) return -1;
+    skiplist_link_node(skiplist, node);
+    return 0;
+}
+
+
+int skiplist_remove(SkipList *skiplist, const char *key) {
+    SkipListNode *update[SKIPLIST_MAX_LEVEL], *node;
+
+    pthread_rwlock_wrlock(&skiplist->rwl);
+    node = find_node(skiplist, key, update);
+    if (node == NULL || strcmp(node->key, key) != 0) {
+        pthread_rwlock_unlock(&skiplist->rwl);
+        return -1;
+    }
+    for (int i = 0; i < node->level; i++) update[i]->next[i] = node->next[i];
+
+    // Drop the levels left empty
+    while (skiplist->level > 1 &&\
+        skiplist->head->next[skiplist->level - 1] == NULL)
+        skiplist->level--;
+    pthread_rwlock_unlock(&skiplist->rwl);
+
+    free(node);
+    return 0;
+}
+
+
+int skiplist_scan_range(SkipList *skiplist, const char *start,\
+    const char *end, int (*visit)(void *item, void *arg), void *arg) {
+    SkipListNode *node;
+    int result = 0;
+
+    pthread_rwlock_rdlock(&skiplist->rwl);
+    node = find_node(skiplist, start, NULL);
+    while (node != NULL && strcmp(node->key, end) <= 0) {
+        if ((result = visit(node->item, arg)) != 0) break;
+        node = node->next[0];
+    }
+    pthread_rwlock_unlock(&skiplist->rwl);
+    return result;
+}
+
+
+int skiplist_scan_prefix(SkipList *skiplist, const char *prefix,\
+    int (*visit)(void *item, void *arg), void *arg) {
+    size_t prefix_len = strlen(prefix);
+    SkipListNode *node;
+    int result = 0;
+
+    pthread_rwlock_rdlock(&skiplist->rwl);
+    // Keys with the prefix are the ones right after it
+    node = find_node(skiplist, prefix, NULL);
+    while (node != NULL && strncmp(node->key, prefix, prefix_len) == 0) {
+        if ((result = visit(node->item, arg)) != 0) break;
+        node = node->next[0];
+    }
+    pthread_rwlock_unlock(&skiplist->rwl);
+    return result;
+}
+
+
+void free_skiplist(SkipList *skiplist) {
+    SkipListNode *node = skiplist->head;
+
+    while (node != NULL) {
+        SkipListNode *next = node->next[0];
+
+        free(node);
+        node = next;
+    }
+    pthread_rwlock_destroy(&skiplist->rwl);
+    free(skiplist);
+}
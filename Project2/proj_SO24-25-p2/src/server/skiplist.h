@@ -0,0 +1,120 @@
+#ifndef SKIPLIST_H
+#define SKIPLIST_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/// Maximum number of levels of a skip list.
+#define SKIPLIST_MAX_LEVEL 16
+
+
+// Skip list node structure.
+typedef struct SkipListNode {
+    const char *key;                 // Key (owned by the item).
+    void *item;                      // Item stored with the key.
+    int level;                       // Number of levels of the node.
+    struct SkipListNode *next[];     // Next node in each level.
+} SkipListNode;
+
+
+// Skip list structure, keys kept in strcmp order.
+typedef struct SkipList {
+    SkipListNode *head;              // Sentinel node with every level.
+    int level;                       // Number of levels in use.
+    uint64_t seed;                   // State of the level generator.
+    pthread_rwlock_t rwl;            // Read-write lock.
+} SkipList;
+
+
+/**
+ * Creates a new empty skip list.
+ *
+ * @return Newly created skip list, NULL on failure.
+ */
+SkipList* create_skiplist();
+
+
+/**
+ * Inserts a key in the skip list. The key must not be in the list and must
+ * stay valid until it is removed.
+ *
+ * @param skiplist The skip list.
+ * @param key The key to insert.
+ * @param item Item stored with the key.
+ * @return 0 on success, -1 otherwise.
+ */
+int skiplist_insert(SkipList *skiplist, const char *key, void *item);
+
+
+/**
+ * Allocates the node of a key for skiplist_link_node, so inserting it later
+ * can't fail. A node that is never linked is freed with free.
+ *
+ * @param skiplist The skip list.
+ * @param key The key to insert (must stay valid until it is removed).
+ * @param item Item stored with the key.
+ * @return The node, NULL on failure.
+ */
+SkipListNode* skiplist_new_node(SkipList *skiplist, const char *key,\
+    void *item);
+
+
+/**
+ * Inserts a node made by skiplist_new_node. Its key must not be in the list.
+ *
+ * @param skiplist The skip list.
+ * @param node The node.
+ */
+void skiplist_link_node(SkipList *skiplist, SkipListNode *node);
+
+
+/**
+ * Removes a key from the skip list.
+ *
+ * @param skiplist The skip list.
+ * @param key The key to remove.
+ * @return 0 if the key was removed, -1 if it wasn't found.
+ */
+int skiplist_remove(SkipList *skiplist, const char *key);
+
+
+/**
+ * Visits, in key order, the items whose key is between start and end
+ * (both inclusive). The list is locked to read during the whole scan, so
+ * items aren't removed while they are visited.
+ *
+ * @param skiplist The skip list.
+ * @param start First key of the range.
+ * @param end Last key of the range.
+ * @param visit Function called with each item, stops the scan if not 0.
+ * @param arg Argument passed to visit.
+ * @return 0 on success, the value returned by visit if it stopped the scan.
+ */
+int skiplist_scan_range(SkipList *skiplist, const char *start,\
+    const char *end, int (*visit)(void *item, void *arg), void *arg);
+
+
+/**
+ * Visits, in key order, the items whose key starts with prefix.
+ *
+ * @param skiplist The skip list.
+ * @param prefix Prefix of the keys.
+ * @param visit Function called with each item, stops the scan if not 0.
+ * @param arg Argument passed to visit.
+ * @return 0 on success, the value returned by visit if it stopped the scan.
+ */
+int skiplist_scan_prefix(SkipList *skiplist, const char *prefix,\
+    int (*visit)(void *item, void *arg), void *arg);
+
+
+/**
+ * Frees the skip list (not the items).
+ *
+ * @param skiplist The skip list to free.
+ */
+void free_skiplist(SkipList *skiplist);
+
+
+#endif // SKIPLIST_H
@@ -0,0 +1,253 @@
+#include "slab.h"
+
+
+// Header at the start of every block, keeps the objects after it aligned.
+typedef union SlabHeader {
+    void *next;            // Next block of the pool.
+    max_align_t align;     // Alignment of the objects.
+} SlabHeader;
+
+
+// Free objects of one pool kept by a thread.
+typedef struct SlabCache {
+    SlabPool *pool;        // Pool of the objects, NULL if never used.
+    void *free_list;       // Free objects.
+    size_t count;          // Number of objects in free_list.
+} SlabCache;
+
+
+static atomic_int next_pool_id = 0;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static _Thread_local SlabCache thread_caches[SLAB_MAX_POOLS];
+
+
+/**
+ * Gets the object stored after a free object.
+ *
+ * @param object Free object.
+ * @return Next free object.
+ */
+static void *get_next_object(void *object) {
+    return *(void **) object;
+}
+
+
+/**
+ * Links a free object to the next one.
+ *
+ * @param object Free object.
+ * @param next Next free object.
+ */
+static void set_next_object(void *object, void *next) {
+    *(void **) object = next;
+}
+
+
+/**
+ * Gets the size of each object of a pool, rounded up so every object in a
+ * block stays aligned and can hold the free list link.
+ *
+ * @param pool The pool.
+ * @return Size of each object.
+ */
+static size_t get_object_size(SlabPool *pool) {
+    size_t alignment = _Alignof(max_align_t);
+    size_t size = pool->object_size;
+
+    if (size < sizeof(void *)) size = sizeof(void *);
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+
+/**
+ * Moves up to count objects from a free list to the pool's free list.
+ * The pool's mutex must be held.
+ *
+ * @param pool The pool.
+ * @param free_list Pointer to the list to take the objects from.
+ * @param count Number of objects to move.
+ * @return Number of objects moved.
+ */
+static size_t give_objects(SlabPool *pool, void **free_list, size_t count) {
+    size_t moved = 0;
+
+    while (moved < count && *free_list != NULL) {
+        void *object = *free_list;
+
+        *free_list = get_next_object(object);
+        set_next_object(object, pool->free_list);
+        pool->free_list = object;
+        moved++;
+    }
+    return moved;
+}
+
+
+/**
+ * Returns the objects cached by a thread that is exiting to their pools.
+ *
+ * @param caches The thread's caches.
+ */
+static void flush_caches(void *caches) {
+    SlabCache *slab_caches = caches;
+
+    for (int i = 0; i < SLAB_MAX_POOLS; i++) {
+        SlabPool *pool = slab_caches[i].pool;
+
+        if (pool == NULL) continue;
+        pthread_mutex_lock(&pool->mutex);
+        give_objects(pool, &slab_caches[i].free_list, slab_caches[i].count);
+        pthread_mutex_unlock(&pool->mutex);
+        slab_caches[i].count = 0;
+    }
+}
+
+
+/**
+ * Creates the thread-specific key used to flush caches on thread exit.
+ */
+static void create_cache_key() {
+    pthread_key_create(&cache_key, flush_caches);
+}
+
+
+/**
+ * Gets the calling thread's cache of a pool.
+ *
+ * @param pool The pool.
+ * @return The cache, or NULL if the pool has none (too many pools).
+ */
+static SlabCache *get_cache(SlabPool *pool) {
+    int id = atomic_load_explicit(&pool->id, memory_order_acquire);
+
+    if (id < 0) {
+        // First use of the pool, give it a position in the thread caches
+        pthread_mutex_lock(&pool->mutex);
+        id = atomic_load(&pool->id);
+        if (id < 0) {
+            id = atomic_fetch_add(&next_pool_id, 1);
+            atomic_store(&pool->id, id);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    if (id >= SLAB_MAX_POOLS) return NULL;
+
+    if (thread_caches[id].pool == NULL) {
+        pthread_once(&cache_key_once, create_cache_key);
+        pthread_setspecific(cache_key, thread_caches);
+        thread_caches[id].pool = pool;
+    }
+    return &thread_caches[id];
+}
+
+
+/**
+ * Allocates a new block and adds its objects to the pool's free list.
+ * The pool's mutex must be held.
+ *
+ * @param pool The pool.
+ * @return 0 on success, -1 if the block couldn't be allocated.
+ */
+static int grow_pool(SlabPool *pool) {
+    size_t object_size = get_object_size(pool);
+    size_t num_objects = (SLAB_SIZE - sizeof(SlabHeader)) / object_size;
+    SlabHeader *slab;
+    char *objects;
+
+    if (num_objects == 0) num_objects = 1; // Objects bigger than a block
+    slab = malloc(sizeof(SlabHeader) + num_objects * object_size);
+    if (slab == NULL) return -1;
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    objects = (char *) (slab + 1);
+    for (size_t i = 0; i < num_objects; i++) {
+        set_next_object(objects + i * object_size, pool->free_list);
+        pool->free_list = objects + i * object_size;
+    }
+    return 0;
+}
+
+
+void *slab_alloc(SlabPool *pool) {
+    SlabCache *cache = get_cache(pool);
+    void *object;
+
+    if (cache != NULL && cache->free_list != NULL) {
+        object = cache->free_list;
+        cache->free_list = get_next_object(object);
+        cache->count--;
+        return object;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->free_list == NULL && grow_pool(pool)) {
+        pthread_mutex_unlock(&pool->mutex);
+        return NULL;
+    }
+    object = pool->free_list;
+    pool->free_list = get_next_object(object);
+
+    // Refill the thread's cache while the pool is locked
+    if (cache != NULL) {
+        while (cache->count < SLAB_CACHE_SIZE / 2 && pool->free_list != NULL) {
+            void *cached = pool->free_list;
+
+            pool->free_list = get_next_object(cached);
+            set_next_object(cached, cache->free_list);
+            cache->free_list = cached;
+            cache->count++;
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return object;
+}
+
+
+void slab_free(SlabPool *pool, void *object) {
+    SlabCache *cache;
+
+    if (object == NULL) return;
+
+    cache = get_cache(pool);
+    if (cache == NULL) {
+        pthread_mutex_lock(&pool->mutex);
+        set_next_object(object, pool->free_list);
+        pool->free_list = object;
+        pthread_mutex_unlock(&pool->mutex);
+        return;
+    }
+
+    set_next_object(object, cache->free_list);
+    cache->free_list = object;
+
+    // Give half of a full cache back so other threads can use it
+    if (++cache->count >= SLAB_CACHE_SIZE) {
+        pthread_mutex_lock(&pool->mutex);
+        cache->count -= give_objects(pool, &cache->free_list,\
+            SLAB_CACHE_SIZE / 2);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+
+void slab_pool_destroy(SlabPool *pool) {
+    SlabCache *cache = get_cache(pool);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->slabs != NULL) {
+        SlabHeader *slab = pool->slabs;
+
+        pool->slabs = slab->next;
+        free(slab);
+    }
+    pool->free_list = NULL;
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (cache != NULL) {
+        cache->free_list = NULL;
+        cache->count = 0;
+    }
+}
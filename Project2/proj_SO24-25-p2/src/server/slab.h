@@ -0,0 +1,61 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/// Size of each block of memory a pool carves objects from.
+#define SLAB_SIZE (64 * 1024)
+/// Maximum number of pools (each one has a cache in every thread).
+#define SLAB_MAX_POOLS 8
+/// Maximum number of free objects a thread keeps for each pool.
+#define SLAB_CACHE_SIZE 64
+
+
+/// Pool of fixed-size objects, carved from SLAB_SIZE blocks.
+/// Threads allocate from and free to their own cache and only lock the pool
+/// to move SLAB_CACHE_SIZE / 2 objects at a time.
+typedef struct SlabPool {
+    size_t object_size;        // Size of each object (aligned).
+    pthread_mutex_t mutex;     // Protects the lists below.
+    void *free_list;           // Free objects shared by every thread.
+    void *slabs;               // Blocks allocated by the pool.
+    atomic_int id;             // Position of the pool's thread caches.
+} SlabPool;
+
+
+/// Initializer of a static pool of objects of the given size.
+#define SLAB_POOL_INITIALIZER(size) \
+    {(size), PTHREAD_MUTEX_INITIALIZER, NULL, NULL, -1}
+
+
+/**
+ * Allocates an object from the pool.
+ *
+ * @param pool Pool of the object.
+ * @return Pointer to the (uninitialized) object, NULL on failure.
+ */
+void *slab_alloc(SlabPool *pool);
+
+
+/**
+ * Returns an object to the pool it was allocated from.
+ *
+ * @param pool Pool of the object.
+ * @param object Object to free, may be NULL.
+ */
+void slab_free(SlabPool *pool, void *object);
+
+
+/**
+ * Frees every block of the pool. Objects still allocated become invalid, only
+ * to be used when the pool's users are terminated.
+ *
+ * @param pool Pool to destroy.
+ */
+void slab_pool_destroy(SlabPool *pool);
+
+
+#endif // SLAB_H
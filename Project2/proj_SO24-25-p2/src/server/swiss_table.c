@@ -0,0 +1,335 @@
+#include "swiss_table.h"
+
+#include "epoch.h"
+
+/// A byte of 1 in each position of a control word.
+#define SWISS_LSBS 0x0101010101010101ULL
+/// The high bit of each byte of a control word.
+#define SWISS_MSBS 0x8080808080808080ULL
+
+
+/**
+ * Gets the control byte of a used slot.
+ *
+ * @param hash Hash of the slot's item.
+ * @return Top 7 bits of the hash.
+ */
+static uint8_t control_byte(uint64_t hash) {
+    return (uint8_t) (hash >> 57);
+}
+
+
+/**
+ * Finds the bytes of a control word equal to a used slot's byte, a few
+ * bytes next to a match may be reported too (callers check the items).
+ *
+ * @param control Control word of a group.
+ * @param byte Control byte searched.
+ * @return Word with the high bit of every matching byte set.
+ */
+static uint64_t match_byte(uint64_t control, uint8_t byte) {
+    uint64_t x = control ^ (SWISS_LSBS * byte);
+
+    return (x - SWISS_LSBS) & ~x & SWISS_MSBS;
+}
+
+
+/**
+ * Finds the empty slots of a control word (SWISS_EMPTY has bit 1 clear,
+ * SWISS_DELETED has it set).
+ *
+ * @param control Control word of a group.
+ * @return Word with the high bit of every empty byte set.
+ */
+static uint64_t match_empty(uint64_t control) {
+    return control & ~(control << 6) & SWISS_MSBS;
+}
+
+
+/**
+ * Finds the free (empty or deleted) slots of a control word.
+ *
+ * @param control Control word of a group.
+ * @return Word with the high bit of every free byte set.
+ */
+static uint64_t match_free(uint64_t control) {
+    return control & SWISS_MSBS;
+}
+
+
+/**
+ * Gets the slot of the lowest byte set in a match.
+ *
+ * @param match Word returned by one of the match functions (not 0).
+ * @return Position of the slot in its group.
+ */
+static size_t first_slot(uint64_t match) {
+    return (size_t) __builtin_ctzll(match) / 8;
+}
+
+
+/**
+ * Sets the control byte of a slot. Lookups see the whole word change at
+ * once, after the slot's item.
+ *
+ * @param slots Slots of the table.
+ * @param group Group of the slot.
+ * @param slot Position of the slot in its group.
+ * @param byte New control byte.
+ */
+static void set_control(SwissSlots *slots, size_t group, size_t slot,\
+    uint8_t byte) {
+    unsigned int shift = (unsigned int) (slot * 8);
+    uint64_t control = (slots->control[group] & ~(0xFFULL << shift)) |\
+        ((uint64_t) byte << shift);
+
+    __atomic_store_n(&slots->control[group], control, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Creates empty slots.
+ *
+ * @param num_groups Number of groups (power of two).
+ * @return The slots, NULL on failure.
+ */
+static SwissSlots* create_slots(size_t num_groups) {
+    size_t num_slots = num_groups * SWISS_GROUP_SIZE;
+    SwissSlots *slots = malloc(sizeof(SwissSlots) +\
+        num_groups * sizeof(uint64_t) + num_slots * sizeof(void *));
+
+    if (slots == NULL) return NULL;
+    slots->num_groups = num_groups;
+    slots->control = (uint64_t *) (slots + 1);
+    slots->items = (void **) (slots->control + num_groups);
+    for (size_t i = 0; i < num_groups; i++)
+        slots->control[i] = SWISS_LSBS * SWISS_EMPTY;
+    return slots;
+}
+
+
+/**
+ * Finds the first free slot of a hash, probing the groups in triangular
+ * order (which visits every group of a power of two).
+ *
+ * @param slots Slots of the table (with at least one free slot).
+ * @param hash Hash of the item to place.
+ * @param group Where the group of the slot is stored.
+ * @return Position of the slot in its group.
+ */
+static size_t find_free_slot(SwissSlots *slots, uint64_t hash,\
+    size_t *group) {
+    size_t mask = slots->num_groups - 1;
+    size_t position = (size_t) (hash >> SWISS_HASH_SHIFT) & mask;
+
+    for (size_t step = 1; ; step++) {
+        uint64_t free_slots = match_free(slots->control[position]);
+
+        if (free_slots != 0) {
+            *group = position;
+            return first_slot(free_slots);
+        }
+        position = (position + step) & mask;
+    }
+}
+
+
+SwissTable* create_swiss_table(uint64_t (*hash_of)(const void *item)) {
+    SwissTable *table = malloc(sizeof(SwissTable));
+
+    if (table == NULL) return NULL;
+    if ((table->slots = create_slots(SWISS_INITIAL_GROUPS)) == NULL) {
+        free(table);
+        return NULL;
+    }
+    table->num_items = 0;
+    table->num_deleted = 0;
+    table->hash_of = hash_of;
+    return table;
+}
+
+
+void* swiss_table_find(SwissTable *table, uint64_t hash,\
+    int (*matches)(const void *item, const void *key), const void *key) {
+    SwissSlots *slots = __atomic_load_n(&table->slots, __ATOMIC_ACQUIRE);
+    size_t mask = slots->num_groups - 1;
+    size_t position = (size_t) (hash >> SWISS_HASH_SHIFT) & mask;
+    uint8_t byte = control_byte(hash);
+
+    // A table is never full, so the probe ends at a group with an empty slot
+    for (size_t step = 1; step <= slots->num_groups; step++) {
+        uint64_t control = __atomic_load_n(&slots->control[position],\
+            __ATOMIC_ACQUIRE);
+
+        for (uint64_t match = match_byte(control, byte); match != 0;\
+            match &= match - 1) {
+            void *item = __atomic_load_n(&slots->items[position *\
+                SWISS_GROUP_SIZE + first_slot(match)], __ATOMIC_ACQUIRE);
+
+            if (matches(item, key)) return item;
+        }
+        if (match_empty(control) != 0) return NULL;
+        position = (position + step) & mask;
+    }
+    return NULL;
+}
+
+
+/**
+ * Moves the items of a table to new slots, dropping its deleted slots.
+ *
+ * @param table The table.
+ * @param num_groups Number of groups of the new slots (power of two, enough
+ * for the items).
+ * @return 0 on success, -1 if the slots couldn't be allocated.
+ */
+static int rebuild_slots(SwissTable *table, size_t num_groups) {
+    SwissSlots *slots = table->slots, *new_slots;
+
+    if ((new_slots = create_slots(num_groups)) == NULL) return -1;
+
+    for (size_t group = 0; group < slots->num_groups; group++) {
+        for (size_t slot = 0; slot < SWISS_GROUP_SIZE; slot++) {
+            void *item = slots->items[group * SWISS_GROUP_SIZE + slot];
+            uint8_t byte = (uint8_t) (slots->control[group] >> (slot * 8));
+            uint64_t hash;
+            size_t new_group, new_slot;
+
+            if (byte & 0x80) continue; // Empty or deleted
+            hash = table->hash_of(item);
+            new_slot = find_free_slot(new_slots, hash, &new_group);
+            new_slots->items[new_group * SWISS_GROUP_SIZE + new_slot] = item;
+            new_slots->control[new_group] = (new_slots->control[new_group] &\
+                ~(0xFFULL << (new_slot * 8))) |\
+                ((uint64_t) control_byte(hash) << (new_slot * 8));
+        }
+    }
+
+    __atomic_store_n(&table->slots, new_slots, __ATOMIC_RELEASE);
+    epoch_retire(slots, free); // Lookups may still be probing them
+    table->num_deleted = 0;
+    return 0;
+}
+
+
+int swiss_table_reserve(SwissTable *table, size_t num_items) {
+    size_t num_groups = table->slots->num_groups;
+    size_t capacity = num_groups * SWISS_GROUP_SIZE;
+
+    // Up to 7/8 of the slots may be used (by items or deleted)
+    if ((table->num_items + table->num_deleted + num_items) * 8 <=\
+        capacity * 7)
+        return 0;
+
+    // Rebuilt with the items under 7/16 of the slots, only growing if the
+    // deleted slots weren't enough
+    while ((table->num_items + num_items) * 16 >\
+        num_groups * SWISS_GROUP_SIZE * 7)
+        num_groups *= 2;
+    return rebuild_slots(table, num_groups);
+}
+
+
+int swiss_table_presize(SwissTable *table, size_t num_items) {
+    size_t num_groups = table->slots->num_groups;
+
+    // Enough for swiss_table_reserve not to grow before num_items
+    while ((num_items + 1) * 8 > num_groups * SWISS_GROUP_SIZE * 7)
+        num_groups *= 2;
+    if (num_groups == table->slots->num_groups) return 0;
+    return rebuild_slots(table, num_groups);
+}
+
+
+void swiss_table_insert(SwissTable *table, uint64_t hash, void *item) {
+    SwissSlots *slots = table->slots;
+    size_t group, slot = find_free_slot(slots, hash, &group);
+
+    if (!(match_empty(slots->control[group]) & (0x80ULL << (slot * 8))))
+        table->num_deleted--; // Reuses a deleted slot
+    table->num_items++;
+    // The item is visible before the control byte that leads to it
+    __atomic_store_n(&slots->items[group * SWISS_GROUP_SIZE + slot], item,\
+        __ATOMIC_RELEASE);
+    set_control(slots, group, slot, control_byte(hash));
+}
+
+
+int swiss_table_remove(SwissTable *table, uint64_t hash, const void *item) {
+    SwissSlots *slots = table->slots;
+    size_t mask = slots->num_groups - 1;
+    size_t position = (size_t) (hash >> SWISS_HASH_SHIFT) & mask;
+    uint8_t byte = control_byte(hash);
+
+    for (size_t step = 1; step <= slots->num_groups; step++) {
+        uint64_t control = slots->control[position];
+
+        for (uint64_t match = match_byte(control, byte); match != 0;\
+            match &= match - 1) {
+            size_t slot = first_slot(match);
+
+            if (slots->items[position * SWISS_GROUP_SIZE + slot] != item)
+                continue;
+            // No probe went past a group with an empty slot, so the slot
+            // can become empty again
+            table->num_items--;
+            if (match_empty(control) != 0)
+                set_control(slots, position, slot, SWISS_EMPTY);
+            else {
+                set_control(slots, position, slot, SWISS_DELETED);
+                table->num_deleted++;
+            }
+            return 0;
+        }
+        if (match_empty(control) != 0) return -1;
+        position = (position + step) & mask;
+    }
+    return -1;
+}
+
+
+size_t swiss_table_num_groups(SwissTable *table) {
+    return __atomic_load_n(&table->slots, __ATOMIC_ACQUIRE)->num_groups;
+}
+
+
+int swiss_table_visit_group(SwissTable *table, size_t group,\
+    int (*visit)(void *item, void *arg), void *arg) {
+    SwissSlots *slots = table->slots;
+    uint64_t control = slots->control[group];
+
+    // Free slots have the high bit set, used ones have it clear
+    for (uint64_t used = ~control & SWISS_MSBS; used != 0; used &= used - 1) {
+        int ret = visit(slots->items[group * SWISS_GROUP_SIZE +\
+            first_slot(used)], arg);
+
+        if (ret != 0) return ret;
+    }
+    return 0;
+}
+
+
+int swiss_table_visit(SwissTable *table, int (*visit)(void *item, void *arg),\
+    void *arg) {
+    for (size_t group = 0; group < table->slots->num_groups; group++) {
+        int ret = swiss_table_visit_group(table, group, visit, arg);
+
+        if (ret != 0) return ret;
+    }
+    return 0;
+}
+
+
+size_t swiss_table_memory(SwissTable *table) {
+    size_t num_groups = table->slots->num_groups;
+
+    return sizeof(SwissTable) + sizeof(SwissSlots) +\
+        num_groups * sizeof(uint64_t) +\
+        num_groups * SWISS_GROUP_SIZE * sizeof(void *);
+}
+
+
+void free_swiss_table(SwissTable *table) {
+    free(table->slots);
+    free(table);
+}
@@ -0,0 +1,162 @@
+#ifndef SWISS_TABLE_H
+#define SWISS_TABLE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/// Slots of a group, their control bytes are probed together in one word.
+#define SWISS_GROUP_SIZE 8
+/// Number of groups of a new table (power of two).
+#define SWISS_INITIAL_GROUPS 4
+/// Bits of the hash left to the caller (e.g. to pick a lock stripe), the
+/// table picks groups with the bits above them.
+#define SWISS_HASH_SHIFT 16
+/// Control byte of a slot that was never used, probes stop at it.
+#define SWISS_EMPTY 0x80
+/// Control byte of a slot whose item was removed, probes go past it.
+#define SWISS_DELETED 0xFE
+
+
+// Slots of a swiss table, replaced as a whole when the table grows.
+// The control byte of a used slot is the top 7 bits of its item's hash
+// (its high bit is clear), group g's bytes are the bytes of control[g]
+// from the lowest.
+typedef struct SwissSlots {
+    size_t num_groups;               // Number of groups (power of two).
+    uint64_t *control;               // Control bytes of each group.
+    void **items;                    // Item of each slot.
+} SwissSlots;
+
+
+// Open-addressing hash table of items, probed a group at a time.
+// Lookups take no lock: they run inside an epoch while a single writer
+// (serialized by the caller) changes the table. Items are published before
+// their control byte and replaced slots are retired through epochs.
+typedef struct SwissTable {
+    SwissSlots *slots;               // Current slots.
+    size_t num_items;                // Slots holding an item.
+    size_t num_deleted;              // Slots marked SWISS_DELETED.
+    uint64_t (*hash_of)(const void *item); // Hash of an item.
+} SwissTable;
+
+
+/**
+ * Creates a new empty swiss table.
+ *
+ * @param hash_of Function giving the hash of an item (used to grow).
+ * @return Newly created table, NULL on failure.
+ */
+SwissTable* create_swiss_table(uint64_t (*hash_of)(const void *item));
+
+
+/**
+ * Searches an item. Safe to call while the table changes if the caller is
+ * inside an epoch.
+ *
+ * @param table The table.
+ * @param hash Hash of the key searched.
+ * @param matches Function telling if an item has the key searched.
+ * @param key Key passed to matches.
+ * @return The item, NULL if none matches.
+ */
+void* swiss_table_find(SwissTable *table, uint64_t hash,\
+    int (*matches)(const void *item, const void *key), const void *key);
+
+
+/**
+ * Makes room for more items, growing (or cleaning the deleted slots of)
+ * the table if it is too full.
+ *
+ * @param table The table.
+ * @param num_items Number of items about to be inserted.
+ * @return 0 on success, -1 if the table couldn't grow.
+ */
+int swiss_table_reserve(SwissTable *table, size_t num_items);
+
+
+/**
+ * Grows the table, if needed, so it holds a number of items without
+ * growing again (e.g. before loading them).
+ *
+ * @param table The table.
+ * @param num_items Number of items the table will hold.
+ * @return 0 on success, -1 if the table couldn't grow.
+ */
+int swiss_table_presize(SwissTable *table, size_t num_items);
+
+
+/**
+ * Inserts an item that isn't in the table. swiss_table_reserve must have
+ * made room for it.
+ *
+ * @param table The table.
+ * @param hash Hash of the item.
+ * @param item The item.
+ */
+void swiss_table_insert(SwissTable *table, uint64_t hash, void *item);
+
+
+/**
+ * Removes an item (searched by address). Lookups running concurrently may
+ * still return it, so it must be retired through epochs.
+ *
+ * @param table The table.
+ * @param hash Hash of the item.
+ * @param item The item.
+ * @return 0 if the item was removed, -1 if it wasn't found.
+ */
+int swiss_table_remove(SwissTable *table, uint64_t hash, const void *item);
+
+
+/**
+ * Gets the number of groups of the table.
+ *
+ * @param table The table.
+ * @return Number of groups.
+ */
+size_t swiss_table_num_groups(SwissTable *table);
+
+
+/**
+ * Visits the items of a group. visit may remove the items it is given.
+ *
+ * @param table The table.
+ * @param group Position of the group.
+ * @param visit Function called with each item, stops the visit if not 0.
+ * @param arg Argument passed to visit.
+ * @return 0 on success, the value returned by visit if it stopped.
+ */
+int swiss_table_visit_group(SwissTable *table, size_t group,\
+    int (*visit)(void *item, void *arg), void *arg);
+
+
+/**
+ * Visits every item of the table. visit may remove the items it is given.
+ *
+ * @param table The table.
+ * @param visit Function called with each item, stops the visit if not 0.
+ * @param arg Argument passed to visit.
+ * @return 0 on success, the value returned by visit if it stopped.
+ */
+int swiss_table_visit(SwissTable *table, int (*visit)(void *item, void *arg),\
+    void *arg);
+
+
+/**
+ * Gets the bytes used by the table (not by its items).
+ *
+ * @param table The table.
+ * @return Size of the table.
+ */
+size_t swiss_table_memory(SwissTable *table);
+
+
+/**
+ * Frees the table (not the items).
+ *
+ * @param table The table to free.
+ */
+void free_swiss_table(SwissTable *table);
+
+
+#endif // SWISS_TABLE_H
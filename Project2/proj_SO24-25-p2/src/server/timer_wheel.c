@@ -0,0 +1,189 @@
+#include "timer_wheel.h"
+
+#include <time.h>
+
+
+static SlabPool timer_entry_pool = SLAB_POOL_INITIALIZER(sizeof(TimerEntry));
+
+
+uint64_t timer_wheel_now() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+
+/**
+ * Gets the current wall clock time.
+ *
+ * @return Milliseconds since the Epoch.
+ */
+static uint64_t wall_clock_now() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+
+uint64_t timer_wheel_to_wall_clock(uint64_t expires_at) {
+    uint64_t now = timer_wheel_now();
+
+    if (expires_at == 0) return 0;
+    if (expires_at <= now) return wall_clock_now() - (now - expires_at);
+    return wall_clock_now() + (expires_at - now);
+}
+
+
+uint64_t timer_wheel_from_wall_clock(uint64_t deadline) {
+    uint64_t now = timer_wheel_now(), wall_now = wall_clock_now();
+
+    if (deadline == 0) return 0;
+    // Anything past is just due, 1 keeps it from meaning "never"
+    if (deadline <= wall_now) return now > 0 ? now : 1;
+    return now + (deadline - wall_now);
+}
+
+
+/**
+ * Puts a timer in the slot of the level its expiry falls in. The wheel's
+ * mutex must be held.
+ *
+ * @param wheel The timer wheel.
+ * @param entry Timer to place.
+ */
+static void place_entry(TimerWheel *wheel, TimerEntry *entry) {
+    uint64_t tick = (entry->expires_at + TIMER_WHEEL_TICK_MS - 1) /\
+        TIMER_WHEEL_TICK_MS;
+    uint64_t delta;
+    int level = 0;
+    size_t slot;
+
+    if (tick <= wheel->now_tick) tick = wheel->now_tick + 1;
+    delta = tick - wheel->now_tick;
+
+    while (level < TIMER_WHEEL_LEVELS - 1 &&\
+        delta >= (uint64_t) 1 << (TIMER_WHEEL_SLOT_BITS * (level + 1)))
+        level++;
+
+    // Beyond the last level, wait in its farthest slot and be placed again
+    if (delta >= (uint64_t) 1 << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS))
+        tick = wheel->now_tick +\
+            ((uint64_t) 1 << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+    slot = (size_t) (tick >> (TIMER_WHEEL_SLOT_BITS * level)) &\
+        (TIMER_WHEEL_SLOTS - 1);
+    entry->next = wheel->slots[level][slot];
+    wheel->slots[level][slot] = entry;
+}
+
+
+/**
+ * Moves the timers of a slot to the levels below, as its time has come.
+ * The wheel's mutex must be held.
+ *
+ * @param wheel The timer wheel.
+ * @param level Level of the slot.
+ */
+static void cascade(TimerWheel *wheel, int level) {
+    size_t slot = (size_t) (wheel->now_tick >>\
+        (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    TimerEntry *entry = wheel->slots[level][slot];
+
+    wheel->slots[level][slot] = NULL;
+    while (entry != NULL) {
+        TimerEntry *next = entry->next;
+
+        place_entry(wheel, entry);
+        entry = next;
+    }
+}
+
+
+TimerWheel* create_timer_wheel() {
+    TimerWheel *wheel = calloc(1, sizeof(TimerWheel));
+
+    if (wheel == NULL) return NULL;
+    if (pthread_mutex_init(&wheel->mutex, NULL)) {
+        free(wheel);
+        return NULL;
+    }
+    wheel->now_tick = timer_wheel_now() / TIMER_WHEEL_TICK_MS;
+    return wheel;
+}
+
+
+int timer_wheel_add(TimerWheel *wheel, const char *key, uint64_t expires_at) {
+    TimerEntry *entry = slab_alloc(&timer_entry_pool);
+    size_t key_len = strnlen(key, MAX_STRING_SIZE);
+
+    if (entry == NULL) return -1;
+    memcpy(entry->key, key, key_len);
+    entry->key[key_len] = '\0';
+    entry->expires_at = expires_at;
+
+    pthread_mutex_lock(&wheel->mutex);
+    place_entry(wheel, entry);
+    pthread_mutex_unlock(&wheel->mutex);
+    return 0;
+}
+
+
+TimerEntry* timer_wheel_advance(TimerWheel *wheel) {
+    uint64_t target = timer_wheel_now() / TIMER_WHEEL_TICK_MS;
+    TimerEntry *expired = NULL;
+
+    pthread_mutex_lock(&wheel->mutex);
+    while (wheel->now_tick < target) {
+        size_t slot;
+        TimerEntry *entry;
+
+        wheel->now_tick++;
+        // A level's slot is due every time the levels below wrap around
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            uint64_t mask =\
+                ((uint64_t) 1 << (TIMER_WHEEL_SLOT_BITS * level)) - 1;
+
+            if (wheel->now_tick & mask) break;
+            cascade(wheel, level);
+        }
+
+        slot = (size_t) wheel->now_tick & (TIMER_WHEEL_SLOTS - 1);
+        entry = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+        while (entry != NULL) {
+            TimerEntry *next = entry->next;
+
+            if (entry->expires_at <= wheel->now_tick * TIMER_WHEEL_TICK_MS) {
+                entry->next = expired;
+                expired = entry;
+            } else {
+                place_entry(wheel, entry);
+            }
+            entry = next;
+        }
+    }
+    pthread_mutex_unlock(&wheel->mutex);
+    return expired;
+}
+
+
+void free_timer_entries(TimerEntry *entries) {
+    while (entries != NULL) {
+        TimerEntry *next = entries->next;
+
+        slab_free(&timer_entry_pool, entries);
+        entries = next;
+    }
+}
+
+
+void free_timer_wheel(TimerWheel *wheel) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+            free_timer_entries(wheel->slots[level][slot]);
+    pthread_mutex_destroy(&wheel->mutex);
+    free(wheel);
+    slab_pool_destroy(&timer_entry_pool);
+}
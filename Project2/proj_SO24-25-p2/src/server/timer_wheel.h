@@ -0,0 +1,112 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "constants.h"
+#include "slab.h"
+
+/// Duration of a tick of the timer wheel, in milliseconds.
+#define TIMER_WHEEL_TICK_MS 10
+/// Number of levels of the timer wheel.
+#define TIMER_WHEEL_LEVELS 4
+/// Bits of the slot index in each level (64 slots).
+#define TIMER_WHEEL_SLOT_BITS 6
+/// Number of slots in each level.
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+
+// Timer of a key, fired once its expiry time is reached.
+typedef struct TimerEntry {
+    char key[MAX_STRING_SIZE + 1];  // Key that expires.
+    uint64_t expires_at;            // Expiry time, in milliseconds.
+    struct TimerEntry *next;        // Next timer in the slot.
+} TimerEntry;
+
+
+// Hierarchical timer wheel: level l has slots of 64^l ticks, timers move to
+// lower levels as their expiry gets closer.
+typedef struct TimerWheel {
+    TimerEntry *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // Timers.
+    uint64_t now_tick;              // Last tick processed.
+    pthread_mutex_t mutex;          // Protects the wheel.
+} TimerWheel;
+
+
+/**
+ * Gets the current monotonic time.
+ *
+ * @return Time in milliseconds.
+ */
+uint64_t timer_wheel_now();
+
+
+/**
+ * Converts an expiry time to wall clock time, which still means the same
+ * instant after a restart (when the monotonic clock starts over).
+ *
+ * @param expires_at Expiry time (see timer_wheel_now), 0 if never.
+ * @return Milliseconds since the Epoch, 0 if never.
+ */
+uint64_t timer_wheel_to_wall_clock(uint64_t expires_at);
+
+
+/**
+ * Converts a wall clock time back to an expiry time.
+ *
+ * @param deadline Milliseconds since the Epoch, 0 if never.
+ * @return Expiry time (see timer_wheel_now), not after the current time if
+ *         the deadline already passed, 0 if never.
+ */
+uint64_t timer_wheel_from_wall_clock(uint64_t deadline);
+
+
+/**
+ * Creates a new empty timer wheel, starting at the current time.
+ *
+ * @return Newly created timer wheel, NULL on failure.
+ */
+TimerWheel* create_timer_wheel();
+
+
+/**
+ * Adds the timer of a key.
+ *
+ * @param wheel The timer wheel.
+ * @param key Key that expires.
+ * @param expires_at Expiry time, in milliseconds.
+ * @return 0 on success, -1 otherwise.
+ */
+int timer_wheel_add(TimerWheel *wheel, const char *key, uint64_t expires_at);
+
+
+/**
+ * Advances the wheel to the current time and takes the timers that expired.
+ *
+ * @param wheel The timer wheel.
+ * @return List of expired timers (linked by next), freed with
+ *         free_timer_entries.
+ */
+TimerEntry* timer_wheel_advance(TimerWheel *wheel);
+
+
+/**
+ * Frees a list of timers.
+ *
+ * @param entries First timer of the list.
+ */
+void free_timer_entries(TimerEntry *entries);
+
+
+/**
+ * Frees the timer wheel and its timers.
+ *
+ * @param wheel The timer wheel to free.
+ */
+void free_timer_wheel(TimerWheel *wheel);
+
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,441 @@
+#include "wal.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "checksum.h"
+#include "../common/io.h"
+
+
+int wal_encode(Buffer *records, uint8_t type, const char *key,\
+    size_t key_len, const char *value, size_t value_len, uint64_t expires_at) {
+    WalRecordHeader header = {0, type, (uint8_t) key_len, 0,\
+        (uint32_t) value_len, 0, expires_at};
+    size_t start = records->length;
+
+    if (buffer_reserve(records, sizeof(header) + key_len + value_len))
+        return -1;
+    buffer_append(records, &header, sizeof(header));
+    buffer_append(records, key, key_len);
+    if (value_len > 0) buffer_append(records, value, value_len);
+
+    // Covers everything after the checksum itself
+    header.checksum = checksum_update(CHECKSUM_INITIAL,\
+        records->data + start + sizeof(header.checksum),\
+        records->length - start - sizeof(header.checksum));
+    memcpy(records->data + start, &header.checksum, sizeof(header.checksum));
+    return 0;
+}
+
+
+int wal_file_path(char *path, size_t size, const char *dir, uint64_t number,\
+    const char *extension) {
+    int len = snprintf(path, size, "%s/%016" PRIx64 ".%s", dir, number,\
+        extension);
+
+    return len < 0 || (size_t) len >= size ? -1 : 0;
+}
+
+
+/**
+ * Gets the number of a file of a log from its name.
+ *
+ * @param name Name of the file.
+ * @param extension Extension of the kind of file looked for.
+ * @param number Where the number is stored.
+ * @return 1 if the file is of that kind, 0 otherwise.
+ */
+static int parse_file_name(const char *name, const char *extension,\
+    uint64_t *number) {
+    size_t digits = 16;
+
+    if (strlen(name) != digits + 1 + strlen(extension) ||\
+        name[digits] != '.' || strcmp(name + digits + 1, extension) != 0)
+        return 0;
+    for (size_t i = 0; i < digits; i++)
+        if (!isxdigit((unsigned char) name[i])) return 0;
+    *number = strtoull(name, NULL, 16);
+    return 1;
+}
+
+
+/**
+ * Orders two file numbers, for qsort.
+ *
+ * @param a First number.
+ * @param b Second number.
+ * @return Negative, 0 or positive as a is before, equal to or after b.
+ */
+static int compare_numbers(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+int wal_list_files(const char *dir, const char *extension, Buffer *numbers) {
+    DIR *directory = opendir(dir);
+    struct dirent *entry;
+    uint64_t number;
+    int ret = 0;
+
+    if (directory == NULL) return errno == ENOENT ? 0 : -1;
+    while (ret == 0 && (entry = readdir(directory)) != NULL)
+        if (parse_file_name(entry->d_name, extension, &number))
+            ret = buffer_append(numbers, &number, sizeof(number));
+    closedir(directory);
+
+    if (numbers->length > 0)
+        qsort(numbers->data, numbers->length / sizeof(uint64_t),\
+            sizeof(uint64_t), compare_numbers);
+    return ret;
+}
+
+
+int wal_remove_files(const char *dir, const char *extension,\
+    uint64_t before) {
+    Buffer numbers = BUFFER_INITIALIZER;
+    char path[PATH_MAX];
+    uint64_t number;
+    int ret = wal_list_files(dir, extension, &numbers);
+
+    for (size_t i = 0; ret == 0 && i < numbers.length / sizeof(number);\
+        i++) {
+        memcpy(&number, numbers.data + i * sizeof(number), sizeof(number));
+        if (number >= before) break;
+        if (wal_file_path(path, sizeof(path), dir, number, extension) ||\
+            unlink(path) != 0)
+            ret = -1;
+    }
+    buffer_free(&numbers);
+    return ret;
+}
+
+
+int wal_sync_directory(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    int ret;
+
+    if (fd == -1) return -1;
+    ret = fsync(fd);
+    close(fd);
+    return ret == 0 ? 0 : -1;
+}
+
+
+int wal_load_segment(const char *path, Buffer *records) {
+    WalRecordHeader header;
+    Buffer data = BUFFER_INITIALIZER; // The whole segment
+    struct stat st;
+    size_t offset = WAL_MAGIC_SIZE;
+    int fd = open(path, O_RDONLY);
+    int ret = -1;
+
+    if (fd == -1) return -1;
+    if (fstat(fd, &st) == 0 &&\
+        buffer_reserve(&data, (size_t) st.st_size) == 0 &&\
+        read_all(fd, data.data, (size_t) st.st_size, NULL) == 1) {
+        data.length = (size_t) st.st_size;
+        ret = 0;
+    }
+    close(fd);
+    if (ret || data.length < WAL_MAGIC_SIZE ||\
+        memcmp(data.data, WAL_MAGIC, WAL_MAGIC_SIZE) != 0) {
+        fprintf(stderr, "%s is not a segment of a log\n", path);
+        buffer_free(&data);
+        return -1;
+    }
+
+    // Records are checked whole, the first one that isn't ends the segment
+    while (offset + sizeof(header) <= data.length) {
+        size_t size;
+
+        memcpy(&header, data.data + offset, sizeof(header));
+        size = sizeof(header) + header.key_len + header.value_len;
+        if ((header.type != WAL_WRITE && header.type != WAL_DELETE) ||\
+            header.key_len == 0 || size > data.length - offset ||\
+            checksum_update(CHECKSUM_INITIAL,\
+            data.data + offset + sizeof(header.checksum),\
+            size - sizeof(header.checksum)) != header.checksum)
+            break;
+        offset += size;
+    }
+    if (offset < data.length)
+        fprintf(stderr, "%s: dropped %zu bytes after its last whole record\n",\
+            path, data.length - offset);
+
+    ret = offset > WAL_MAGIC_SIZE ? buffer_append(records,\
+        data.data + WAL_MAGIC_SIZE, offset - WAL_MAGIC_SIZE) : 0;
+    buffer_free(&data);
+    return ret;
+}
+
+
+/**
+ * Gets the time of the next sync of an interval policy.
+ *
+ * @param sync_ms Milliseconds between syncs.
+ * @return Current monotonic time plus sync_ms.
+ */
+static struct timespec next_sync_time(int sync_ms) {
+    struct timespec next;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    next.tv_sec += sync_ms / 1000;
+    next.tv_nsec += (long) (sync_ms % 1000) * 1000000;
+    if (next.tv_nsec >= 1000000000) {
+        next.tv_sec++;
+        next.tv_nsec -= 1000000000;
+    }
+    return next;
+}
+
+
+/**
+ * Flusher of a log: takes everything appended, writes it (and syncs it) and
+ * wakes the writers waiting for it. With an interval policy it only flushes
+ * once per interval.
+ *
+ * @param arg The log.
+ * @return NULL.
+ */
+static void* wal_thread(void *arg) {
+    Wal *wal = arg;
+    Buffer batch = BUFFER_INITIALIZER; // Records being written
+    struct timespec next_sync = next_sync_time(0);
+
+    pthread_mutex_lock(&wal->mutex);
+    while (wal->running || wal->pending.length > 0) {
+        Buffer swap = wal->pending;
+        uint64_t end = wal->appended;
+        int fd = wal->fd;
+        int rotating = wal->next_fd != -1;
+        int failed = 0;
+
+        if (wal->pending.length == 0 && !rotating) {
+            pthread_cond_wait(&wal->wake, &wal->mutex);
+            continue;
+        }
+        // Lets the records of the interval accumulate (woken by each append)
+        if (wal->sync_ms > 0 && wal->running && !rotating &&\
+            pthread_cond_timedwait(&wal->wake, &wal->mutex, &next_sync) !=\
+            ETIMEDOUT)
+            continue;
+
+        // Writers append to the emptied buffer while this batch is written
+        wal->pending = batch;
+        batch = swap;
+        // This batch ends the segment, the records after it start the next
+        if (rotating) {
+            wal->fd = wal->next_fd;
+            wal->next_fd = -1;
+            wal->segment_start = end;
+            pthread_cond_broadcast(&wal->flushed);
+        }
+        pthread_mutex_unlock(&wal->mutex);
+
+        if (batch.length > 0)
+            failed = write_all(fd, batch.data, batch.length) != 1 ||\
+                (wal->sync_ms != WAL_SYNC_NEVER && fdatasync(fd) != 0);
+        if (rotating) close(fd);
+        batch.length = 0;
+        if (wal->sync_ms > 0) next_sync = next_sync_time(wal->sync_ms);
+
+        pthread_mutex_lock(&wal->mutex);
+        if (failed && !wal->failed) perror("Failed to write the log");
+        wal->failed |= failed;
+        wal->durable = end;
+        pthread_cond_broadcast(&wal->flushed);
+    }
+    pthread_mutex_unlock(&wal->mutex);
+
+    buffer_free(&batch);
+    return NULL;
+}
+
+
+/**
+ * Creates a segment of a log, with its magic.
+ *
+ * @param dir Directory of the log.
+ * @param segment Number of the segment.
+ * @return File descriptor of the segment, positioned at its end, -1 on
+ * failure.
+ */
+static int create_segment(const char *dir, uint64_t segment) {
+    char path[PATH_MAX];
+    int fd;
+
+    if (wal_file_path(path, sizeof(path), dir, segment, WAL_SEGMENT_EXTENSION))
+        return -1;
+    fd = open(path, O_CREAT | O_EXCL | O_WRONLY | O_APPEND, S_IRUSR | S_IWUSR);
+    if (fd == -1) return -1;
+    // Synced with the directory, so a synced record is never in a file that
+    // a crash loses
+    if (write_all(fd, WAL_MAGIC, WAL_MAGIC_SIZE) != 1 ||\
+        wal_sync_directory(dir)) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+
+/**
+ * Gets the number of the last file of a log, of either kind.
+ *
+ * @param dir Directory of the log.
+ * @param last Where the number is stored (0 if the log has no files).
+ * @return 0 on success, -1 if the directory couldn't be read.
+ */
+static int last_file_number(const char *dir, uint64_t *last) {
+    const char *extensions[] = {WAL_SEGMENT_EXTENSION,\
+        WAL_CHECKPOINT_EXTENSION};
+    Buffer numbers = BUFFER_INITIALIZER;
+    uint64_t number;
+
+    *last = 0;
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(*extensions); i++) {
+        numbers.length = 0;
+        if (wal_list_files(dir, extensions[i], &numbers)) {
+            buffer_free(&numbers);
+            return -1;
+        }
+        if (numbers.length == 0) continue;
+        memcpy(&number, numbers.data + numbers.length - sizeof(number),\
+            sizeof(number));
+        if (number > *last) *last = number;
+    }
+    buffer_free(&numbers);
+    return 0;
+}
+
+
+Wal* wal_open(const char *path, int sync_ms) {
+    Wal *wal = malloc(sizeof(Wal));
+    pthread_condattr_t attr;
+    uint64_t last;
+
+    if (wal == NULL) return NULL;
+    if ((mkdir(path, S_IRWXU) != 0 && errno != EEXIST) ||\
+        last_file_number(path, &last) ||\
+        (wal->dir = strdup(path)) == NULL) {
+        free(wal);
+        return NULL;
+    }
+    wal->segment = last + 1;
+    if ((wal->fd = create_segment(path, wal->segment)) == -1) {
+        free(wal->dir);
+        free(wal);
+        return NULL;
+    }
+
+    wal->next_fd = -1;
+    wal->segment_start = 0;
+    wal->sync_ms = sync_ms;
+    wal->pending = (Buffer) BUFFER_INITIALIZER;
+    wal->appended = 0;
+    wal->durable = 0;
+    wal->failed = 0;
+    wal->running = 1;
+    wal->pid = getpid();
+    pthread_mutex_init(&wal->mutex, NULL);
+    // Sync intervals are measured in monotonic time
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wal->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&wal->flushed, NULL);
+
+    if (pthread_create(&wal->thread, NULL, wal_thread, wal)) {
+        pthread_cond_destroy(&wal->flushed);
+        pthread_cond_destroy(&wal->wake);
+        pthread_mutex_destroy(&wal->mutex);
+        close(wal->fd);
+        free(wal->dir);
+        free(wal);
+        return NULL;
+    }
+    return wal;
+}
+
+
+int wal_rotate(Wal *wal, int force, uint64_t *segment) {
+    int fd, empty;
+
+    pthread_mutex_lock(&wal->mutex);
+    empty = wal->appended == wal->segment_start;
+    pthread_mutex_unlock(&wal->mutex);
+    if (empty && !force) return 1;
+    if ((fd = create_segment(wal->dir, wal->segment + 1)) == -1) return -1;
+
+    // The flusher switches to it between two batches
+    pthread_mutex_lock(&wal->mutex);
+    wal->segment++;
+    wal->next_fd = fd;
+    pthread_cond_signal(&wal->wake);
+    while (wal->next_fd != -1)
+        pthread_cond_wait(&wal->flushed, &wal->mutex);
+    *segment = wal->segment;
+    pthread_mutex_unlock(&wal->mutex);
+    return 0;
+}
+
+
+int wal_append(Wal *wal, const Buffer *records, uint64_t *end) {
+    int ret;
+
+    pthread_mutex_lock(&wal->mutex);
+    ret = buffer_append(&wal->pending, records->data, records->length);
+    if (ret == 0) {
+        wal->appended += records->length;
+        pthread_cond_signal(&wal->wake);
+    }
+    *end = wal->appended;
+    pthread_mutex_unlock(&wal->mutex);
+    return ret;
+}
+
+
+int wal_wait(Wal *wal, uint64_t end) {
+    int ret;
+
+    if (wal->sync_ms != WAL_SYNC_ALWAYS) return 0;
+
+    pthread_mutex_lock(&wal->mutex);
+    while (wal->durable < end && !wal->failed)
+        pthread_cond_wait(&wal->flushed, &wal->mutex);
+    ret = wal->failed ? -1 : 0;
+    pthread_mutex_unlock(&wal->mutex);
+    return ret;
+}
+
+
+void wal_close(Wal *wal) {
+    if (wal->pid == getpid()) {
+        // The flusher writes what is left before it stops
+        pthread_mutex_lock(&wal->mutex);
+        wal->running = 0;
+        pthread_cond_signal(&wal->wake);
+        pthread_mutex_unlock(&wal->mutex);
+        pthread_join(wal->thread, NULL);
+
+        pthread_cond_destroy(&wal->flushed);
+        pthread_cond_destroy(&wal->wake);
+        pthread_mutex_destroy(&wal->mutex);
+    }
+    buffer_free(&wal->pending);
+    close(wal->fd);
+    free(wal->dir);
+    free(wal);
+}
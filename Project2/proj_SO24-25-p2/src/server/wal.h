@@ -0,0 +1,205 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "buffer.h"
+
+/// First bytes of a log file.
+#define WAL_MAGIC "KVSWAL2"
+/// Length of WAL_MAGIC, with its terminator.
+#define WAL_MAGIC_SIZE 8
+/// Sync policy where each write waits for its records to be synced (the
+/// writes waiting together share one sync).
+#define WAL_SYNC_ALWAYS -1
+/// Sync policy where the log is never synced, only written.
+#define WAL_SYNC_NEVER 0
+/// Record of a write of a pair.
+#define WAL_WRITE 1
+/// Record of a delete of a pair.
+#define WAL_DELETE 2
+/// Extension of the files of the log's segments.
+#define WAL_SEGMENT_EXTENSION "log"
+/// Extension of the files of the log's checkpoints.
+#define WAL_CHECKPOINT_EXTENSION "ckpt"
+
+
+// Header of a record of the log, followed by its key and its value.
+typedef struct WalRecordHeader {
+    uint32_t checksum;              // Checksum of the rest of the record.
+    uint8_t type;                   // WAL_WRITE or WAL_DELETE.
+    uint8_t key_len;                // Length of the key.
+    uint16_t reserved;              // Always 0.
+    uint32_t value_len;             // Length of the value (0 if deleted).
+    uint32_t padding;               // Always 0.
+    uint64_t expires_at;            // Wall clock time (ms) it expires, or 0.
+} WalRecordHeader;
+
+
+// Append-only log of the changes to the KVS, a directory of numbered
+// segments ("<number>.log", each one started by WAL_MAGIC) and of the
+// checkpoints that replace them ("<number>.ckpt", a dump of the KVS with
+// every change of the segments before <number>).
+// Writers append records to pending, a flusher thread writes what was
+// appended with one write (and, unless the policy is WAL_SYNC_NEVER, one
+// fdatasync) per batch, so concurrent writers share the cost (group commit).
+// Positions are counted in bytes appended since the log was opened.
+typedef struct Wal {
+    char *dir;                      // Directory of the log.
+    int fd;                         // Segment being written.
+    int next_fd;                    // Segment to switch to, -1 if none.
+    uint64_t segment;               // Number of the segment being written.
+    uint64_t segment_start;         // Position where that segment starts.
+    int sync_ms;                    // Sync policy, or interval between syncs.
+    Buffer pending;                 // Records appended but not written.
+    uint64_t appended;              // Position of the end of pending.
+    uint64_t durable;               // Position written (and synced).
+    int failed;                     // 1 once a write or sync failed.
+    int running;                    // Cleared to stop the flusher.
+    pid_t pid;                      // Process where the flusher runs.
+    pthread_t thread;               // Flusher thread.
+    pthread_mutex_t mutex;          // Protects the fields above.
+    pthread_cond_t wake;            // Wakes the flusher up.
+    pthread_cond_t flushed;         // Signaled when durable grows.
+} Wal;
+
+
+/**
+ * Appends a record to a buffer of records.
+ *
+ * @param records The buffer.
+ * @param type WAL_WRITE or WAL_DELETE.
+ * @param key Key of the pair.
+ * @param key_len Length of the key.
+ * @param value Value written, NULL for a delete.
+ * @param value_len Length of the value, 0 for a delete.
+ * @param expires_at Wall clock time (ms since the Epoch) the value expires,
+ * 0 if never (or for a delete).
+ * @return 0 on success, -1 if the buffer couldn't grow.
+ */
+int wal_encode(Buffer *records, uint8_t type, const char *key,\
+    size_t key_len, const char *value, size_t value_len, uint64_t expires_at);
+
+
+/**
+ * Gets the path of a file of a log.
+ *
+ * @param path Where the path is written.
+ * @param size Size of path.
+ * @param dir Directory of the log.
+ * @param number Number of the file.
+ * @param extension WAL_SEGMENT_EXTENSION or WAL_CHECKPOINT_EXTENSION.
+ * @return 0 on success, -1 if the path doesn't fit.
+ */
+int wal_file_path(char *path, size_t size, const char *dir, uint64_t number,\
+    const char *extension);
+
+
+/**
+ * Lists the numbers of a kind of file of a log, in increasing order.
+ *
+ * @param dir Directory of the log (missing if the log has no files).
+ * @param extension WAL_SEGMENT_EXTENSION or WAL_CHECKPOINT_EXTENSION.
+ * @param numbers Buffer the numbers (uint64_t) are appended to.
+ * @return 0 on success, -1 if the directory couldn't be read.
+ */
+int wal_list_files(const char *dir, const char *extension, Buffer *numbers);
+
+
+/**
+ * Removes the files of a kind of a log numbered before a number.
+ *
+ * @param dir Directory of the log.
+ * @param extension WAL_SEGMENT_EXTENSION or WAL_CHECKPOINT_EXTENSION.
+ * @param before Number of the first file kept.
+ * @return 0 on success, -1 if a file couldn't be removed.
+ */
+int wal_remove_files(const char *dir, const char *extension, uint64_t before);
+
+
+/**
+ * Syncs a directory, so the files created in (or renamed to) it survive a
+ * crash.
+ *
+ * @param dir The directory.
+ * @return 0 on success, -1 on failure.
+ */
+int wal_sync_directory(const char *dir);
+
+
+/**
+ * Reads the records of a segment, up to its end or to its first torn or
+ * corrupt record (the tail a crash left, which is reported and dropped).
+ *
+ * @param path Path of the segment.
+ * @param records Buffer the records are appended to, as wal_encode made
+ * them.
+ * @return 0 on success, -1 if the segment couldn't be read or isn't one.
+ */
+int wal_load_segment(const char *path, Buffer *records);
+
+
+/**
+ * Opens a log, creating its directory if it doesn't exist, and starts its
+ * flusher. Records are appended to a new segment, numbered after every
+ * file of the log (so a torn record is never followed by new ones).
+ *
+ * @param path Directory of the log.
+ * @param sync_ms WAL_SYNC_ALWAYS, WAL_SYNC_NEVER or the milliseconds
+ * between syncs.
+ * @return The log, NULL on failure.
+ */
+Wal* wal_open(const char *path, int sync_ms);
+
+
+/**
+ * Appends records to the log, they are written by the flusher. Callers that
+ * must keep the order of their records append them while holding the locks
+ * that order their changes.
+ *
+ * @param wal The log.
+ * @param records Records made by wal_encode.
+ * @param end Where the position of the end of the records is stored.
+ * @return 0 on success, -1 if the records couldn't be queued.
+ */
+int wal_append(Wal *wal, const Buffer *records, uint64_t *end);
+
+
+/**
+ * Waits until the records before a position are durable, if the policy is
+ * WAL_SYNC_ALWAYS (the others return right away).
+ *
+ * @param wal The log.
+ * @param end Position returned by wal_append.
+ * @return 0 on success, -1 if the log failed to be written or synced.
+ */
+int wal_wait(Wal *wal, uint64_t end);
+
+
+/**
+ * Starts a new segment: records appended once this returns are written to
+ * it, the ones before to the segments before it. Called by one thread at a
+ * time.
+ *
+ * @param wal The log.
+ * @param force Starts it even if nothing was appended to the current one.
+ * @param segment Where the number of the new segment is stored.
+ * @return 0 on success, 1 if nothing was appended to the current segment
+ * (which is kept) and force is not set, -1 on failure.
+ */
+int wal_rotate(Wal *wal, int force, uint64_t *segment);
+
+
+/**
+ * Writes the records appended, stops the flusher and closes the log. In a
+ * forked child (where the flusher doesn't exist) only frees the log.
+ *
+ * @param wal The log.
+ */
+void wal_close(Wal *wal);
+
+
+#endif // WAL_H